@@ -741,6 +741,66 @@ AC_DEFINE(HAVE_KALLSYMS_LOOKUP_NAME, 1,
 ])
 ])
 
+#
+# LC_SEEK_DATA
+#
+# 3.1 adds SEEK_DATA and SEEK_HOLE to llseek
+#
+AC_DEFUN([LC_SEEK_DATA],
+[AC_MSG_CHECKING([if kernel has SEEK_DATA and SEEK_HOLE])
+LB_LINUX_TRY_COMPILE([
+	#include <linux/fs.h>
+],[
+	int whence = SEEK_DATA;
+
+	whence = SEEK_HOLE;
+], [
+	AC_MSG_RESULT([yes])
+	AC_DEFINE(HAVE_SEEK_DATA, 1,
+		[kernel has SEEK_DATA and SEEK_HOLE])
+],[
+	AC_MSG_RESULT([no])
+])
+])
+
+#
+# LC_FILE_FALLOCATE_PUNCH_HOLE
+#
+# 2.6.38 adds FALLOC_FL_PUNCH_HOLE, 3.0 moves fallocate to file_operations
+#
+AC_DEFUN([LC_FILE_FALLOCATE_PUNCH_HOLE],
+[AC_MSG_CHECKING([if kernel has .fallocate of file and FALLOC_FL_PUNCH_HOLE])
+LB_LINUX_TRY_COMPILE([
+	#include <linux/fs.h>
+	#include <linux/falloc.h>
+],[
+	struct file_operations file;
+	int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+
+	file.fallocate = NULL;
+], [
+	AC_MSG_RESULT([yes])
+	AC_DEFINE(HAVE_FILE_FALLOCATE_PUNCH_HOLE, 1,
+		[kernel has .fallocate of file and FALLOC_FL_PUNCH_HOLE])
+],[
+	AC_MSG_RESULT([no])
+])
+])
+
+#
+# LC_DENTRY_PATH_RAW
+#
+# 2.6.38 removes dcache_lock and exports dentry_path_raw
+#
+AC_DEFUN([LC_DENTRY_PATH_RAW],
+[LB_CHECK_SYMBOL_EXPORT([dentry_path_raw],
+[fs/dcache.c],[
+AC_DEFINE(HAVE_DENTRY_PATH_RAW, 1,
+          [dentry_path_raw is exported])
+],[
+])
+])
+
 #
 # LC_PROG_LINUX
 #
@@ -783,6 +843,9 @@ AC_DEFUN([LC_PROG_LINUX],
 	LC_FUNC_SHOW_TASK
 	LC_STACKTRACE_OPS_HAVE_WALK_STACK
 	LC_KALLSYMS_LOOKUP_NAME
+	LC_SEEK_DATA
+	LC_FILE_FALLOCATE_PUNCH_HOLE
+	LC_DENTRY_PATH_RAW
 ])
 
 #
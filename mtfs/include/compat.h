@@ -58,6 +58,93 @@ extern void mtfs_symbol_put(struct module *owner);
 #define MODULE_LICENSE(s)
 #define MODULE_PARM(a, b)
 #define MODULE_PARM_DESC(a, b)
+#define module_param(name, type, perm)
+
+#include <stdlib.h>
+#include <time.h>
+#include <endian.h>
+#include <linux/swab.h>
+
+#ifndef min
+#define min(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); _x < _y ? _x : _y; })
+#endif /* !min */
+#ifndef max
+#define max(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); _x > _y ? _x : _y; })
+#endif /* !max */
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define random32() ((__u32)random())
+#define get_seconds() ((unsigned long)time(NULL))
+
+#define le16_to_cpu(x) ((__u16)le16toh(x))
+#define le32_to_cpu(x) ((__u32)le32toh(x))
+#define le64_to_cpu(x) ((__u64)le64toh(x))
+#define cpu_to_le16(x) ((__u16)htole16(x))
+#define cpu_to_le32(x) ((__u32)htole32(x))
+#define cpu_to_le64(x) ((__u64)htole64(x))
+
+/* The swap function is always the default one of qsort */
+#define sort(base, num, size, cmp, swap) qsort(base, num, size, cmp)
+
+/* Divides n in place and returns the remainder */
+#define do_div(n, base)                                                       \
+({                                                                            \
+    __u32 __base = (base);                                                    \
+    __u32 __rem = (n) % __base;                                               \
+    (n) = (n) / __base;                                                       \
+    __rem;                                                                    \
+})
+
+typedef struct {
+	volatile int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i) { (i) }
+#define atomic_read(v)             ((v)->counter)
+#define atomic_set(v, i)           ((v)->counter = (i))
+#define atomic_add(i, v)           ((void)__sync_add_and_fetch(&(v)->counter, i))
+#define atomic_sub(i, v)           ((void)__sync_sub_and_fetch(&(v)->counter, i))
+#define atomic_inc(v)              atomic_add(1, v)
+#define atomic_dec(v)              atomic_sub(1, v)
+#define atomic_inc_return(v)       __sync_add_and_fetch(&(v)->counter, 1)
+#define atomic_dec_and_test(v)     (__sync_sub_and_fetch(&(v)->counter, 1) == 0)
+
+/* Little endian bitmaps of ext2, set and clear return the old bit */
+static inline int ext2_test_bit(int nr, const void *addr)
+{
+	return (((const unsigned char *)addr)[nr >> 3] >> (nr & 7)) & 1;
+}
+
+static inline int ext2_set_bit(int nr, void *addr)
+{
+	int old = ext2_test_bit(nr, addr);
+
+	((unsigned char *)addr)[nr >> 3] |= 1 << (nr & 7);
+	return old;
+}
+
+static inline int ext2_clear_bit(int nr, void *addr)
+{
+	int old = ext2_test_bit(nr, addr);
+
+	((unsigned char *)addr)[nr >> 3] &= ~(1 << (nr & 7));
+	return old;
+}
+
+typedef __s64 ktime_t;
+
+static inline ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ktime_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define ktime_sub(a, b) ((a) - (b))
+#define ktime_to_ns(kt) ((__s64)(kt))
 
 extern int mtfs_symbol_get(const char *module_name,
                            const char *symbol_name,
@@ -70,6 +70,44 @@ do {                                                                          \
 
 #define MTFS_FREE_PTR(ptr) MTFS_FREE(ptr, sizeof *(ptr))
 
+#include <linux/vmalloc.h>
+
+#define MTFS_VMALLOC(ptr, size)                                               \
+do {                                                                          \
+    MASSERT(!in_interrupt());                                                 \
+    (ptr) = vmalloc(size);                                                    \
+    if (likely((ptr) != NULL)) {                                              \
+        mtfs_kmem_inc((ptr), (size));                                         \
+        memset((ptr), 0, size);                                               \
+        MDEBUG_MEM("mtfs_vmalloced '" #ptr "': %d at %p.\n",                  \
+                   (int)(size), (ptr));                                       \
+    }                                                                         \
+} while (0)
+
+#define MTFS_VFREE(ptr, size)                                                 \
+do {                                                                          \
+    int _size = (size);                                                       \
+    MASSERT(ptr);                                                             \
+    MDEBUG_MEM("mtfs_vfreed '" #ptr "': %d at %p.\n",                         \
+               _size, (ptr));                                                 \
+    POISON((ptr), 0x5a, _size);                                               \
+    vfree(ptr);                                                               \
+    mtfs_kmem_dec((ptr), _size);                                              \
+    (ptr) = NULL;                                                             \
+} while (0)
+
+/* Memory that could be mapped to user space by remap_vmalloc_range() */
+#define MTFS_VMALLOC_USER(ptr, size)                                          \
+do {                                                                          \
+    MASSERT(!in_interrupt());                                                 \
+    (ptr) = vmalloc_user(size);                                               \
+    if (likely((ptr) != NULL)) {                                              \
+        mtfs_kmem_inc((ptr), (size));                                         \
+        MDEBUG_MEM("mtfs_vmalloced '" #ptr "': %d at %p.\n",                  \
+                   (int)(size), (ptr));                                       \
+    }                                                                         \
+} while (0)
+
 #define MTFS_SLAB_ALLOC_GFP(ptr, slab, size, gfp_mask)                        \
 do {                                                                          \
     MASSERT(!in_interrupt());                                                 \
@@ -150,6 +188,10 @@ do {                                                                          \
 
 #define MTFS_FREE_PTR(ptr) MTFS_FREE(ptr, sizeof *(ptr))
 
+#define MTFS_VMALLOC(ptr, size) MTFS_ALLOC(ptr, size)
+#define MTFS_VFREE(ptr, size) MTFS_FREE(ptr, size)
+#define MTFS_VMALLOC_USER(ptr, size) MTFS_ALLOC(ptr, size)
+
 #define MTFS_STRDUP(buff, str)                                                \
 do {                                                                          \
     buff = strdup(str);                                                       \
@@ -14,6 +14,11 @@
 #include <mtfs_io.h>
 #include <mtfs_file.h>
 #include <mtfs_interval_tree.h>
+#include <mtfs_log.h>
+#include <memory.h>
+#include <bitmap.h>
+#include <mtfs_bloom.h>
+#include <mtfs_async_dirty.h>
 
 #ifdef HAVE_SHRINK_CONTROL
 #define SHRINKER_ARGS(sc, nr_to_scan, gfp_mask)  \
@@ -67,13 +72,22 @@ typedef shrinker_t mtfs_shrinker_t;
 #define mtfs_remove_shrinker(s)  remove_shrinker(s)
 #endif /* !HAVE_REGISTER_SHRINKER */
 
+/* Growable array of intent record cookies */
+struct masync_cookies {
+	struct mlog_cookie *mc_array;
+	/* Number of valid cookies */
+	int                 mc_count;
+	/* Number of allocated cookies */
+	int                 mc_size;
+};
+
 struct masync_extent {
 	/* Bucket belongs to, protected by mae_lock */
 	struct masync_bucket       *mae_bucket;
 	/* Info that belongs to, unchangeable */
 	struct msubject_async_info *mae_info;
-	/* Protect mae_bucket */
-	mtfs_spinlock_t             mae_lock;
+	/* Protect mae_bucket, held by flush across lock enqueue and I/O */
+	struct mutex                mae_lock;
 	/* Extent info, protected by mab_lock */
 	struct mtfs_interval        mae_interval;
 	/* Linkage to LRU list, protected by msai_lru_lock */
@@ -82,42 +96,48 @@ struct masync_extent {
 	mtfs_list_t                 mae_cancel_linkage;
 	/* Reference number */
 	atomic_t                    mae_reference;
-	/* Chunks, protected by mab_lock */
-	mtfs_list_t                 mae_chunks;
+	/* Secondary branches not synced yet, protected by mab_lock */
+	unsigned long               mae_dirty[MASYNC_BRANCH_LONGS];
+	/* Parked flush waiting for a lock cancel or a bucket unlock */
+	struct mlock_deferred       mae_deferred;
 };
 
 #define masync_interval2extent(interval) \
     container_of(interval, struct masync_extent, mae_interval)
 
-#define MASYNC_CHUNK_FLAG_DRITY 0x00000001 /* Have diry extents */
-#define MASYNC_CHUNK_SIZE      (MTFS_INTERVAL_EOF)
+/* Dirty bitmap of chunk has a bit for each block */
+#define MASYNC_BLOCK_SHIFT     12
+#define MASYNC_BLOCK_SIZE      (1ULL << MASYNC_BLOCK_SHIFT)
+#define MASYNC_CHUNK_SHIFT     22
+#define MASYNC_CHUNK_SIZE      (1ULL << MASYNC_CHUNK_SHIFT)
+#define MASYNC_CHUNK_BLOCKS    (1 << (MASYNC_CHUNK_SHIFT - MASYNC_BLOCK_SHIFT))
+#define MASYNC_CHUNK_LONGS     (MASYNC_CHUNK_BLOCKS / BITS_PER_LONG)
 
 struct masync_chunk {
 	/* Bucket belongs to */
 	struct masync_bucket       *mac_bucket;
 	/* Info that belongs to, unchangeable */
 	struct msubject_async_info *mac_info;
-	/* Linkage to bucket, protected by mab_chunk_lock */
-	mtfs_list_t                 mac_linkage;
-	/* Start offset, unchangeable */
-	__u64                       mac_start;
-	/* End offset, unchangeable */
-	__u64                       mac_end;
-	/* Length, unchangeable */
-	__u64                       mac_size;
+	/* Node in chunk tree of bucket, protected by mab_chunk_lock */
+	struct mtfs_interval        mac_interval;
 	/* Reference number */
 	atomic_t                    mac_reference;
-	/* Protect mac_flag */
-	struct semaphore            mac_lock;
-	/* Flags */
-	__u32                       mac_flags;
+	/* Writers relying on mac_dirty instead of adding extents */
+	atomic_t                    mac_writers;
+	/*
+	 * Region is logged if equal to mab_region_epoch,
+	 * written holding mab_region_lock and mab_lock.
+	 */
+	int                         mac_region_epoch;
+	/*
+	 * Blocks wholly covered by extents, set holding mab_lock,
+	 * cleared holding mab_lock and mab_chunk_lock, tested without lock.
+	 */
+	unsigned long               mac_dirty[MASYNC_CHUNK_LONGS];
 };
 
-struct masync_chunk_linkage {
-	/* Linkage to extent */
-	mtfs_list_t                 macl_linkage;
-	struct masync_chunk        *macl_chunk;
-};
+#define masync_interval2chunk(interval) \
+    container_of(interval, struct masync_chunk, mac_interval)
 
 struct masync_bucket {
 	/* Info that belongs to, unchangeable */
@@ -132,14 +152,93 @@ struct masync_bucket {
 	int                         mab_fvalid;
 	/* Protect tree, mab_number, mab_finfo and mab_fvalid */
 	struct semaphore            mab_lock;
+	/* Lowest start of extents, written holding mab_lock */
+	__u64                       mab_dirty_start;
+	/* Highest end of extents, written holding mab_lock */
+	__u64                       mab_dirty_end;
+	/* Let readers check mab_dirty_start and mab_dirty_end without mab_lock */
+	seqlock_t                   mab_dirty_seqlock;
+	/* Flushes parked until mab_lock is up, protected by mab_deferred_lock */
+	mtfs_list_t                 mab_deferred;
+	/* Protect mab_deferred */
+	mtfs_spinlock_t             mab_deferred_lock;
 	/* Linkage to info, protected by msai_bucket_lock */
 	mtfs_list_t                 mab_linkage;
-	/* chunk list, protected by mab_chunk_lock*/
-	mtfs_list_t                 mab_chunks;
-	/* Protect mab_chunks, mac_linkage */
-	struct semaphore            mab_chunk_lock;
+	/* Chunk tree, protected by mab_chunk_lock */
+	struct mtfs_interval_node  *mab_chunk_root;
+	/* Protect mab_chunk_root and mac_writers */
+	mtfs_spinlock_t             mab_chunk_lock;
+	/* Intent state, protected by msai_intent_lock */
+	int                         mab_intent;
+	/* Writers between intent get and put, protected by msai_intent_lock */
+	int                         mab_intent_writers;
+	/* Error of the last intent commit, protected by msai_intent_lock */
+	int                         mab_intent_error;
+	/* Cookies of the intent records, valid when MASYNC_INTENT_DURABLE */
+	struct mlog_cookie          mab_cookies[MTFS_BRANCH_MAX];
+	/* Linkage to intent batch, protected by msai_intent_lock */
+	mtfs_list_t                 mab_intent_linkage;
+	/* Path to log with the intent, owned by the batch */
+	char                       *mab_intent_path;
+	/* Length of mab_intent_path */
+	int                         mab_intent_path_len;
+	/*
+	 * Serialize region logging, held without mab_lock during journal I/O.
+	 * Regions are only logged by intent writers and detached together
+	 * with the intent records when no writer is left.
+	 */
+	struct semaphore            mab_region_lock;
+	/* Cookies of region records of each branch, protected by mab_region_lock */
+	struct masync_cookies       mab_regions[MTFS_BRANCH_MAX];
+	/* Number of regions logged, protected by mab_region_lock */
+	int                         mab_region_number;
+	/* Whole file is logged as a region, written holding mab_region_lock */
+	int                         mab_region_whole;
+	/* Increased when regions are detached, protected by msai_intent_lock */
+	int                         mab_region_epoch;
+	/* Fid added to msai_bloom, zero if none, protected by msai_intent_lock */
+	__u64                       mab_bloom_fid;
+	/*
+	 * Extents from here are being discarded by truncate, so flushes of
+	 * them give up. MTFS_INTERVAL_EOF if none. Written holding i_mutex,
+	 * read without lock.
+	 */
+	__u64                       mab_discard_start;
+	/* State of the cache branch, MASYNC_CACHE_*, protected by mab_lock */
+	int                         mab_cache_state;
+	/* Opened files of the inode in cache mode, protected by mab_lock */
+	int                         mab_cache_opens;
+	/* Bytes accounted in msai_cache_bytes, protected by msai_cache_lock */
+	__u64                       mab_cache_bytes;
+	/* Linkage to msai_cache_lru, protected by msai_cache_lock */
+	mtfs_list_t                 mab_cache_linkage;
 };
 
+/* Not checked since the inode is loaded */
+#define MASYNC_CACHE_UNKNOWN  0
+/* Cache branch has the data of the file */
+#define MASYNC_CACHE_PRESENT  1
+/* Evicted, the data is only on the backing branch */
+#define MASYNC_CACHE_ABSENT   2
+
+/* Branch that caches files in cache mode, filled from the next branch */
+#define MASYNC_CACHE_BINDEX   0
+#define MASYNC_BACKING_BINDEX 1
+
+/* Above this, regions of a file are compacted into a whole file region */
+#define MASYNC_REGION_MAX 64
+
+#define MASYNC_PATH_MAX PATH_MAX
+
+/* No intent record, the file is clean on every branch */
+#define MASYNC_INTENT_CLEAN   0
+/* Waiting in the pending batch */
+#define MASYNC_INTENT_PENDING 1
+/* Being written by the leader of a batch */
+#define MASYNC_INTENT_LOGGING 2
+/* Intent records are in the logs */
+#define MASYNC_INTENT_DURABLE 3
+
 #define MASYNC_BULK_SIZE (4096)
 
 struct msubject_async_info {
@@ -163,6 +262,186 @@ struct msubject_async_info {
 	wait_queue_head_t      msai_waitq;
 	/* Proc entrys for async debug */
 	struct proc_dir_entry *msai_proc_entry;
+	/* Buckets waiting for intent records, protected by msai_intent_lock */
+	mtfs_list_t            msai_intent_pending;
+	/* A leader is committing a batch, protected by msai_intent_lock */
+	int                    msai_intent_committing;
+	/* Protect msai_intent_pending, msai_intent_committing and mab_intent* */
+	mtfs_spinlock_t        msai_intent_lock;
+	/* Queue to wait on for intent commit */
+	wait_queue_head_t      msai_intent_waitq;
+	/* Number of intent batches committed */
+	atomic_t               msai_intent_batches;
+	/* Number of intent records logged */
+	atomic_t               msai_intent_records;
+	/* Number of region records logged */
+	atomic_t               msai_region_records;
+	/* Crash recovery in progress, NULL if clean, protected by msai_recover_lock */
+	struct masync_recover *msai_recover;
+	/* Protect msai_recover from being freed while reading proc */
+	mtfs_spinlock_t        msai_recover_lock;
+	/* Bytes covered by extents, protected by msai_throttle_lock */
+	__u64                  msai_dirty_bytes;
+	/* Memory of extent and chunk objects, protected by msai_throttle_lock */
+	__u64                  msai_object_bytes;
+	/* Writers are throttled above soft limits, protected by msai_throttle_lock */
+	__u64                  msai_dirty_soft;
+	__u64                  msai_object_soft;
+	/* Writers block above hard limits, zero means no limit */
+	__u64                  msai_dirty_hard;
+	__u64                  msai_object_hard;
+	/* Protect usage and limits above */
+	mtfs_spinlock_t        msai_throttle_lock;
+	/* Queue for writers blocked above hard limits */
+	wait_queue_head_t      msai_throttle_waitq;
+	/* Number of writes throttled */
+	atomic_t               msai_throttled;
+	/* Number of writes blocked */
+	atomic_t               msai_blocked;
+	/*
+	 * Fids that may be dirty on branch msai_bloom_bindex,
+	 * changed holding msai_intent_lock, tested without lock.
+	 */
+	struct mtfs_bloom      msai_bloom;
+	/* Branch of fids in msai_bloom, -1 if no filter */
+	mtfs_bindex_t          msai_bloom_bindex;
+	/* msai_bloom is loaded from the saved file when mounting */
+	int                    msai_bloom_loaded;
+	/* Cache branch only keeps the recently used files, unchangeable */
+	int                    msai_cache_enabled;
+	/* Clean and dirty files in cache branch, protected by msai_cache_lock */
+	mtfs_list_t            msai_cache_lru;
+	/* Number of files in msai_cache_lru */
+	int                    msai_cache_number;
+	/* Bytes of files in msai_cache_lru */
+	__u64                  msai_cache_bytes;
+	/* Evict files above it, zero means no limit */
+	__u64                  msai_cache_capacity;
+	/* Bytes copied from backing branch when filling */
+	__u64                  msai_cache_fill_bytes;
+	/* Protect cache list, usage, capacity and mab_cache_bytes */
+	mtfs_spinlock_t        msai_cache_lock;
+	/* Opens that found the file in cache branch */
+	atomic_t               msai_cache_hits;
+	/* Opens that filled the file from backing branch */
+	atomic_t               msai_cache_misses;
+	/* Files evicted from cache branch */
+	atomic_t               msai_cache_evictions;
+};
+
+/*
+ * Filter saved in log directory of msai_bloom_bindex when umounting,
+ * header is followed by the counters.
+ */
+#define MASYNC_BLOOM_NAME  "ASYNC_BLOOM"
+#define MASYNC_BLOOM_MAGIC 0x10620001
+
+struct masync_bloom_hdr {
+	/* MASYNC_BLOOM_MAGIC if saved, zero after loaded */
+	__u32 mbh_magic;
+	__u32 mbh_bindex;
+	__u32 mbh_bits;
+	__u32 mbh_hashes;
+	__u64 mbh_keys;
+	/* CRC32 of the counters */
+	__u32 mbh_checksum;
+	__u32 mbh_padding;
+} __attribute__((packed));
+
+#define MASYNC_DIRTY_SOFT_DEFAULT   (256ULL << 20)
+#define MASYNC_DIRTY_HARD_DEFAULT   (1024ULL << 20)
+#define MASYNC_OBJECT_SOFT_DEFAULT  (32ULL << 20)
+#define MASYNC_OBJECT_HARD_DEFAULT  (64ULL << 20)
+/* Longest pause of a throttled writer, reached at the hard limit */
+#define MASYNC_THROTTLE_PAUSE_MAX   (HZ / 5)
+/* Extents moved to cancel list each time a writer is throttled */
+#define MASYNC_THROTTLE_BATCH       16
+
+struct masync_recover_file {
+	/* Linkage to msr_hash, protected by msr_lock */
+	mtfs_hlist_node_t     mrf_hash;
+	/* Linkage to msr_files, protected by msr_lock */
+	mtfs_list_t           mrf_linkage;
+	/* Lower inode number of branch msr_bindex, unchangeable */
+	__u64                 mrf_fid;
+	/* Path from root in the record, NULL if not logged */
+	char                 *mrf_path;
+	/* Length of mrf_path */
+	int                   mrf_path_len;
+	/* Records of branch msr_bindex */
+	struct masync_cookies mrf_cookies;
+	/* Regions in the records, copy the whole file if none */
+	struct mtfs_interval_node_extent *mrf_regions;
+	/* Number of regions in mrf_regions */
+	int                   mrf_region_count;
+	/* Size of mrf_regions */
+	int                   mrf_region_size;
+	/* Whole file region is in the records */
+	int                   mrf_whole;
+	/* Lower inode numbers of other branches, zero if not looked up */
+	__u64                 mrf_bfids[MTFS_BRANCH_MAX];
+};
+
+/* Record of a branch other than msr_bindex */
+struct masync_recover_other {
+	/* Lower inode number of the branch */
+	__u64                 mro_fid;
+	struct mlog_cookie    mro_cookie;
+	/* The file is recovered, protected by msr_lock */
+	int                   mro_done;
+};
+
+/* Records of a branch other than msr_bindex, sorted by fid after scan */
+struct masync_recover_others {
+	struct masync_recover_other *mro_array;
+	/* Number of valid records */
+	int                          mro_count;
+	/* Number of allocated records */
+	int                          mro_size;
+};
+
+#define MASYNC_RECOVER_HASH_BITS  10
+#define MASYNC_RECOVER_HASH_SIZE  (1 << MASYNC_RECOVER_HASH_BITS)
+#define MASYNC_RECOVER_BULK_SIZE  (16384)
+
+struct masync_recover {
+	/* Super block that belongs to, unchangeable */
+	struct super_block    *msr_sb;
+	/* Branch whose records are used to find files, unchangeable */
+	mtfs_bindex_t          msr_bindex;
+	/* Root dentries of branches, referred until fini */
+	struct dentry         *msr_roots[MTFS_BRANCH_MAX];
+	/* Files not recovered yet, protected by msr_lock */
+	mtfs_hlist_head_t      msr_hash[MASYNC_RECOVER_HASH_SIZE];
+	/* Files waiting for workers, protected by msr_lock */
+	mtfs_list_t            msr_files;
+	/* Number of files being recovered, protected by msr_lock */
+	int                    msr_running;
+	/* All files are done, protected by msr_lock */
+	int                    msr_finished;
+	/* Protect msr_hash, msr_files, msr_running and msr_finished */
+	mtfs_spinlock_t        msr_lock;
+	/* Number of files in msr_hash */
+	atomic_t               msr_untrusted;
+	/* Number of files recovered */
+	atomic_t               msr_recovered;
+	/* Number of files failed to recover */
+	atomic_t               msr_failed;
+	/* Number of files found in records, unchangeable after init */
+	int                    msr_total;
+	/* Number of records found, unchangeable after init */
+	int                    msr_records;
+	/* Bytes copied to other branches, protected by msr_lock */
+	__u64                  msr_copied;
+	/* Bytes of zero left as holes in other branches, protected by msr_lock */
+	__u64                  msr_sparse;
+	/*
+	 * Records of other branches, canceled for the recovered files, and
+	 * all of them when no file failed.
+	 */
+	struct masync_recover_others msr_others[MTFS_BRANCH_MAX];
+	/* Workers that recover the files */
+	struct mtfs_service   *msr_service;
 };
 
 struct msubject_async {
@@ -178,9 +457,14 @@ struct msubject_async {
 	mtfs_spinlock_t      msa_info_lock;
 	/* Number of infos */
 	atomic_t             msa_info_number;
+	/* Some cache is above its capacity */
+	atomic_t             msa_cache_wanted;
 };
 
 extern struct mtfs_subject_operations masync_subject_ops;
+extern struct mtfs_subject_operations masync_cache_subject_ops;
+int masync_cache_open(struct inode *inode, struct file *file);
+int masync_cache_release(struct inode *inode, struct file *file);
 
 extern const struct mtfs_io_operations masync_io_ops[];
 #else /* !defined (__linux__) && defined(__KERNEL__) */
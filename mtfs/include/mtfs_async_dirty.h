@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#ifndef __MTFS_ASYNC_DIRTY_H__
+#define __MTFS_ASYNC_DIRTY_H__
+
+#include <mtfs_common.h>
+#include <memory.h>
+#include <bitmap.h>
+
+/*
+ * Bitmap of secondary branches an async extent is not synced to yet.
+ * Bit 0 is the primary branch and is never set.
+ */
+#define MASYNC_BRANCH_LONGS ((MTFS_BRANCH_MAX + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+/* Every secondary branch lags behind the primary one */
+static inline void masync_dirty_init(unsigned long *dirty, mtfs_bindex_t bnum)
+{
+	mtfs_bindex_t bindex = 0;
+
+	for (bindex = 1; bindex < bnum; bindex++) {
+		mtfs_set_bit(bindex, dirty);
+	}
+}
+
+/* Return the first dirty branch in [from, bnum), or 0 if none */
+static inline mtfs_bindex_t masync_dirty_next(unsigned long *dirty,
+                                              mtfs_bindex_t bnum,
+                                              mtfs_bindex_t from)
+{
+	mtfs_bindex_t bindex = 0;
+
+	for (bindex = from; bindex < bnum; bindex++) {
+		if (mtfs_test_bit(bindex, dirty)) {
+			return bindex;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Whether every secondary branch is dirty.
+ * Dirty bits of chunks let writers skip adding extents, so they may
+ * only be set for ranges whose extent is still dirty on every branch.
+ * Otherwise a write would never reach a branch flushed before it.
+ */
+static inline int masync_dirty_full(unsigned long *dirty, mtfs_bindex_t bnum)
+{
+	mtfs_bindex_t bindex = 0;
+
+	for (bindex = 1; bindex < bnum; bindex++) {
+		if (!mtfs_test_bit(bindex, dirty)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif /* __MTFS_ASYNC_DIRTY_H__ */
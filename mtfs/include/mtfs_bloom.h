@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#ifndef __MTFS_BLOOM_H__
+#define __MTFS_BLOOM_H__
+
+#if defined (__linux__) && defined(__KERNEL__)
+#include <linux/types.h>
+#else /* !defined (__linux__) && defined(__KERNEL__) */
+#include <asm/types.h>
+#endif /* !defined (__linux__) && defined(__KERNEL__) */
+
+/*
+ * Counting bloom filter of 64 bit keys.
+ * A key that has been added and not deleted is always found,
+ * a key that is not added is found with a false positive rate of about
+ * (1 - e^(-k * n / m))^k, where m is the number of counters,
+ * k is the number of hashes and n is the number of keys.
+ * Counters saturated are never decreased, so the filter stays conservative.
+ */
+struct mtfs_bloom {
+	/* Number of counters is 1 << mbl_bits */
+	int    mbl_bits;
+	/* Number of hashes of each key */
+	int    mbl_hashes;
+	/* Number of keys added and not deleted */
+	__u64  mbl_keys;
+	__u8  *mbl_counters;
+};
+
+#define MTFS_BLOOM_BITS_MIN      6
+#define MTFS_BLOOM_BITS_MAX      20
+#define MTFS_BLOOM_HASHES_MAX    16
+#define MTFS_BLOOM_COUNTER_MAX   0xff
+
+#define mtfs_bloom_size(bloom)   (1UL << (bloom)->mbl_bits)
+
+int mtfs_bloom_init(struct mtfs_bloom *bloom, int bits, int hashes);
+void mtfs_bloom_fini(struct mtfs_bloom *bloom);
+void mtfs_bloom_add(struct mtfs_bloom *bloom, __u64 key);
+void mtfs_bloom_del(struct mtfs_bloom *bloom, __u64 key);
+int mtfs_bloom_test(struct mtfs_bloom *bloom, __u64 key);
+unsigned long mtfs_bloom_fill(struct mtfs_bloom *bloom);
+#endif /* __MTFS_BLOOM_H__ */
@@ -103,14 +103,28 @@ static inline __u32 crc32c_hw(__u32 crc, unsigned char const *p, size_t len)
 
         return crc;
 }
-#else /* !X86_FEATURE_XMM4_2 */
+#elif defined(__linux__) && defined(__KERNEL__) /* !X86_FEATURE_XMM4_2 */
 /* We should never call this unless the CPU has previously been detected to
  * support this instruction in the SSE4.2 feature set. b=23549  */
 static inline __u32 crc32c_hw(__u32 crc, unsigned char const *p,size_t len)
 {
         MBUG();
 }
-#endif /* !X86_FEATURE_XMM4_2 */
+#else /* !X86_FEATURE_XMM4_2 && !(defined(__linux__) && defined(__KERNEL__)) */
+#define CRC32CPOLY_LE 0x82f63b78
+/* Bitwise in userspace, so that tests can check the zero path against it */
+static inline __u32 crc32c_hw(__u32 crc, unsigned char const *p, size_t len)
+{
+	int i;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32CPOLY_LE : 0);
+		}
+	}
+	return crc;
+}
+#endif /* !X86_FEATURE_XMM4_2 && !(defined(__linux__) && defined(__KERNEL__)) */
 
 typedef enum {
 	MCHECKSUM_CRC32  = 0x00000001,
@@ -156,6 +170,133 @@ static inline __u32 mchecksum_compute(__u32 checksum, unsigned char const *p,
 	return 0;
 }
 
+/* Reflected polynomials, same as the register updates above */
+#define MCHECKSUM_CRC32_POLY  0xedb88320
+#define MCHECKSUM_CRC32C_POLY 0x82f63b78
+
+/* Multiply a 32x32 GF(2) matrix by vector */
+static inline __u32 mchecksum_gf2_times(const __u32 *mat, __u32 vec)
+{
+	__u32 sum = 0;
+
+	while (vec) {
+		if (vec & 1) {
+			sum ^= *mat;
+		}
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+/* Square a 32x32 GF(2) matrix */
+static inline void mchecksum_gf2_square(__u32 *square, const __u32 *mat)
+{
+	int n = 0;
+
+	for (n = 0; n < 32; n++) {
+		square[n] = mchecksum_gf2_times(mat, mat[n]);
+	}
+}
+
+/*
+ * Advance a reflected CRC register over len zero bytes in O(log(len)).
+ * Zero data makes the update linear, so the operator of one zero bit
+ * is squared to get operators of 2^n zero bytes, as crc32_combine() of zlib.
+ */
+static inline __u32 mchecksum_crc_zero(__u32 crc, size_t len, __u32 poly)
+{
+	__u32 even[32]; /* Operator of even power of two zero bits */
+	__u32 odd[32];  /* Operator of odd power of two zero bits */
+	__u32 row = 1;
+	int n = 0;
+
+	if (len == 0) {
+		return crc;
+	}
+
+	/* Operator of one zero bit */
+	odd[0] = poly;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	/* Operator of two zero bits */
+	mchecksum_gf2_square(even, odd);
+	/* Operator of four zero bits */
+	mchecksum_gf2_square(odd, even);
+
+	/* First square gives the operator of one zero byte */
+	do {
+		mchecksum_gf2_square(even, odd);
+		if (len & 1) {
+			crc = mchecksum_gf2_times(even, crc);
+		}
+		len >>= 1;
+		if (len == 0) {
+			break;
+		}
+
+		mchecksum_gf2_square(odd, even);
+		if (len & 1) {
+			crc = mchecksum_gf2_times(odd, crc);
+		}
+		len >>= 1;
+	} while (len);
+
+	return crc;
+}
+
+#ifdef HAVE_ADLER
+#define MCHECKSUM_ADLER_BASE 65521U
+
+/* Zero bytes leave sum A unchanged and add A to sum B for each byte */
+static inline __u32 mchecksum_adler_zero(__u32 adler, size_t len)
+{
+	__u64 a = adler & 0xffff;
+	__u64 b = (adler >> 16) & 0xffff;
+
+	b = (b + (len % MCHECKSUM_ADLER_BASE) * a) % MCHECKSUM_ADLER_BASE;
+	return (__u32)((b << 16) | a);
+}
+#endif /* HAVE_ADLER */
+
+/* Below this, computing over a zero buffer is cheaper than the matrices */
+#define MCHECKSUM_ZERO_BUF_SIZE 64
+
+/*
+ * Same as mchecksum_compute() over len zero bytes,
+ * but takes O(log(len)) time rather than O(len).
+ */
+static inline __u32 mchecksum_compute_zero(__u32 checksum, size_t len,
+                                           mchecksum_type_t type)
+{
+	static const unsigned char zero[MCHECKSUM_ZERO_BUF_SIZE];
+
+	if (len <= MCHECKSUM_ZERO_BUF_SIZE) {
+		if (len == 0) {
+			return checksum;
+		}
+		return mchecksum_compute(checksum, zero, len, type);
+	}
+
+	switch (type) {
+	case MCHECKSUM_CRC32C:
+		return mchecksum_crc_zero(checksum, len, MCHECKSUM_CRC32C_POLY);
+#ifdef HAVE_ADLER
+	case MCHECKSUM_ADLER:
+		return mchecksum_adler_zero(checksum, len);
+#endif
+	case MCHECKSUM_CRC32:
+		return mchecksum_crc_zero(checksum, len, MCHECKSUM_CRC32_POLY);
+        default:
+                MERROR("Unknown checksum type (%x)!!!\n", type);
+                MBUG();
+	}
+	return 0;
+}
+
 /*
  * Return a bitmask of the checksum types supported on this system.
  *
@@ -31,6 +31,7 @@ struct mtfs_dentry_info {
 
 extern int mtfs_d_revalidate(struct dentry *dentry, struct nameidata *nd);
 extern void mtfs_d_release(struct dentry *dentry);
+extern char *mtfs_dentry_path(struct dentry *dentry, char *buf, int size);
 
 static inline struct dentry *mtfs_d_root_branch(struct dentry *dentry, mtfs_bindex_t bindex)
 {
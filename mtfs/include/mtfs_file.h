@@ -89,6 +89,14 @@ struct mtfs_file_info {
 #endif /* !HAVE_DENTRY_OPEN_4ARGS */
 
 ssize_t _do_read_write(int is_write, struct file *file, void *buf, ssize_t count, loff_t *ppos);
+void mtfs_file_seek_data(struct file *file, loff_t start, loff_t end,
+                         loff_t *data_start, loff_t *data_end);
+int mtfs_buffer_is_zero(const char *buf, size_t len);
+ssize_t mtfs_file_write_zero(struct file *file, char *zero_buf,
+                             size_t len, loff_t pos);
+ssize_t mtfs_file_write_sparse(struct file *file, char *buf,
+                               size_t len, loff_t pos);
+int mtfs_file_extend(struct file *file, loff_t size);
 
 #else /* !defined (__linux__) && defined(__KERNEL__) */
 #error This head is only for kernel space use
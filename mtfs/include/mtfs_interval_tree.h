@@ -77,6 +77,8 @@ typedef enum mtfs_interval_iter (*mtfs_interval_callback_t)(struct mtfs_interval
 struct mtfs_interval_node *mtfs_interval_insert(struct mtfs_interval_node *node,
                                                 struct mtfs_interval_node **root);
 void mtfs_interval_erase(struct mtfs_interval_node *node, struct mtfs_interval_node **root);
+void mtfs_interval_detach(struct mtfs_interval_node **root,
+                          mtfs_interval_callback_t func, void *data);
 
 /* Search the extents in the tree and call @func for each overlapped
  * extents. */
@@ -84,6 +86,15 @@ enum mtfs_interval_iter mtfs_interval_search(struct mtfs_interval_node *root,
                                              struct mtfs_interval_node_extent *ex,
                                              mtfs_interval_callback_t func, void *data);
 
+/* Same as mtfs_interval_search, but in ascending order of start. */
+enum mtfs_interval_iter mtfs_interval_search_inorder(struct mtfs_interval_node *root,
+                                                     struct mtfs_interval_node_extent *ext,
+                                                     mtfs_interval_callback_t func, void *data);
+
+/* Walk the tree in ascending order of start. */
+struct mtfs_interval_node *mtfs_interval_first(struct mtfs_interval_node *root);
+struct mtfs_interval_node *mtfs_interval_next(struct mtfs_interval_node *node);
+
 /* Iterate every node in the tree - by reverse order or regular order. */
 enum mtfs_interval_iter mtfs_interval_iterate(struct mtfs_interval_node *root, 
                                               mtfs_interval_callback_t func, void *data);
@@ -46,6 +46,9 @@ struct mtfs_io_trace {
 	mtfs_operation_result_t result;
 	struct timeval          start;
 	struct timeval          end;
+	__u64                   ino;    /* Inode of the file operated on */
+	__u64                   offset; /* Position before the operation */
+	__u64                   size;   /* Bytes asked for */
 };
 
 #if defined(__linux__) && defined(__KERNEL__)
@@ -205,7 +208,9 @@ struct mtfs_io_checksum {
 	struct mtfs_io_checksum_branch branch[MTFS_BRANCH_MAX]; /* Global bindex */
 	struct mtfs_io_checksum_branch gather;                  /* First valid checksum */
 	mchecksum_type_t               type;
-	mtfs_list_t                    dirty_extents;           /* List of dirty extents */
+	mtfs_list_t                    dirty_extents;           /* Copy of dirty extents */
+	int                            tail_dirty;              /* Dirty extents after the range */
+	int                            primary_only;            /* Only primary is trustable */
 };
 
 struct mtfs_io {
@@ -69,10 +69,27 @@ union mlock_policy_data {
 /* Return failure when conflict */
 #define MLOCK_FL_BLOCK_NOWAIT 0x000001
 
+/*
+ * Parked on the resource when a MLOCK_FL_BLOCK_NOWAIT enqueue fails,
+ * notified once after any lock of the resource is canceled.
+ */
+struct mlock_deferred {
+	mtfs_list_t   mld_linkage;                        /* Linkage to mlr_deferred */
+	void        (*mld_notify)(struct mlock_deferred *); /* Called without any lock */
+};
+
+static inline void mlock_deferred_init(struct mlock_deferred *deferred,
+                                       void (*notify)(struct mlock_deferred *))
+{
+	MTFS_INIT_LIST_HEAD(&deferred->mld_linkage);
+	deferred->mld_notify = notify;
+}
+
 struct mlock_enqueue_info {
 	mlock_mode_t mode;
 	union mlock_policy_data data;
 	int flag;
+	struct mlock_deferred *deferred; /* Parked if failed with NOWAIT, could be NULL */
 };
 
 struct mlock_type_object {
@@ -97,6 +114,7 @@ struct mlock_resource {
 	int                        mlr_inited;            /* Resource is inited */
 	struct mlock_type_object  *mlr_type;              /* Resource type */
 	mtfs_list_t                mlr_reprocess_linkage; /* Linkage to reprocess list, protected by mlr_lock */
+	mtfs_list_t                mlr_deferred;          /* Parked enqueues, protected by mlr_lock */
 	/* fields of extent lock */
 	struct mlock_interval_tree mlr_itree[MLOCK_MODE_NUM];  /* Interval trees */
 };
@@ -136,6 +154,7 @@ struct mlock {
 	pthread_cond_t            ml_cond;
 #endif
 	pid_t                     ml_pid;         /* Pid which created this lock */
+	struct mlock_deferred    *ml_deferred;    /* Parked if enqueue failed */
 
 	union mlock_policy_data   ml_policy_data; /* Policy data */
 	/* fields of plain lock */
@@ -159,6 +178,7 @@ static inline int mlock_is_granted(struct mlock *lock)
 }
 
 extern void mlock_cancel(struct mlock *lock);
+extern void mlock_resource_wakeup(struct mlock_resource *resource);
 extern struct mlock *mlock_enqueue(struct mlock_resource *resource,
                                    struct mlock_enqueue_info *einfo);
 void mlock_resource_init(struct mlock_resource *resource);
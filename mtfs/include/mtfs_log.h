@@ -7,8 +7,15 @@
 
 #if defined (__linux__) && defined(__KERNEL__)
 #include <linux/completion.h>
+#else /* !defined (__linux__) && defined(__KERNEL__) */
+#include <compat.h>
+#include <thread.h>
+#include <mtfs_lowerfs.h>
+#endif /* !defined (__linux__) && defined(__KERNEL__) */
 #include <debug.h>
 #include <memory.h>
+#include <spinlock.h>
+#include <mtfs_list.h>
 #include <mtfs_common.h>
 
 /** Identifier for a single log object */
@@ -21,6 +28,8 @@ struct mlog_logid {
 /** Log record header - stored in little endian order.
  * Each record must start with this struct, end with a mlog_rec_tail,
  * and be a multiple of 256 bits in size.
+ * Records are packed but 8 byte aligned, so that a pointer to the
+ * header of a record is aligned.
  */
 struct mlog_rec_hdr {
 	__u32			mrh_len;
@@ -43,20 +52,49 @@ struct mlog_logid_rec {
         __u32			padding4;
         __u32			padding5;
 	struct mlog_rec_tail	mid_tail;
-} __attribute__((packed));
+} __attribute__((packed, aligned(8)));
 
 struct mlog_extent_rec {
 	struct mlog_rec_hdr	mex_hdr;
 	__u64			mex_start;
 	__u64			mex_end;
 	struct mlog_rec_tail	mex_tail;
-} __attribute__((packed));
+} __attribute__((packed, aligned(8)));
 
 struct mlog_async_rec {
         struct mlog_rec_hdr	mas_hdr;
         __u64			mas_fid;
         struct mlog_rec_tail	mas_tail;
-} __attribute__((packed));
+} __attribute__((packed, aligned(8)));
+
+/*
+ * Async record with the path of the file under the mount root,
+ * followed by the path padded to 8 bytes and the tail.
+ */
+struct mlog_async_path_rec {
+	struct mlog_rec_hdr	map_hdr;
+	__u64			map_fid;
+	__u32			map_path_len;
+	__u32			map_padding;
+	char			map_path[0];
+} __attribute__((packed, aligned(8)));
+
+#define MLOG_ASYNC_PATH_REC_LEN(path_len)           \
+    (sizeof(struct mlog_async_path_rec) +           \
+     (((path_len) + 7) & ~7) +                      \
+     sizeof(struct mlog_rec_tail))
+
+/*
+ * Region of a file that may differ between branches, logged before
+ * writing it. Region of [0, MTFS_INTERVAL_EOF] covers the whole file.
+ */
+struct mlog_async_region_rec {
+	struct mlog_rec_hdr	mar_hdr;
+	__u64			mar_fid;
+	__u64			mar_start;
+	__u64			mar_end;
+	struct mlog_rec_tail	mar_tail;
+} __attribute__((packed, aligned(8)));
 
 struct mlog_gen {
         __u64 mnt_cnt;
@@ -92,7 +130,7 @@ struct mlog_log_hdr {
 	__u32                   mlh_reserved[MLOG_HEADER_SIZE/sizeof(__u32) - 23];
 	__u32                   mlh_bitmap[MLOG_BITMAP_BYTES/sizeof(__u32)];
 	struct mlog_rec_tail    mlh_tail;
-} __attribute__((packed));
+} __attribute__((packed, aligned(8)));
 
 #define MLOG_BITMAP_SIZE(mlh)  ((mlh->mlh_hdr.mrh_len -         \
                                  mlh->mlh_bitmap_offset -       \
@@ -104,6 +142,7 @@ struct mlog_ctxt {
         struct dentry           *moc_dlog; /* Which directory the logs saved in */
         struct vfsmount         *moc_mnt;  /* Mnt of lowerfs */
         struct mtfs_lowerfs     *moc_lowerfs;
+        struct mtfs_run_ctxt    *moc_run_ctxt; /* Context of log service threads */
 
         struct mlog_operations  *moc_logops;
 };
@@ -119,15 +158,27 @@ struct mlog_cookie {
 struct mlog_handle;
 
 struct plain_handle_data {
-        struct list_head    phd_entry;
+        mtfs_list_t         phd_entry;
         struct mlog_handle *phd_cat_handle;
         struct mlog_cookie  phd_cookie; /* cookie of this log in its cat */
         int                 phd_last_idx;
 };
 
 struct cat_handle_data {
-        struct list_head        chd_head;
+        mtfs_list_t             chd_head;
         struct mlog_handle     *chd_current_log; /* currently open log */
+        mtfs_spinlock_t         chd_group_lock;
+        mtfs_list_t             chd_group_pending; /* appends to commit */
+        int                     chd_group_committing; /* leader running */
+        wait_queue_head_t       chd_group_waitq;
+        atomic_t                chd_group_batches;
+        atomic_t                chd_group_records;
+        atomic_t                chd_group_headers; /* header writes */
+        mtfs_list_t             chd_spare_head;    /* preallocated logs */
+        int                     chd_spare_count;
+        mtfs_list_t             chd_spare_linkage; /* queued for refill */
+        int                     chd_spare_stopped;
+        atomic_t                chd_spare_misses;  /* rollovers w/o spare */
 };
 
 /* In-memory descriptor for a log object or log catalog */
@@ -139,6 +190,9 @@ struct mlog_handle {
 	int                     mgh_last_idx;
 	int                     mgh_cur_idx;    /* used during mlog_process */
 	__u64                   mgh_cur_offset; /* used during mlog_process */
+	int                     mgh_defer_header; /* appends leave header dirty */
+	int                     mgh_dirty_first; /* dirty bitmap range */
+	int                     mgh_dirty_last;  /* 0 if header is clean */
 	struct mlog_ctxt       *mgh_ctxt;
 	union {
 		struct plain_handle_data phd;
@@ -159,6 +213,8 @@ typedef enum {
 	MLOG_LOGID_MAGIC  = MLOG_OP_MAGIC | 0x00004,
 	MLOG_EXTENT_MAGIC = MLOG_OP_MAGIC | 0x00008,
 	MLOG_ASYNC_MAGIC  = MLOG_OP_MAGIC | 0x00010,
+	MLOG_ASYNC_PATH_MAGIC = MLOG_OP_MAGIC | 0x00020,
+	MLOG_ASYNC_REGION_MAGIC = MLOG_OP_MAGIC | 0x00040,
 } mlog_op_type;
 
 #define MLOG_REC_HDR_NEEDS_SWABBING(r)                                     \
@@ -212,11 +268,23 @@ struct mlog_process_data {
 	 * in catalog.
 	 */
 	mlog_cb_t            mpd_cb;
+	/**
+	 * MLOG_PROCESS_* flags of this processing.
+	 */
+	int                  mpd_flags;
+	/**
+	 * Plain logs collected for unordered processing.
+	 */
+	mtfs_list_t          mpd_logs;
 };
 
 #define MLOG_PROC_BREAK 0x0001
 #define MLOG_DEL_RECORD 0x0002
 
+/* Flags of mlog_process_flags() and mlog_cat_process_flags() */
+#define MLOG_PROCESS_NOTHREAD  0x0001 /* Process in the calling thread */
+#define MLOG_PROCESS_UNORDERED 0x0002 /* Callback does not depend on log order */
+
 struct mlog_process_cat_data {
 	/**
 	 * Temporary stored first_idx while scanning log.
@@ -376,6 +444,7 @@ static inline struct mlog_ctxt *mlog_context_init(struct dentry *log_directory,
 	ctxt->moc_mnt = mnt;
 	ctxt->moc_lowerfs = lowerfs;
 	ctxt->moc_logops = logops;
+	ctxt->moc_run_ctxt = NULL;
 out:
 	MRETURN(ctxt);
 }
@@ -396,19 +465,33 @@ extern int mlog_init_handle(struct mlog_handle *handle, int flags,
                             struct mlog_uuid *uuid);
 extern int mlog_process(struct mlog_handle *loghandle, mlog_cb_t cb,
                         void *data, void *catdata);
+extern int mlog_process_flags(struct mlog_handle *loghandle, mlog_cb_t cb,
+                              void *data, void *catdata, int flags);
 extern int mlog_cancel_rec(struct mlog_handle *loghandle, int index);
+extern int mlog_cancel_arr_rec(struct mlog_handle *loghandle, int num,
+                               int *index);
 extern int mlog_cat_add_rec(struct mlog_handle *cathandle, struct mlog_rec_hdr *rec,
 		            struct mlog_cookie *reccookie, void *buf);
+extern int mlog_cat_add_rec_sync(struct mlog_handle *cathandle,
+                                 struct mlog_rec_hdr *rec,
+                                 struct mlog_cookie *reccookie, void *buf);
+extern int mlog_cat_add_recs(struct mlog_handle *cathandle,
+                             struct mlog_rec_hdr **recs, int count,
+                             struct mlog_cookie *cookies);
+extern int mlog_flush_header(struct mlog_handle *loghandle);
+extern int mlog_sync_header(struct mlog_handle *loghandle);
+extern int mlog_write_header(struct mlog_handle *loghandle);
+extern int mlog_spare_init(void);
+extern void mlog_spare_fini(void);
 extern int mlog_cat_cancel_records(struct mlog_handle *cathandle, int count,
 			    struct mlog_cookie *cookies);
 extern int mlog_cat_put(struct mlog_handle *cathandle);
 extern int mlog_cat_destroy(struct mlog_handle *cathandle);
 extern int mlog_cat_process(struct mlog_handle *cat_mlh, mlog_cb_t cb, void *data);
+extern int mlog_cat_reap(struct mlog_handle *cathandle);
+extern int mlog_cat_process_flags(struct mlog_handle *cat_mlh, mlog_cb_t cb,
+                                  void *data, int flags);
 extern int mlog_reverse_process(struct mlog_handle *loghandle, mlog_cb_t cb,
                                 void *data, void *catdata);
-#else /* !defined (__linux__) && defined(__KERNEL__) */
-#error This head is only for kernel space use
-#endif /* !defined (__linux__) && defined(__KERNEL__) */
-
 
 #endif /* __MTFS_LOG_H__ */
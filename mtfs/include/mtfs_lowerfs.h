@@ -205,6 +205,37 @@ static inline int mlowerfs_commit(struct mtfs_lowerfs *lowerfs,
 	return ret;
 }
 
+static inline int mlowerfs_commit_async(struct mtfs_lowerfs *lowerfs,
+                                        struct inode *inode,
+                                        void *handle,
+                                        void **wait_handle)
+{
+	unsigned long now = jiffies;
+	int ret = 0;
+
+	MASSERT(lowerfs->ml_commit_async);
+	ret = lowerfs->ml_commit_async(inode, handle, wait_handle);
+
+	mlowerfs_check_slow(now, "journal commit");
+
+	return ret;
+}
+
+static inline int mlowerfs_commit_wait(struct mtfs_lowerfs *lowerfs,
+                                       struct inode *inode,
+                                       void *wait_handle)
+{
+	unsigned long now = jiffies;
+	int ret = 0;
+
+	MASSERT(lowerfs->ml_commit_wait);
+	ret = lowerfs->ml_commit_wait(inode, wait_handle);
+
+	mlowerfs_check_slow(now, "journal commit wait");
+
+	return ret;
+}
+
 static inline int mlowerfs_read_record(struct mtfs_lowerfs *lowerfs,
 				       struct file *file,
 				       void *buf,
@@ -255,7 +286,146 @@ static inline struct inode *mlowerfs_iget(struct mtfs_lowerfs *lowerfs,
 	return inode;
 }
 
-#endif /* defined (__linux__) && defined(__KERNEL__) */
+/* Whether the caller is running a transaction of the lowerfs */
+static inline int mlowerfs_in_trans(void)
+{
+	return current->journal_info != NULL;
+}
+
+#else /* !(defined (__linux__) && defined(__KERNEL__)) */
+#include <pthread.h>
+#include <mtfs_types.h>
+
+/*
+ * Userspace lowerfs, so that code on top of struct file, like mlog, runs
+ * in libuser. An inode is an ordinary file accessed with pread/pwrite,
+ * and transactions just fsync the file when committed in sync.
+ */
+#define MLOWERFS_USER_NAME_MAX 256
+
+struct inode {
+	int                  i_fd;
+	unsigned long        i_ino;
+	__u32                i_generation;
+	unsigned int         i_blkbits;
+	loff_t               i_size;
+	pthread_mutex_t      i_size_lock;
+};
+
+struct qstr {
+	unsigned int         len;
+	const char          *name;
+};
+
+struct dentry {
+	struct qstr          d_name;
+	struct inode        *d_inode;
+};
+
+struct vfsmount;
+
+struct file {
+	struct dentry       *f_dentry;
+	loff_t               f_pos;
+	struct dentry        f_dentry_data;
+	struct inode         f_inode_data;
+	char                 f_name[MLOWERFS_USER_NAME_MAX];
+};
+
+static inline loff_t i_size_read(struct inode *inode)
+{
+	loff_t size;
+
+	pthread_mutex_lock(&inode->i_size_lock);
+	size = inode->i_size;
+	pthread_mutex_unlock(&inode->i_size_lock);
+	return size;
+}
+
+struct mtfs_lowerfs {
+	const char                         *ml_type;
+	/* Support transaction or not */
+	int                                 ml_trans_support;
+
+	void *(* ml_start)(struct inode *inode, int op);
+	int (* ml_commit)(struct inode *inode, void *handle,int force_sync);
+	int (* ml_commit_async)(struct inode *inode, void *handle,
+	                        void **wait_handle);
+	int (* ml_commit_wait)(struct inode *inode, void *handle);
+	int (* ml_write_record)(struct file *, void *, int size, loff_t *,
+	                        int force_sync);
+	int (* ml_read_record)(struct file *, void *, int size, loff_t *);
+};
+
+extern struct mtfs_lowerfs mlowerfs_user;
+extern void mlowerfs_user_dir_init(struct dentry *dir, const char *path);
+extern struct file *mlowerfs_user_open(struct dentry *dir, const char *name,
+                                       int create);
+extern int mlowerfs_user_close(struct file *file);
+extern int mlowerfs_user_rename(struct dentry *dir, const char *old_name,
+                                const char *new_name);
+extern int mlowerfs_user_unlink(struct dentry *dir, const char *name);
+
+static inline void *mlowerfs_start(struct mtfs_lowerfs *lowerfs,
+                                   struct inode *inode, int op)
+{
+	MASSERT(lowerfs->ml_start);
+	return lowerfs->ml_start(inode, op);
+}
+
+static inline int mlowerfs_commit(struct mtfs_lowerfs *lowerfs,
+                                  struct inode *inode,
+                                  void *handle,
+                                  int force_sync)
+{
+	MASSERT(lowerfs->ml_commit);
+	return lowerfs->ml_commit(inode, handle, force_sync);
+}
+
+static inline int mlowerfs_commit_async(struct mtfs_lowerfs *lowerfs,
+                                        struct inode *inode,
+                                        void *handle,
+                                        void **wait_handle)
+{
+	MASSERT(lowerfs->ml_commit_async);
+	return lowerfs->ml_commit_async(inode, handle, wait_handle);
+}
+
+static inline int mlowerfs_commit_wait(struct mtfs_lowerfs *lowerfs,
+                                       struct inode *inode,
+                                       void *wait_handle)
+{
+	MASSERT(lowerfs->ml_commit_wait);
+	return lowerfs->ml_commit_wait(inode, wait_handle);
+}
+
+static inline int mlowerfs_read_record(struct mtfs_lowerfs *lowerfs,
+				       struct file *file,
+				       void *buf,
+				       loff_t size,
+				       loff_t *offs)
+{
+	MASSERT(lowerfs->ml_read_record);
+	return lowerfs->ml_read_record(file, buf, size, offs);
+}
+
+static inline int mlowerfs_write_record(struct mtfs_lowerfs *lowerfs,
+                                        struct file *file,
+                                        void *buf,
+                                        loff_t size,
+                                        loff_t *offs,
+                                        int force_sync)
+{
+	MASSERT(lowerfs->ml_write_record);
+	return lowerfs->ml_write_record(file, buf, size, offs, force_sync);
+}
+
+static inline int mlowerfs_in_trans(void)
+{
+	return 0;
+}
+
+#endif /* !(defined (__linux__) && defined(__KERNEL__)) */
 
 #define MLOWERFS_BUCKET_NUMBER (64)
 
@@ -264,6 +434,10 @@ struct mlowerfs_slot {
 	struct mtfs_interval_node_extent mi_extent;
 };
 
+/*
+ * Used slots are packed at the head of mdb_slots, sorted by start.
+ * Extents in slots never overlap, but may be adjacent.
+ */
 struct mlowerfs_disk_bucket {
 	__u64                               mdb_generation; /* Generation of bucket */
 	__u64                               mdb_reference;
@@ -278,11 +452,16 @@ struct mlowerfs_bucket {
 	struct mlowerfs_disk_bucket         mb_disk;
 	int                                 mb_inited; /* $mb_disk is inited or not */
 	int                                 mb_dirty; /* $mb_disk is flushed or not */
+	int                                 mb_slot_number; /* Slots allowed to use, all if zero */
 };
 
 #define mlowerfs_bucket2type(bucket)             (bucket->mb_type)
 #define mlowerfs_bucket2lock(bucket)             (&bucket->mb_lock)
 #define mlowerfs_bucket2disk(bucket)             (&bucket->mb_disk)
+#define mlowerfs_bucket2capacity(bucket)                                     \
+    ((bucket)->mb_slot_number > 0 &&                                         \
+     (bucket)->mb_slot_number < MLOWERFS_BUCKET_NUMBER ?                     \
+     (bucket)->mb_slot_number : MLOWERFS_BUCKET_NUMBER)
 
 #define mlowerfs_bucket2generation(bucket)       (mlowerfs_bucket2disk(bucket)->mdb_generation)
 #define mlowerfs_bucket2reference(bucket)        (mlowerfs_bucket2disk(bucket)->mdb_reference)
@@ -300,6 +479,8 @@ int _mlowerfs_bucket_add(struct mlowerfs_bucket *bucket,
 void _mlowerfs_bucket_dump(struct mlowerfs_bucket *bucket);
 int _mlowerfs_bucket_is_valid(struct mlowerfs_bucket *bucket);
 int _mlowerfs_bucket_check(struct mlowerfs_bucket *bucket, __u64 position);
+int _mlowerfs_bucket_count(struct mlowerfs_bucket *bucket);
+void _mlowerfs_bucket_pack(struct mlowerfs_bucket *bucket);
 #endif /* !defined (__KERNEL__) */
 
 #endif /* __MTFS_LOWERFS_H__ */
@@ -10,24 +10,78 @@ struct mrecord_head {
 	__u64 mrh_sequence;
 };
 
+#define MRECORD_RING_ALIGN 128
+
+/*
+ * Header of a record ring, in the first page of the ring and followed
+ * by the data at $mrrh_offset. The reader of the "trace/ring" proc file
+ * maps the header read-write and the data read-only, then consumes
+ * records from $mrrh_tail to $mrrh_head and moves $mrrh_tail forward.
+ * Both are byte counts that never wrap back, and a record may wrap
+ * around the end of the data. Only $mrrh_tail is read back by the
+ * kernel, other fields are copies published for the reader.
+ * $mrrh_head and $mrrh_tail are written by different sides, so they
+ * are kept in different cache lines.
+ */
+struct mrecord_ring_header {
+	__u64 mrrh_head;    /* Bytes added */
+	__u64 mrrh_dropped; /* Records dropped because of full */
+	__u32 mrrh_size;    /* Bytes of data, power of two */
+	__u32 mrrh_offset;  /* Offset of data from the header */
+	__u32 mrrh_cpu;
+	__u32 mrrh_padding;
+	char  mrrh_pad1[MRECORD_RING_ALIGN - 32];
+	__u64 mrrh_tail;    /* Bytes consumed */
+	char  mrrh_pad2[MRECORD_RING_ALIGN - 8];
+};
+
 #if defined(__linux__) && defined(__KERNEL__)
 #include <linux/fs.h>
 #include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <asm/atomic.h>
+
+struct mtfs_service;
+
+/*
+ * Records are copied into the ring of the CPU adding them, which is
+ * only written by that CPU with preemption disabled, and only consumed
+ * by the drain thread, or by the mmap reader when the rings are
+ * exported. So neither side takes a lock.
+ */
+struct mrecord_ring {
+	struct mrecord_ring_header *mrr_header;
+	char                       *mrr_buf;
+	unsigned int                mrr_area_size; /* Header and data */
+	/* The header is writable by the reader, so these are kept here */
+	__u64                       mrr_head;
+	__u64                       mrr_tail;      /* Tail checked last */
+	__u64                       mrr_dropped;
+};
 
 struct mrecord_file_info {
-	char               *mrfi_fname;
-	struct file        *mrfi_filp;
-	struct vfsmount    *mrfi_mnt;
-	struct dentry      *mrfi_dparent;
-	struct dentry      *mrfi_dchild;
-	struct rw_semaphore mrfi_rwsem;
+	char                *mrfi_fname;
+	struct file         *mrfi_filp;
+	struct vfsmount     *mrfi_mnt;
+	struct dentry       *mrfi_dparent;
+	struct dentry       *mrfi_dchild;
+	struct rw_semaphore  mrfi_rwsem;  /* Held when writing the file */
+	struct mrecord_ring *mrfi_rings;  /* Per-CPU rings */
+	unsigned int         mrfi_ring_size;
+	char                *mrfi_batch;  /* Buffer of drained records */
+	unsigned int         mrfi_batch_size;
+	unsigned long        mrfi_dropped; /* Drops reported */
+	struct mtfs_service *mrfi_service;
+	struct mutex         mrfi_drain_mutex;
+	int                  mrfi_exported; /* Rings consumed by mmap reader */
 };
 
 struct mrecord_handle {
 	int                        mrh_type;
 	const char                *mrh_name;
 	/* Sequence number. Zero is presaved */
-	__u64                      mrh_prev_sequence;
+	atomic64_t                 mrh_prev_sequence;
 	struct mrecord_operations *mrh_ops;
 	union {
 		struct mrecord_file_info mrh_file;
@@ -48,6 +102,13 @@ extern int mrecord_init(struct mrecord_handle *handle);
 extern int mrecord_fini(struct mrecord_handle *handle);
 extern int mrecord_cleanup(struct mrecord_handle *handle);
 extern int mrecord_add(struct mrecord_handle *handle, struct mrecord_head *head);
+extern unsigned long mrecord_dropped(struct mrecord_handle *handle);
+extern int mrecord_export_start(struct mrecord_handle *handle);
+extern void mrecord_export_stop(struct mrecord_handle *handle);
+extern int mrecord_export_mmap(struct mrecord_handle *handle,
+                               struct vm_area_struct *vma);
+extern int mrecord_export_stats(struct mrecord_handle *handle, char *buf,
+                                int size);
 
 #endif /* defined (__linux__) && defined(__KERNEL__) */
 
@@ -14,9 +14,14 @@
 #include "mtfs_record.h"
 #include "mtfs_io.h"
 
+struct mtrace_filters;
+
 struct msubject_trace_info {
 	struct mrecord_handle msti_handle;
 	struct ctl_table_header *msti_ctl_table;
+	struct proc_dir_entry *msti_proc_entry;
+	struct mtrace_filters *msti_filters;     /* NULL if all traced */
+	struct mutex msti_filter_mutex;          /* Serializes filter updates */
 };
 
 extern int mtrace_subject_init(struct super_block *sb);
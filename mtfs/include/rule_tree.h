@@ -27,7 +27,9 @@ typedef struct rule_tree {
 #define MAX_RULE_NUM 32
 #define MAX_RULE_LEN 32
 rule_tree_t *rule_tree_construct(rule_t *rule_array, unsigned int rule_number);
+rule_tree_t *rule_tree_construct_prefix(rule_t *rule_array, unsigned int rule_number);
 int rule_tree_dump(rule_tree_t *root);
 raid_type_t rule_tree_search(rule_tree_t *root, const char *string);
+raid_type_t rule_tree_search_prefix(rule_tree_t *root, const char *string);
 int rule_tree_destruct(rule_tree_t *root);
 #endif /* __MTFS_RULE_TREE_H__ */
@@ -28,6 +28,24 @@ typedef pthread_spinlock_t mtfs_spinlock_t;
 #define mtfs_spin_is_locked(lock)             1
 #define mtfs_spin_destroy(lock)               pthread_spin_destroy(lock);
 
+struct rw_semaphore {
+	pthread_rwlock_t rw_lock;
+};
+
+#define init_rwsem(sem)                       pthread_rwlock_init(&(sem)->rw_lock, NULL)
+#define down_read(sem)                        pthread_rwlock_rdlock(&(sem)->rw_lock)
+#define up_read(sem)                          pthread_rwlock_unlock(&(sem)->rw_lock)
+#define down_write(sem)                       pthread_rwlock_wrlock(&(sem)->rw_lock)
+#define up_write(sem)                         pthread_rwlock_unlock(&(sem)->rw_lock)
+
+struct mutex {
+	pthread_mutex_t m_lock;
+};
+
+#define mutex_init(mutex)                     pthread_mutex_init(&(mutex)->m_lock, NULL)
+#define mutex_lock(mutex)                     pthread_mutex_lock(&(mutex)->m_lock)
+#define mutex_unlock(mutex)                   pthread_mutex_unlock(&(mutex)->m_lock)
+
 #endif /* !((__linux__) && defined(__KERNEL__)) */
 
 #endif /* __MTFS_SPINLOCK_H__ */
@@ -207,8 +207,85 @@ static inline long mtfs_time_seconds(int seconds)
 
 #define mtfs_kthread_run(fn, data, fmt, arg...) kthread_run(fn, data, fmt, ##arg)
 
-#else /* defined (__linux__) && defined(__KERNEL__) */
-#error This head is only for kernel space use
-#endif /* ! defined (__linux__) && defined(__KERNEL__) */
+#else /* !defined (__linux__) && defined(__KERNEL__) */
+#include <pthread.h>
+
+#ifndef CLONE_VM
+#define CLONE_VM    0x00000100
+#endif /* !CLONE_VM */
+#ifndef CLONE_FILES
+#define CLONE_FILES 0x00000400
+#endif /* !CLONE_FILES */
+
+/* Threads are always detached, flags are ignored */
+extern int mtfs_create_thread(int (*fn)(void *), void *arg, unsigned long flags);
+extern int mtfs_daemonize_ctxt(char *str);
+
+typedef struct {
+	pthread_mutex_t wq_mutex;
+	pthread_cond_t  wq_cond;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+	pthread_mutex_init(&wq->wq_mutex, NULL);
+	pthread_cond_init(&wq->wq_cond, NULL);
+}
+
+static inline void wake_up_all(wait_queue_head_t *wq)
+{
+	pthread_mutex_lock(&wq->wq_mutex);
+	pthread_cond_broadcast(&wq->wq_cond);
+	pthread_mutex_unlock(&wq->wq_mutex);
+}
+
+#define wake_up(wq) wake_up_all(wq)
+
+/*
+ * The condition is checked again under wq_mutex before sleeping, and
+ * wakers take wq_mutex, so a wake up after the change is never lost.
+ */
+#define mtfs_wait_condition(wq, condition)                      \
+({                                                              \
+    while (!(condition)) {                                      \
+        pthread_mutex_lock(&(wq).wq_mutex);                     \
+        if (!(condition))                                       \
+            pthread_cond_wait(&(wq).wq_cond, &(wq).wq_mutex);   \
+        pthread_mutex_unlock(&(wq).wq_mutex);                   \
+    }                                                           \
+    0;                                                          \
+})
+
+struct completion {
+	pthread_mutex_t c_mutex;
+	pthread_cond_t  c_cond;
+	int             c_done;
+};
+
+static inline void init_completion(struct completion *c)
+{
+	pthread_mutex_init(&c->c_mutex, NULL);
+	pthread_cond_init(&c->c_cond, NULL);
+	c->c_done = 0;
+}
+
+static inline void complete(struct completion *c)
+{
+	pthread_mutex_lock(&c->c_mutex);
+	c->c_done++;
+	pthread_cond_signal(&c->c_cond);
+	pthread_mutex_unlock(&c->c_mutex);
+}
+
+static inline void wait_for_completion(struct completion *c)
+{
+	pthread_mutex_lock(&c->c_mutex);
+	while (c->c_done == 0) {
+		pthread_cond_wait(&c->c_cond, &c->c_mutex);
+	}
+	c->c_done--;
+	pthread_mutex_unlock(&c->c_mutex);
+}
+#endif /* !defined (__linux__) && defined(__KERNEL__) */
 
 #endif /*__MTFS_THREAD_H__ */
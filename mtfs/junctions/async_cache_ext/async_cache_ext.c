@@ -11,6 +11,7 @@
 #include <mtfs_file.h>
 #include <mtfs_mmap.h>
 #include <mtfs_junction.h>
+#include <mtfs_async.h>
 #include "async_cache_ext.h"
 
 struct super_operations mtfs_ext_sops =
@@ -119,8 +120,9 @@ struct file_operations mtfs_ext_main_fops =
 	poll:       mtfs_poll,
 	ioctl:      mtfs_ioctl,
 	mmap:       mtfs_file_mmap,
-	open:       mtfs_open,
-	release:    mtfs_release,
+	/* Fill evicted file from backing branch */
+	open:       masync_cache_open,
+	release:    masync_cache_release,
 	fsync:      mtfs_fsync,
 	/* TODO: splice_read, splice_write */
 };
@@ -198,7 +200,7 @@ struct mtfs_operations mtfs_ext2_operations = {
 	aops:                    &mtfs_aops,
 	vm_ops:                  &mtfs_file_vm_ops,
 	ioctl:                   &mtfs_ext2_ioctl,
-	subject_ops:             &masync_subject_ops,
+	subject_ops:             &masync_cache_subject_ops,
 	iupdate_ops:             &mtfs_iupdate_master,
 	io_ops:                  &masync_io_ops,
 };
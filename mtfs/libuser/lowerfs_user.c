@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <debug.h>
+#include <memory.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <mtfs_lowerfs.h>
+
+void mlowerfs_user_dir_init(struct dentry *dir, const char *path)
+{
+	memset(dir, 0, sizeof(*dir));
+	dir->d_name.name = path;
+	dir->d_name.len = strlen(path);
+}
+
+static int mlowerfs_user_path(struct dentry *dir, const char *name,
+                              char *path, int length)
+{
+	int ret = 0;
+
+	ret = snprintf(path, length, "%.*s/%s",
+	               dir->d_name.len, dir->d_name.name, name);
+	if (ret >= length) {
+		MERROR("path of [%.*s/%s] is too long\n",
+		       dir->d_name.len, dir->d_name.name, name);
+		return -ENAMETOOLONG;
+	}
+	return 0;
+}
+
+struct file *mlowerfs_user_open(struct dentry *dir, const char *name,
+                                int create)
+{
+	struct file *file = NULL;
+	struct inode *inode = NULL;
+	char path[PATH_MAX];
+	struct stat st;
+	int flags = O_RDWR;
+	int ret = 0;
+	MENTRY();
+
+	ret = mlowerfs_user_path(dir, name, path, sizeof(path));
+	if (ret) {
+		file = ERR_PTR(ret);
+		goto out;
+	}
+
+	MTFS_ALLOC_PTR(file);
+	if (file == NULL) {
+		MERROR("not enough memory\n");
+		file = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	inode = &file->f_inode_data;
+	if (create) {
+		flags |= O_CREAT;
+	}
+	inode->i_fd = open(path, flags, S_IRWXU);
+	if (inode->i_fd < 0) {
+		ret = -errno;
+		MDEBUG("failed to open [%s], ret = %d\n", path, ret);
+		goto out_free_file;
+	}
+
+	if (fstat(inode->i_fd, &st) < 0) {
+		ret = -errno;
+		MERROR("failed to stat [%s], ret = %d\n", path, ret);
+		goto out_close;
+	}
+
+	inode->i_ino = st.st_ino;
+	inode->i_generation = 0;
+	inode->i_blkbits = 12;
+	inode->i_size = st.st_size;
+	pthread_mutex_init(&inode->i_size_lock, NULL);
+
+	strncpy(file->f_name, name, sizeof(file->f_name) - 1);
+	file->f_dentry_data.d_name.name = file->f_name;
+	file->f_dentry_data.d_name.len = strlen(file->f_name);
+	file->f_dentry_data.d_inode = inode;
+	file->f_dentry = &file->f_dentry_data;
+	file->f_pos = 0;
+	goto out;
+out_close:
+	close(inode->i_fd);
+out_free_file:
+	MTFS_FREE_PTR(file);
+	file = ERR_PTR(ret);
+out:
+	MRETURN(file);
+}
+
+int mlowerfs_user_close(struct file *file)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	int ret = 0;
+	MENTRY();
+
+	if (close(inode->i_fd) < 0) {
+		ret = -errno;
+	}
+	pthread_mutex_destroy(&inode->i_size_lock);
+	MTFS_FREE_PTR(file);
+	MRETURN(ret);
+}
+
+int mlowerfs_user_rename(struct dentry *dir, const char *old_name,
+                         const char *new_name)
+{
+	char old_path[PATH_MAX];
+	char new_path[PATH_MAX];
+	int ret = 0;
+	MENTRY();
+
+	ret = mlowerfs_user_path(dir, old_name, old_path, sizeof(old_path));
+	if (ret) {
+		goto out;
+	}
+
+	ret = mlowerfs_user_path(dir, new_name, new_path, sizeof(new_path));
+	if (ret) {
+		goto out;
+	}
+
+	/* Like vfs_rename() of a log, never replace an existing one */
+	if (access(new_path, F_OK) == 0) {
+		ret = -EEXIST;
+		goto out;
+	}
+
+	if (rename(old_path, new_path) < 0) {
+		ret = -errno;
+	}
+out:
+	MRETURN(ret);
+}
+
+int mlowerfs_user_unlink(struct dentry *dir, const char *name)
+{
+	char path[PATH_MAX];
+	int ret = 0;
+	MENTRY();
+
+	ret = mlowerfs_user_path(dir, name, path, sizeof(path));
+	if (ret) {
+		goto out;
+	}
+
+	if (unlink(path) < 0) {
+		ret = -errno;
+	}
+out:
+	MRETURN(ret);
+}
+
+/*
+ * There is no journal under an ordinary file. A transaction is just the
+ * inode it is started on, and committing it in sync flushes the file.
+ */
+static void *mlowerfs_user_start(struct inode *inode, int op)
+{
+	return inode;
+}
+
+static int mlowerfs_user_sync(struct inode *inode)
+{
+	if (fdatasync(inode->i_fd) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int mlowerfs_user_commit(struct inode *inode, void *handle,
+                                int force_sync)
+{
+	MASSERT(handle == inode);
+	if (force_sync) {
+		return mlowerfs_user_sync(inode);
+	}
+	return 0;
+}
+
+static int mlowerfs_user_commit_async(struct inode *inode, void *handle,
+                                      void **wait_handle)
+{
+	MASSERT(handle == inode);
+	*wait_handle = handle;
+	return 0;
+}
+
+static int mlowerfs_user_commit_wait(struct inode *inode, void *handle)
+{
+	MASSERT(handle == inode);
+	return mlowerfs_user_sync(inode);
+}
+
+static int mlowerfs_user_read_record(struct file *file, void *buf,
+                                     int size, loff_t *offs)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	loff_t i_size = i_size_read(inode);
+	ssize_t nbytes = 0;
+
+	/* prevent reading after eof */
+	if (i_size < *offs + size) {
+		size = i_size - *offs;
+		if (size < 0) {
+			MDEBUG("size %llu is too short for read @%llu\n",
+			       (unsigned long long)i_size,
+			       (unsigned long long)*offs);
+			return -EBADR;
+		} else if (size == 0) {
+			return 0;
+		}
+	}
+
+	while (size > 0) {
+		nbytes = pread(inode->i_fd, buf, size, *offs);
+		if (nbytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			MERROR("can't read @%llu: %d\n",
+			       (unsigned long long)*offs, -errno);
+			return -errno;
+		} else if (nbytes == 0) {
+			MERROR("unexpected eof @%llu\n",
+			       (unsigned long long)*offs);
+			return -EIO;
+		}
+		*offs += nbytes;
+		buf += nbytes;
+		size -= nbytes;
+	}
+	return 0;
+}
+
+static int mlowerfs_user_write_record(struct file *file, void *buf,
+                                      int bufsize, loff_t *offs,
+                                      int force_sync)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	loff_t offset = *offs;
+	ssize_t nbytes = 0;
+	int ret = 0;
+
+	while (bufsize > 0) {
+		nbytes = pwrite(inode->i_fd, buf, bufsize, offset);
+		if (nbytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = -errno;
+			MERROR("can't write @%llu: %d\n",
+			       (unsigned long long)offset, ret);
+			goto out;
+		}
+		offset += nbytes;
+		buf += nbytes;
+		bufsize -= nbytes;
+	}
+
+	if (force_sync) {
+		ret = mlowerfs_user_sync(inode);
+	}
+out:
+	/* correct in-core size */
+	pthread_mutex_lock(&inode->i_size_lock);
+	if (offset > inode->i_size) {
+		inode->i_size = offset;
+	}
+	pthread_mutex_unlock(&inode->i_size_lock);
+
+	if (ret == 0) {
+		*offs = offset;
+	}
+	return ret;
+}
+
+struct mtfs_lowerfs mlowerfs_user = {
+	ml_type:            "user",
+	ml_trans_support:   1,
+	ml_start:           mlowerfs_user_start,
+	ml_commit:          mlowerfs_user_commit,
+	ml_commit_async:    mlowerfs_user_commit_async,
+	ml_commit_wait:     mlowerfs_user_commit_wait,
+	ml_write_record:    mlowerfs_user_write_record,
+	ml_read_record:     mlowerfs_user_read_record,
+};
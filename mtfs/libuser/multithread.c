@@ -14,6 +14,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <compat.h>
+#include <thread.h>
 
 struct mtfs_hlist_head thread_head;
 
@@ -27,7 +28,8 @@ struct thread_info *create_thread_info(const char *identifier)
 		goto out;
 	}
 	
-	strncpy(thread_info->identifier, identifier, sizeof(thread_info->identifier));
+	snprintf(thread_info->identifier, sizeof(thread_info->identifier), "%s",
+	         identifier);
 out:
 	return thread_info;
 }
@@ -235,4 +237,55 @@ void stop_thread_groups(struct thread_group *thread_groups, const int group_numb
 	for (i = 0; i < group_number; i++) {
 		stop_thread_group(&(thread_groups[i]));
 	}
-}
\ No newline at end of file
+}
+
+struct mtfs_thread_start {
+	int (*mts_fn)(void *);
+	void *mts_arg;
+};
+
+static void *mtfs_thread_main(void *arg)
+{
+	struct mtfs_thread_start *start = arg;
+	int (*fn)(void *) = start->mts_fn;
+	void *fn_arg = start->mts_arg;
+
+	MTFS_FREE_PTR(start);
+	fn(fn_arg);
+	return NULL;
+}
+
+/* Userspace version of the kernel one, used by code shared with kernel */
+int mtfs_create_thread(int (*fn)(void *), void *arg, unsigned long flags)
+{
+	struct mtfs_thread_start *start = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret = 0;
+
+	MTFS_ALLOC_PTR(start);
+	if (start == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+	start->mts_fn = fn;
+	start->mts_arg = arg;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, mtfs_thread_main, start);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		MERROR("fail to create thread, ret = %d\n", ret);
+		MTFS_FREE_PTR(start);
+		ret = -ret;
+	}
+out:
+	return ret;
+}
+
+int mtfs_daemonize_ctxt(char *str)
+{
+	return 0;
+}
@@ -8,7 +8,7 @@ desc="tests for mchecksum"
 dir=`dirname $0`
 . ${dir}/../misc.sh
 
-echo "1..7"
+echo "1..19"
 
 #
 # TEST FORMAT:
@@ -20,6 +20,9 @@ echo "1..7"
 # OUTPUT:
 # "equal" or "diff"
 #
+# ZERO:<n> means n zero bytes, computed fast before AGAIN,
+# and byte by byte after AGAIN.
+#
 
 #test 1
 IN="
@@ -82,4 +85,139 @@ AGAIN
 abcdef
 " OUT="
 differ
-" expect 0
\ No newline at end of file
+" expect 0
+
+#test 8
+IN="
+ZERO:0
+AGAIN
+" OUT="
+equal
+" expect 0
+
+#test 9
+IN="
+abc
+ZERO:1
+def
+AGAIN
+abc
+ZERO:1
+def
+" OUT="
+equal
+" expect 0
+
+#test 10
+IN="
+abc
+ZERO:65
+def
+AGAIN
+abc
+ZERO:65
+def
+" OUT="
+equal
+" expect 0
+
+#test 11
+IN="
+ZERO:100003
+abc
+AGAIN
+ZERO:100003
+abc
+" OUT="
+equal
+" expect 0
+
+#test 12
+IN="
+abc
+ZERO:4097
+def
+AGAIN
+abc
+ZERO:4097
+def
+" OUT="
+equal
+" expect 0 crc32
+
+#test 13
+IN="
+ZERO:100003
+AGAIN
+ZERO:100003
+" OUT="
+equal
+" expect 0 crc32
+
+#test 14
+IN="
+abc
+ZERO:65
+ZERO:65
+AGAIN
+abc
+ZERO:130
+" OUT="
+equal
+" expect 0 crc32
+
+#test 15
+IN="
+abc
+ZERO:1000
+AGAIN
+abc
+ZERO:999
+" OUT="
+differ
+" expect 0 crc32
+
+#test 16
+IN="
+abc
+ZERO:4097
+def
+AGAIN
+abc
+ZERO:4097
+def
+" OUT="
+equal
+" expect 0 crc32c
+
+#test 17
+IN="
+ZERO:100003
+AGAIN
+ZERO:100003
+" OUT="
+equal
+" expect 0 crc32c
+
+#test 18
+IN="
+abc
+ZERO:65
+ZERO:65
+AGAIN
+abc
+ZERO:130
+" OUT="
+equal
+" expect 0 crc32c
+
+#test 19
+IN="
+abc
+ZERO:1000
+AGAIN
+abc
+ZERO:999
+" OUT="
+differ
+" expect 0 crc32c
@@ -8,7 +8,7 @@ desc="tests for mlock"
 dir=`dirname $0`
 . ${dir}/../misc.sh
 
-echo "1..34"
+echo "1..38"
 
 #
 # TEST FORMAT:
@@ -20,8 +20,14 @@ echo "1..34"
 # [start, end] -- a line of bucket
 #
 
+# +: Enqueue, block if conflict
+# -: Cancel
+# ?: Enqueue, park if conflict
+#
 # C: Canceled
 # B: Blocked
+# P: Parked
+# A: Parked and notified by cancel
 # G: Granted
 # N: Null
 
@@ -397,4 +403,54 @@ IN="2
 0 - 0 N 1 G
 1 - 0 N 1 N
 " OUT="
-" expect 0
\ No newline at end of file
+" expect 0
+
+#test35
+IN="2
+0 W 2 5
+1 F 0 3
+0 + 0 G 1 N
+1 ? 0 G 1 P
+0 - 0 N 1 A
+1 ? 0 N 1 G
+1 - 0 N 1 N
+" OUT="
+" expect 0
+
+#test36
+IN="2
+0 K 2 5
+1 F 6 7
+0 + 0 G 1 N
+1 ? 0 G 1 G
+1 - 0 G 1 N
+0 - 0 N 1 N
+" OUT="
+" expect 0
+
+#test37
+IN="3
+0 D 0 5
+1 D 4 9
+2 F 3 4
+0 + 0 G 1 N 2 N
+1 + 0 G 1 G 2 N
+2 ? 0 G 1 G 2 P
+0 - 0 N 1 G 2 A
+2 ? 0 N 1 G 2 P
+1 - 0 N 1 N 2 A
+2 ? 0 N 1 N 2 G
+2 - 0 N 1 N 2 N
+" OUT="
+" expect 0
+
+#test38
+IN="2
+0 K 0 5
+1 K 2 3
+0 + 0 G 1 N
+1 ? 0 G 1 G
+0 - 0 N 1 G
+1 - 0 N 1 N
+" OUT="
+" expect 0
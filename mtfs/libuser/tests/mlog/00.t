@@ -0,0 +1,23 @@
+#!/bin/sh
+#
+# Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+#
+
+desc="tests for mlog"
+
+dir=`dirname $0`
+. ${dir}/../misc.sh
+
+echo "1..1"
+
+#
+# TEST FORMAT:
+# INPUT:
+# nothing
+#
+# OUTPUT:
+# messages of the mlog tests, return 0 if ok
+#
+
+#test 1
+IN="" OUT="" expect 0
@@ -8,7 +8,7 @@ desc="tests for mlowerfs_bucket"
 dir=`dirname $0`
 . ${dir}/../misc.sh
 
-echo "1..48"
+echo "1..55"
 
 #
 # TEST FORMAT:
@@ -19,6 +19,8 @@ echo "1..48"
 # OUTPUT:
 # [start, end] -- a line of bucket
 #
+# Argument is the number of slots, all slots are used if not given.
+#
 
 
 #test 1
@@ -545,3 +547,81 @@ IN="3
 " OUT="
 [1, 2], [5, 6], [7, 7]
 " expect 0
+
+#
+# test 49
+#
+IN="3
+1 2
+5 6
+10 20
+" OUT="
+[1, 6], [10, 20]
+" expect 0 2
+
+#
+# test 50
+#
+IN="3
+1 2
+8 9
+4 4
+" OUT="
+[1, 4], [8, 9]
+" expect 0 2
+
+#
+# test 51
+#
+IN="3
+1 2
+8 9
+6 6
+" OUT="
+[1, 2], [6, 9]
+" expect 0 2
+
+#
+# test 52
+#
+IN="3
+1 2
+4 5
+20 30
+" OUT="
+[1, 5], [20, 30]
+" expect 0 2
+
+#
+# test 53
+#
+IN="4
+1 2
+5 6
+9 10
+3 9
+" OUT="
+[1, 2], [3, 10]
+" expect 0 2
+
+#
+# test 54
+#
+IN="3
+10 20
+1 2
+30 40
+" OUT="
+[1, 40]
+" expect 0 1
+
+#
+# test 55
+#
+IN="3
+1 2
+10 11
+13 14
+" OUT="
+[1, 2], [10, 14]
+" expect 0 2
@@ -8,7 +8,7 @@ desc="random tests for mlowerfs bucket"
 dir=`dirname $0`
 . ${dir}/../misc.sh
 
-echo "1..1"
+echo "1..2"
 
 #
 # TEST FORMAT:
@@ -18,9 +18,14 @@ echo "1..1"
 # OUTPUT:
 # message if error, nothing if ok
 #
+# With -b, benchmark results are printed and not checked.
+#
 
 
 #test 1
 IN="
 " OUT="
 " expect 0
+
+#test 2
+IN="" OUT="" expect 0 -b
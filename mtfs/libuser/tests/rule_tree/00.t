@@ -8,7 +8,7 @@ desc="tests for rule_tree"
 dir=`dirname $0`
 . ${dir}/../misc.sh
 
-echo "1..10"
+echo "1..12"
 
 #
 # TEST FORMAT:
@@ -202,3 +202,44 @@ a|a|a|a|a|a|a|a|a|a
 5
 0
 " expect 0
+
+#
+# test 11
+# with -p, the longest prefix is matched, 4095 if none
+#
+IN="3
+/home 0
+/home/a 1
+/data/ 5
+5
+/home/a/b
+/home/b
+/data/c
+/data
+/var
+" OUT="
+/_/_/
+/_/_/
+d|h_h
+a|o_o
+t|m_m
+a|e_e
+/|.|/
+.|.|a
+1
+0
+5
+4095
+4095
+" expect 0 -p
+
+#
+# test 12
+# with -p, same rule should report error
+#
+IN="2
+/home 0
+/home 0
+0
+" OUT="
+" expect -EINVAL -p
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <memory.h>
+#include <mtfs_bloom.h>
+
+#define TEST_BITS    14
+#define TEST_HASHES  4
+#define TEST_KEYS    1024
+/* Rate is about 0.24% with these parameters, tolerate four times of it */
+#define TEST_FALSE_POSITIVE_MAX 100 /* Per ten thousand */
+#define TEST_PROBES  10000
+
+static __u64 random_key(void)
+{
+	return ((__u64)random() << 33) ^ ((__u64)random() << 11) ^ random();
+}
+
+static int key_added(__u64 *keys, int number, __u64 key)
+{
+	int i = 0;
+
+	for (i = 0; i < number; i++) {
+		if (keys[i] == key) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Usage: test_bloom
+ * Prints nothing if ok.
+ */
+int main(int argc, char *argv[])
+{
+	struct mtfs_bloom bloom;
+	__u64 *keys = NULL;
+	__u64 key = 0;
+	int ret = 0;
+	int i = 0;
+	int false_positive = 0;
+
+	srandom(time(NULL));
+	MTFS_ALLOC(keys, sizeof(*keys) * TEST_KEYS);
+	if (keys == NULL) {
+		fprintf(stderr, "not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = mtfs_bloom_init(&bloom, MTFS_BLOOM_BITS_MAX + 1, TEST_HASHES);
+	if (ret != -EINVAL) {
+		fprintf(stderr, "too many bits accepted\n");
+		ret = -EINVAL;
+		goto out_free_keys;
+	}
+
+	ret = mtfs_bloom_init(&bloom, TEST_BITS, TEST_HASHES);
+	if (ret) {
+		fprintf(stderr, "failed to init bloom, ret = %d\n", ret);
+		goto out_free_keys;
+	}
+
+	for (i = 0; i < TEST_KEYS; i++) {
+		/* Sequential keys as well as random ones, like inode numbers */
+		keys[i] = (i % 2) ? random_key() : i;
+		mtfs_bloom_add(&bloom, keys[i]);
+	}
+
+	for (i = 0; i < TEST_KEYS; i++) {
+		if (!mtfs_bloom_test(&bloom, keys[i])) {
+			fprintf(stderr, "key %llu added but not found\n",
+			        keys[i]);
+			ret = -EINVAL;
+			goto out_fini;
+		}
+	}
+
+	for (i = 0; i < TEST_PROBES; i++) {
+		key = random_key();
+		if (key_added(keys, TEST_KEYS, key)) {
+			continue;
+		}
+		if (mtfs_bloom_test(&bloom, key)) {
+			false_positive++;
+		}
+	}
+	if (false_positive > TEST_FALSE_POSITIVE_MAX) {
+		fprintf(stderr, "too many false positives, %d of %d\n",
+		        false_positive, TEST_PROBES);
+		ret = -EINVAL;
+		goto out_fini;
+	}
+
+	/* Delete half of the keys, the other half should still be found */
+	for (i = 0; i < TEST_KEYS / 2; i++) {
+		mtfs_bloom_del(&bloom, keys[i]);
+	}
+	for (i = TEST_KEYS / 2; i < TEST_KEYS; i++) {
+		if (!mtfs_bloom_test(&bloom, keys[i])) {
+			fprintf(stderr, "key %llu deleted by others\n",
+			        keys[i]);
+			ret = -EINVAL;
+			goto out_fini;
+		}
+	}
+
+	for (i = TEST_KEYS / 2; i < TEST_KEYS; i++) {
+		mtfs_bloom_del(&bloom, keys[i]);
+	}
+	if (bloom.mbl_keys != 0 || mtfs_bloom_fill(&bloom) != 0) {
+		fprintf(stderr, "bloom not empty after deleting all keys, "
+		        "keys = %llu, fill = %lu\n",
+		        bloom.mbl_keys, mtfs_bloom_fill(&bloom));
+		ret = -EINVAL;
+		goto out_fini;
+	}
+
+	/* Saturated counters are never decreased */
+	for (i = 0; i < MTFS_BLOOM_COUNTER_MAX + 1; i++) {
+		mtfs_bloom_add(&bloom, 0);
+	}
+	mtfs_bloom_del(&bloom, 0);
+	if (!mtfs_bloom_test(&bloom, 0)) {
+		fprintf(stderr, "saturated counter decreased\n");
+		ret = -EINVAL;
+		goto out_fini;
+	}
+out_fini:
+	mtfs_bloom_fini(&bloom);
+out_free_keys:
+	MTFS_FREE(keys, sizeof(*keys) * TEST_KEYS);
+out:
+	return ret;
+}
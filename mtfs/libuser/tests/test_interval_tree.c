@@ -156,6 +156,56 @@ static int it_test_search(struct mtfs_interval_node *root)
         return 0;
 }
 
+static __u64 inorder_last;
+
+static enum mtfs_interval_iter inorder_cb(struct mtfs_interval_node *n, void *args)
+{
+        if (n->in_extent.start < inorder_last)
+                error("node "__S" is out of order, last start %#llx\n",
+                      __F(&n->in_extent), inorder_last);
+        inorder_last = n->in_extent.start;
+        return cb(n, args);
+}
+
+static int it_test_search_inorder(struct mtfs_interval_node *root)
+{
+        struct it_node *n;
+        struct mtfs_interval_node_extent ext;
+        int times = 10, i;
+
+        while (times--) {
+                it_test_clear();
+                inorder_last = 0;
+                ext.start = (random() % max_count) & ALIGN_MASK;
+                ext.end = random() % (max_count - ext.start + 2) + ext.start;
+                ext.end &= ALIGN_MASK;
+                if (ext.end > max_count)
+                        ext.end = max_count;
+
+                dprintf("\n\nSearching in order the node overlapped "__S" ..\n",
+                        __F(&ext));
+
+                mtfs_interval_search_inorder(root, &ext, inorder_cb, NULL);
+
+                /* verify */
+                for (i = 0; i < it_count; i++) {
+                        n = &it_array[i];
+                        if (n->valid == 0)
+                                continue;
+
+                        if (extent_overlapped(&ext, &n->node.in_extent) !=
+                            n->hit)
+                                error("node "__S" overlaps "__S": %d, hit: %d\n",
+                                      __F(&n->node.in_extent), __F(&ext),
+                                      extent_overlapped(&ext, &n->node.in_extent),
+                                      n->hit);
+                }
+                dprintf("ok.\n");
+        }
+
+        return 0;
+}
+
 static int it_test_iterate(struct mtfs_interval_node *root)
 {
         int i;
@@ -411,6 +461,36 @@ static int it_test_performance(struct mtfs_interval_node *root, unsigned long le
         return 0;
 }
 
+static enum mtfs_interval_iter detach_cb(struct mtfs_interval_node *n, void *args)
+{
+        if (mtfs_interval_is_intree(n) || n->in_left || n->in_right ||
+            n->in_parent)
+                error("Node "__S" is still linked\n", __F(&n->in_extent));
+        return cb(n, args);
+}
+
+static int it_test_detach(struct mtfs_interval_node *root)
+{
+        int i;
+
+        dprintf("\n\ndetach testing start..\n");
+        it_test_clear();
+        mtfs_interval_detach(&root, detach_cb, NULL);
+        if (root != NULL)
+                error("Tree is not empty after detach\n");
+
+        /* verify */
+        for (i = 0; i < it_count; i++) {
+                if (it_array[i].valid == 0)
+                        continue;
+                if (it_array[i].hit == 0)
+                        error("Node "__S" is not detached\n",
+                              __F(&it_array[i].node.in_extent));
+        }
+
+        return 0;
+}
+
 static struct mtfs_interval_node *it_test_helper(struct mtfs_interval_node *root)
 {
         int idx, count = 0;
@@ -552,8 +632,10 @@ int main(int argc, char *argv[])
                 it_test_find(root);
                 it_test_search_hole(root);
                 it_test_search(root);
+                it_test_search_inorder(root);
                 root = it_test_helper(root);
         }
+        it_test_detach(root);
         it_test_fini();
 
         return 0;
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mtfs_async_dirty.h>
+
+/*
+ * Model of an async file with a single extent over a single chunk,
+ * following masync_extent_flush(), masync_sync_file() and
+ * masync_io_iter_start_writev().
+ * Data of each block is a version number, so a stale branch is seen.
+ */
+#define TEST_BNUM       3
+#define TEST_BLOCKS     8
+#define TEST_OPERATIONS 10000
+
+#define TEST_FLUSH_DONE  0
+#define TEST_FLUSH_RETRY 1
+#define TEST_FLUSH_AGAIN 3
+
+struct test_file {
+	int           tf_version[TEST_BNUM][TEST_BLOCKS];
+	/* Whether the extent is in the tree */
+	int           tf_extent;
+	unsigned long tf_dirty[MASYNC_BRANCH_LONGS];
+	/* Dirty bits of chunk */
+	unsigned long tf_chunk;
+	/* Branches failing to be written */
+	int           tf_fail[TEST_BNUM];
+	/* Branches leaving the pass for lag */
+	int           tf_slow[TEST_BNUM];
+};
+
+static void test_write(struct test_file *file, int block)
+{
+	file->tf_version[0][block]++;
+	if (mtfs_test_bit(block, &file->tf_chunk)) {
+		/* Fast path, no extent is added */
+		return;
+	}
+
+	if (!file->tf_extent) {
+		memset(file->tf_dirty, 0, sizeof(file->tf_dirty));
+		file->tf_extent = 1;
+	}
+	/* Merged with the new extent dirty on every branch */
+	masync_dirty_init(file->tf_dirty, TEST_BNUM);
+	mtfs_set_bit(block, &file->tf_chunk);
+}
+
+static int test_flush(struct test_file *file)
+{
+	unsigned long active[MASYNC_BRANCH_LONGS];
+	mtfs_bindex_t bindex = 0;
+	int nr_active = 0;
+	int failed = 0;
+	int block = 0;
+
+	if (!file->tf_extent) {
+		return TEST_FLUSH_DONE;
+	}
+
+	file->tf_chunk = 0;
+	memcpy(active, file->tf_dirty, sizeof(active));
+	for (bindex = 1; bindex < TEST_BNUM; bindex++) {
+		if (mtfs_test_bit(bindex, active)) {
+			nr_active++;
+		}
+	}
+
+	/* One read of primary feeds every branch left in the pass */
+	for (bindex = 1; bindex < TEST_BNUM; bindex++) {
+		if (!mtfs_test_bit(bindex, active)) {
+			continue;
+		}
+
+		if (file->tf_fail[bindex]) {
+			failed = 1;
+			mtfs_clear_bit(bindex, active);
+			nr_active--;
+		} else if (file->tf_slow[bindex] && nr_active > 1) {
+			mtfs_clear_bit(bindex, active);
+			nr_active--;
+		}
+	}
+
+	for (bindex = 1; bindex < TEST_BNUM; bindex++) {
+		if (!mtfs_test_bit(bindex, active)) {
+			continue;
+		}
+
+		for (block = 0; block < TEST_BLOCKS; block++) {
+			file->tf_version[bindex][block] = file->tf_version[0][block];
+		}
+		mtfs_clear_bit(bindex, file->tf_dirty);
+	}
+
+	if (failed) {
+		if (masync_dirty_full(file->tf_dirty, TEST_BNUM)) {
+			file->tf_chunk = ~0UL;
+		}
+		return TEST_FLUSH_RETRY;
+	}
+
+	if (masync_dirty_next(file->tf_dirty, TEST_BNUM, 1)) {
+		return TEST_FLUSH_AGAIN;
+	}
+
+	file->tf_extent = 0;
+	return TEST_FLUSH_DONE;
+}
+
+/* Flush with no failure until clean, then compare branches */
+static int test_check(struct test_file *file)
+{
+	mtfs_bindex_t bindex = 0;
+	int block = 0;
+	int ret = 0;
+
+	memset(file->tf_fail, 0, sizeof(file->tf_fail));
+	memset(file->tf_slow, 0, sizeof(file->tf_slow));
+	while (test_flush(file) != TEST_FLUSH_DONE);
+
+	for (bindex = 1; bindex < TEST_BNUM; bindex++) {
+		for (block = 0; block < TEST_BLOCKS; block++) {
+			if (file->tf_version[bindex][block] !=
+			    file->tf_version[0][block]) {
+				fprintf(stderr, "block %d of branch[%d] is stale, "
+				        "version %d, expected %d\n",
+				        block, bindex,
+				        file->tf_version[bindex][block],
+				        file->tf_version[0][block]);
+				ret = -EINVAL;
+			}
+		}
+	}
+	return ret;
+}
+
+/* A branch synced by a failed flush must get the later write */
+static int test_partial_failure(void)
+{
+	struct test_file file;
+	int ret = 0;
+
+	memset(&file, 0, sizeof(file));
+	test_write(&file, 0);
+	file.tf_fail[2] = 1;
+	ret = test_flush(&file);
+	if (ret != TEST_FLUSH_RETRY) {
+		fprintf(stderr, "failing flush returned %d\n", ret);
+		return -EINVAL;
+	}
+
+	file.tf_fail[2] = 0;
+	test_write(&file, 0);
+	return test_check(&file);
+}
+
+/* A lagging branch leaves the pass, the others are synced */
+static int test_lagging(void)
+{
+	struct test_file file;
+	int ret = 0;
+
+	memset(&file, 0, sizeof(file));
+	test_write(&file, 0);
+	file.tf_slow[1] = 1;
+	ret = test_flush(&file);
+	if (ret != TEST_FLUSH_AGAIN) {
+		fprintf(stderr, "lagging flush returned %d\n", ret);
+		return -EINVAL;
+	}
+
+	if (file.tf_version[2][0] != file.tf_version[0][0]) {
+		fprintf(stderr, "branch[2] is not synced with branch[1] lagging\n");
+		return -EINVAL;
+	}
+
+	/* Only the lagging branch is left, so it is never skipped */
+	ret = test_flush(&file);
+	if (ret != TEST_FLUSH_DONE) {
+		fprintf(stderr, "flush of lagging branch returned %d\n", ret);
+		return -EINVAL;
+	}
+	return test_check(&file);
+}
+
+static int test_random(void)
+{
+	struct test_file file;
+	mtfs_bindex_t bindex = 0;
+	int i = 0;
+
+	memset(&file, 0, sizeof(file));
+	for (i = 0; i < TEST_OPERATIONS; i++) {
+		switch (random() % 4) {
+		case 0:
+			test_write(&file, random() % TEST_BLOCKS);
+			break;
+		case 1:
+			test_flush(&file);
+			break;
+		case 2:
+			bindex = 1 + random() % (TEST_BNUM - 1);
+			file.tf_fail[bindex] = !file.tf_fail[bindex];
+			break;
+		default:
+			bindex = 1 + random() % (TEST_BNUM - 1);
+			file.tf_slow[bindex] = !file.tf_slow[bindex];
+			break;
+		}
+	}
+	return test_check(&file);
+}
+
+/*
+ * Usage: test_masync_dirty
+ * Prints nothing if ok.
+ */
+int main(int argc, char *argv[])
+{
+	int ret = 0;
+
+	srandom(time(NULL));
+	ret = test_partial_failure();
+	if (ret) {
+		fprintf(stderr, "partial failure test failed\n");
+		goto out;
+	}
+
+	ret = test_lagging();
+	if (ret) {
+		fprintf(stderr, "lagging test failed\n");
+		goto out;
+	}
+
+	ret = test_random();
+	if (ret) {
+		fprintf(stderr, "random test failed\n");
+		goto out;
+	}
+out:
+	return ret;
+}
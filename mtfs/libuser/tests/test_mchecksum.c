@@ -10,7 +10,44 @@
 #define MAX_MOUNT_OPTION_LENGTH 1024
 #define AGAIN_SLOT "AGAIN"
 #define AGAIN_SLOT_LEN strlen(AGAIN_SLOT)
-int main()
+#define ZERO_SLOT "ZERO:"
+#define ZERO_SLOT_LEN strlen(ZERO_SLOT)
+
+/* Compute zero bytes one by one, as reference of mchecksum_compute_zero() */
+static __u32 zero_checksum_slow(__u32 checksum, size_t len,
+                                mchecksum_type_t type)
+{
+	unsigned char data[1] = {0};
+	size_t i = 0;
+
+	for (i = 0; i < len; i++) {
+		checksum = mchecksum_compute(checksum, data, 1, type);
+	}
+	return checksum;
+}
+
+static int checksum_type_parse(const char *name, mchecksum_type_t *type)
+{
+	if (strcmp(name, "crc32") == 0) {
+		*type = MCHECKSUM_CRC32;
+	} else if (strcmp(name, "crc32c") == 0) {
+		*type = MCHECKSUM_CRC32C;
+#ifdef HAVE_ADLER
+	} else if (strcmp(name, "adler") == 0) {
+		*type = MCHECKSUM_ADLER;
+#endif
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Usage: test_mchecksum [crc32|crc32c|adler]
+ * ZERO:<n> in input means n zero bytes, which are computed
+ * by mchecksum_compute_zero() before AGAIN, and byte by byte after it.
+ */
+int main(int argc, char *argv[])
 {
 	__u32 checksum1 = 0;
 	__u32 checksum2 = 0;
@@ -19,6 +56,15 @@ int main()
 	mchecksum_type_t type = mchecksum_type_select();
 	int number = 0;
 	int again = 0;
+	size_t zero_len = 0;
+
+	if (argc > 1) {
+		ret = checksum_type_parse(argv[1], &type);
+		if (ret) {
+			fprintf(stderr ,"invalid checksum type %s\n", argv[1]);
+			goto out;
+		}
+	}
 
 	checksum1 = mchecksum_init(type);
 	checksum2 = mchecksum_init(type);
@@ -36,6 +82,15 @@ int main()
 			   strcmp(input, AGAIN_SLOT) == 0) {
 			again = 1;
 			continue;
+		} else if (strncmp(input, ZERO_SLOT, ZERO_SLOT_LEN) == 0) {
+			zero_len = strtoul(input + ZERO_SLOT_LEN, NULL, 0);
+			if (!again) {
+				checksum1 = mchecksum_compute_zero(checksum1,
+				                  zero_len, type);
+			} else {
+				checksum2 = zero_checksum_slow(checksum2,
+				                  zero_len, type);
+			}
 		} else {
 			if (!again) {
 				checksum1 = mchecksum_compute(checksum1, input,
@@ -5,18 +5,23 @@
 #include <debug.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <compat.h>
 #include <mtfs_lock.h>
 #include <multithread.h>
 
 #define LOCK_STATE_NULL     0
 #define LOCK_STATE_GRANTED  1
 #define LOCK_STATE_BLOCKED  2
+#define LOCK_STATE_PARKED   3
+#define LOCK_STATE_NOTIFIED 4
 
 
 struct lock_info {
 	struct mlock *lock;
 	struct mlock_enqueue_info einfo;
 	int state;
+	struct mlock_deferred deferred;
 };
 
 struct lock_control {
@@ -46,6 +51,15 @@ static void control_init(struct lock_control *control,
 	control->index = -1;
 }
 
+/* Called by mlock_cancel() of the locker, which is holding req_mutex */
+static void locker_deferred_notify(struct mlock_deferred *deferred)
+{
+	struct lock_info *lock_info = container_of(deferred, struct lock_info, deferred);
+
+	MASSERT(lock_info->state == LOCK_STATE_PARKED);
+	lock_info->state = LOCK_STATE_NOTIFIED;
+}
+
 void cleanup(void *arg)
 {
 	struct lock_control *control = (struct lock_control *)(arg);
@@ -98,6 +112,21 @@ mtfs_locker(struct thread_info *info)
 				       control->index);
 				lock_info->state = LOCK_STATE_GRANTED;
 			}
+		} else if (operation == '?') {
+			MASSERT(lock_info->state == LOCK_STATE_NULL ||
+			        lock_info->state == LOCK_STATE_NOTIFIED);
+			einfo.deferred = &lock_info->deferred;
+			lock_info->lock = mlock_enqueue(control->resource, &einfo);
+			if (IS_ERR(lock_info->lock)) {
+				MDEBUG("lock[%d] parked\n",
+				       control->index);
+				lock_info->state = LOCK_STATE_PARKED;
+				lock_info->lock = NULL;
+			} else {
+				MDEBUG("lock[%d] granted\n",
+				       control->index);
+				lock_info->state = LOCK_STATE_GRANTED;
+			}
 		} else {
 			MASSERT(control->operation == '-');
 			MASSERT(lock_info->state == LOCK_STATE_GRANTED);
@@ -154,7 +183,9 @@ static int lock_check(struct lock_control *control, struct lock_info *lock_info,
 		}
 		break;
 	case LOCK_STATE_BLOCKED:
-		if (lock_info->state != LOCK_STATE_BLOCKED) {
+	case LOCK_STATE_PARKED:
+	case LOCK_STATE_NOTIFIED:
+		if (lock_info->state != state) {
 			MERROR("error actual state %d\n", lock_info->state);
 			ret =-1;
 		}
@@ -175,6 +206,8 @@ static int char2state(char c)
 	case 'G': return LOCK_STATE_GRANTED;
 	case 'N': return LOCK_STATE_NULL;
 	case 'B': return LOCK_STATE_BLOCKED;
+	case 'P': return LOCK_STATE_PARKED;
+	case 'A': return LOCK_STATE_NOTIFIED;
 	default: MERROR("unrecongnized mode %c\n", c); return -1;
 	}
 }
@@ -234,6 +267,8 @@ int main()
 			goto out_free_array;
 		}
 
+		mlock_deferred_init(&lock_array[i].deferred,
+		                    locker_deferred_notify);
 		lock_array[i].einfo.mode = char2mod(mode);
 		if (lock_array[i].einfo.mode == 0) {
 			ret = -EINVAL;
@@ -283,7 +318,7 @@ int main()
 		}
 
 		fscanf(stdin, " %c", &operation);
-		if (operation != '+' && operation != '-') {
+		if (operation != '+' && operation != '-' && operation != '?') {
 			MERROR("operation error %c\n",
 			       operation);
 			goto out_stop_group;
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <debug.h>
+#include <memory.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <compat.h>
+#include <mtfs_lowerfs.h>
+#include <mtfs_log.h>
+
+#define BENCH_RECORDS      16384 /* Records appended by each run */
+#define BENCH_THREADS_MAX  8
+#define BENCH_CANCEL_BATCH 64
+
+static int bench_rec_sizes[] = { 64, 256, 1024, 4096 };
+
+struct bench_thread {
+	pthread_t           bt_thread;
+	struct mlog_handle *bt_cath;
+	struct mlog_cookie *bt_cookies;
+	int                 bt_rec_size;
+	int                 bt_records;
+	int                 bt_ret;
+};
+
+static void *bench_append_main(void *arg)
+{
+	struct bench_thread *bt = (struct bench_thread *)arg;
+	struct mlog_rec_hdr rec;
+	char buf[4096];
+	int ret = 0;
+	int i = 0;
+
+	memset(buf, 0x5a, sizeof(buf));
+	for (i = 0; i < bt->bt_records; i++) {
+		rec.mrh_len = bt->bt_rec_size - sizeof(struct mlog_rec_hdr) -
+		              sizeof(struct mlog_rec_tail);
+		rec.mrh_type = MLOG_GEN_REC;
+		ret = mlog_cat_add_rec(bt->bt_cath, &rec, &bt->bt_cookies[i], buf);
+		if (ret != 1) {
+			fprintf(stderr, "failed to add record #%d, ret = %d\n",
+			        i, ret);
+			bt->bt_ret = ret < 0 ? ret : -EIO;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int bench_process_cb(struct mlog_handle *loghandle,
+                            struct mlog_rec_hdr *rec, void *data)
+{
+	atomic_add(rec->mrh_len, (atomic_t *)data);
+	return 0;
+}
+
+static double bench_seconds(ktime_t start)
+{
+	return ktime_to_ns(ktime_sub(ktime_get(), start)) / 1000000000.0;
+}
+
+static double bench_mib(int bytes)
+{
+	return bytes / 1048576.0;
+}
+
+static int bench_process(struct mlog_handle *cath, int flags, const char *name)
+{
+	atomic_t bytes = ATOMIC_INIT(0);
+	ktime_t start;
+	double seconds;
+	int ret = 0;
+
+	start = ktime_get();
+	ret = mlog_cat_process_flags(cath, bench_process_cb, &bytes, flags);
+	seconds = bench_seconds(start);
+	if (ret) {
+		fprintf(stderr, "failed to process catalog, ret = %d\n", ret);
+		return ret;
+	}
+	printf("  process %-9s %10.1f MiB/s\n", name,
+	       bench_mib(atomic_read(&bytes)) / seconds);
+	return 0;
+}
+
+static int bench_run(struct mlog_ctxt *ctxt, int rec_size, int nthreads)
+{
+	struct bench_thread threads[BENCH_THREADS_MAX];
+	struct mlog_handle *cath = NULL;
+	struct mlog_cookie *cookies = NULL;
+	char name[16];
+	ktime_t start;
+	double seconds;
+	int per_thread = BENCH_RECORDS / nthreads;
+	int records = per_thread * nthreads;
+	int started = 0;
+	int ret = 0;
+	int i = 0;
+
+	MTFS_ALLOC(cookies, sizeof(*cookies) * records);
+	if (cookies == NULL) {
+		fprintf(stderr, "not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	sprintf(name, "%x", random32());
+	ret = mlog_create(ctxt, &cath, NULL, name);
+	if (ret) {
+		fprintf(stderr, "failed to create catalog, ret = %d\n", ret);
+		goto out_free;
+	}
+	ret = mlog_init_handle(cath, MLOG_F_IS_CAT, NULL);
+	if (ret) {
+		fprintf(stderr, "failed to init catalog, ret = %d\n", ret);
+		goto out_destroy;
+	}
+
+	start = ktime_get();
+	for (started = 0; started < nthreads; started++) {
+		threads[started].bt_cath = cath;
+		threads[started].bt_cookies = cookies + started * per_thread;
+		threads[started].bt_rec_size = rec_size;
+		threads[started].bt_records = per_thread;
+		threads[started].bt_ret = 0;
+		ret = pthread_create(&threads[started].bt_thread, NULL,
+		                     bench_append_main, &threads[started]);
+		if (ret) {
+			fprintf(stderr, "failed to create thread, ret = %d\n",
+			        ret);
+			ret = -ret;
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i].bt_thread, NULL);
+		if (threads[i].bt_ret && ret == 0) {
+			ret = threads[i].bt_ret;
+		}
+	}
+	seconds = bench_seconds(start);
+	if (ret) {
+		goto out_destroy;
+	}
+	printf("record %d bytes, %d threads\n", rec_size, nthreads);
+	printf("  append            %10.0f records/s\n", records / seconds);
+
+	ret = mlog_flush_header(cath);
+	if (ret) {
+		fprintf(stderr, "failed to flush catalog, ret = %d\n", ret);
+		goto out_destroy;
+	}
+
+	ret = bench_process(cath, 0, "ordered");
+	if (ret) {
+		goto out_destroy;
+	}
+
+	ret = bench_process(cath, MLOG_PROCESS_UNORDERED, "unordered");
+	if (ret) {
+		goto out_destroy;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < records; i += BENCH_CANCEL_BATCH) {
+		ret = mlog_cat_cancel_records(cath,
+		                              min(BENCH_CANCEL_BATCH, records - i),
+		                              cookies + i);
+		if (ret) {
+			fprintf(stderr, "failed to cancel records, ret = %d\n",
+			        ret);
+			goto out_destroy;
+		}
+	}
+	seconds = bench_seconds(start);
+	printf("  cancel            %10.0f records/s\n", records / seconds);
+out_destroy:
+	if (mlog_cat_destroy(cath)) {
+		fprintf(stderr, "failed to destroy catalog\n");
+	} else {
+		mlog_free_handle(cath);
+	}
+out_free:
+	MTFS_FREE(cookies, sizeof(*cookies) * records);
+out:
+	return ret;
+}
+
+static int bench(struct mlog_ctxt *ctxt)
+{
+	int nthreads = 0;
+	int ret = 0;
+	int i = 0;
+
+	for (i = 0; i < sizeof(bench_rec_sizes) / sizeof(bench_rec_sizes[0]); i++) {
+		for (nthreads = 1; nthreads <= BENCH_THREADS_MAX; nthreads *= 2) {
+			ret = bench_run(ctxt, bench_rec_sizes[i], nthreads);
+			if (ret) {
+				goto out;
+			}
+		}
+	}
+out:
+	return ret;
+}
+
+/* Remove the logs left in the directory, and the directory itself */
+static void cleanup_dir(const char *path)
+{
+	char name[PATH_MAX];
+	struct dirent *dirent = NULL;
+	DIR *dir = NULL;
+
+	dir = opendir(path);
+	if (dir != NULL) {
+		while ((dirent = readdir(dir)) != NULL) {
+			if (strcmp(dirent->d_name, ".") == 0 ||
+			    strcmp(dirent->d_name, "..") == 0) {
+				continue;
+			}
+			snprintf(name, sizeof(name), "%s/%s", path,
+			         dirent->d_name);
+			unlink(name);
+		}
+		closedir(dir);
+	}
+	rmdir(path);
+}
+
+/*
+ * Usage: test_mlog [-b]
+ * Runs the mlog tests on logs in a temporary directory, prints nothing
+ * but the messages of tests if ok. With -b, runs the benchmark instead.
+ */
+int main(int argc, char *argv[])
+{
+	char path[] = "/tmp/test_mlog.XXXXXX";
+	struct dentry dir;
+	struct mlog_ctxt *ctxt = NULL;
+	int benchmark = 0;
+	int ret = 0;
+
+	if (argc == 2 && strcmp(argv[1], "-b") == 0) {
+		benchmark = 1;
+	} else if (argc != 1) {
+		fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	srandom(time(NULL));
+	if (mkdtemp(path) == NULL) {
+		ret = -errno;
+		fprintf(stderr, "failed to create directory, ret = %d\n", ret);
+		goto out;
+	}
+	mlowerfs_user_dir_init(&dir, path);
+
+	ctxt = mlog_context_init(&dir, NULL, &mlowerfs_user,
+	                         &mlog_vfs_operations);
+	if (ctxt == NULL) {
+		ret = -ENOMEM;
+		goto out_cleanup;
+	}
+
+	ret = mlog_spare_init();
+	if (ret) {
+		fprintf(stderr, "failed to init spare logs, ret = %d\n", ret);
+		goto out_fini_ctxt;
+	}
+
+	if (benchmark) {
+		ret = bench(ctxt);
+	} else {
+		ret = mlog_run_tests(ctxt);
+	}
+
+	mlog_spare_fini();
+out_fini_ctxt:
+	mlog_context_fini(ctxt);
+out_cleanup:
+	cleanup_dir(path);
+out:
+	return ret;
+}
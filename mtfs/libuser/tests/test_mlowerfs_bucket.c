@@ -7,7 +7,10 @@
 #include <bitmap.h>
 #include <mtfs_lowerfs.h>
 
-int main()
+/*
+ * Usage: test_mlowerfs_bucket [slot_number]
+ */
+int main(int argc, char *argv[])
 {
 	int ret = 0;
 	struct mlowerfs_bucket *bucket = NULL;
@@ -22,10 +25,15 @@ int main()
 		goto out;
 	}
 
+	if (argc > 1) {
+		bucket->mb_slot_number = atoi(argv[1]);
+	}
+
 	fscanf(stdin, "%d", &operation_num);
 	for (i = 0; i < operation_num; i ++) {
 		fscanf(stdin, "%llu%llu", &extent.start, &extent.end);
 		_mlowerfs_bucket_add(bucket, &extent);
+		_mlowerfs_bucket_is_valid(bucket);
 	}
 	_mlowerfs_bucket_dump(bucket);
 out_free_bucket:
@@ -7,6 +7,7 @@
 #include <bitmap.h>
 #include <mtfs_random.h>
 #include <mtfs_lowerfs.h>
+#include <sys/time.h>
 #define MAX_INTERVAL_NUMBER 1024
 
 typedef enum operation_type {
@@ -60,7 +61,200 @@ int random_test(struct mlowerfs_bucket *bucket, mtfs_bitmap_t *bitmap, int limit
 	return ret;
 }
 
-int main()
+/*
+ * Benchmark of random writes to a large file, comparing the bucket
+ * with the region records that async_replica logs to the catalog.
+ * The constants are copied since the kernel headers are not usable here.
+ */
+#define BENCH_BLOCK_SHIFT      12                 /* MASYNC_BLOCK_SHIFT */
+#define BENCH_CHUNK_SHIFT      22                 /* MASYNC_CHUNK_SHIFT */
+#define BENCH_REGION_MAX       64                 /* MASYNC_REGION_MAX */
+#define BENCH_REGION_REC_SIZE  48                 /* struct mlog_async_region_rec */
+#define BENCH_BLOCK_NUMBER     (1 << 20)          /* 4G file */
+#define BENCH_WRITE_BLOCKS     16                 /* Max blocks of a write */
+#define BENCH_WRITE_NUMBER     10000
+#define BENCH_CHUNK_BLOCKS     (1 << (BENCH_CHUNK_SHIFT - BENCH_BLOCK_SHIFT))
+#define BENCH_CHUNK_NUMBER     (BENCH_BLOCK_NUMBER / BENCH_CHUNK_BLOCKS)
+
+/* Writes are at random inside the first span blocks */
+int bench_test(struct mlowerfs_bucket *bucket, int span)
+{
+	struct mtfs_interval_node_extent extent;
+	mtfs_bitmap_t *dirty = NULL;
+	mtfs_bitmap_t *chunks = NULL;
+	__u64 bucket_written = 0;
+	__u64 bucket_resync = 0;
+	__u64 region_written = 0;
+	__u64 region_resync = 0;
+	__u64 dirty_blocks = 0;
+	int region_number = 0;
+	int whole = 0;
+	int covered = 0;
+	__u64 block = 0;
+	__u64 chunk = 0;
+	int i = 0;
+	int ret = 0;
+
+	dirty = mtfs_bitmap_allocate(BENCH_BLOCK_NUMBER);
+	if (dirty == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	chunks = mtfs_bitmap_allocate(BENCH_CHUNK_NUMBER);
+	if (chunks == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_free_dirty;
+	}
+
+	memset(bucket, 0, sizeof(*bucket));
+	mtfs_random_init(0);
+	for (i = 0; i < BENCH_WRITE_NUMBER; i++) {
+		extent.start = random() % (span - BENCH_WRITE_BLOCKS);
+		extent.end = extent.start + random() % BENCH_WRITE_BLOCKS;
+
+		/* Bucket is rewritten if the write is not covered */
+		covered = 1;
+		for (block = extent.start; block <= extent.end; block++) {
+			if (!_mlowerfs_bucket_check(bucket, block)) {
+				covered = 0;
+			}
+			if (!mtfs_bitmap_check(dirty, block)) {
+				mtfs_bitmap_set(dirty, block);
+				dirty_blocks++;
+			}
+		}
+		if (!covered) {
+			_mlowerfs_bucket_add(bucket, &extent);
+			bucket_written += sizeof(struct mlowerfs_disk_bucket);
+		}
+
+		/* A record for each new chunk until the whole file is logged */
+		for (chunk = extent.start / BENCH_CHUNK_BLOCKS;
+		     chunk <= extent.end / BENCH_CHUNK_BLOCKS && !whole;
+		     chunk++) {
+			if (mtfs_bitmap_check(chunks, chunk)) {
+				continue;
+			}
+			mtfs_bitmap_set(chunks, chunk);
+			region_written += BENCH_REGION_REC_SIZE;
+			if (++region_number > BENCH_REGION_MAX) {
+				whole = 1;
+			}
+		}
+	}
+
+	for (i = 0; i < MLOWERFS_BUCKET_NUMBER; i++) {
+		if (mlowerfs_bucket2s_used(bucket, i)) {
+			bucket_resync += mlowerfs_bucket2s_end(bucket, i) -
+			                 mlowerfs_bucket2s_start(bucket, i) + 1;
+		}
+	}
+	bucket_resync <<= BENCH_BLOCK_SHIFT;
+
+	if (whole) {
+		region_resync = (__u64)BENCH_BLOCK_NUMBER << BENCH_BLOCK_SHIFT;
+	} else {
+		region_resync = (__u64)region_number << BENCH_CHUNK_SHIFT;
+	}
+
+	printf("span: %llu, writes: %d, dirty: %llu\n",
+	       (__u64)span << BENCH_BLOCK_SHIFT, BENCH_WRITE_NUMBER,
+	       dirty_blocks << BENCH_BLOCK_SHIFT);
+	printf("bucket: written %llu, resync %llu\n",
+	       bucket_written, bucket_resync);
+	printf("region: written %llu, resync %llu%s\n",
+	       region_written, region_resync, whole ? " (whole file)" : "");
+
+	mtfs_bitmap_freee(chunks);
+out_free_dirty:
+	mtfs_bitmap_freee(dirty);
+out:
+	return ret;
+}
+
+/*
+ * Benchmark of adding random writes to buckets with different slot numbers.
+ * Over-approximation is the bytes covered by the bucket but not written,
+ * which would be synced needlessly.
+ */
+int bench_slots(struct mlowerfs_bucket *bucket, int span, int slot_number)
+{
+	struct mtfs_interval_node_extent *extents = NULL;
+	mtfs_bitmap_t *dirty = NULL;
+	struct timeval start;
+	struct timeval end;
+	__u64 dirty_blocks = 0;
+	__u64 covered_blocks = 0;
+	__u64 block = 0;
+	long usec = 0;
+	int i = 0;
+	int ret = 0;
+
+	MTFS_ALLOC(extents, sizeof(*extents) * BENCH_WRITE_NUMBER);
+	if (extents == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dirty = mtfs_bitmap_allocate(span);
+	if (dirty == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_free_extents;
+	}
+
+	mtfs_random_init(0);
+	for (i = 0; i < BENCH_WRITE_NUMBER; i++) {
+		extents[i].start = random() % (span - BENCH_WRITE_BLOCKS);
+		extents[i].end = extents[i].start + random() % BENCH_WRITE_BLOCKS;
+		for (block = extents[i].start; block <= extents[i].end; block++) {
+			if (!mtfs_bitmap_check(dirty, block)) {
+				mtfs_bitmap_set(dirty, block);
+				dirty_blocks++;
+			}
+		}
+	}
+
+	memset(bucket, 0, sizeof(*bucket));
+	bucket->mb_slot_number = slot_number;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_WRITE_NUMBER; i++) {
+		_mlowerfs_bucket_add(bucket, &extents[i]);
+	}
+	gettimeofday(&end, NULL);
+	usec = (end.tv_sec - start.tv_sec) * 1000000 +
+	       (end.tv_usec - start.tv_usec);
+	if (usec == 0) {
+		usec = 1;
+	}
+
+	for (i = 0; i < _mlowerfs_bucket_count(bucket); i++) {
+		covered_blocks += mlowerfs_bucket2s_end(bucket, i) -
+		                  mlowerfs_bucket2s_start(bucket, i) + 1;
+	}
+	MASSERT(covered_blocks >= dirty_blocks);
+
+	printf("slots: %d, span: %llu, adds/s: %llu, over-approximation: %llu\n",
+	       slot_number, (__u64)span << BENCH_BLOCK_SHIFT,
+	       (__u64)BENCH_WRITE_NUMBER * 1000000 / usec,
+	       (covered_blocks - dirty_blocks) << BENCH_BLOCK_SHIFT);
+
+	mtfs_bitmap_freee(dirty);
+out_free_extents:
+	MTFS_FREE(extents, sizeof(*extents) * BENCH_WRITE_NUMBER);
+out:
+	return ret;
+}
+
+/*
+ * Usage: test_mlowerfs_bucket_random [-b]
+ * -b: run benchmark rather than random tests
+ */
+int main(int argc, char *argv[])
 {
 	int ret = 0;
 	struct mlowerfs_bucket *bucket = NULL;
@@ -81,6 +275,17 @@ int main()
 		goto out;
 	}
 
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		ret = bench_test(bucket, BENCH_BLOCK_NUMBER);
+		if (ret == 0) {
+			ret = bench_test(bucket, BENCH_CHUNK_BLOCKS * BENCH_REGION_MAX / 4);
+		}
+		for (i = 8; ret == 0 && i <= MLOWERFS_BUCKET_NUMBER; i *= 2) {
+			ret = bench_slots(bucket, BENCH_BLOCK_NUMBER, i);
+		}
+		goto out_free_bucket;
+	}
+
 	bitmap = mtfs_bitmap_allocate(MAX_INTERVAL_NUMBER);
 	if (bitmap == NULL) {
 		MERROR("not enough memory\n");
@@ -92,6 +297,10 @@ int main()
 	for (i = 0; i < iter_num; i++) {
 		for(j = 1; j <= interval_num; j++) {
 			memset(bucket, 0, sizeof(*bucket));
+			bucket->mb_slot_number = 1 + i % MLOWERFS_BUCKET_NUMBER;
+			mtfs_foreach_bit(bitmap, k) {
+				mtfs_bitmap_clear(bitmap, k);
+			}
 			//printf("interval: %d\n", j);
 			for (k = 0; k < operation_num; k++) {
 				ret = random_test(bucket, bitmap, j);
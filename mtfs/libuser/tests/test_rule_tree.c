@@ -2,6 +2,7 @@
  * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
  */
 
+#include <string.h>
 #include <debug.h>
 #include <memory.h>
 #include "rule_tree.h"
@@ -33,7 +34,11 @@ void string_dump(char **string, unsigned int string_number)
 }
 #endif
 
-int main()
+/*
+ * Usage: test_rule_tree [-p]
+ * Matches suffixes of strings, or prefixes with -p.
+ */
+int main(int argc, char *argv[])
 {
 	int i = 0;
 	rule_tree_t *root = NULL;
@@ -44,6 +49,11 @@ int main()
 	rule_t *rule_array = NULL;
 	char check_str[MAX_RULE_LEN * 2];
 	int check_num = 0;
+	int prefix = 0;
+
+	if (argc == 2 && strcmp(argv[1], "-p") == 0) {
+		prefix = 1;
+	}
 
 	fscanf(stdin, "%d", &str_num);
 	MTFS_ALLOC(rule_array, sizeof(*rule_array) * str_num);
@@ -67,7 +77,11 @@ int main()
 	}
 	
 	/* construct tree */
-	root = rule_tree_construct(rule_array, str_num);
+	if (prefix) {
+		root = rule_tree_construct_prefix(rule_array, str_num);
+	} else {
+		root = rule_tree_construct(rule_array, str_num);
+	}
 	if (IS_ERR(root)) {
 		ret = PTR_ERR(root);
 		MERROR("construct rule tree failed\n");
@@ -79,7 +93,11 @@ int main()
 	fscanf(stdin, "%d", &check_num);
 	for(i = 0; i < check_num; i++) {
 		fscanf(stdin, "%s", check_str);
-		raid_type = rule_tree_search(root, check_str);
+		if (prefix) {
+			raid_type = rule_tree_search_prefix(root, check_str);
+		} else {
+			raid_type = rule_tree_search(root, check_str);
+		}
 		raid = raid_type;
 		MPRINT("%d\n", raid);
 	}
@@ -324,6 +324,28 @@ out:
         return ret;
 }
 
+/*
+ * Submit reads of all the blocks of a multi-block range before reading them
+ * one by one, so that the block reads of mlog_process are not serialized.
+ */
+static void mlowerfs_ext3_readahead(struct inode *inode, loff_t offs, int size)
+{
+	unsigned long block = offs >> inode->i_blkbits;
+	unsigned long last = (offs + size - 1) >> inode->i_blkbits;
+	sector_t phys;
+
+	if (block == last) {
+		return;
+	}
+
+	for (; block <= last; block++) {
+		phys = bmap(inode, block);
+		if (phys) {
+			sb_breadahead(inode->i_sb, phys);
+		}
+	}
+}
+
 static int mlowerfs_ext3_read_record(struct file * file, void *buf,
                                      int size, loff_t *offs)
 {
@@ -349,6 +371,7 @@ static int mlowerfs_ext3_read_record(struct file * file, void *buf,
 	}
 
 	blocksize = 1 << inode->i_blkbits;
+	mlowerfs_ext3_readahead(inode, *offs, size);
 
 	while (size > 0) {
 		block = *offs >> inode->i_blkbits;
@@ -386,6 +409,21 @@ int mlowerfs_ext3_write_record(struct file *file, void *buf, int bufsize,
 	block_count = (*offs & (blocksize - 1)) + bufsize;
 	block_count = (block_count + blocksize - 1) >> inode->i_blkbits;
 
+	/*
+	 * A record written inside the transaction of the caller, e.g. a
+	 * group commit of mlog, takes its credits from that transaction
+	 */
+	if (current->journal_info) {
+		err = mlowerfs_ext3_extend(inode,
+		                           block_count * EXT3_DATA_TRANS_BLOCKS(inode->i_sb) + 2,
+		                           current->journal_info);
+		if (err) {
+			MERROR("can't extend transaction for %d blocks, ret = %d\n",
+			       block_count, err);
+			return err;
+		}
+	}
+
 	handle = _mlowerfs_ext3_journal_start(inode,
 	                                      block_count * EXT3_DATA_TRANS_BLOCKS(inode->i_sb) + 2);
 	if (IS_ERR(handle)) {
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+/*
+ * For both kernel and userspace use
+ * DO NOT use anything special that opposes this purpose
+ */
+
+#if defined (__linux__) && defined(__KERNEL__)
+#include <linux/module.h>
+#endif /* defined (__linux__) && defined(__KERNEL__) */
+
+#include <compat.h>
+#include <debug.h>
+#include <memory.h>
+#include <mtfs_bloom.h>
+
+int mtfs_bloom_init(struct mtfs_bloom *bloom, int bits, int hashes)
+{
+	int ret = 0;
+	MENTRY();
+
+	if (bits < MTFS_BLOOM_BITS_MIN || bits > MTFS_BLOOM_BITS_MAX ||
+	    hashes < 1 || hashes > MTFS_BLOOM_HASHES_MAX) {
+		MERROR("invalid bloom filter, bits = %d, hashes = %d\n",
+		       bits, hashes);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	bloom->mbl_bits = bits;
+	bloom->mbl_hashes = hashes;
+	bloom->mbl_keys = 0;
+	MTFS_ALLOC(bloom->mbl_counters, mtfs_bloom_size(bloom));
+	if (bloom->mbl_counters == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+	}
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mtfs_bloom_init);
+
+void mtfs_bloom_fini(struct mtfs_bloom *bloom)
+{
+	MENTRY();
+
+	if (bloom->mbl_counters) {
+		MTFS_FREE(bloom->mbl_counters, mtfs_bloom_size(bloom));
+		bloom->mbl_counters = NULL;
+	}
+
+	_MRETURN();
+}
+EXPORT_SYMBOL(mtfs_bloom_fini);
+
+/* Finalizer of splitmix64, which spreads every bit of the key */
+static inline __u64 mtfs_bloom_mix(__u64 key)
+{
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+/*
+ * Position of the n-th hash. Double hashing of the two halves
+ * behaves like independent hashes with only one mix.
+ */
+static inline unsigned long mtfs_bloom_position(struct mtfs_bloom *bloom,
+                                                __u64 hash, int n)
+{
+	__u32 low = (__u32)hash;
+	__u32 high = (__u32)(hash >> 32) | 1;
+
+	return (low + n * high) & (mtfs_bloom_size(bloom) - 1);
+}
+
+void mtfs_bloom_add(struct mtfs_bloom *bloom, __u64 key)
+{
+	__u64 hash = mtfs_bloom_mix(key);
+	unsigned long position = 0;
+	int n = 0;
+
+	for (n = 0; n < bloom->mbl_hashes; n++) {
+		position = mtfs_bloom_position(bloom, hash, n);
+		if (bloom->mbl_counters[position] < MTFS_BLOOM_COUNTER_MAX) {
+			bloom->mbl_counters[position]++;
+		}
+	}
+	bloom->mbl_keys++;
+}
+EXPORT_SYMBOL(mtfs_bloom_add);
+
+/* Only keys added before should be deleted */
+void mtfs_bloom_del(struct mtfs_bloom *bloom, __u64 key)
+{
+	__u64 hash = mtfs_bloom_mix(key);
+	unsigned long position = 0;
+	int n = 0;
+
+	for (n = 0; n < bloom->mbl_hashes; n++) {
+		position = mtfs_bloom_position(bloom, hash, n);
+		MASSERT(bloom->mbl_counters[position] > 0);
+		if (bloom->mbl_counters[position] < MTFS_BLOOM_COUNTER_MAX) {
+			bloom->mbl_counters[position]--;
+		}
+	}
+	MASSERT(bloom->mbl_keys > 0);
+	bloom->mbl_keys--;
+}
+EXPORT_SYMBOL(mtfs_bloom_del);
+
+/* Return 0 if key is definitely not in the filter */
+int mtfs_bloom_test(struct mtfs_bloom *bloom, __u64 key)
+{
+	__u64 hash = mtfs_bloom_mix(key);
+	int n = 0;
+
+	for (n = 0; n < bloom->mbl_hashes; n++) {
+		if (bloom->mbl_counters[mtfs_bloom_position(bloom, hash, n)] == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+EXPORT_SYMBOL(mtfs_bloom_test);
+
+/* Return number of counters not zero */
+unsigned long mtfs_bloom_fill(struct mtfs_bloom *bloom)
+{
+	unsigned long fill = 0;
+	unsigned long i = 0;
+
+	for (i = 0; i < mtfs_bloom_size(bloom); i++) {
+		if (bloom->mbl_counters[i]) {
+			fill++;
+		}
+	}
+	return fill;
+}
+EXPORT_SYMBOL(mtfs_bloom_fill);
@@ -14,6 +14,52 @@
 #define qstr_pair(qstr)        (qstr)->len, (qstr)->name
 #define d_name_pair(dentry)    qstr_pair(&(dentry)->d_name)
 
+#ifndef HAVE_DENTRY_PATH_RAW
+/* Renames change d_name and d_parent under dcache_lock */
+static char *mtfs_dentry_path_locked(struct dentry *dentry, char *buf, int size)
+{
+	struct dentry *d_tmp = dentry;
+	char *path = buf + size;
+
+	*--path = '\0';
+	spin_lock(&dcache_lock);
+	while (!IS_ROOT(d_tmp)) {
+		if (path - buf < d_tmp->d_name.len + 1) {
+			path = ERR_PTR(-ENAMETOOLONG);
+			goto out;
+		}
+		path -= d_tmp->d_name.len;
+		memcpy(path, d_tmp->d_name.name, d_tmp->d_name.len);
+		*--path = '/';
+		d_tmp = d_tmp->d_parent;
+	}
+	if (*path == '\0') {
+		*--path = '/';
+	}
+out:
+	spin_unlock(&dcache_lock);
+	return path;
+}
+#endif /* !HAVE_DENTRY_PATH_RAW */
+
+/*
+ * Build path of dentry under the root of mtfs at the end of buf.
+ * Return the start of the path, which is "/" for the root.
+ */
+char *mtfs_dentry_path(struct dentry *dentry, char *buf, int size)
+{
+	char *path = NULL;
+	MENTRY();
+
+#ifdef HAVE_DENTRY_PATH_RAW
+	path = dentry_path_raw(dentry, buf, size);
+#else /* !HAVE_DENTRY_PATH_RAW */
+	path = mtfs_dentry_path_locked(dentry, buf, size);
+#endif /* !HAVE_DENTRY_PATH_RAW */
+	MRETURN(path);
+}
+EXPORT_SYMBOL(mtfs_dentry_path);
+
 int mtfs_dentry_dump(struct dentry *dentry)
 {
 	int ret = 0;
@@ -8,6 +8,9 @@
 #include <linux/uio.h>
 #include <linux/mount.h>
 #include <linux/sched.h>
+#ifdef HAVE_FILE_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif /* HAVE_FILE_FALLOCATE_PUNCH_HOLE */
 #include <mtfs_oplist.h>
 #include <mtfs_ioctl.h>
 #include <mtfs_device.h>
@@ -604,6 +607,164 @@ ssize_t _do_read_write(int is_write, struct file *file, void *buf, ssize_t count
 }
 EXPORT_SYMBOL(_do_read_write);
 
+/*
+ * Find the first data range of file in [start, end).
+ * Set [*data_start, *data_end) to it, or both to end if it is all hole.
+ * Without SEEK_DATA support, the whole range is taken as data.
+ * Must not be called holding i_mutex of file, llseek may take it.
+ */
+void mtfs_file_seek_data(struct file *file, loff_t start, loff_t end,
+                         loff_t *data_start, loff_t *data_end)
+{
+#ifdef HAVE_SEEK_DATA
+	loff_t offset = 0;
+#endif /* HAVE_SEEK_DATA */
+	MENTRY();
+
+	*data_start = start;
+	*data_end = end;
+#ifdef HAVE_SEEK_DATA
+	offset = vfs_llseek(file, start, SEEK_DATA);
+	if (offset == -ENXIO) {
+		/* No data after start */
+		*data_start = end;
+		goto out;
+	} else if (offset < 0) {
+		/* Lower fs does not know, take it as data */
+		goto out;
+	} else if (offset >= end) {
+		*data_start = end;
+		goto out;
+	}
+	*data_start = offset;
+
+	offset = vfs_llseek(file, offset, SEEK_HOLE);
+	if (offset > *data_start && offset < end) {
+		*data_end = offset;
+	}
+out:
+#endif /* HAVE_SEEK_DATA */
+	_MRETURN();
+}
+EXPORT_SYMBOL(mtfs_file_seek_data);
+
+int mtfs_buffer_is_zero(const char *buf, size_t len)
+{
+	const unsigned long *word = (const unsigned long *)buf;
+	size_t i = 0;
+
+	for (i = 0; i < len / sizeof(*word); i++) {
+		if (word[i]) {
+			return 0;
+		}
+	}
+
+	for (i = i * sizeof(*word); i < len; i++) {
+		if (buf[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+EXPORT_SYMBOL(mtfs_buffer_is_zero);
+
+/*
+ * Make [pos, pos + len) of file read as zero, zero_buf is len of zero.
+ * Nothing is written beyond the size of file, caller extends it if needed.
+ * Within the size, punch a hole if lower fs supports, otherwise write zero.
+ * Return len or negative error.
+ */
+ssize_t mtfs_file_write_zero(struct file *file, char *zero_buf,
+                             size_t len, loff_t pos)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	loff_t size = i_size_read(inode);
+	ssize_t ret = len;
+	ssize_t result = 0;
+	size_t inside = 0;
+	MENTRY();
+
+	if (pos >= size) {
+		goto out;
+	}
+
+	inside = len;
+	if (inside > size - pos) {
+		inside = size - pos;
+	}
+
+#ifdef HAVE_FILE_FALLOCATE_PUNCH_HOLE
+	if (file->f_op && file->f_op->fallocate) {
+		result = file->f_op->fallocate(file,
+		                               FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		                               pos, inside);
+		if (result == 0) {
+			goto out;
+		} else if (result != -EOPNOTSUPP) {
+			ret = result;
+			goto out;
+		}
+	}
+#endif /* HAVE_FILE_FALLOCATE_PUNCH_HOLE */
+
+	result = _do_read_write(WRITE, file, zero_buf, inside, &pos);
+	if (result != inside) {
+		ret = result < 0 ? result : -EIO;
+	}
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mtfs_file_write_zero);
+
+/*
+ * Write buf to file, leave it as hole if it is all zero.
+ * Return len or negative error.
+ */
+ssize_t mtfs_file_write_sparse(struct file *file, char *buf,
+                               size_t len, loff_t pos)
+{
+	ssize_t ret = 0;
+	MENTRY();
+
+	if (mtfs_buffer_is_zero(buf, len)) {
+		ret = mtfs_file_write_zero(file, buf, len, pos);
+	} else {
+		ret = _do_read_write(WRITE, file, buf, len, &pos);
+		if (ret >= 0 && ret != len) {
+			ret = -EIO;
+		}
+	}
+
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mtfs_file_write_sparse);
+
+/*
+ * Extend file to size if it is smaller, by writing the last byte.
+ * The range skipped by mtfs_file_write_zero() stays as hole.
+ */
+int mtfs_file_extend(struct file *file, loff_t size)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	char zero = 0;
+	loff_t pos = size - 1;
+	ssize_t result = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (size <= 0 || i_size_read(inode) >= size) {
+		goto out;
+	}
+
+	result = _do_read_write(WRITE, file, &zero, 1, &pos);
+	if (result != 1) {
+		ret = result < 0 ? result : -EIO;
+	}
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mtfs_file_extend);
+
 ssize_t debug_write_truncate(struct file *file, const struct iovec *iov,
                              unsigned long nr_segs, loff_t *ppos)
 {
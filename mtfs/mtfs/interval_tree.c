@@ -109,7 +109,7 @@ for (node = mtfs_interval_first(root); node != NULL;         \
 for (node = mtfs_interval_last(root); node != NULL;          \
      node = mtfs_interval_prev(node))
 
-static struct mtfs_interval_node *mtfs_interval_first(struct mtfs_interval_node *node)
+struct mtfs_interval_node *mtfs_interval_first(struct mtfs_interval_node *node)
 {
 	MENTRY();
 
@@ -119,6 +119,7 @@ static struct mtfs_interval_node *mtfs_interval_first(struct mtfs_interval_node
 		node = node->in_left;
 	MRETURN(node);
 }
+EXPORT_SYMBOL(mtfs_interval_first);
 
 static struct mtfs_interval_node *mtfs_interval_last(struct mtfs_interval_node *node)
 {
@@ -131,7 +132,7 @@ static struct mtfs_interval_node *mtfs_interval_last(struct mtfs_interval_node *
         MRETURN(node);
 }
 
-static struct mtfs_interval_node *mtfs_interval_next(struct mtfs_interval_node *node)
+struct mtfs_interval_node *mtfs_interval_next(struct mtfs_interval_node *node)
 {
 	MENTRY();
 
@@ -143,6 +144,7 @@ static struct mtfs_interval_node *mtfs_interval_next(struct mtfs_interval_node *
 		node = node->in_parent;
 	MRETURN(node->in_parent);
 }
+EXPORT_SYMBOL(mtfs_interval_next);
 
 static struct mtfs_interval_node *mtfs_interval_prev(struct mtfs_interval_node *node)
 {
@@ -568,6 +570,46 @@ color:
 }
 EXPORT_SYMBOL(mtfs_interval_erase);
 
+/*
+ * Empty the tree at once without rebalancing, by walking it in post order.
+ * Every node is out of tree when @func is called, so @func could free it.
+ * The return value of @func is ignored.
+ */
+void mtfs_interval_detach(struct mtfs_interval_node **root,
+                          mtfs_interval_callback_t func, void *data)
+{
+	struct mtfs_interval_node *node = *root;
+	struct mtfs_interval_node *parent = NULL;
+	MENTRY();
+
+	*root = NULL;
+	while (node) {
+		if (node->in_left) {
+			node = node->in_left;
+			continue;
+		}
+		if (node->in_right) {
+			node = node->in_right;
+			continue;
+		}
+
+		/* Leaf, cut it off from parent */
+		parent = node->in_parent;
+		if (parent) {
+			if (parent->in_left == node)
+				parent->in_left = NULL;
+			else
+				parent->in_right = NULL;
+		}
+		node->in_parent = NULL;
+		node->in_intree = 0;
+		func(node, data);
+		node = parent;
+	}
+	_MRETURN();
+}
+EXPORT_SYMBOL(mtfs_interval_detach);
+
 static inline int mtfs_interval_may_overlap(struct mtfs_interval_node *node,
                                           struct mtfs_interval_node_extent *ext)
 {
@@ -653,6 +695,59 @@ enum mtfs_interval_iter mtfs_interval_search(struct mtfs_interval_node *node,
 }
 EXPORT_SYMBOL(mtfs_interval_search);
 
+/*
+ * Find the overlapped node with the lowest start.
+ * If the left subtree reaches ext->start but has no overlapped node,
+ * its node that reaches ext->start starts after ext->end,
+ * so does every node in order after it.
+ */
+static struct mtfs_interval_node *
+mtfs_interval_first_overlap(struct mtfs_interval_node *node,
+                            struct mtfs_interval_node_extent *ext)
+{
+	while (node) {
+		if (node->in_left && node->in_left->in_max_high >= ext->start) {
+			node = node->in_left;
+		} else if (extent_overlapped(ext, &node->in_extent)) {
+			break;
+		} else if (mtfs_interval_low(node) > ext->end) {
+			node = NULL;
+		} else {
+			node = node->in_right;
+		}
+	}
+	return node;
+}
+
+/*
+ * Same as mtfs_interval_search, but calls func in ascending order of
+ * start, so that callers need not sort the result.
+ */
+enum mtfs_interval_iter mtfs_interval_search_inorder(struct mtfs_interval_node *root,
+                                                     struct mtfs_interval_node_extent *ext,
+                                                     mtfs_interval_callback_t func,
+                                                     void *data)
+{
+	struct mtfs_interval_node *node = NULL;
+	enum mtfs_interval_iter rc = MTFS_INTERVAL_ITER_CONT;
+
+	MASSERT(ext != NULL);
+	MASSERT(func != NULL);
+
+	for (node = mtfs_interval_first_overlap(root, ext);
+	     node != NULL && mtfs_interval_low(node) <= ext->end;
+	     node = mtfs_interval_next(node)) {
+		if (!extent_overlapped(ext, &node->in_extent))
+			continue;
+		rc = func(node, data);
+		if (rc == MTFS_INTERVAL_ITER_STOP)
+			break;
+	}
+
+	return rc;
+}
+EXPORT_SYMBOL(mtfs_interval_search_inorder);
+
 static enum mtfs_interval_iter mtfs_interval_overlap_cb(struct mtfs_interval_node *n,
                                               void *args)
 {
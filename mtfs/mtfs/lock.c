@@ -466,6 +466,7 @@ static struct mlock *mlock_create(struct mlock_resource *resource, struct mlock_
 	lock->ml_mode = einfo->mode;
 	lock->ml_type = resource->mlr_type;
 	lock->ml_state = MLOCK_STATE_NEW;
+	lock->ml_deferred = einfo->deferred;
 	mlock_init_waitq(lock);
 #if defined (__linux__) && defined(__KERNEL__)
 	lock->ml_pid = current->pid;
@@ -573,6 +574,15 @@ static int mlock_enqueue_try_nolock(struct mlock *lock, int flag)
 out_pend:
 	if (flag & MLOCK_FL_BLOCK_NOWAIT) {
 		ret = -EWOULDBLOCK;
+		if (lock->ml_deferred) {
+			/*
+			 * Park under resource lock, so that the cancel
+			 * of the conflicting lock can not be missed.
+			 */
+			MASSERT(mtfs_list_empty(&lock->ml_deferred->mld_linkage));
+			mtfs_list_add_tail(&lock->ml_deferred->mld_linkage,
+			                   &resource->mlr_deferred);
+		}
 	} else if (lock->ml_state == MLOCK_STATE_NEW) {
 		mlock_pend(lock);
 	}
@@ -710,15 +720,33 @@ void mlock_resource_reprocess(struct mlock_resource *resource)
 static void mlock_resource_add2list(struct mlock_resource *resource);
 #endif /* defined(__linux__) && defined(__KERNEL__) */
 
+/* Notify enqueues parked on the resource, called without resource lock */
+static void mlock_deferred_notify(mtfs_list_t *deferred_list)
+{
+	struct mlock_deferred *deferred = NULL;
+	MENTRY();
+
+	while (!mtfs_list_empty(deferred_list)) {
+		deferred = mtfs_list_entry(deferred_list->next,
+		                           struct mlock_deferred,
+		                           mld_linkage);
+		mtfs_list_del_init(&deferred->mld_linkage);
+		deferred->mld_notify(deferred);
+	}
+	_MRETURN();
+}
+
 void mlock_cancel(struct mlock *lock)
 {
 	struct mlock_resource *resource = lock->ml_resource;
+	MTFS_LIST_HEAD(deferred_list);
 	MENTRY();
 
 	MASSERT(lock->ml_state == MLOCK_STATE_GRANTED);
 
 	mlock_resource_lock(resource);
 	mlock_unlink(lock);
+	mtfs_list_splice_init(&resource->mlr_deferred, &deferred_list);
 #if defined(__linux__) && defined(__KERNEL__)
 	mlock_destroy(lock);
 	mlock_resource_unlock(resource);
@@ -729,10 +757,26 @@ void mlock_cancel(struct mlock *lock)
 	mlock_resource_unlock(resource);
 #endif /* !defined(__linux__) && defined(__KERNEL__) */
 
+	mlock_deferred_notify(&deferred_list);
 	_MRETURN();
 }
 EXPORT_SYMBOL(mlock_cancel);
 
+/* Notify all enqueues parked on the resource, e.g. before freeing it */
+void mlock_resource_wakeup(struct mlock_resource *resource)
+{
+	MTFS_LIST_HEAD(deferred_list);
+	MENTRY();
+
+	mlock_resource_lock(resource);
+	mtfs_list_splice_init(&resource->mlr_deferred, &deferred_list);
+	mlock_resource_unlock(resource);
+
+	mlock_deferred_notify(&deferred_list);
+	_MRETURN();
+}
+EXPORT_SYMBOL(mlock_resource_wakeup);
+
 int mlock_state(struct mlock *lock)
 {
 	int state = 0;
@@ -757,6 +801,7 @@ void mlock_resource_init(struct mlock_resource *resource)
 	MTFS_INIT_LIST_HEAD(&resource->mlr_granted);
 	MTFS_INIT_LIST_HEAD(&resource->mlr_waiting);
 	MTFS_INIT_LIST_HEAD(&resource->mlr_reprocess_linkage);
+	MTFS_INIT_LIST_HEAD(&resource->mlr_deferred);
 
 	mtfs_spin_lock_init(&resource->mlr_lock);
 	resource->mlr_type = MLOCK_TYPE_DEFAULT;
@@ -1,14 +1,18 @@
 /*
  * Copied from Lustre-2.x
  */
+#if defined (__linux__) && defined(__KERNEL__)
 #include <linux/namei.h>
 #include <linux/module.h>
 #include <linux/mount.h>
 #include <linux/random.h>
+#include <mtfs_file.h>
+#else /* !defined (__linux__) && defined(__KERNEL__) */
+#include <unistd.h>
+#endif /* !defined (__linux__) && defined(__KERNEL__) */
 #include <thread.h>
 #include <mtfs_lowerfs.h>
 #include <mtfs_log.h>
-#include <mtfs_file.h>
 
 static int mlog_vfs_pad(struct mtfs_lowerfs *lowerfs,
 		    struct file *file,
@@ -118,6 +122,110 @@ static int mlog_vfs_write_blob(struct mtfs_lowerfs *lowerfs,
 	MRETURN(ret);
 }
 
+static int mlog_vfs_write_range(struct mtfs_lowerfs *lowerfs,
+				struct file *file,
+				struct mlog_log_hdr *mlh,
+				loff_t start, loff_t end)
+{
+	loff_t offset = start;
+	int ret = 0;
+	MENTRY();
+
+	ret = mlowerfs_write_record(lowerfs, file, (char *)mlh + start,
+				    end - start, &offset, 0);
+	if (ret) {
+		MERROR("error writing log header [%llu, %llu), ret = %d\n",
+		       (unsigned long long)start, (unsigned long long)end, ret);
+	}
+	MRETURN(ret);
+}
+
+/*
+ * Write back the part of the header dirtied by setting or clearing
+ * bit index: the fixed fields and the bitmap words holding the bit and
+ * the bits of deferred appends, rounded to the block size of the lower fs.
+ * Index 0 writes the whole header.
+ * The header tail is written only if write_tail is set, appended
+ * plain logs find their last index from the last record instead.
+ */
+static int mlog_vfs_write_header(struct mlog_handle *loghandle,
+				 int index, int write_tail)
+{
+	struct mlog_log_hdr *mlh = loghandle->mgh_hdr;
+	struct file *file = loghandle->mgh_file;
+	struct mtfs_lowerfs *lowerfs = loghandle->mgh_ctxt->moc_lowerfs;
+	loff_t blocksize = 1 << file->f_dentry->d_inode->i_blkbits;
+	int first = index;
+	int last = index;
+	loff_t fixed_end;
+	loff_t word_start;
+	loff_t word_end;
+	loff_t tail_start;
+	int ret = 0;
+	MENTRY();
+
+	if (index == 0 || blocksize >= MLOG_CHUNK_SIZE) {
+		ret = mlog_vfs_write_range(lowerfs, file, mlh,
+					   0, MLOG_CHUNK_SIZE);
+		goto out;
+	}
+
+	if (loghandle->mgh_dirty_last != 0) {
+		first = min(first, loghandle->mgh_dirty_first);
+		last = max(last, loghandle->mgh_dirty_last);
+	}
+
+	fixed_end = (offsetof(struct mlog_log_hdr, mlh_bitmap) +
+		     blocksize - 1) & ~(blocksize - 1);
+	word_start = offsetof(struct mlog_log_hdr, mlh_bitmap) +
+		     (first / 32) * sizeof(__u32);
+	word_end = offsetof(struct mlog_log_hdr, mlh_bitmap) +
+		   (last / 32 + 1) * sizeof(__u32);
+	word_end = (word_end + blocksize - 1) & ~(blocksize - 1);
+	word_start &= ~(blocksize - 1);
+	tail_start = (MLOG_CHUNK_SIZE - sizeof(mlh->mlh_tail)) &
+		     ~(blocksize - 1);
+
+	if (write_tail && word_end >= tail_start) {
+		word_end = MLOG_CHUNK_SIZE;
+		write_tail = 0;
+	}
+
+	if (word_start <= fixed_end) {
+		ret = mlog_vfs_write_range(lowerfs, file, mlh,
+					   0, max(word_end, fixed_end));
+	} else {
+		ret = mlog_vfs_write_range(lowerfs, file, mlh, 0, fixed_end);
+		if (ret) {
+			goto out;
+		}
+		ret = mlog_vfs_write_range(lowerfs, file, mlh,
+					   word_start, word_end);
+	}
+	if (ret) {
+		goto out;
+	}
+
+	if (write_tail) {
+		ret = mlog_vfs_write_range(lowerfs, file, mlh,
+					   max(tail_start, word_end),
+					   MLOG_CHUNK_SIZE);
+	}
+out:
+	if (ret == 0) {
+		loghandle->mgh_dirty_first = 0;
+		loghandle->mgh_dirty_last = 0;
+	}
+	MRETURN(ret);
+}
+
+/*
+ * Fields of packed records may be unaligned, so they are swabbed in place
+ * by value rather than through a pointer.
+ */
+#define mlog_swab32_field(field) ((field) = __swab32(field))
+#define mlog_swab64_field(field) ((field) = __swab64(field))
+
 static void mlog_swab_rec(struct mlog_rec_hdr *rec, struct mlog_rec_tail *tail)
 {
 	__swab32s(&rec->mrh_len);
@@ -128,15 +236,15 @@ static void mlog_swab_rec(struct mlog_rec_hdr *rec, struct mlog_rec_tail *tail)
 	case MLOG_HDR_MAGIC: {
 		struct mlog_log_hdr *mlh = (struct mlog_log_hdr *)rec;
 
-		__swab64s(&mlh->mlh_timestamp);
-		__swab32s(&mlh->mlh_count);
-		__swab32s(&mlh->mlh_bitmap_offset);
-		__swab32s(&mlh->mlh_flags);
-		__swab32s(&mlh->mlh_size);
-		__swab32s(&mlh->mlh_cat_idx);
+		mlog_swab64_field(mlh->mlh_timestamp);
+		mlog_swab32_field(mlh->mlh_count);
+		mlog_swab32_field(mlh->mlh_bitmap_offset);
+		mlog_swab32_field(mlh->mlh_flags);
+		mlog_swab32_field(mlh->mlh_size);
+		mlog_swab32_field(mlh->mlh_cat_idx);
 		if (tail != &mlh->mlh_tail) {
-			__swab32s(&mlh->mlh_tail.mrt_index);
-			__swab32s(&mlh->mlh_tail.mrt_len);
+			mlog_swab32_field(mlh->mlh_tail.mrt_index);
+			mlog_swab32_field(mlh->mlh_tail.mrt_len);
 		}
 
 		break;
@@ -144,16 +252,16 @@ static void mlog_swab_rec(struct mlog_rec_hdr *rec, struct mlog_rec_tail *tail)
 	case MLOG_LOGID_MAGIC: {
 		struct mlog_logid_rec *mid = (struct mlog_logid_rec *)rec;
 
-		__swab64s(&mid->mid_id.mgl_oid);
-		__swab64s(&mid->mid_id.mgl_ogr);
-		__swab32s(&mid->mid_id.mgl_ogen);
+		mlog_swab64_field(mid->mid_id.mgl_oid);
+		mlog_swab64_field(mid->mid_id.mgl_ogr);
+		mlog_swab32_field(mid->mid_id.mgl_ogen);
 		break;
 	}
 	case MLOG_EXTENT_MAGIC: {
 		struct mlog_extent_rec *mex = (struct mlog_extent_rec *)rec;
 
-		__swab64s(&mex->mex_start);
-		__swab64s(&mex->mex_end);
+		mlog_swab64_field(mex->mex_start);
+		mlog_swab64_field(mex->mex_end);
 		break;
 	}
 	case MLOG_PAD_MAGIC:
@@ -174,9 +282,156 @@ static void mlog_swab_hdr(struct mlog_log_hdr *h)
 	mlog_swab_rec(&h->mlh_hdr, &h->mlh_tail);
 }
 
+/*
+ * The last record of a plain log was torn by a crash while appending.
+ * Walk the records from the first chunk to find the last complete one,
+ * and cover the torn bytes with a pad record up to the end of their
+ * chunk, so that later appends and processing do not run into them.
+ * Records never cross a chunk boundary, so neither do the torn bytes.
+ */
+static int mlog_vfs_recover_last_idx(struct mlog_handle *handle,
+				     int swab, loff_t size)
+{
+	struct mtfs_lowerfs *lowerfs = handle->mgh_ctxt->moc_lowerfs;
+	struct file *file = handle->mgh_file;
+	struct mlog_rec_hdr rec;
+	struct mlog_rec_tail tail;
+	loff_t offset = MLOG_CHUNK_SIZE;
+	loff_t chunk_end = 0;
+	__u32 last_idx = 0;
+	int ret = 0;
+	MENTRY();
+
+	while (offset + MLOG_MIN_REC_SIZE <= size) {
+		chunk_end = (offset | (MLOG_CHUNK_SIZE - 1)) + 1;
+		ret = mlog_vfs_read_blob(lowerfs, file, &rec,
+					 sizeof(rec), offset);
+		if (ret) {
+			goto out;
+		}
+
+		if (swab) {
+			__swab32s(&rec.mrh_len);
+			__swab32s(&rec.mrh_index);
+		}
+
+		if (rec.mrh_len < MLOG_MIN_REC_SIZE ||
+		    (rec.mrh_len & 0x7) != 0 ||
+		    offset + rec.mrh_len > min(size, chunk_end) ||
+		    rec.mrh_index <= last_idx ||
+		    rec.mrh_index >= MLOG_BITMAP_SIZE(handle->mgh_hdr)) {
+			break;
+		}
+
+		ret = mlog_vfs_read_blob(lowerfs, file, &tail, sizeof(tail),
+					 offset + rec.mrh_len - sizeof(tail));
+		if (ret) {
+			goto out;
+		}
+
+		if (swab) {
+			__swab32s(&tail.mrt_len);
+			__swab32s(&tail.mrt_index);
+		}
+
+		if (tail.mrt_len != rec.mrh_len ||
+		    tail.mrt_index != rec.mrh_index) {
+			break;
+		}
+
+		last_idx = rec.mrh_index;
+		offset += rec.mrh_len;
+	}
+
+	chunk_end = (offset | (MLOG_CHUNK_SIZE - 1)) + 1;
+	if (size > chunk_end) {
+		MERROR("log %.*s is corrupted after offset %llu\n",
+		       file->f_dentry->d_name.len,
+		       file->f_dentry->d_name.name,
+		       (unsigned long long)offset);
+		ret = -EIO;
+		goto out;
+	}
+
+	/* Never reuse the index of a record that might be referenced */
+	if (last_idx > handle->mgh_last_idx) {
+		handle->mgh_last_idx = last_idx;
+	}
+
+	if (offset < size &&
+	    handle->mgh_last_idx < MLOG_BITMAP_SIZE(handle->mgh_hdr) - 1) {
+		file->f_pos = offset;
+		ret = mlog_vfs_pad(lowerfs, file, chunk_end - offset,
+				   handle->mgh_last_idx + 1);
+		if (ret) {
+			goto out;
+		}
+		handle->mgh_last_idx++;
+	}
+	handle->mgh_hdr->mlh_tail.mrt_index = handle->mgh_last_idx;
+	MDEBUG("recovered log %.*s, last index %u, end %llu\n",
+	       file->f_dentry->d_name.len, file->f_dentry->d_name.name,
+	       handle->mgh_last_idx, (unsigned long long)file->f_pos);
+out:
+	MRETURN(ret);
+}
+
+/*
+ * Appends do not rewrite the header tail, so the index of the last
+ * record appended to a plain log is taken from the tail of the last
+ * record in the file.
+ */
+static int mlog_vfs_read_last_idx(struct mlog_handle *handle, int swab)
+{
+	struct mtfs_lowerfs *lowerfs = handle->mgh_ctxt->moc_lowerfs;
+	loff_t size = i_size_read(handle->mgh_file->f_dentry->d_inode);
+	struct mlog_rec_tail tail;
+	int ret = 0;
+	MENTRY();
+
+	if (size <= MLOG_CHUNK_SIZE) {
+		goto out;
+	}
+
+	memset(&tail, 0, sizeof(tail));
+	if (size >= MLOG_CHUNK_SIZE + MLOG_MIN_REC_SIZE) {
+		ret = mlog_vfs_read_blob(lowerfs, handle->mgh_file, &tail,
+					 sizeof(tail), size - sizeof(tail));
+		if (ret) {
+			goto out;
+		}
+
+		if (swab) {
+			__swab32s(&tail.mrt_len);
+			__swab32s(&tail.mrt_index);
+		}
+	}
+
+	if ((size & 0x7) != 0 ||
+	    tail.mrt_len < MLOG_MIN_REC_SIZE ||
+	    tail.mrt_len > MLOG_CHUNK_SIZE ||
+	    tail.mrt_index >= MLOG_BITMAP_SIZE(handle->mgh_hdr)) {
+		MWARN("bad tail of last record in log %.*s: "
+		      "len %u, index %u, recovering\n",
+		      handle->mgh_file->f_dentry->d_name.len,
+		      handle->mgh_file->f_dentry->d_name.name,
+		      tail.mrt_len, tail.mrt_index);
+		ret = mlog_vfs_recover_last_idx(handle, swab, size);
+		goto out;
+	}
+
+	if (tail.mrt_index > handle->mgh_last_idx) {
+		handle->mgh_last_idx = tail.mrt_index;
+		handle->mgh_hdr->mlh_tail.mrt_index = tail.mrt_index;
+	}
+out:
+	MRETURN(ret);
+}
+
 static int mlog_vfs_read_header(struct mlog_handle *handle)
 {
 	struct mtfs_lowerfs *lowerfs = NULL;
+	int swab = 0;
 	int ret = 0;
 	MENTRY();
 
@@ -200,7 +455,8 @@ static int mlog_vfs_read_header(struct mlog_handle *handle)
 	} else {
 		struct mlog_rec_hdr *mlh_hdr = &handle->mgh_hdr->mlh_hdr;
 
-		if (MLOG_REC_HDR_NEEDS_SWABBING(mlh_hdr)) {
+		swab = MLOG_REC_HDR_NEEDS_SWABBING(mlh_hdr);
+		if (swab) {
 			mlog_swab_hdr(handle->mgh_hdr);
 		}
 
@@ -222,6 +478,9 @@ static int mlog_vfs_read_header(struct mlog_handle *handle)
 
 	handle->mgh_last_idx = handle->mgh_hdr->mlh_tail.mrt_index;
 	handle->mgh_file->f_pos = i_size_read(handle->mgh_file->f_dentry->d_inode);
+	if (ret == 0 && !(handle->mgh_hdr->mlh_flags & MLOG_F_IS_CAT)) {
+		ret = mlog_vfs_read_last_idx(handle, swab);
+	}
 
 out:
 	MRETURN(ret);
@@ -288,7 +547,12 @@ static int mlog_vfs_write_rec(struct mlog_handle *loghandle,
 			MERROR("Index mismatch %d %u\n", idx, rec->mrh_index);
 		}
 
-		ret = mlog_vfs_write_blob(lowerfs, file, &mlh->mlh_hdr, NULL, 0);
+		/* the header of a new log is written as a whole */
+		if (i_size_read(file->f_dentry->d_inode) < MLOG_CHUNK_SIZE) {
+			ret = mlog_vfs_write_header(loghandle, 0, 1);
+		} else {
+			ret = mlog_vfs_write_header(loghandle, idx, 1);
+		}
 		/* we are done if we only write the header or on error */
 		if (ret || idx == 0) {
 			goto out;
@@ -303,9 +567,9 @@ static int mlog_vfs_write_rec(struct mlog_handle *loghandle,
 			/* We assume that caller has set mgh_cur_* */
 			saved_offset = loghandle->mgh_cur_offset;
 
-			MDEBUG("modify record %I64x: idx:%d/%u/%d, len:%u "
+			MDEBUG("modify record %llx: idx:%d/%u/%d, len:%u "
 			       "offset %llu\n",
-			       loghandle->mgh_id.mgl_oid, idx, rec->mrh_index,
+			       (unsigned long long)loghandle->mgh_id.mgl_oid, idx, rec->mrh_index,
 			       loghandle->mgh_cur_idx, rec->mrh_len,
 			       (long long)(saved_offset - sizeof(*mlh)));
 			if (rec->mrh_index != loghandle->mgh_cur_idx) {
@@ -338,6 +602,15 @@ static int mlog_vfs_write_rec(struct mlog_handle *loghandle,
 		goto out;
 	}
 
+	if (file->f_pos < MLOG_CHUNK_SIZE) {
+		/* the header of a new log is written as a whole */
+		ret = mlog_vfs_write_header(loghandle, 0, 1);
+		if (ret) {
+			goto out;
+		}
+		file->f_pos = MLOG_CHUNK_SIZE;
+	}
+
 	/* Make sure that records don't cross a chunk boundary, so we can
 	 * process them page-at-a-time if needed.  If it will cross a chunk
 	 * boundary, write in a fake (but referenced) entry to pad the chunk.
@@ -380,18 +653,30 @@ static int mlog_vfs_write_rec(struct mlog_handle *loghandle,
 	mlh->mlh_count++;
 	mlh->mlh_tail.mrt_index = index;
 
-	ret = mlog_vfs_write_blob(lowerfs, file, &mlh->mlh_hdr, NULL, 0);
+	/*
+	 * Write the record before its bit, so that a crash in between
+	 * leaves an unreferenced record rather than a bit without one.
+	 */
+	ret = mlog_vfs_write_blob(lowerfs, file, rec, buf, file->f_pos);
 	if (ret) {
 		goto out;
 	}
 
-	ret = mlog_vfs_write_blob(lowerfs, file, rec, buf, file->f_pos);
-	if (ret) {
-		goto out;
+	if (loghandle->mgh_defer_header) {
+		/* mlog_flush_header() will write it with the others */
+		if (loghandle->mgh_dirty_last == 0) {
+			loghandle->mgh_dirty_first = index;
+		}
+		loghandle->mgh_dirty_last = index;
+	} else {
+		ret = mlog_vfs_write_header(loghandle, index, 0);
+		if (ret) {
+			goto out;
+		}
 	}
 
-	MDEBUG("added record %I64x: idx: %u, %u bytes\n",
-	       loghandle->mgh_id.mgl_oid, index, rec->mrh_len);
+	MDEBUG("added record %llx: idx: %u, %u bytes\n",
+	       (unsigned long long)loghandle->mgh_id.mgl_oid, index, rec->mrh_len);
 	if (ret == 0 && reccookie) {
 		reccookie->mgc_mgl = loghandle->mgh_id;
 		reccookie->mgc_index = index;
@@ -433,10 +718,10 @@ void mlog_free_handle(struct mlog_handle *loghandle)
 	}
 
 	if (loghandle->mgh_hdr->mlh_flags & MLOG_F_IS_PLAIN) {
-		list_del_init(&loghandle->u.phd.phd_entry);
+		mtfs_list_del_init(&loghandle->u.phd.phd_entry);
 	}
 	if (loghandle->mgh_hdr->mlh_flags & MLOG_F_IS_CAT) {
-		MASSERT(list_empty(&loghandle->u.chd.chd_head));
+		MASSERT(mtfs_list_empty(&loghandle->u.chd.chd_head));
 	}
 	MTFS_FREE(loghandle->mgh_hdr, MLOG_CHUNK_SIZE);
 
@@ -454,6 +739,7 @@ void mlog_id2name(struct mlog_logid *logid, char *name, int length)
 		 logid->mgl_ogen);
 }
 
+#if defined (__linux__) && defined(__KERNEL__)
 static struct file *mlog_vfs_open_id(struct mlog_ctxt *ctxt, struct mlog_logid *logid)
 {
 	struct dentry *dchild = NULL;
@@ -477,7 +763,7 @@ static struct file *mlog_vfs_open_id(struct mlog_ctxt *ctxt, struct mlog_logid *
 				strlen(name));
 	mutex_unlock(&ctxt->moc_dlog->d_inode->i_mutex);
 	if (IS_ERR(dchild)) {
-		MERROR("lookup [%.*s/%s] failed, ret = %d\n",
+		MERROR("lookup [%.*s/%s] failed, ret = %ld\n",
 		       ctxt->moc_dlog->d_name.len,
 		       ctxt->moc_dlog->d_name.name,
 		       name,
@@ -562,7 +848,7 @@ static struct file *mlog_vfs_create_open_name(struct mlog_ctxt *ctxt, const char
 				    name, strlen(name),
 				    S_IFREG | S_IRWXU, 0, NULL, 0);
 	if (IS_ERR(dchild)) {
-		MERROR("failed to create [%.*s/%s], ret = %d\n",
+		MERROR("failed to create [%.*s/%s], ret = %ld\n",
 		       ctxt->moc_dlog->d_name.len,
 		       ctxt->moc_dlog->d_name.name,
 		       name, PTR_ERR(dchild));
@@ -674,7 +960,7 @@ static struct file *mlog_vfs_create_open_new(struct mlog_ctxt *ctxt, struct mlog
 
 	file = mlog_vfs_open_id(ctxt, logid);
 	if (IS_ERR(file)) {
-		MERROR("failed to open file, ret = %d\n", PTR_ERR(file));
+		MERROR("failed to open file, ret = %ld\n", PTR_ERR(file));
 		goto out_put_dchild;
 	}
 	goto out;
@@ -684,6 +970,145 @@ out:
 	MRETURN(file);
 }
 
+#else /* !defined (__linux__) && defined(__KERNEL__) */
+static struct file *mlog_vfs_open_id(struct mlog_ctxt *ctxt, struct mlog_logid *logid)
+{
+	struct file *file = NULL;
+	struct inode *inode = NULL;
+	int length = 64;
+	char *name = NULL;
+	MENTRY();
+
+	MTFS_ALLOC(name, length);
+	if (name == NULL) {
+		MERROR("not enough memory\n");
+		file = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	mlog_id2name(logid, name, length);
+
+	file = mlowerfs_user_open(ctxt->moc_dlog, name, 0);
+	if (IS_ERR(file)) {
+		MERROR("lookup [%.*s/%s] failed, ret = %ld\n",
+		       ctxt->moc_dlog->d_name.len,
+		       ctxt->moc_dlog->d_name.name,
+		       name,
+		       PTR_ERR(file));
+		goto out_free_name;
+	}
+
+	inode = file->f_dentry->d_inode;
+	if (inode->i_ino != logid->mgl_oid ||
+	    inode->i_generation != logid->mgl_ogen) {
+		/* we didn't find the right inode.. */
+		MDEBUG("found wrong inode, "
+		       "inode = %lu, "
+		       "generation = %u/%u\n",
+		       inode->i_ino,
+		       inode->i_generation,
+		       logid->mgl_ogen);
+		mlowerfs_user_close(file);
+		file = ERR_PTR(-ENOENT);
+	}
+out_free_name:
+	MTFS_FREE(name, length);
+out:
+	MRETURN(file);
+}
+
+static struct file *mlog_vfs_create_open_name(struct mlog_ctxt *ctxt, const char *name)
+{
+	struct file *file = NULL;
+	MENTRY();
+
+	file = mlowerfs_user_open(ctxt->moc_dlog, name, 1);
+	if (IS_ERR(file)) {
+		MERROR("failed to create [%.*s/%s], ret = %ld\n",
+		       ctxt->moc_dlog->d_name.len,
+		       ctxt->moc_dlog->d_name.name,
+		       name, PTR_ERR(file));
+	}
+	MRETURN(file);
+}
+
+int mlog_vfs_create_new(struct mlog_ctxt *ctxt, struct mlog_logid *logid)
+{
+	struct file *file = NULL;
+	int ret = 0;
+	int length = 64;
+	char *name = NULL;
+	char *new_name = NULL;
+	unsigned int tmpname = random32();
+	MENTRY();
+
+	MTFS_ALLOC(name, length);
+	if (name == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	MTFS_ALLOC(new_name, length);
+	if (new_name == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_free_name;
+	}
+
+	sprintf(name, "%u.%u", tmpname, getpid());
+
+	file = mlowerfs_user_open(ctxt->moc_dlog, name, 1);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		MERROR("create [%.*s/%s] failed, ret = %d\n",
+		       ctxt->moc_dlog->d_name.len,
+		       ctxt->moc_dlog->d_name.name,
+		       name, ret);
+		goto out_free_new_name;
+	}
+
+	logid->mgl_oid = file->f_dentry->d_inode->i_ino;
+	logid->mgl_ogen = file->f_dentry->d_inode->i_generation;
+	mlowerfs_user_close(file);
+	mlog_id2name(logid, new_name, length);
+
+	ret = mlowerfs_user_rename(ctxt->moc_dlog, name, new_name);
+	if (ret) {
+		MERROR("error renaming new object %s, ret = %d\n",
+		       new_name, ret);
+		mlowerfs_user_unlink(ctxt->moc_dlog, name);
+	}
+out_free_new_name:
+	MTFS_FREE(new_name, length);
+out_free_name:
+	MTFS_FREE(name, length);
+out:
+	MRETURN(ret);
+}
+
+static struct file *mlog_vfs_create_open_new(struct mlog_ctxt *ctxt, struct mlog_logid *logid)
+{
+	struct file *file = NULL;
+	int ret = 0;
+	MENTRY();
+
+	ret = mlog_vfs_create_new(ctxt, logid);
+	if (ret) {
+		MERROR("failed to create new log, ret = %d\n", ret);
+		file = ERR_PTR(ret);
+		goto out;
+	}
+
+	file = mlog_vfs_open_id(ctxt, logid);
+	if (IS_ERR(file)) {
+		MERROR("failed to open file, ret = %ld\n", PTR_ERR(file));
+	}
+out:
+	MRETURN(file);
+}
+#endif /* !defined (__linux__) && defined(__KERNEL__) */
+
 /* This is a callback from the mlog_* functions.
  * Assumes caller has already pushed us into the kernel context. */
 int mlog_vfs_create(struct mlog_ctxt *ctxt, struct mlog_handle **res,
@@ -738,6 +1163,7 @@ out:
 	MRETURN(ret);
 }
 
+#if defined (__linux__) && defined(__KERNEL__)
 static int mlog_vfs_close(struct mlog_handle *handle)
 {
 	int ret = 0;
@@ -776,6 +1202,40 @@ static int mlog_vfs_destroy(struct mlog_handle *handle)
 
 	MRETURN(ret);
 }
+#else /* !defined (__linux__) && defined(__KERNEL__) */
+static int mlog_vfs_close(struct mlog_handle *handle)
+{
+	int ret = 0;
+	MENTRY();
+
+	ret = mlowerfs_user_close(handle->mgh_file);
+	if (ret) {
+		MERROR("error closing log, ret = %d\n", ret);
+	}
+	MRETURN(ret);
+}
+
+static int mlog_vfs_destroy(struct mlog_handle *handle)
+{
+	struct dentry *dentry = NULL;
+	struct mlog_ctxt *ctxt = NULL;
+	char name[MLOWERFS_USER_NAME_MAX];
+	int ret = 0;
+	MENTRY();
+
+	dentry = handle->mgh_file->f_dentry;
+	ctxt = handle->mgh_ctxt;
+	snprintf(name, sizeof(name), "%.*s",
+	         dentry->d_name.len, dentry->d_name.name);
+
+	ret = mlog_vfs_close(handle);
+	if (ret == 0) {
+		ret = mlowerfs_user_unlink(ctxt->moc_dlog, name);
+	}
+
+	MRETURN(ret);
+}
+#endif /* !defined (__linux__) && defined(__KERNEL__) */
 
 /* We can skip reading at least as many log blocks as the number of
 * minimum sized log records we are skipping.  If it turns out
@@ -1000,7 +1460,7 @@ int mlog_cancel_rec(struct mlog_handle *loghandle, int index)
 		goto out;
 	}
 
-	ret = mlog_write_rec(loghandle, &mlh->mlh_hdr, NULL, 0, NULL, 0);
+	ret = mlog_vfs_write_header(loghandle, index, 0);
 	if (ret) {
 		MERROR("Failure re-writing header %d\n", ret);
 		ext2_set_bit(index, mlh->mlh_bitmap);
@@ -1011,6 +1471,156 @@ out:
 }
 EXPORT_SYMBOL(mlog_cancel_rec);
 
+/*
+ * Cancel num records of a log and write its header once.
+ * The indexes actually cleared are moved to the head of the array.
+ * Returns 1 if the log has been destroyed because it became empty.
+ */
+int mlog_cancel_arr_rec(struct mlog_handle *loghandle, int num, int *index)
+{
+	struct mlog_log_hdr *mlh = loghandle->mgh_hdr;
+	int cleared = 0;
+	int first = 0;
+	int last = 0;
+	int ret = 0;
+	int i;
+	MENTRY();
+
+	for (i = 0; i < num; i++) {
+		if (index[i] == 0) {
+			MERROR("Can't cancel index 0 which is header\n");
+			continue;
+		}
+
+		if (!ext2_clear_bit(index[i], mlh->mlh_bitmap)) {
+			MDEBUG("Index %u of log %llx already clear?\n",
+			       index[i], loghandle->mgh_id.mgl_oid);
+			continue;
+		}
+
+		if (cleared == 0 || index[i] < first) {
+			first = index[i];
+		}
+		if (index[i] > last) {
+			last = index[i];
+		}
+		index[cleared++] = index[i];
+	}
+
+	if (cleared == 0) {
+		goto out;
+	}
+
+	MDEBUG("Canceling %d records in log %llx\n",
+	       cleared, loghandle->mgh_id.mgl_oid);
+	mlh->mlh_count -= cleared;
+
+	if ((mlh->mlh_flags & MLOG_F_ZAP_WHEN_EMPTY) &&
+	    (mlh->mlh_count == 1) &&
+	    (loghandle->mgh_last_idx == (MLOG_BITMAP_BYTES * 8) - 1)) {
+		ret = mlog_destroy(loghandle);
+		if (ret) {
+			MERROR("Failure destroying log after last cancel: %d\n",
+			       ret);
+			goto out_restore;
+		}
+		ret = 1;
+		goto out;
+	}
+
+	if (loghandle->mgh_dirty_last != 0) {
+		first = min(first, loghandle->mgh_dirty_first);
+		last = max(last, loghandle->mgh_dirty_last);
+	}
+	loghandle->mgh_dirty_first = first;
+	loghandle->mgh_dirty_last = last;
+	ret = mlog_vfs_write_header(loghandle, first, 0);
+	if (ret) {
+		MERROR("Failure re-writing header %d\n", ret);
+		goto out_restore;
+	}
+	goto out;
+out_restore:
+	for (i = 0; i < cleared; i++) {
+		ext2_set_bit(index[i], mlh->mlh_bitmap);
+	}
+	mlh->mlh_count += cleared;
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_cancel_arr_rec);
+
+/* Write the header updates deferred by appends with mgh_defer_header set */
+int mlog_flush_header(struct mlog_handle *loghandle)
+{
+	int ret = 0;
+	MENTRY();
+
+	if (loghandle->mgh_dirty_last == 0) {
+		goto out;
+	}
+
+	ret = mlog_vfs_write_header(loghandle, loghandle->mgh_dirty_first, 0);
+	if (ret) {
+		MERROR("failed to flush header of log %llx, ret = %d\n",
+		       loghandle->mgh_id.mgl_oid, ret);
+	}
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_flush_header);
+
+/*
+ * Flush the header and make the appended records durable without a
+ * transaction of our own: the fixed fields are rewritten in sync, which
+ * syncs the log file or marks the running transaction of the caller sync.
+ */
+int mlog_sync_header(struct mlog_handle *loghandle)
+{
+	struct mtfs_lowerfs *lowerfs = loghandle->mgh_ctxt->moc_lowerfs;
+	loff_t offset = 0;
+	int ret = 0;
+	MENTRY();
+
+	ret = mlog_flush_header(loghandle);
+	if (ret) {
+		goto out;
+	}
+
+	ret = mlowerfs_write_record(lowerfs, loghandle->mgh_file,
+				    loghandle->mgh_hdr,
+				    offsetof(struct mlog_log_hdr, mlh_bitmap),
+				    &offset, 1);
+	if (ret) {
+		MERROR("failed to sync header of log %llx, ret = %d\n",
+		       loghandle->mgh_id.mgl_oid, ret);
+	}
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_sync_header);
+
+/* Write the whole header of a new log, so that it is ready for appends */
+int mlog_write_header(struct mlog_handle *loghandle)
+{
+	int ret = 0;
+	MENTRY();
+
+	ret = mlog_vfs_write_header(loghandle, 0, 1);
+	if (ret) {
+		MERROR("failed to write header of log %llx, ret = %d\n",
+		       loghandle->mgh_id.mgl_oid, ret);
+		goto out;
+	}
+
+	if (loghandle->mgh_file->f_pos < MLOG_CHUNK_SIZE) {
+		loghandle->mgh_file->f_pos = MLOG_CHUNK_SIZE;
+	}
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_write_header);
+
 static inline int mlog_uuid_equals(struct mlog_uuid *u1, struct mlog_uuid *u2)
 {
 	return strcmp((char *)u1->uuid, (char *)u2->uuid) == 0;
@@ -1065,6 +1675,11 @@ int mlog_init_handle(struct mlog_handle *handle, int flags,
 out:
 	if (flags & MLOG_F_IS_CAT) {
 		MTFS_INIT_LIST_HEAD(&handle->u.chd.chd_head);
+		mtfs_spin_lock_init(&handle->u.chd.chd_group_lock);
+		MTFS_INIT_LIST_HEAD(&handle->u.chd.chd_group_pending);
+		init_waitqueue_head(&handle->u.chd.chd_group_waitq);
+		MTFS_INIT_LIST_HEAD(&handle->u.chd.chd_spare_head);
+		MTFS_INIT_LIST_HEAD(&handle->u.chd.chd_spare_linkage);
 		mlh->mlh_size = sizeof(struct mlog_logid_rec);
 	} else if (flags & MLOG_F_IS_PLAIN) {
 		MTFS_INIT_LIST_HEAD(&handle->u.phd.phd_entry);
@@ -1082,31 +1697,74 @@ out:
 	MRETURN(ret);
 }
 
-static int mlog_process_thread(void *arg)
+/*
+ * mlog_process reads mlog_process_read_size bytes of the log at a time
+ * instead of one chunk, so that the lower fs sees large sequential reads
+ * that it can read ahead. Records never cross chunk boundaries, hence a
+ * buffer of several chunks is walked exactly like a single one.
+ */
+static int mlog_process_read_size = 1 << 20;
+module_param(mlog_process_read_size, int, 0644);
+MODULE_PARM_DESC(mlog_process_read_size, "bytes of log read at a time by mlog_process");
+
+#ifdef __KERNEL__
+static int mlog_process_threaded = 1;
+module_param(mlog_process_threaded, int, 0644);
+MODULE_PARM_DESC(mlog_process_threaded, "run mlog_process in a dedicated thread");
+#endif
+
+static int mlog_process_buf_size(void)
+{
+	int size = mlog_process_read_size & ~(MLOG_CHUNK_SIZE - 1);
+
+	if (size < MLOG_CHUNK_SIZE) {
+		size = MLOG_CHUNK_SIZE;
+	}
+	return size;
+}
+
+/* Returns the first index not before @index set in bitmap, skip zero words */
+static int mlog_next_set_index(struct mlog_log_hdr *mlh, int index,
+                               int last_index)
+{
+	while (index <= last_index) {
+		if ((index & 31) == 0 && mlh->mlh_bitmap[index / 32] == 0) {
+			index += 32;
+			continue;
+		}
+		if (ext2_test_bit(index, mlh->mlh_bitmap)) {
+			break;
+		}
+		index++;
+	}
+
+	if (index > last_index + 1) {
+		index = last_index + 1;
+	}
+	return index;
+}
+
+static int mlog_process_log(struct mlog_process_info *mpi)
 {
-	struct mlog_process_info     *mpi = (struct mlog_process_info *)arg;
 	struct mlog_handle           *loghandle = mpi->mpi_loghandle;
 	struct mlog_log_hdr          *mlh = loghandle->mgh_hdr;
 	struct mlog_process_cat_data *cd  = mpi->mpi_catdata;
 	char	                     *buf;
+	int                           buf_size = mlog_process_buf_size();
 	__u64			      cur_offset = MLOG_CHUNK_SIZE;
 	__u64			      last_offset;
 	int			      ret = 0, index = 1, last_index;
 	int			      saved_index = 0, last_called_index = 0;
+	MENTRY();
 
 	MASSERT(mlh);
 
-	MTFS_ALLOC(buf, MLOG_CHUNK_SIZE);
+	MTFS_VMALLOC(buf, buf_size);
 	if (!buf) {
-		mpi->mpi_ret = -ENOMEM;
-#ifdef __KERNEL__
-		complete(&mpi->mpi_completion);
-#endif
-		return 0;
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	mtfs_daemonize_ctxt("mlog_process_thread");
-
 	if (cd != NULL) {
 		last_called_index = cd->mpcd_first_idx;
 		index = cd->mpcd_first_idx + 1;
@@ -1120,9 +1778,7 @@ static int mlog_process_thread(void *arg)
 		struct mlog_rec_hdr *rec;
 
 		/* skip records not set in bitmap */
-		while (index <= last_index &&
-		       !ext2_test_bit(index, mlh->mlh_bitmap))
-			++index;
+		index = mlog_next_set_index(mlh, index, last_index);
 
 		MASSERT(index <= last_index + 1);
 		if (index == last_index + 1)
@@ -1134,16 +1790,16 @@ static int mlog_process_thread(void *arg)
 		/* get the buf with our target record; avoid old garbage */
 		last_offset = cur_offset;
 		ret = mlog_next_block(loghandle, &saved_index, index,
-				     &cur_offset, buf, MLOG_CHUNK_SIZE);
+				     &cur_offset, buf, buf_size);
 		if (ret) {
-			goto out;
+			goto out_free;
 		}
 
 		/* NB: when rec->mrh_len is accessed it is already swabbed
 		 * since it is used at the "end" of the loop and the rec
 		 * swabbing is done at the beginning of the loop. */
 		for (rec = (struct mlog_rec_hdr *)buf;
-		     (char *)rec < buf + MLOG_CHUNK_SIZE;
+		     (char *)rec < buf + buf_size;
 		     rec = (struct mlog_rec_hdr *)((char *)rec + rec->mrh_len)){
 
 			MDEBUG("processing rec 0x%p type %#x\n",
@@ -1157,7 +1813,7 @@ static int mlog_process_thread(void *arg)
 
 			if (rec->mrh_index == 0) {
 				/* no more records */
-				goto out;
+				goto out_free;
 			}
 
 			if (rec->mrh_len == 0 || rec->mrh_len > MLOG_CHUNK_SIZE){
@@ -1165,7 +1821,7 @@ static int mlog_process_thread(void *arg)
 				       "index %d/%d\n", rec->mrh_len,
 				       rec->mrh_index, index);
 				ret = -EINVAL;
-				goto out;
+				goto out_free;
 			}
 
 			if (rec->mrh_index < index) {
@@ -1176,7 +1832,7 @@ static int mlog_process_thread(void *arg)
 
 			MDEBUG("mrh_index: %d mrh_len: %d (%d remains)\n",
 			       rec->mrh_index, rec->mrh_len,
-			       (int)(buf + MLOG_CHUNK_SIZE - (char *)rec));
+			       (int)(buf + buf_size - (char *)rec));
 
 			loghandle->mgh_cur_idx    = rec->mrh_index;
 			loghandle->mgh_cur_offset = (char *)rec - (char *)buf +
@@ -1191,14 +1847,14 @@ static int mlog_process_thread(void *arg)
 					MDEBUG("recovery from log: %llx:%x stopped\n",
 					       loghandle->mgh_id.mgl_oid,
 					       loghandle->mgh_id.mgl_ogen);
-					goto out;
+					goto out_free;
 				} else if (ret == MLOG_DEL_RECORD) {
 					mlog_cancel_rec(loghandle,
 							rec->mrh_index);
 					ret = 0;
 				}
 				if (ret) {
-					goto out;
+					goto out_free;
 				}
 			} else {
 				MDEBUG("Skipped index %d\n", index);
@@ -1207,25 +1863,34 @@ static int mlog_process_thread(void *arg)
 			/* next record, still in buffer? */
 			++index;
 			if (index > last_index) {
-				goto out;
+				goto out_free;
 			}
 		}
 	}
 
- out:
+out_free:
 	if (cd != NULL)
 		cd->mpcd_last_idx = last_called_index;
-	if (buf)
-		MTFS_FREE(buf, MLOG_CHUNK_SIZE);
+	MTFS_VFREE(buf, buf_size);
+out:
 	mpi->mpi_ret = ret;
+	MRETURN(ret);
+}
+
 #ifdef __KERNEL__
+static int mlog_process_thread(void *arg)
+{
+	struct mlog_process_info *mpi = (struct mlog_process_info *)arg;
+
+	mtfs_daemonize_ctxt("mlog_process_thread");
+	mlog_process_log(mpi);
 	complete(&mpi->mpi_completion);
-#endif
-	MRETURN(ret);
+	return 0;
 }
+#endif
 
-int mlog_process(struct mlog_handle *loghandle, mlog_cb_t cb,
-                 void *data, void *catdata)
+int mlog_process_flags(struct mlog_handle *loghandle, mlog_cb_t cb,
+                       void *data, void *catdata, int flags)
 {
 	struct mlog_process_info *mpi;
 	int                       ret;
@@ -1243,22 +1908,34 @@ int mlog_process(struct mlog_handle *loghandle, mlog_cb_t cb,
 	mpi->mpi_catdata   = catdata;
 
 #ifdef __KERNEL__
-	init_completion(&mpi->mpi_completion);
-	ret = mtfs_create_thread(mlog_process_thread, mpi, CLONE_VM | CLONE_FILES);
-	if (ret < 0) {
-		MERROR("cannot start thread: %d\n", ret);
-		MTFS_FREE_PTR(mpi);
-		goto out;
+	if (!(flags & MLOG_PROCESS_NOTHREAD) && mlog_process_threaded) {
+		init_completion(&mpi->mpi_completion);
+		ret = mtfs_create_thread(mlog_process_thread, mpi,
+		                         CLONE_VM | CLONE_FILES);
+		if (ret < 0) {
+			MERROR("cannot start thread: %d\n", ret);
+			MTFS_FREE_PTR(mpi);
+			goto out;
+		}
+		wait_for_completion(&mpi->mpi_completion);
+	} else {
+		mlog_process_log(mpi);
 	}
-	wait_for_completion(&mpi->mpi_completion);
 #else
-	mlog_process_thread(mpi);
+	mlog_process_log(mpi);
 #endif
 	ret = mpi->mpi_ret;
 	MTFS_FREE_PTR(mpi);
 out:
 	MRETURN(ret);
 }
+EXPORT_SYMBOL(mlog_process_flags);
+
+int mlog_process(struct mlog_handle *loghandle, mlog_cb_t cb,
+                 void *data, void *catdata)
+{
+	return mlog_process_flags(loghandle, cb, data, catdata, 0);
+}
 EXPORT_SYMBOL(mlog_process);
 
 int mlog_reverse_process(struct mlog_handle *loghandle, mlog_cb_t cb,
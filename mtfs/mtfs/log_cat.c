@@ -1,38 +1,52 @@
 /*
  * Copied from Lustre-2.x
  */
+#if defined (__linux__) && defined(__KERNEL__)
 #include <linux/namei.h>
 #include <linux/module.h>
 #include <linux/mount.h>
 #include <linux/random.h>
+#include <linux/sort.h>
+#include <mtfs_service.h>
+#include <mtfs_file.h>
+#include <mtfs_context.h>
+#endif /* defined (__linux__) && defined(__KERNEL__) */
+#include <thread.h>
 #include <mtfs_lowerfs.h>
 #include <mtfs_log.h>
-#include <mtfs_file.h>
 
-/* Create a new log handle and add it to the open list.
- * This log handle will be closed when all of the records in it are removed.
- *
- * Assumes caller has already pushed us into the kernel context and is locking.
+/*
+ * Rolling over to a new plain log used to create, open and initialize the
+ * log file on the path of the unlucky writer. Instead, each catalog keeps
+ * mlog_spare_logs logs with their headers written in chd_spare_head, so
+ * that the rollover only takes one of them.
+ * The spare service refills the catalogs queued in the_mlog_spare.
+ * Spare logs are recorded in the catalog as soon as they are created,
+ * so that mlog_cat_reap() drops those left by a crash.
  */
-static struct mlog_handle *mlog_cat_new_log(struct mlog_handle *cathandle)
-{
-	struct mlog_handle *loghandle;
-	struct mlog_log_hdr *mlh;
-	struct mlog_logid_rec rec = { { 0 }, };
-	int ret, index, bitmap_size;
-	MENTRY();
+#if defined (__linux__) && defined(__KERNEL__)
+static int mlog_spare_logs = 1;
+module_param(mlog_spare_logs, int, 0644);
+MODULE_PARM_DESC(mlog_spare_logs, "preallocated plain logs of each catalog");
+#endif /* defined (__linux__) && defined(__KERNEL__) */
 
-	mlh = cathandle->mgh_hdr;
-	bitmap_size = MLOG_BITMAP_SIZE(mlh);
+struct mlog_spare {
+	mtfs_spinlock_t      mls_lock;
+	mtfs_list_t          mls_catalogs; /* catalogs short of spare logs */
+	struct mutex         mls_mutex;    /* held while refilling */
+#if defined (__linux__) && defined(__KERNEL__)
+	struct mtfs_service *mls_service;
+#endif /* defined (__linux__) && defined(__KERNEL__) */
+};
 
-	index = (cathandle->mgh_last_idx + 1) % bitmap_size;
+static struct mlog_spare the_mlog_spare;
 
-	/* maximum number of available slots in catlog is bitmap_size - 2 */
-	if (mlh->mlh_cat_idx == index) {
-		MERROR("no free catalog slots for log\n");
-		loghandle = ERR_PTR(-ENOSPC);
-		goto out;
-	}
+/* Create a plain log for the catalog, with its header written */
+static struct mlog_handle *mlog_cat_create_log(struct mlog_handle *cathandle)
+{
+	struct mlog_handle *loghandle = NULL;
+	int ret = 0;
+	MENTRY();
 
 	ret = mlog_create(cathandle->mgh_ctxt, &loghandle, NULL, NULL);
 	if (ret) {
@@ -48,6 +62,43 @@ static struct mlog_handle *mlog_cat_new_log(struct mlog_handle *cathandle)
 		MERROR("failed to init handle, ret = %d\n", ret);
 		goto out_destroy;
 	}
+
+	ret = mlog_write_header(loghandle);
+	if (ret) {
+		goto out_destroy;
+	}
+	goto out;
+out_destroy:
+	mlog_destroy(loghandle);
+	mlog_free_handle(loghandle);
+	loghandle = ERR_PTR(ret);
+out:
+	MRETURN(loghandle);
+}
+
+/*
+ * Record a plain log in the catalog at the next free index.
+ * Called holding the write lock of the catalog.
+ */
+static int mlog_cat_add_log(struct mlog_handle *cathandle,
+                            struct mlog_handle *loghandle)
+{
+	struct mlog_log_hdr *mlh = cathandle->mgh_hdr;
+	struct mlog_logid_rec rec = { { 0 }, };
+	int bitmap_size = MLOG_BITMAP_SIZE(mlh);
+	int index = 0;
+	int ret = 0;
+	MENTRY();
+
+	index = (cathandle->mgh_last_idx + 1) % bitmap_size;
+
+	/* maximum number of available slots in catlog is bitmap_size - 2 */
+	if (mlh->mlh_cat_idx == index) {
+		MERROR("no free catalog slots for log\n");
+		ret = -ENOSPC;
+		goto out;
+	}
+
 	if (index == 0) {
 		index = 1;
 	}
@@ -78,17 +129,295 @@ static struct mlog_handle *mlog_cat_new_log(struct mlog_handle *cathandle)
 			    &loghandle->u.phd.phd_cookie, 1, NULL, index);
 	if (ret < 0) {
 		MERROR("failed to write record, ret = %d\n", ret);
-		goto out_destroy;
+		goto out;
 	}
+	ret = 0;
 
 	loghandle->mgh_hdr->mlh_cat_idx = index;
-	cathandle->u.chd.chd_current_log = loghandle;
-	MASSERT(list_empty(&loghandle->u.phd.phd_entry));
-	list_add_tail(&loghandle->u.phd.phd_entry, &cathandle->u.chd.chd_head);
+out:
+	MRETURN(ret);
+}
 
-out_destroy:
-	if (ret < 0)
+#if defined (__linux__) && defined(__KERNEL__)
+static void mlog_cat_spare_queue(struct mlog_handle *cathandle)
+{
+	struct mlog_spare *spare = &the_mlog_spare;
+	struct cat_handle_data *chd = &cathandle->u.chd;
+	int queued = 0;
+	MENTRY();
+
+	if (spare->mls_service == NULL || mlog_spare_logs <= 0) {
+		goto out;
+	}
+
+	mtfs_spin_lock(&spare->mls_lock);
+	if (!chd->chd_spare_stopped &&
+	    mtfs_list_empty(&chd->chd_spare_linkage)) {
+		mtfs_list_add_tail(&chd->chd_spare_linkage,
+		                   &spare->mls_catalogs);
+		queued = 1;
+	}
+	mtfs_spin_unlock(&spare->mls_lock);
+
+	if (queued) {
+		wake_up(&spare->mls_service->srv_waitq);
+	}
+out:
+	_MRETURN();
+}
+
+static void mlog_cat_spare_refill(struct mlog_handle *cathandle)
+{
+	struct cat_handle_data *chd = &cathandle->u.chd;
+	struct mtfs_run_ctxt *run_ctxt = cathandle->mgh_ctxt->moc_run_ctxt;
+	struct mlog_handle *loghandle = NULL;
+	struct mtfs_run_ctxt saved;
+	struct mtfs_ucred ucred = { 0 };
+	int count = 0;
+	int ret = 0;
+	MENTRY();
+
+	MASSERT(run_ctxt);
+	/* the owner of log file should always be root */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+	mtfs_push_ctxt(&saved, run_ctxt, &ucred);
+	while (1) {
+		down_read(&cathandle->mgh_lock);
+		count = chd->chd_spare_count;
+		up_read(&cathandle->mgh_lock);
+		if (count >= mlog_spare_logs) {
+			break;
+		}
+
+		loghandle = mlog_cat_create_log(cathandle);
+		if (IS_ERR(loghandle)) {
+			MERROR("failed to create spare log of catalog %llx, "
+			       "ret = %ld\n", cathandle->mgh_id.mgl_oid,
+			       PTR_ERR(loghandle));
+			break;
+		}
+
+		down_write(&cathandle->mgh_lock);
+		ret = mlog_cat_add_log(cathandle, loghandle);
+		if (ret == 0) {
+			mtfs_list_add_tail(&loghandle->u.phd.phd_entry,
+			                   &chd->chd_spare_head);
+			chd->chd_spare_count++;
+		}
+		up_write(&cathandle->mgh_lock);
+		if (ret) {
+			MERROR("failed to add spare log %llx to catalog %llx, "
+			       "ret = %d\n", loghandle->mgh_id.mgl_oid,
+			       cathandle->mgh_id.mgl_oid, ret);
+			mlog_destroy(loghandle);
+			mlog_free_handle(loghandle);
+			break;
+		}
+	}
+	mtfs_pop_ctxt(&saved, run_ctxt, &ucred);
+	_MRETURN();
+}
+#else /* !defined (__linux__) && defined(__KERNEL__) */
+/* No spare service in user space, rollovers create logs inline */
+static void mlog_cat_spare_queue(struct mlog_handle *cathandle)
+{
+}
+#endif /* !defined (__linux__) && defined(__KERNEL__) */
+
+static int mlog_cat_cancel_logs(struct mlog_handle *cathandle, int count,
+                                int *index);
+
+/*
+ * Take the catalog off the refill queue, destroy its spare logs and
+ * drop them from the catalog. Those not dropped are left to mlog_cat_reap().
+ */
+static void mlog_cat_spare_fini(struct mlog_handle *cathandle)
+{
+	struct mlog_spare *spare = &the_mlog_spare;
+	struct cat_handle_data *chd = &cathandle->u.chd;
+	struct mlog_handle *loghandle = NULL;
+	struct mlog_handle *n = NULL;
+	int *index = NULL;
+	int size = 0;
+	int count = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&spare->mls_lock);
+	chd->chd_spare_stopped = 1;
+	mtfs_list_del_init(&chd->chd_spare_linkage);
+	mtfs_spin_unlock(&spare->mls_lock);
+
+	/* Wait for the refill that might be running on this catalog */
+	mutex_lock(&spare->mls_mutex);
+	mutex_unlock(&spare->mls_mutex);
+
+	if (chd->chd_spare_count == 0) {
+		goto out;
+	}
+
+	size = sizeof(*index) * chd->chd_spare_count;
+	MTFS_ALLOC(index, size);
+	if (index == NULL) {
+		MERROR("not enough memory\n");
+	}
+
+	mtfs_list_for_each_entry_safe(loghandle, n, &chd->chd_spare_head,
+	                              u.phd.phd_entry) {
+		mtfs_list_del_init(&loghandle->u.phd.phd_entry);
+		chd->chd_spare_count--;
+		if (mlog_destroy(loghandle)) {
+			MERROR("failed to destroy spare log %llx\n",
+			       loghandle->mgh_id.mgl_oid);
+		} else if (index != NULL) {
+			index[count++] = loghandle->u.phd.phd_cookie.mgc_index;
+		}
+		mlog_free_handle(loghandle);
+	}
+	MASSERT(chd->chd_spare_count == 0);
+
+	if (count > 0) {
+		down_write(&cathandle->mgh_lock);
+		if (mlog_cat_cancel_logs(cathandle, count, index) < 0) {
+			MERROR("failed to drop %d spare logs of catalog %llx\n",
+			       count, cathandle->mgh_id.mgl_oid);
+		}
+		up_write(&cathandle->mgh_lock);
+	}
+
+	if (index != NULL) {
+		MTFS_FREE(index, size);
+	}
+out:
+	_MRETURN();
+}
+
+#if defined (__linux__) && defined(__KERNEL__)
+static int mlog_spare_service_busy(struct mtfs_service *service,
+                                   struct mservice_thread *thread)
+{
+	struct mlog_spare *spare = (struct mlog_spare *)service->srv_data;
+	int ret = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&spare->mls_lock);
+	ret = !mtfs_list_empty(&spare->mls_catalogs);
+	mtfs_spin_unlock(&spare->mls_lock);
+	MRETURN(ret);
+}
+
+static int mlog_spare_service_main(struct mtfs_service *service,
+                                   struct mservice_thread *thread)
+{
+	struct mlog_spare *spare = (struct mlog_spare *)service->srv_data;
+	struct mlog_handle *cathandle = NULL;
+	int ret = 0;
+	MENTRY();
+
+	while (1) {
+		if (mservice_wait_event(service, thread)) {
+			break;
+		}
+
+		mutex_lock(&spare->mls_mutex);
+		mtfs_spin_lock(&spare->mls_lock);
+		if (mtfs_list_empty(&spare->mls_catalogs)) {
+			mtfs_spin_unlock(&spare->mls_lock);
+			mutex_unlock(&spare->mls_mutex);
+			continue;
+		}
+		cathandle = mtfs_list_entry(spare->mls_catalogs.next,
+		                            struct mlog_handle,
+		                            u.chd.chd_spare_linkage);
+		mtfs_list_del_init(&cathandle->u.chd.chd_spare_linkage);
+		mtfs_spin_unlock(&spare->mls_lock);
+
+		mlog_cat_spare_refill(cathandle);
+		mutex_unlock(&spare->mls_mutex);
+	}
+	MRETURN(ret);
+}
+#endif /* defined (__linux__) && defined(__KERNEL__) */
+
+#define MLOG_SPARE_SERVICE_NAME "mlog_spare"
+
+int mlog_spare_init(void)
+{
+	struct mlog_spare *spare = &the_mlog_spare;
+	int ret = 0;
+	MENTRY();
+
+	mtfs_spin_lock_init(&spare->mls_lock);
+	MTFS_INIT_LIST_HEAD(&spare->mls_catalogs);
+	mutex_init(&spare->mls_mutex);
+#if defined (__linux__) && defined(__KERNEL__)
+	spare->mls_service = mservice_init(MLOG_SPARE_SERVICE_NAME,
+	                                   MLOG_SPARE_SERVICE_NAME,
+	                                   1, 1, 100,
+	                                   0, mlog_spare_service_main,
+	                                   mlog_spare_service_busy,
+	                                   spare);
+	if (spare->mls_service == NULL) {
+		MERROR("failed to init service of spare logs\n");
+		ret = -EINVAL;
+	}
+#endif /* defined (__linux__) && defined(__KERNEL__) */
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_spare_init);
+
+void mlog_spare_fini(void)
+{
+	struct mlog_spare *spare = &the_mlog_spare;
+
+	MASSERT(mtfs_list_empty(&spare->mls_catalogs));
+#if defined (__linux__) && defined(__KERNEL__)
+	mservice_fini(spare->mls_service);
+	spare->mls_service = NULL;
+#endif /* defined (__linux__) && defined(__KERNEL__) */
+}
+EXPORT_SYMBOL(mlog_spare_fini);
+
+/* Add a new log handle to the catalog and the open list.
+ * This log handle will be closed when all of the records in it are removed.
+ *
+ * Assumes caller has already pushed us into the kernel context and is locking.
+ */
+static struct mlog_handle *mlog_cat_new_log(struct mlog_handle *cathandle)
+{
+	struct cat_handle_data *chd = &cathandle->u.chd;
+	struct mlog_handle *loghandle;
+	int ret = 0;
+	MENTRY();
+
+	if (!mtfs_list_empty(&chd->chd_spare_head)) {
+		/* Recorded in the catalog by the refill */
+		loghandle = mtfs_list_entry(chd->chd_spare_head.next,
+		                            struct mlog_handle,
+		                            u.phd.phd_entry);
+		mtfs_list_del_init(&loghandle->u.phd.phd_entry);
+		chd->chd_spare_count--;
+		mlog_cat_spare_queue(cathandle);
+		goto out_current;
+	}
+
+	atomic_inc(&chd->chd_spare_misses);
+	mlog_cat_spare_queue(cathandle);
+	loghandle = mlog_cat_create_log(cathandle);
+	if (IS_ERR(loghandle)) {
+		goto out;
+	}
+
+	ret = mlog_cat_add_log(cathandle, loghandle);
+	if (ret) {
 		mlog_destroy(loghandle);
+		mlog_free_handle(loghandle);
+		loghandle = ERR_PTR(ret);
+		goto out;
+	}
+out_current:
+	chd->chd_current_log = loghandle;
+	MASSERT(mtfs_list_empty(&loghandle->u.phd.phd_entry));
+	mtfs_list_add_tail(&loghandle->u.phd.phd_entry, &chd->chd_head);
 out:
 	MRETURN(loghandle);
 }
@@ -154,6 +483,26 @@ out:
 	MRETURN(loghandle);
 }
 
+static struct mlog_handle *mlog_cat_find_open(mtfs_list_t *head,
+                                              struct mlog_logid *logid)
+{
+	struct mlog_handle *loghandle = NULL;
+
+	mtfs_list_for_each_entry(loghandle, head, u.phd.phd_entry) {
+		struct mlog_logid *cgl = &loghandle->mgh_id;
+		if (cgl->mgl_oid == logid->mgl_oid) {
+			if (cgl->mgl_ogen != logid->mgl_ogen) {
+				MERROR("log %llx generation %x != %x\n",
+				       logid->mgl_oid, cgl->mgl_ogen,
+				       logid->mgl_ogen);
+				continue;
+			}
+			return loghandle;
+		}
+	}
+	return NULL;
+}
+
 /* Open an existent log handle and add it to the open list.
  * This log handle will be closed when all of the records in it are removed.
  *
@@ -163,7 +512,7 @@ out:
 int mlog_cat_id2handle(struct mlog_handle *cathandle, struct mlog_handle **res,
 		       struct mlog_logid *logid)
 {
-	struct mlog_handle *loghandle;
+	struct mlog_handle *loghandle = NULL;
 	int ret = 0;
 	MENTRY();
 
@@ -172,19 +521,15 @@ int mlog_cat_id2handle(struct mlog_handle *cathandle, struct mlog_handle **res,
 		goto out;
 	}
 
-	list_for_each_entry(loghandle, &cathandle->u.chd.chd_head,
-			    u.phd.phd_entry) {
-		struct mlog_logid *cgl = &loghandle->mgh_id;
-		if (cgl->mgl_oid == logid->mgl_oid) {
-			if (cgl->mgl_ogen != logid->mgl_ogen) {
-				MERROR("log %llx generation %x != %x\n",
-				       logid->mgl_oid, cgl->mgl_ogen,
-				       logid->mgl_ogen);
-				continue;
-			}
-			loghandle->u.phd.phd_cat_handle = cathandle;
-			goto out;
-		}
+	loghandle = mlog_cat_find_open(&cathandle->u.chd.chd_head, logid);
+	if (loghandle == NULL) {
+		/* Spare logs are in the catalog too */
+		loghandle = mlog_cat_find_open(&cathandle->u.chd.chd_spare_head,
+		                               logid);
+	}
+	if (loghandle != NULL) {
+		loghandle->u.phd.phd_cat_handle = cathandle;
+		goto out;
 	}
 
 	ret = mlog_create(cathandle->mgh_ctxt, &loghandle, logid, NULL);
@@ -194,8 +539,8 @@ int mlog_cat_id2handle(struct mlog_handle *cathandle, struct mlog_handle **res,
 	} else {
 		ret = mlog_init_handle(loghandle, MLOG_F_IS_PLAIN, NULL);
 		if (!ret) {
-			list_add(&loghandle->u.phd.phd_entry,
-				 &cathandle->u.chd.chd_head);
+			mtfs_list_add(&loghandle->u.phd.phd_entry,
+			              &cathandle->u.chd.chd_head);
 		}
 	}
 	if (!ret) {
@@ -216,8 +561,9 @@ int mlog_cat_put(struct mlog_handle *cathandle)
 	int ret;
 	MENTRY();
 
-	list_for_each_entry_safe(loghandle, n, &cathandle->u.chd.chd_head,
-				 u.phd.phd_entry) {
+	mlog_cat_spare_fini(cathandle);
+	mtfs_list_for_each_entry_safe(loghandle, n, &cathandle->u.chd.chd_head,
+	                              u.phd.phd_entry) {
 		int err = mlog_close(loghandle);
 		if (err)
 			MERROR("error closing loghandle\n");
@@ -227,43 +573,371 @@ int mlog_cat_put(struct mlog_handle *cathandle)
 }
 EXPORT_SYMBOL(mlog_cat_put);
 
-/* Add a single record to the recovery log(s) using a catalog
- * Returns as mlog_write_record
- *
- * Assumes caller has already pushed us into the kernel context.
+/*
+ * Catalog appends are committed in groups. An appender queues its record
+ * in the pending list of the catalog. The first appender that finds no
+ * commit running becomes the leader, writes up to MLOG_GROUP_MAX pending
+ * records inside one lowerfs transaction and updates the header of the
+ * plain log once for all of them. The others just wait for the leader
+ * to complete them with their cookies. Records added together by
+ * mlog_cat_add_recs() are never split between batches.
  */
-int mlog_cat_add_rec(struct mlog_handle *cathandle, struct mlog_rec_hdr *rec,
-		     struct mlog_cookie *reccookie, void *buf)
+#define MLOG_GROUP_MAX 64
+
+struct mlog_group_entry {
+	mtfs_list_t          mge_linkage;
+	struct mlog_rec_hdr *mge_rec;
+	struct mlog_cookie  *mge_cookie;
+	void                *mge_buf;
+	int                  mge_first; /* first record of an appender */
+	int                  mge_sync;  /* wait for the transaction commit */
+	int                  mge_ret;
+	int                  mge_done;
+};
+
+struct mlog_group_trans {
+	struct mtfs_lowerfs *mgt_lowerfs;
+	struct inode        *mgt_inode;
+	int                  mgt_enabled;
+	int                  mgt_sync;
+	void                *mgt_handle; /* running transaction */
+	void                *mgt_wait;   /* last transaction to wait for */
+};
+
+static int mlog_group_trans_start(struct mlog_group_trans *trans)
+{
+	void *handle = NULL;
+	int ret = 0;
+	MENTRY();
+
+	if (!trans->mgt_enabled || trans->mgt_handle != NULL) {
+		goto out;
+	}
+
+	handle = mlowerfs_start(trans->mgt_lowerfs, trans->mgt_inode, 0);
+	if (IS_ERR(handle)) {
+		ret = PTR_ERR(handle);
+		MERROR("failed to start transaction, ret = %d\n", ret);
+		goto out;
+	}
+	trans->mgt_handle = handle;
+out:
+	MRETURN(ret);
+}
+
+static int mlog_group_trans_stop(struct mlog_group_trans *trans)
+{
+	struct mtfs_lowerfs *lowerfs = trans->mgt_lowerfs;
+	int ret = 0;
+	MENTRY();
+
+	if (trans->mgt_handle == NULL) {
+		goto out;
+	}
+
+	if (trans->mgt_sync && lowerfs->ml_commit_async) {
+		ret = mlowerfs_commit_async(lowerfs, trans->mgt_inode,
+		                            trans->mgt_handle, &trans->mgt_wait);
+	} else {
+		ret = mlowerfs_commit(lowerfs, trans->mgt_inode,
+		                      trans->mgt_handle, trans->mgt_sync);
+	}
+	trans->mgt_handle = NULL;
+	if (ret) {
+		MERROR("failed to commit transaction, ret = %d\n", ret);
+	}
+out:
+	MRETURN(ret);
+}
+
+/*
+ * Write the records from *pos on into the current log, inside one
+ * transaction and with one header update. Stops at the end of the batch
+ * or when the log is full, since creating the next log and taking its
+ * lock are not allowed inside the transaction.
+ */
+static int mlog_cat_group_write(struct mlog_handle *cathandle,
+                                struct mlog_group_trans *trans,
+                                mtfs_list_t *batch,
+                                mtfs_list_t **pos)
 {
 	struct mlog_handle *loghandle = NULL;
+	struct mlog_group_entry *entry = NULL;
 	int ret = 0;
+	int ret2 = 0;
 	MENTRY();
 
-	MASSERT(rec->mrh_len <= MLOG_CHUNK_SIZE);
 	loghandle = mlog_cat_current_log(cathandle, 1);
 	if (IS_ERR(loghandle)) {
 		ret = PTR_ERR(loghandle);
 		goto out;
 	}
 
-	/* loghandle is already locked by mlog_cat_current_log() for us */
-	ret = mlog_write_rec(loghandle, rec, reccookie, 1, buf, -1);
-	up_write(&loghandle->mgh_lock);
-	if (ret == -ENOSPC) {
-		/* to create a new plain log */
-		loghandle = mlog_cat_current_log(cathandle, 1);
-		if (IS_ERR(loghandle)) {
-			ret = PTR_ERR(loghandle);
-			goto out;
+	ret = mlog_group_trans_start(trans);
+	if (ret) {
+		goto out_unlock;
+	}
+
+	loghandle->mgh_defer_header = 1;
+	while (*pos != batch) {
+		entry = mtfs_list_entry(*pos, struct mlog_group_entry,
+		                        mge_linkage);
+		ret2 = mlog_write_rec(loghandle, entry->mge_rec,
+		                      entry->mge_cookie, 1, entry->mge_buf, -1);
+		if (ret2 == -ENOSPC && entry->mge_ret != -ENOSPC) {
+			/* Filled up by pad, retry once in the next log */
+			entry->mge_ret = -ENOSPC;
+			break;
+		}
+		entry->mge_ret = ret2;
+		*pos = (*pos)->next;
+		if (loghandle->mgh_last_idx >=
+		    MLOG_BITMAP_SIZE(loghandle->mgh_hdr) - 1) {
+			break;
 		}
-		ret = mlog_write_rec(loghandle, rec, reccookie, 1, buf, -1);
-		up_write(&loghandle->mgh_lock);
 	}
+	loghandle->mgh_defer_header = 0;
+
+	if (loghandle->mgh_dirty_last != 0) {
+		atomic_inc(&cathandle->u.chd.chd_group_headers);
+	}
+	if (trans->mgt_sync && trans->mgt_handle == NULL) {
+		/* No transaction of our own to commit in sync */
+		ret = mlog_sync_header(loghandle);
+	} else {
+		ret = mlog_flush_header(loghandle);
+	}
+	ret2 = mlog_group_trans_stop(trans);
+	if (ret == 0) {
+		ret = ret2;
+	}
+out_unlock:
+	up_write(&loghandle->mgh_lock);
 out:
 	MRETURN(ret);
 }
+
+static void mlog_cat_group_commit(struct mlog_handle *cathandle,
+                                  mtfs_list_t *batch)
+{
+	struct mlog_group_trans trans;
+	struct mlog_group_entry *entry = NULL;
+	mtfs_list_t *pos = batch->next;
+	int records = 0;
+	int ret = 0;
+	MENTRY();
+
+	memset(&trans, 0, sizeof(trans));
+	trans.mgt_lowerfs = cathandle->mgh_ctxt->moc_lowerfs;
+	trans.mgt_inode = cathandle->mgh_file->f_dentry->d_inode;
+	/* Never stop a transaction that the caller is running */
+	trans.mgt_enabled = trans.mgt_lowerfs->ml_trans_support &&
+	                    !mlowerfs_in_trans();
+	mtfs_list_for_each_entry(entry, batch, mge_linkage) {
+		if (entry->mge_sync) {
+			trans.mgt_sync = 1;
+		}
+		records++;
+	}
+
+	while (pos != batch) {
+		ret = mlog_cat_group_write(cathandle, &trans, batch, &pos);
+		if (ret) {
+			break;
+		}
+	}
+
+	if (ret == 0 && trans.mgt_wait != NULL) {
+		ret = mlowerfs_commit_wait(trans.mgt_lowerfs, trans.mgt_inode,
+		                           trans.mgt_wait);
+	}
+
+	if (ret) {
+		mtfs_list_for_each_entry(entry, batch, mge_linkage) {
+			if (entry->mge_ret >= 0) {
+				entry->mge_ret = ret;
+			}
+		}
+	}
+
+	atomic_inc(&cathandle->u.chd.chd_group_batches);
+	atomic_add(records, &cathandle->u.chd.chd_group_records);
+	_MRETURN();
+}
+
+static int mlog_cat_group_done(struct cat_handle_data *chd,
+                               struct mlog_group_entry *entry)
+{
+	int ret = 0;
+
+	mtfs_spin_lock(&chd->chd_group_lock);
+	ret = (entry->mge_done || !chd->chd_group_committing);
+	mtfs_spin_unlock(&chd->chd_group_lock);
+	return ret;
+}
+
+/* Queue the entries as one appender and wait until they are written */
+static int mlog_cat_group_add(struct mlog_handle *cathandle,
+                              struct mlog_group_entry *entries, int count)
+{
+	struct cat_handle_data *chd = &cathandle->u.chd;
+	struct mlog_group_entry *tmp = NULL;
+	struct mlog_group_entry *n = NULL;
+	MTFS_LIST_HEAD(batch);
+	int batched = 0;
+	int ret = 0;
+	int i = 0;
+	MENTRY();
+
+	MASSERT(count > 0);
+	entries[0].mge_first = 1;
+	mtfs_spin_lock(&chd->chd_group_lock);
+	for (i = 0; i < count; i++) {
+		MASSERT(entries[i].mge_rec->mrh_len <= MLOG_CHUNK_SIZE);
+		mtfs_list_add_tail(&entries[i].mge_linkage,
+		                   &chd->chd_group_pending);
+	}
+	while (!entries[0].mge_done) {
+		if (chd->chd_group_committing) {
+			mtfs_spin_unlock(&chd->chd_group_lock);
+			mtfs_wait_condition(chd->chd_group_waitq,
+			                    mlog_cat_group_done(chd, &entries[0]));
+			mtfs_spin_lock(&chd->chd_group_lock);
+			continue;
+		}
+
+		/* Become the leader, take the oldest pending records */
+		chd->chd_group_committing = 1;
+		batched = 0;
+		mtfs_list_for_each_entry_safe(tmp, n, &chd->chd_group_pending,
+		                              mge_linkage) {
+			if (tmp->mge_first && batched >= MLOG_GROUP_MAX) {
+				break;
+			}
+			mtfs_list_move_tail(&tmp->mge_linkage, &batch);
+			batched++;
+		}
+		mtfs_spin_unlock(&chd->chd_group_lock);
+
+		mlog_cat_group_commit(cathandle, &batch);
+
+		mtfs_spin_lock(&chd->chd_group_lock);
+		mtfs_list_for_each_entry_safe(tmp, n, &batch, mge_linkage) {
+			mtfs_list_del_init(&tmp->mge_linkage);
+			tmp->mge_done = 1;
+		}
+		chd->chd_group_committing = 0;
+		mtfs_spin_unlock(&chd->chd_group_lock);
+		wake_up_all(&chd->chd_group_waitq);
+		mtfs_spin_lock(&chd->chd_group_lock);
+	}
+	mtfs_spin_unlock(&chd->chd_group_lock);
+
+	/* Records of an appender are done together, return the first error */
+	ret = entries[0].mge_ret;
+	for (i = 1; i < count && ret >= 0; i++) {
+		MASSERT(entries[i].mge_done);
+		if (entries[i].mge_ret < 0) {
+			ret = entries[i].mge_ret;
+		}
+	}
+	MRETURN(ret);
+}
+
+static int mlog_cat_group_add_rec(struct mlog_handle *cathandle,
+                                  struct mlog_rec_hdr *rec,
+                                  struct mlog_cookie *reccookie,
+                                  void *buf, int sync)
+{
+	struct mlog_group_entry entry;
+	int ret = 0;
+	MENTRY();
+
+	memset(&entry, 0, sizeof(entry));
+	entry.mge_rec = rec;
+	entry.mge_cookie = reccookie;
+	entry.mge_buf = buf;
+	entry.mge_sync = sync;
+	ret = mlog_cat_group_add(cathandle, &entry, 1);
+	MRETURN(ret);
+}
+
+/* Add a single record to the recovery log(s) using a catalog
+ * Returns as mlog_write_record
+ *
+ * Assumes caller has already pushed us into the kernel context.
+ */
+int mlog_cat_add_rec(struct mlog_handle *cathandle, struct mlog_rec_hdr *rec,
+		     struct mlog_cookie *reccookie, void *buf)
+{
+	int ret = 0;
+	MENTRY();
+
+	ret = mlog_cat_group_add_rec(cathandle, rec, reccookie, buf, 0);
+	MRETURN(ret);
+}
 EXPORT_SYMBOL(mlog_cat_add_rec);
 
+/*
+ * Same as mlog_cat_add_rec(), but returns after the record is committed.
+ * Inside a transaction of the caller, that transaction is made sync.
+ */
+int mlog_cat_add_rec_sync(struct mlog_handle *cathandle,
+                          struct mlog_rec_hdr *rec,
+                          struct mlog_cookie *reccookie, void *buf)
+{
+	int ret = 0;
+	MENTRY();
+
+	ret = mlog_cat_group_add_rec(cathandle, rec, reccookie, buf, 1);
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_cat_add_rec_sync);
+
+/*
+ * Add records to the catalog in one group commit, so that they take one
+ * transaction and one header write unless the current log fills up.
+ * Returns 0 if all records are added, with their cookies filled in.
+ *
+ * Assumes caller has already pushed us into the kernel context.
+ */
+int mlog_cat_add_recs(struct mlog_handle *cathandle, struct mlog_rec_hdr **recs,
+                      int count, struct mlog_cookie *cookies)
+{
+	struct mlog_group_entry *entries = NULL;
+	int ret = 0;
+	int i = 0;
+	MENTRY();
+
+	if (count == 0) {
+		goto out;
+	}
+
+	MTFS_ALLOC(entries, sizeof(*entries) * count);
+	if (entries == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		entries[i].mge_rec = recs[i];
+		entries[i].mge_cookie = &cookies[i];
+	}
+
+	ret = mlog_cat_group_add(cathandle, entries, count);
+	if (ret == 1) {
+		ret = 0;
+	} else if (ret == 0) {
+		/* A record without cookie, should never happen */
+		ret = -EIO;
+	}
+	MTFS_FREE(entries, sizeof(*entries) * count);
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_cat_add_recs);
+
 static int mlog_cat_set_first_idx(struct mlog_handle *cathandle, int index)
 {
 	struct mlog_log_hdr *mlh = cathandle->mgh_hdr;
@@ -305,44 +979,146 @@ out:
  *
  * Assumes caller has already pushed us into the kernel context.
  */
+static int mlog_cookie_cmp(const void *a, const void *b)
+{
+	const struct mlog_cookie *ca = a;
+	const struct mlog_cookie *cb = b;
+
+	if (ca->mgc_mgl.mgl_oid != cb->mgc_mgl.mgl_oid)
+		return ca->mgc_mgl.mgl_oid < cb->mgc_mgl.mgl_oid ? -1 : 1;
+	if (ca->mgc_mgl.mgl_ogr != cb->mgc_mgl.mgl_ogr)
+		return ca->mgc_mgl.mgl_ogr < cb->mgc_mgl.mgl_ogr ? -1 : 1;
+	if (ca->mgc_mgl.mgl_ogen != cb->mgc_mgl.mgl_ogen)
+		return ca->mgc_mgl.mgl_ogen < cb->mgc_mgl.mgl_ogen ? -1 : 1;
+	if (ca->mgc_index != cb->mgc_index)
+		return ca->mgc_index < cb->mgc_index ? -1 : 1;
+	return 0;
+}
+
+static int mlog_index_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Remove the destroyed plain logs from the catalog with one header write.
+ * mlog_cat_set_first_idx() only moves forward from mlh_cat_idx, so the
+ * indexes are visited in catalog order, beginning after mlh_cat_idx.
+ * The new first index goes to disk with that header write, and is
+ * taken back together with the bitmap if the write fails.
+ */
+static int mlog_cat_cancel_logs(struct mlog_handle *cathandle, int count,
+                                int *index)
+{
+	__u32 cat_idx = cathandle->mgh_hdr->mlh_cat_idx;
+	int first = 0;
+	int ret = 0;
+	int i;
+	MENTRY();
+
+	sort(index, count, sizeof(*index), mlog_index_cmp, NULL);
+	while (first < count && index[first] <= cat_idx) {
+		first++;
+	}
+
+	for (i = 0; i < count; i++) {
+		MASSERT(index[(first + i) % count]);
+		mlog_cat_set_first_idx(cathandle, index[(first + i) % count]);
+	}
+
+	ret = mlog_cancel_arr_rec(cathandle, count, index);
+	if (ret < 0) {
+		cathandle->mgh_hdr->mlh_cat_idx = cat_idx;
+	} else {
+		MDEBUG("cancel %d plain logs of catalog %llx\n",
+		       count, cathandle->mgh_id.mgl_oid);
+	}
+	MRETURN(ret);
+}
+
+/*
+ * Cookies are sorted by log, so that each plain log has its bits cleared
+ * together and its header written once, and the logs emptied by the
+ * cancel are dropped from the catalog in one header update.
+ */
 int mlog_cat_cancel_records(struct mlog_handle *cathandle, int count,
 			    struct mlog_cookie *cookies)
 {
-	int i, index, ret = 0;
+	struct mlog_cookie *sorted = NULL;
+	int *index = NULL;
+	int *cat_index = NULL;
+	int cat_count = 0;
+	int i, j, num, rc, ret = 0;
 	MENTRY();
 
+	if (count <= 0) {
+		goto out;
+	}
+
+	MTFS_ALLOC(sorted, sizeof(*sorted) * count);
+	MTFS_ALLOC(index, sizeof(*index) * count);
+	MTFS_ALLOC(cat_index, sizeof(*cat_index) * count);
+	if (sorted == NULL || index == NULL || cat_index == NULL) {
+		MERROR("failed to allocate memory\n");
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	memcpy(sorted, cookies, sizeof(*sorted) * count);
+	sort(sorted, count, sizeof(*sorted), mlog_cookie_cmp, NULL);
+
 	down_write(&cathandle->mgh_lock);
-	for (i = 0; i < count; i++, cookies++) {
+	for (i = 0; i < count; i = j) {
 		struct mlog_handle *loghandle;
-		struct mlog_logid *mgl = &cookies->mgc_mgl;
+		struct mlog_logid *mgl = &sorted[i].mgc_mgl;
 
-		ret = mlog_cat_id2handle(cathandle, &loghandle, mgl);
-		if (ret) {
+		num = 0;
+		for (j = i; j < count &&
+		     mlog_logid_equals(&sorted[j].mgc_mgl, mgl); j++) {
+			index[num++] = sorted[j].mgc_index;
+		}
+
+		rc = mlog_cat_id2handle(cathandle, &loghandle, mgl);
+		if (rc) {
 			MERROR("Cannot find log %llx\n", mgl->mgl_oid);
-			break;
+			if (ret == 0)
+				ret = rc;
+			continue;
 		}
 
 		down_write(&loghandle->mgh_lock);
-		ret = mlog_cancel_rec(loghandle, cookies->mgc_index);
+		rc = mlog_cancel_arr_rec(loghandle, num, index);
 		up_write(&loghandle->mgh_lock);
 
-		if (ret == 1) {	  /* log has been destroyed */
-			index = loghandle->u.phd.phd_cookie.mgc_index;
+		if (rc == 1) {	  /* log has been destroyed */
+			cat_index[cat_count++] =
+				loghandle->u.phd.phd_cookie.mgc_index;
 			if (cathandle->u.chd.chd_current_log == loghandle)
 				cathandle->u.chd.chd_current_log = NULL;
 			mlog_free_handle(loghandle);
-
-			MASSERT(index);
-			mlog_cat_set_first_idx(cathandle, index);
-			ret = mlog_cancel_rec(cathandle, index);
+		} else if (rc) {
+			MERROR("failed to cancel %d records of log %llx, "
+			       "ret = %d\n", num, mgl->mgl_oid, rc);
 			if (ret == 0)
-				MDEBUG("cancel plain log at index %u"
-				       " of catalog %llx\n",
-				       index, cathandle->mgh_id.mgl_oid);
+				ret = rc;
+		}
+	}
+
+	if (cat_count > 0) {
+		rc = mlog_cat_cancel_logs(cathandle, cat_count, cat_index);
+		if (rc && ret == 0) {
+			ret = rc;
 		}
 	}
 	up_write(&cathandle->mgh_lock);
 
+out_free:
+	if (sorted)
+		MTFS_FREE(sorted, sizeof(*sorted) * count);
+	if (index)
+		MTFS_FREE(index, sizeof(*index) * count);
+	if (cat_index)
+		MTFS_FREE(cat_index, sizeof(*cat_index) * count);
+out:
 	MRETURN(ret);
 }
 EXPORT_SYMBOL(mlog_cat_cancel_records);
@@ -353,8 +1129,9 @@ int mlog_cat_destroy(struct mlog_handle *cathandle)
 	int ret;
 	MENTRY();
 
-	list_for_each_entry_safe(loghandle, n, &cathandle->u.chd.chd_head,
-	                         u.phd.phd_entry) {
+	mlog_cat_spare_fini(cathandle);
+	mtfs_list_for_each_entry_safe(loghandle, n, &cathandle->u.chd.chd_head,
+	                              u.phd.phd_entry) {
 		ret = mlog_destroy(loghandle);
 		if (ret) {
 			MERROR("error closing loghandle\n");
@@ -367,12 +1144,35 @@ int mlog_cat_destroy(struct mlog_handle *cathandle)
 }
 EXPORT_SYMBOL(mlog_cat_destroy);
 
+/*
+ * With MLOG_PROCESS_UNORDERED, the plain logs of a catalog are collected
+ * while walking the catalog, and then processed by up to
+ * mlog_process_threads threads at the same time, the caller included.
+ */
+static int mlog_process_threads = 4;
+module_param(mlog_process_threads, int, 0644);
+MODULE_PARM_DESC(mlog_process_threads, "threads processing plain logs of a catalog in parallel");
+
+struct mlog_process_log {
+	mtfs_list_t         mpl_linkage;
+	struct mlog_handle *mpl_handle;
+};
+
+struct mlog_cat_parallel {
+	struct mlog_process_data *mcp_data;
+	mtfs_spinlock_t           mcp_lock;    /* protects mpd_logs and mcp_ret */
+	int                       mcp_ret;
+	atomic_t                  mcp_running; /* threads still processing */
+	struct completion         mcp_completion;
+};
+
 int mlog_cat_process_cb(struct mlog_handle *cat_mlh, struct mlog_rec_hdr *rec,
                         void *data)
 {
 	struct mlog_process_data *d = data;
 	struct mlog_logid_rec *mir = (struct mlog_logid_rec *)rec;
 	struct mlog_handle *mlh;
+	struct mlog_process_log *mpl;
 	int ret = 0;
 	MENTRY();
 
@@ -392,42 +1192,251 @@ int mlog_cat_process_cb(struct mlog_handle *cat_mlh, struct mlog_rec_hdr *rec,
 		goto out;
 	}
 
-	ret = mlog_process(mlh, d->mpd_cb, d->mpd_data, NULL);
+	if (d->mpd_flags & MLOG_PROCESS_UNORDERED) {
+		MTFS_ALLOC_PTR(mpl);
+		if (mpl == NULL) {
+			MERROR("failed to allocate memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+		mpl->mpl_handle = mlh;
+		mtfs_list_add_tail(&mpl->mpl_linkage, &d->mpd_logs);
+		goto out;
+	}
+
+	ret = mlog_process_flags(mlh, d->mpd_cb, d->mpd_data, NULL,
+	                         d->mpd_flags);
 out:
 	MRETURN(ret);
 }
 
-int mlog_cat_process(struct mlog_handle *cat_mlh, mlog_cb_t cb, void *data)
+static void mlog_cat_parallel_process(struct mlog_cat_parallel *mcp)
+{
+	struct mlog_process_data *d = mcp->mcp_data;
+	struct mlog_process_log *mpl;
+	int ret;
+
+	while (1) {
+		mtfs_spin_lock(&mcp->mcp_lock);
+		if (mcp->mcp_ret || mtfs_list_empty(&d->mpd_logs)) {
+			mtfs_spin_unlock(&mcp->mcp_lock);
+			break;
+		}
+		mpl = mtfs_list_entry(d->mpd_logs.next,
+		                      struct mlog_process_log, mpl_linkage);
+		mtfs_list_del(&mpl->mpl_linkage);
+		mtfs_spin_unlock(&mcp->mcp_lock);
+
+		ret = mlog_process_flags(mpl->mpl_handle, d->mpd_cb,
+		                         d->mpd_data, NULL,
+		                         d->mpd_flags | MLOG_PROCESS_NOTHREAD);
+		MTFS_FREE_PTR(mpl);
+		if (ret) {
+			mtfs_spin_lock(&mcp->mcp_lock);
+			if (mcp->mcp_ret == 0) {
+				mcp->mcp_ret = ret;
+			}
+			mtfs_spin_unlock(&mcp->mcp_lock);
+		}
+	}
+
+	if (atomic_dec_and_test(&mcp->mcp_running)) {
+		complete(&mcp->mcp_completion);
+	}
+}
+
+static int mlog_cat_parallel_thread(void *arg)
+{
+	struct mlog_cat_parallel *mcp = arg;
+
+	mtfs_daemonize_ctxt("mlog_cat_process");
+	mlog_cat_parallel_process(mcp);
+	return 0;
+}
+
+static int mlog_cat_process_parallel(struct mlog_process_data *d)
+{
+	struct mlog_cat_parallel mcp;
+	struct mlog_process_log *mpl;
+	struct mlog_process_log *n;
+	int count = 0;
+	int i;
+	int ret;
+	MENTRY();
+
+	mtfs_list_for_each_entry(mpl, &d->mpd_logs, mpl_linkage) {
+		count++;
+	}
+
+	mcp.mcp_data = d;
+	mcp.mcp_ret = 0;
+	mtfs_spin_lock_init(&mcp.mcp_lock);
+	init_completion(&mcp.mcp_completion);
+	/* Reference of the caller */
+	atomic_set(&mcp.mcp_running, 1);
+
+	for (i = 1; i < mlog_process_threads && i < count; i++) {
+		atomic_inc(&mcp.mcp_running);
+		ret = mtfs_create_thread(mlog_cat_parallel_thread, &mcp,
+		                         CLONE_VM | CLONE_FILES);
+		if (ret < 0) {
+			MERROR("cannot start thread: %d\n", ret);
+			atomic_dec(&mcp.mcp_running);
+			break;
+		}
+	}
+
+	mlog_cat_parallel_process(&mcp);
+	wait_for_completion(&mcp.mcp_completion);
+
+	/* Logs left because of failure */
+	mtfs_list_for_each_entry_safe(mpl, n, &d->mpd_logs, mpl_linkage) {
+		mtfs_list_del(&mpl->mpl_linkage);
+		MTFS_FREE_PTR(mpl);
+	}
+
+	MRETURN(mcp.mcp_ret);
+}
+
+/* Call cb on records of the catalog, which may cross index zero */
+static int mlog_cat_walk(struct mlog_handle *cat_mlh, mlog_cb_t cb,
+                         void *data, int flags)
 {
-	struct mlog_process_data d;
 	struct mlog_process_cat_data cd;
 	struct mlog_log_hdr *mlh = cat_mlh->mgh_hdr;
 	int ret = 0;
 	MENTRY();
 
-	MASSERT(mlh->mlh_flags & MLOG_F_IS_CAT);
-	d.mpd_data = data;
-	d.mpd_cb = cb;
-
 	if (mlh->mlh_cat_idx > cat_mlh->mgh_last_idx) {
 		MPRINT("catlog %llx crosses index zero\n",
 		       cat_mlh->mgh_id.mgl_oid);
 
 		cd.mpcd_first_idx = mlh->mlh_cat_idx;
 		cd.mpcd_last_idx = 0;
-		ret = mlog_process(cat_mlh, mlog_cat_process_cb, &d, &cd);
+		ret = mlog_process_flags(cat_mlh, cb, data, &cd, flags);
 		if (ret != 0) {
 			goto out;
 		}
 
 		cd.mpcd_first_idx = 0;
 		cd.mpcd_last_idx = cat_mlh->mgh_last_idx;
-		ret = mlog_process(cat_mlh, mlog_cat_process_cb, &d, &cd);
+		ret = mlog_process_flags(cat_mlh, cb, data, &cd, flags);
 	} else {
-		ret = mlog_process(cat_mlh, mlog_cat_process_cb, &d, NULL);
+		ret = mlog_process_flags(cat_mlh, cb, data, NULL, flags);
 	}
-
 out:
 	MRETURN(ret);
 }
+
+int mlog_cat_process_flags(struct mlog_handle *cat_mlh, mlog_cb_t cb,
+                           void *data, int flags)
+{
+	struct mlog_process_data d;
+	struct mlog_log_hdr *mlh = cat_mlh->mgh_hdr;
+	struct mlog_process_log *mpl;
+	struct mlog_process_log *n;
+	int ret = 0;
+	MENTRY();
+
+	MASSERT(mlh->mlh_flags & MLOG_F_IS_CAT);
+	d.mpd_data = data;
+	d.mpd_cb = cb;
+	d.mpd_flags = flags;
+	MTFS_INIT_LIST_HEAD(&d.mpd_logs);
+
+	ret = mlog_cat_walk(cat_mlh, mlog_cat_process_cb, &d, flags);
+	if (ret == 0 && (flags & MLOG_PROCESS_UNORDERED)) {
+		ret = mlog_cat_process_parallel(&d);
+	}
+
+	mtfs_list_for_each_entry_safe(mpl, n, &d.mpd_logs, mpl_linkage) {
+		mtfs_list_del(&mpl->mpl_linkage);
+		MTFS_FREE_PTR(mpl);
+	}
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_cat_process_flags);
+
+int mlog_cat_process(struct mlog_handle *cat_mlh, mlog_cb_t cb, void *data)
+{
+	return mlog_cat_process_flags(cat_mlh, cb, data, 0);
+}
 EXPORT_SYMBOL(mlog_cat_process);
+
+/*
+ * Drop a plain log without any record from the catalog.
+ * Errors are only reported, the log is tried again at next mount.
+ */
+static int mlog_cat_reap_cb(struct mlog_handle *cathandle,
+                            struct mlog_rec_hdr *rec, void *data)
+{
+	struct mlog_logid_rec *mir = (struct mlog_logid_rec *)rec;
+	struct mlog_handle *loghandle = NULL;
+	int *reaped = data;
+	int index = rec->mrh_index;
+	int ret = 0;
+	MENTRY();
+
+	if (rec->mrh_type != MLOG_LOGID_MAGIC) {
+		MERROR("invalid record in catalog\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = mlog_cat_id2handle(cathandle, &loghandle, &mir->mid_id);
+	if (ret) {
+		MERROR("Cannot find handle for log %llx, ret = %d\n",
+		       mir->mid_id.mgl_oid, ret);
+		ret = 0;
+		goto out;
+	}
+
+	if (loghandle->mgh_hdr->mlh_count > 1) {
+		goto out;
+	}
+
+	ret = mlog_destroy(loghandle);
+	if (ret) {
+		MERROR("failed to destroy empty log %llx, ret = %d\n",
+		       mir->mid_id.mgl_oid, ret);
+		ret = 0;
+		goto out;
+	}
+	mlog_free_handle(loghandle);
+
+	down_write(&cathandle->mgh_lock);
+	ret = mlog_cat_cancel_logs(cathandle, 1, &index);
+	up_write(&cathandle->mgh_lock);
+	if (ret < 0) {
+		MERROR("failed to drop log %llx from catalog %llx, ret = %d\n",
+		       mir->mid_id.mgl_oid, cathandle->mgh_id.mgl_oid, ret);
+	} else {
+		(*reaped)++;
+	}
+	ret = 0;
+out:
+	MRETURN(ret);
+}
+
+/*
+ * Drop plain logs without any record from the catalog, such as spare logs
+ * left by a crash, or logs whose records were all canceled before they
+ * were full. Called before the catalog is used.
+ *
+ * Assumes caller has already pushed us into the kernel context.
+ */
+int mlog_cat_reap(struct mlog_handle *cathandle)
+{
+	int reaped = 0;
+	int ret = 0;
+	MENTRY();
+
+	MASSERT(cathandle->mgh_hdr->mlh_flags & MLOG_F_IS_CAT);
+	ret = mlog_cat_walk(cathandle, mlog_cat_reap_cb, &reaped, 0);
+	if (reaped > 0) {
+		MDEBUG("dropped %d empty logs of catalog %llx\n",
+		       reaped, cathandle->mgh_id.mgl_oid);
+	}
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mlog_cat_reap);
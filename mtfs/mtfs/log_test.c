@@ -1,17 +1,22 @@
 /*
  * Copied from Lustre-2.x
  */
+#if defined (__linux__) && defined(__KERNEL__)
 #include <linux/namei.h>
 #include <linux/module.h>
 #include <linux/mount.h>
 #include <linux/random.h>
-#include <mtfs_log.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
 #include <mtfs_file.h>
+#endif /* defined (__linux__) && defined(__KERNEL__) */
+#include <thread.h>
+#include <mtfs_log.h>
 
 struct mlog_mini_rec {
         struct mlog_rec_hdr     mmr_hdr;
         struct mlog_rec_tail    mmr_tail;
-} __attribute__((packed));
+} __attribute__((packed, aligned(8)));
 
 static int mlog_verify_handle(char *test, struct mlog_handle *mlh, int num_recs)
 {
@@ -157,7 +162,7 @@ static int mlog_test_3(struct mlog_ctxt *ctxt, struct mlog_handle *mlh)
 	mid.mid_hdr.mrh_type = MLOG_LOGID_MAGIC;
 
 	MPRINT("3a: write one logid record\n");
-	ret = mlog_write_rec(mlh,  &mid.mid_hdr, NULL, 0, NULL, -1);
+	ret = mlog_write_rec(mlh, &mid.mid_hdr, NULL, 0, NULL, -1);
 	num_recs++;
 	if (ret) {
 		MERROR("3a: write one log record failed: %d\n", ret);
@@ -490,7 +495,7 @@ static int mlog_test_7(struct mlog_ctxt *ctxt)
 
 	mid.mid_hdr.mrh_len = mid.mid_tail.mrt_len = sizeof(mid);
 	mid.mid_hdr.mrh_type = MLOG_LOGID_MAGIC;
-	ret = mlog_write_rec(mlh,  &mid.mid_hdr, NULL, 0, NULL, -1);
+	ret = mlog_write_rec(mlh, &mid.mid_hdr, NULL, 0, NULL, -1);
 	if (ret) {
 		MERROR("7: write one log record failed: %d\n", ret);
 		goto out;
@@ -506,9 +511,527 @@ out:
 	MRETURN(ret);
 }
 
+#define MLOG_TEST_8_THREADS 16
+#define MLOG_TEST_8_RECORDS 1000
+
+struct mlog_test_8_thread {
+	struct mlog_handle *mtt_cath;
+	__u64              *mtt_latency; /* ns of each append */
+	int                 mtt_ret;
+	struct completion   mtt_completion;
+};
+
+static int mlog_test_8_main(void *arg)
+{
+	struct mlog_test_8_thread *mtt = arg;
+	struct mlog_mini_rec mmr;
+	ktime_t start;
+	int ret = 0;
+	int i = 0;
+
+	mtfs_daemonize_ctxt("mlog_test_8");
+	for (i = 0; i < MLOG_TEST_8_RECORDS; i++) {
+		mmr.mmr_hdr.mrh_len = mmr.mmr_tail.mrt_len = MLOG_MIN_REC_SIZE;
+		mmr.mmr_hdr.mrh_type = 0xf00f00;
+		start = ktime_get();
+		ret = mlog_cat_add_rec_sync(mtt->mtt_cath, &mmr.mmr_hdr,
+		                            NULL, NULL);
+		mtt->mtt_latency[i] = ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (ret) {
+			mtt->mtt_ret = ret;
+			break;
+		}
+	}
+	complete(&mtt->mtt_completion);
+	return 0;
+}
+
+static int mlog_test_8_cmp(const void *a, const void *b)
+{
+	__u64 left = *(const __u64 *)a;
+	__u64 right = *(const __u64 *)b;
+
+	if (left < right) {
+		return -1;
+	} else if (left > right) {
+		return 1;
+	}
+	return 0;
+}
+
+/* Run nthreads concurrent appenders and report throughput and p99 latency */
+static int mlog_test_8_run(struct mlog_handle *cath, int nthreads)
+{
+	struct mlog_test_8_thread *mtts = NULL;
+	__u64 *latency = NULL;
+	int records = nthreads * MLOG_TEST_8_RECORDS;
+	int batches = atomic_read(&cath->u.chd.chd_group_batches);
+	ktime_t start;
+	__u64 elapsed = 0;
+	__u64 rate = 0;
+	__u64 p99 = 0;
+	__u64 max = 0;
+	int misses = atomic_read(&cath->u.chd.chd_spare_misses);
+	int started = 0;
+	int ret = 0;
+	int i = 0;
+	MENTRY();
+
+	MTFS_ALLOC(mtts, sizeof(*mtts) * nthreads);
+	if (mtts == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	MTFS_ALLOC(latency, sizeof(*latency) * records);
+	if (latency == NULL) {
+		ret = -ENOMEM;
+		goto out_free_mtts;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < nthreads; i++) {
+		mtts[i].mtt_cath = cath;
+		mtts[i].mtt_latency = latency + i * MLOG_TEST_8_RECORDS;
+		init_completion(&mtts[i].mtt_completion);
+		ret = mtfs_create_thread(mlog_test_8_main, &mtts[i],
+		                         CLONE_VM | CLONE_FILES);
+		if (ret < 0) {
+			MERROR("cannot start thread: %d\n", ret);
+			break;
+		}
+		ret = 0;
+		started++;
+	}
+
+	for (i = 0; i < started; i++) {
+		wait_for_completion(&mtts[i].mtt_completion);
+		if (mtts[i].mtt_ret && ret == 0) {
+			ret = mtts[i].mtt_ret;
+		}
+	}
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (ret) {
+		MERROR("8: appending with %d threads failed: %d\n",
+		       nthreads, ret);
+		goto out_free_latency;
+	}
+
+	sort(latency, records, sizeof(*latency), mlog_test_8_cmp, NULL);
+	p99 = latency[records / 100 * 99];
+	do_div(p99, 1000);
+	max = latency[records - 1];
+	do_div(max, 1000);
+	do_div(elapsed, 1000);
+	rate = (__u64)records * 1000000;
+	do_div(rate, (__u32)elapsed + 1);
+	batches = atomic_read(&cath->u.chd.chd_group_batches) - batches;
+	misses = atomic_read(&cath->u.chd.chd_spare_misses) - misses;
+	MPRINT("8: %d threads, %d records in %d batches, "
+	       "%llu records/s, p99 latency %llu us, max latency %llu us, "
+	       "%d rollovers without spare log\n",
+	       nthreads, records, batches, rate, p99, max, misses);
+
+out_free_latency:
+	MTFS_FREE(latency, sizeof(*latency) * records);
+out_free_mtts:
+	MTFS_FREE(mtts, sizeof(*mtts) * nthreads);
+out:
+	MRETURN(ret);
+}
+
+/* Test group commit of catalog appends as concurrency grows */
+static int mlog_test_8(struct mlog_ctxt *ctxt)
+{
+	struct mlog_handle *cath = NULL;
+	char name[10];
+	int nthreads = 0;
+	int ret = 0;
+	MENTRY();
+
+	sprintf(name, "%x", random32());
+	MPRINT("8: create a catalog log with name: %s\n", name);
+	ret = mlog_create(ctxt, &cath, NULL, name);
+	if (ret) {
+		MERROR("8: mlog_create with name %s failed: %d\n", name, ret);
+		goto out;
+	}
+	mlog_init_handle(cath, MLOG_F_IS_CAT, &mlog_test_uuid);
+
+	for (nthreads = 1; nthreads <= MLOG_TEST_8_THREADS; nthreads *= 2) {
+		ret = mlog_test_8_run(cath, nthreads);
+		if (ret) {
+			break;
+		}
+	}
+
+	if (mlog_cat_destroy(cath)) {
+		MERROR("8: failed to destroy catalog\n");
+	} else {
+		mlog_free_handle(cath);
+	}
+out:
+	MRETURN(ret);
+}
+
+#define MLOG_TEST_9_RECORDS 1000
+
+/* Test cancel of many records of a catalog in one batch */
+static int mlog_test_9(struct mlog_ctxt *ctxt)
+{
+	struct mlog_handle *cath = NULL;
+	struct mlog_cookie *cookies = NULL;
+	struct mlog_cookie cookie;
+	struct mlog_mini_rec mmr;
+	char name[10];
+	int ret = 0;
+	int i;
+	MENTRY();
+
+	MTFS_ALLOC(cookies, sizeof(*cookies) * MLOG_TEST_9_RECORDS);
+	if (cookies == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	sprintf(name, "%x", random32());
+	MPRINT("9a: create a catalog log with name: %s\n", name);
+	ret = mlog_create(ctxt, &cath, NULL, name);
+	if (ret) {
+		MERROR("9a: mlog_create with name %s failed: %d\n", name, ret);
+		goto out_free;
+	}
+	mlog_init_handle(cath, MLOG_F_IS_CAT, &mlog_test_uuid);
+
+	mmr.mmr_hdr.mrh_len = mmr.mmr_tail.mrt_len = MLOG_MIN_REC_SIZE;
+	mmr.mmr_hdr.mrh_type = 0xf00f00;
+
+	MPRINT("9b: write %d records into the catalog\n", MLOG_TEST_9_RECORDS);
+	for (i = 0; i < MLOG_TEST_9_RECORDS; i++) {
+		ret = mlog_cat_add_rec(cath, &mmr.mmr_hdr, &cookies[i], NULL);
+		if (ret != 1) {
+			MERROR("9b: write record failed at #%d: %d\n",
+			       i + 1, ret);
+			ret = ret < 0 ? ret : -EIO;
+			goto out_destroy;
+		}
+	}
+
+	/* Reverse the cookies, so that the cancel has to sort them */
+	for (i = 0; i < MLOG_TEST_9_RECORDS / 2; i++) {
+		cookie = cookies[i];
+		cookies[i] = cookies[MLOG_TEST_9_RECORDS - 1 - i];
+		cookies[MLOG_TEST_9_RECORDS - 1 - i] = cookie;
+	}
+
+	MPRINT("9c: cancel all records in one batch\n");
+	ret = mlog_cat_cancel_records(cath, MLOG_TEST_9_RECORDS, cookies);
+	if (ret) {
+		MERROR("9c: cancel %d records failed: %d\n",
+		       MLOG_TEST_9_RECORDS, ret);
+		goto out_destroy;
+	}
+
+	ret = mlog_verify_handle("9c", cath->u.chd.chd_current_log, 1);
+out_destroy:
+	if (mlog_cat_destroy(cath)) {
+		MERROR("9: failed to destroy catalog\n");
+	} else {
+		mlog_free_handle(cath);
+	}
+out_free:
+	MTFS_FREE(cookies, sizeof(*cookies) * MLOG_TEST_9_RECORDS);
+out:
+	MRETURN(ret);
+}
+
+#define MLOG_TEST_10_RECORDS 10
+
+/* Test reap of plain logs left empty when the catalog is reopened */
+static int mlog_test_10(struct mlog_ctxt *ctxt)
+{
+	struct mlog_handle *cath = NULL;
+	struct mlog_cookie cookies[MLOG_TEST_10_RECORDS];
+	struct mlog_mini_rec mmr;
+	char name[10];
+	int ret = 0;
+	int i;
+	MENTRY();
+
+	sprintf(name, "%x", random32());
+	MPRINT("10a: create a catalog log with name: %s\n", name);
+	ret = mlog_create(ctxt, &cath, NULL, name);
+	if (ret) {
+		MERROR("10a: mlog_create with name %s failed: %d\n", name, ret);
+		goto out;
+	}
+	mlog_init_handle(cath, MLOG_F_IS_CAT, &mlog_test_uuid);
+
+	mmr.mmr_hdr.mrh_len = mmr.mmr_tail.mrt_len = MLOG_MIN_REC_SIZE;
+	mmr.mmr_hdr.mrh_type = 0xf00f00;
+
+	MPRINT("10b: write and cancel %d records\n", MLOG_TEST_10_RECORDS);
+	for (i = 0; i < MLOG_TEST_10_RECORDS; i++) {
+		ret = mlog_cat_add_rec(cath, &mmr.mmr_hdr, &cookies[i], NULL);
+		if (ret != 1) {
+			MERROR("10b: write record failed at #%d: %d\n",
+			       i + 1, ret);
+			ret = ret < 0 ? ret : -EIO;
+			goto out_destroy;
+		}
+	}
+
+	ret = mlog_cat_cancel_records(cath, MLOG_TEST_10_RECORDS, cookies);
+	if (ret) {
+		MERROR("10b: cancel %d records failed: %d\n",
+		       MLOG_TEST_10_RECORDS, ret);
+		goto out_destroy;
+	}
+
+	/* The plain log is not full, so it is kept in the catalog */
+	ret = mlog_verify_handle("10b", cath, 2);
+	if (ret) {
+		goto out_destroy;
+	}
+
+	MPRINT("10c: reopen the catalog and reap empty logs\n");
+	ret = mlog_cat_put(cath);
+	if (ret) {
+		MERROR("10c: failed to close catalog: %d\n", ret);
+		goto out;
+	}
+
+	ret = mlog_create(ctxt, &cath, NULL, name);
+	if (ret) {
+		MERROR("10c: mlog_create with name %s failed: %d\n", name, ret);
+		goto out;
+	}
+	mlog_init_handle(cath, MLOG_F_IS_CAT, &mlog_test_uuid);
+
+	ret = mlog_cat_reap(cath);
+	if (ret) {
+		MERROR("10c: reap failed: %d\n", ret);
+		goto out_destroy;
+	}
+
+	ret = mlog_verify_handle("10c", cath, 1);
+out_destroy:
+	if (mlog_cat_destroy(cath)) {
+		MERROR("10: failed to destroy catalog\n");
+	} else {
+		mlog_free_handle(cath);
+	}
+out:
+	MRETURN(ret);
+}
+
+#define MLOG_TEST_11_RECORDS 16
+
+/* Test that records added together take one batch and one header write */
+static int mlog_test_11(struct mlog_ctxt *ctxt)
+{
+	struct mlog_handle *cath = NULL;
+	struct mlog_mini_rec mmrs[MLOG_TEST_11_RECORDS];
+	struct mlog_rec_hdr *recs[MLOG_TEST_11_RECORDS];
+	struct mlog_cookie cookies[MLOG_TEST_11_RECORDS];
+	struct mlog_mini_rec mmr;
+	char name[10];
+	int batches = 0;
+	int headers = 0;
+	int ret = 0;
+	int i;
+	MENTRY();
+
+	sprintf(name, "%x", random32());
+	MPRINT("11a: create a catalog log with name: %s\n", name);
+	ret = mlog_create(ctxt, &cath, NULL, name);
+	if (ret) {
+		MERROR("11a: mlog_create with name %s failed: %d\n", name, ret);
+		goto out;
+	}
+	mlog_init_handle(cath, MLOG_F_IS_CAT, &mlog_test_uuid);
+
+	/* Open the plain log first, its creation writes headers too */
+	mmr.mmr_hdr.mrh_len = mmr.mmr_tail.mrt_len = MLOG_MIN_REC_SIZE;
+	mmr.mmr_hdr.mrh_type = 0xf00f00;
+	ret = mlog_cat_add_rec(cath, &mmr.mmr_hdr, NULL, NULL);
+	if (ret < 0) {
+		MERROR("11a: write record failed: %d\n", ret);
+		goto out_destroy;
+	}
+
+	MPRINT("11b: add %d records together\n", MLOG_TEST_11_RECORDS);
+	for (i = 0; i < MLOG_TEST_11_RECORDS; i++) {
+		mmrs[i].mmr_hdr.mrh_len = MLOG_MIN_REC_SIZE;
+		mmrs[i].mmr_tail.mrt_len = MLOG_MIN_REC_SIZE;
+		mmrs[i].mmr_hdr.mrh_type = 0xf00f00;
+		recs[i] = &mmrs[i].mmr_hdr;
+	}
+	memset(cookies, 0, sizeof(cookies));
+	batches = atomic_read(&cath->u.chd.chd_group_batches);
+	headers = atomic_read(&cath->u.chd.chd_group_headers);
+	ret = mlog_cat_add_recs(cath, recs, MLOG_TEST_11_RECORDS, cookies);
+	if (ret) {
+		MERROR("11b: add %d records failed: %d\n",
+		       MLOG_TEST_11_RECORDS, ret);
+		goto out_destroy;
+	}
+	batches = atomic_read(&cath->u.chd.chd_group_batches) - batches;
+	headers = atomic_read(&cath->u.chd.chd_group_headers) - headers;
+	if (batches != 1 || headers != 1) {
+		MERROR("11b: %d batches and %d header writes, expected 1\n",
+		       batches, headers);
+		ret = -ERANGE;
+		goto out_destroy;
+	}
+
+	for (i = 0; i < MLOG_TEST_11_RECORDS; i++) {
+		if (cookies[i].mgc_index == 0) {
+			MERROR("11b: no cookie of record #%d\n", i + 1);
+			ret = -EINVAL;
+			goto out_destroy;
+		}
+	}
+
+	ret = mlog_verify_handle("11b", cath->u.chd.chd_current_log,
+	                         MLOG_TEST_11_RECORDS + 2);
+out_destroy:
+	if (mlog_cat_destroy(cath)) {
+		MERROR("11: failed to destroy catalog\n");
+	} else {
+		mlog_free_handle(cath);
+	}
+out:
+	MRETURN(ret);
+}
+
+#define MLOG_TEST_12_RECORDS 3
+
+static int mlog_test_12_cb(struct mlog_handle *mlh, struct mlog_rec_hdr *rec,
+                           void *data)
+{
+	int *seen = (int *)data;
+	MENTRY();
+
+	if (rec->mrh_type != 0xf00f00) {
+		MERROR("12: unexpected record type %#x at index %u\n",
+		       rec->mrh_type, rec->mrh_index);
+		MRETURN(-EINVAL);
+	}
+	(*seen)++;
+	MRETURN(0);
+}
+
+/* Reopen a plain log whose last append was torn */
+static int mlog_test_12(struct mlog_ctxt *ctxt)
+{
+	struct mlog_handle *mlh = NULL;
+	struct mlog_mini_rec mmr;
+	struct mlog_rec_hdr torn;
+	loff_t pos = 0;
+	char name[10];
+	int seen = 0;
+	int ret = 0;
+	int i;
+	MENTRY();
+
+	sprintf(name, "%x", random32());
+	MPRINT("12a: create a log with name: %s\n", name);
+	ret = mlog_create(ctxt, &mlh, NULL, name);
+	if (ret) {
+		MERROR("12a: mlog_create with name %s failed: %d\n", name, ret);
+		goto out;
+	}
+	mlog_init_handle(mlh, MLOG_F_IS_PLAIN, &mlog_test_uuid);
+
+	for (i = 0; i < MLOG_TEST_12_RECORDS; i++) {
+		mmr.mmr_hdr.mrh_len = mmr.mmr_tail.mrt_len = MLOG_MIN_REC_SIZE;
+		mmr.mmr_hdr.mrh_type = 0xf00f00;
+		ret = mlog_write_rec(mlh, &mmr.mmr_hdr, NULL, 0, NULL, -1);
+		if (ret) {
+			MERROR("12a: write record #%d failed: %d\n", i + 1, ret);
+			goto out_destroy;
+		}
+	}
+
+	MPRINT("12b: tear the next record after its header\n");
+	memset(&torn, 0, sizeof(torn));
+	torn.mrh_len = 64;
+	torn.mrh_index = MLOG_TEST_12_RECORDS + 1;
+	torn.mrh_type = 0xdeadbeef;
+	pos = mlh->mgh_file->f_pos;
+	ret = mlowerfs_write_record(ctxt->moc_lowerfs, mlh->mgh_file,
+	                            &torn, sizeof(torn), &pos, 0);
+	if (ret) {
+		MERROR("12b: write torn record failed: %d\n", ret);
+		goto out_destroy;
+	}
+
+	ret = mlog_close(mlh);
+	if (ret) {
+		MERROR("12b: mlog_close failed: %d\n", ret);
+		goto out;
+	}
+
+	MPRINT("12c: reopen the log and append to it\n");
+	ret = mlog_create(ctxt, &mlh, NULL, name);
+	if (ret) {
+		MERROR("12c: mlog_create with name %s failed: %d\n", name, ret);
+		goto out;
+	}
+
+	ret = mlog_init_handle(mlh, MLOG_F_IS_PLAIN, &mlog_test_uuid);
+	if (ret) {
+		MERROR("12c: mlog_init_handle failed: %d\n", ret);
+		goto out_destroy;
+	}
+
+	/* The torn bytes are padded over, taking one index */
+	if (mlh->mgh_last_idx != MLOG_TEST_12_RECORDS + 1) {
+		MERROR("12c: last index is %d, expected %d\n",
+		       mlh->mgh_last_idx, MLOG_TEST_12_RECORDS + 1);
+		ret = -ERANGE;
+		goto out_destroy;
+	}
+
+	mmr.mmr_hdr.mrh_len = mmr.mmr_tail.mrt_len = MLOG_MIN_REC_SIZE;
+	mmr.mmr_hdr.mrh_type = 0xf00f00;
+	ret = mlog_write_rec(mlh, &mmr.mmr_hdr, NULL, 0, NULL, -1);
+	if (ret) {
+		MERROR("12c: write record failed: %d\n", ret);
+		goto out_destroy;
+	}
+
+	ret = mlog_verify_handle("12c", mlh, MLOG_TEST_12_RECORDS + 2);
+	if (ret) {
+		goto out_destroy;
+	}
+
+	ret = mlog_process(mlh, mlog_test_12_cb, &seen, NULL);
+	if (ret) {
+		MERROR("12c: mlog_process failed: %d\n", ret);
+		goto out_destroy;
+	}
+
+	if (seen != MLOG_TEST_12_RECORDS + 1) {
+		MERROR("12c: processed %d records, expected %d\n",
+		       seen, MLOG_TEST_12_RECORDS + 1);
+		ret = -ERANGE;
+	}
+out_destroy:
+	if (mlog_destroy(mlh)) {
+		MERROR("12: mlog_destroy failed\n");
+	} else {
+		mlog_free_handle(mlh);
+	}
+out:
+	MRETURN(ret);
+}
+
 int mlog_run_tests(struct mlog_ctxt *ctxt)
 {
 	int ret = 0;
+	int rc = 0;
 	char *name = "log_test";
 	struct mlog_handle *mlh = NULL;
 	char cat_name[64];
@@ -558,11 +1081,44 @@ int mlog_run_tests(struct mlog_ctxt *ctxt)
 		goto out_destroy;
 	}
 
+	ret = mlog_test_8(ctxt);
+	if (ret) {
+		MERROR("test 8 failed\n");
+		goto out_destroy;
+	}
+
+	ret = mlog_test_9(ctxt);
+	if (ret) {
+		MERROR("test 9 failed\n");
+		goto out_destroy;
+	}
+
+	ret = mlog_test_10(ctxt);
+	if (ret) {
+		MERROR("test 10 failed\n");
+		goto out_destroy;
+	}
+
+	ret = mlog_test_11(ctxt);
+	if (ret) {
+		MERROR("test 11 failed\n");
+		goto out_destroy;
+	}
+
+	ret = mlog_test_12(ctxt);
+	if (ret) {
+		MERROR("test 12 failed\n");
+		goto out_destroy;
+	}
+
 	MERROR("mlog tests finished\n");
 out_destroy:
-	ret = mlog_destroy(mlh);
-	if (ret) {
-		MERROR("failed to destroy handle, ret = %d\n", ret);
+	rc = mlog_destroy(mlh);
+	if (rc) {
+		MERROR("failed to destroy handle, ret = %d\n", rc);
+		if (ret == 0) {
+			ret = rc;
+		}
 	} else {
 		mlog_free_handle(mlh); 
 	}
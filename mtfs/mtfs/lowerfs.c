@@ -9,77 +9,118 @@
 #include <string.h>
 #endif
 
-void _mlowerfs_bucket_dump(struct mlowerfs_bucket *bucket)
+/*
+ * Return number of used slots.
+ * Used slots are packed at the head, so binary search the first idle one.
+ */
+int _mlowerfs_bucket_count(struct mlowerfs_bucket *bucket)
 {
-	int i = 0;
-	struct mtfs_interval_node_extent last_extent = {0, 0};
-	int inited = 0;
-	int last_id = 0;
-	int print_id = 0;
-	MENTRY();
+	int low = 0;
+	int high = MLOWERFS_BUCKET_NUMBER;
+	int middle = 0;
 
-	for (i = 0; i < MLOWERFS_BUCKET_NUMBER; i++) {
-		if (!mlowerfs_bucket2s_used(bucket, i)) {
-			continue;
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (mlowerfs_bucket2s_used(bucket, middle)) {
+			low = middle + 1;
+		} else {
+			high = middle;
 		}
+	}
+	return low;
+}
 
-		if (inited) {
-			if (print_id) {
-				MPRINT("%d[%llu, %llu], ",
-				       last_id, last_extent.start,
-				       last_extent.end);
-			} else {
-				MPRINT("[%llu, %llu], ",
-				       last_extent.start,
-				       last_extent.end);
-			}
+/* Return the first slot in [0, count) that ends at or after position */
+static int _mlowerfs_bucket_lower(struct mlowerfs_bucket *bucket,
+                                  int count,
+                                  __u64 position)
+{
+	int low = 0;
+	int high = count;
+	int middle = 0;
+
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (mlowerfs_bucket2s_end(bucket, middle) < position) {
+			low = middle + 1;
+		} else {
+			high = middle;
 		}
-		last_extent = mlowerfs_bucket2s_extent(bucket, i);
-		last_id = i;
-		inited = 1;
 	}
-	if (print_id) {
-		MPRINT("%d[%llu, %llu]",
-		       last_id, last_extent.start,
-		       last_extent.end);
-	} else {
-		MPRINT("[%llu, %llu]",
-		       last_extent.start,
-		       last_extent.end);
+	return low;
+}
+
+/* Return the first slot in [0, count) that starts after position */
+static int _mlowerfs_bucket_upper(struct mlowerfs_bucket *bucket,
+                                  int count,
+                                  __u64 position)
+{
+	int low = 0;
+	int high = count;
+	int middle = 0;
+
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (mlowerfs_bucket2s_start(bucket, middle) <= position) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
 	}
-	MPRINT("\n");
+	return low;
+}
 
-	_MRETURN();
+/* Positions not in any extent, but covered if slot $index and $index + 1 are merged */
+static inline __u64 _mlowerfs_bucket_gap(struct mlowerfs_bucket *bucket, int index)
+{
+	return mlowerfs_bucket2s_start(bucket, index + 1) -
+	       mlowerfs_bucket2s_end(bucket, index) - 1;
 }
 
-int _mlowerfs_bucket_is_valid(struct mlowerfs_bucket *bucket)
+/* Return index of the slot followed by the smallest gap, -1 if none */
+static int _mlowerfs_bucket_min_gap(struct mlowerfs_bucket *bucket,
+                                    int count,
+                                    __u64 *min_gap)
 {
+	int selected_index = -1;
+	__u64 gap = 0;
 	int i = 0;
-	struct mtfs_interval_node_extent last_extent = {0, 0};
-	int inited = 0;
-	int ret = 0;
-	MENTRY();
 
-	for (i = 0; i < MLOWERFS_BUCKET_NUMBER; i++) {
-		if (!mlowerfs_bucket2s_used(bucket, i)) {
-			continue;
-		}
-
-		if (inited) {
-			MASSERT(mlowerfs_bucket2s_start(bucket, i) <= mlowerfs_bucket2s_end(bucket, i));
-			MASSERT(last_extent.end < mlowerfs_bucket2s_start(bucket, i));
-			last_extent = mlowerfs_bucket2s_extent(bucket, i);
-			inited = 1;
+	for (i = 0; i < count - 1; i++) {
+		gap = _mlowerfs_bucket_gap(bucket, i);
+		if (selected_index == -1 || gap < *min_gap) {
+			*min_gap = gap;
+			selected_index = i;
 		}
 	}
+	return selected_index;
+}
 
-	MRETURN(ret);
+/* Merge slot $index + 1 into slot $index */
+static void _mlowerfs_bucket_merge(struct mlowerfs_bucket *bucket,
+                                   int count,
+                                   int index)
+{
+	MASSERT(index >= 0 && index < count - 1);
+	mlowerfs_bucket2s_end(bucket, index) = mlowerfs_bucket2s_end(bucket, index + 1);
+	if (index + 2 < count) {
+		memmove(&mlowerfs_bucket2slot(bucket, index + 1),
+		        &mlowerfs_bucket2slot(bucket, index + 2),
+		        sizeof(struct mlowerfs_slot) * (count - index - 2));
+	}
+	mlowerfs_bucket2s_used(bucket, count - 1) = 0;
 }
 
-int _mlowerfs_bucket_check(struct mlowerfs_bucket *bucket, __u64 position)
+/*
+ * Pack used slots to the head and merge them until the capacity is enough.
+ * Slots are sorted even if they were not packed.
+ */
+void _mlowerfs_bucket_pack(struct mlowerfs_bucket *bucket)
 {
+	int capacity = mlowerfs_bucket2capacity(bucket);
+	int count = 0;
+	__u64 min_gap = 0;
 	int i = 0;
-	int ret = 0;
 	MENTRY();
 
 	for (i = 0; i < MLOWERFS_BUCKET_NUMBER; i++) {
@@ -87,332 +128,175 @@ int _mlowerfs_bucket_check(struct mlowerfs_bucket *bucket, __u64 position)
 			continue;
 		}
 
-		if (position > mlowerfs_bucket2s_end(bucket, i)) {
-			continue;
-		} else if (position < mlowerfs_bucket2s_start(bucket, i)) {
-			break;
-		} else {
-			ret = 1;
-			break;
+		if (i != count) {
+			mlowerfs_bucket2slot(bucket, count) = mlowerfs_bucket2slot(bucket, i);
+			mlowerfs_bucket2s_used(bucket, i) = 0;
 		}
+		count++;
 	}
 
-	MRETURN(ret);
+	while (count > capacity) {
+		i = _mlowerfs_bucket_min_gap(bucket, count, &min_gap);
+		_mlowerfs_bucket_merge(bucket, count, i);
+		count--;
+	}
+
+	_MRETURN();
 }
 
-/*
- * Shift idle seat to [0]
- * return:     -1 if failed
- *             0  else
- */
-int _mlowerfs_bucket_shift_head(struct mlowerfs_bucket *bucket)
+void _mlowerfs_bucket_dump(struct mlowerfs_bucket *bucket)
 {
 	int i = 0;
-	int ret = 0;
+	int count = _mlowerfs_bucket_count(bucket);
 	MENTRY();
 
-	for (i = 0; i < MLOWERFS_BUCKET_NUMBER; i++) {
-		if (!mlowerfs_bucket2s_used(bucket, i)) {
-			break;
-		}
-	}
-
-	if (i == MLOWERFS_BUCKET_NUMBER) {
-		ret = -1;
+	if (count == 0) {
+		MPRINT("[0, 0]\n");
 		goto out;
 	}
 
-	if (i != 0) {
-		memmove(&mlowerfs_bucket2slot(bucket, 1),
-		        &mlowerfs_bucket2slot(bucket, 0),
-		        sizeof(struct mlowerfs_slot) * i);
+	for (i = 0; i < count; i++) {
+		MPRINT("[%llu, %llu]%s",
+		       mlowerfs_bucket2s_start(bucket, i),
+		       mlowerfs_bucket2s_end(bucket, i),
+		       i == count - 1 ? "\n" : ", ");
 	}
 out:
-	MRETURN(ret);
+	_MRETURN();
 }
 
-/*
- * Shift idle seat to [MLOWERFS_BUCKET_NUMBER - 1]
- * return:     -1 if failed
- *             0  else
- */
-int _mlowerfs_bucket_shift_tail(struct mlowerfs_bucket *bucket)
+int _mlowerfs_bucket_is_valid(struct mlowerfs_bucket *bucket)
 {
 	int i = 0;
+	int count = _mlowerfs_bucket_count(bucket);
 	int ret = 0;
 	MENTRY();
 
+	MASSERT(count <= mlowerfs_bucket2capacity(bucket));
 	for (i = 0; i < MLOWERFS_BUCKET_NUMBER; i++) {
-		if (!mlowerfs_bucket2s_used(bucket, MLOWERFS_BUCKET_NUMBER - 1 - i)) {
-			break;
+		if (i >= count) {
+			MASSERT(!mlowerfs_bucket2s_used(bucket, i));
+			continue;
 		}
-	}
 
-	if (i == MLOWERFS_BUCKET_NUMBER) {
-		ret = -1;
-		goto out;
+		MASSERT(mlowerfs_bucket2s_start(bucket, i) <= mlowerfs_bucket2s_end(bucket, i));
+		if (i > 0) {
+			MASSERT(mlowerfs_bucket2s_end(bucket, i - 1) < mlowerfs_bucket2s_start(bucket, i));
+		}
 	}
 
-	if (i != 0) {
-		memmove(&mlowerfs_bucket2slot(bucket, MLOWERFS_BUCKET_NUMBER - 1 - i),
-		        &mlowerfs_bucket2slot(bucket, MLOWERFS_BUCKET_NUMBER - i),
-		        sizeof(struct mlowerfs_slot) * i);
-	}
-out:
 	MRETURN(ret);
 }
 
-/*
- * Shift idle seat for not overlaped extent
- * $head_index: -1 for add to head 
- *              MLOWERFS_BUCKET_NUMBER for adding to tail
- *              [0, MLOWERFS_BUCKET_NUMBER - 2] for middle
- */
-int _mlowerfs_bucket_shift_idle(struct mlowerfs_bucket *bucket, int head_index)
+int _mlowerfs_bucket_check(struct mlowerfs_bucket *bucket, __u64 position)
 {
-	int selected_index = -1;
+	int count = _mlowerfs_bucket_count(bucket);
 	int i = 0;
+	int ret = 0;
 	MENTRY();
 
-	if (head_index == -1) {
-		/* head */
-		if (_mlowerfs_bucket_shift_head(bucket) != 0) {
-			goto out;
-		}
-		selected_index = 0;
-	} else if (head_index == MLOWERFS_BUCKET_NUMBER) {
-		/* Tail */
-		if (_mlowerfs_bucket_shift_tail(bucket) != 0) {
-			goto out;
-		}
-		selected_index = MLOWERFS_BUCKET_NUMBER - 1;
-	} else {
-		/* Middle */
-		MASSERT(head_index >= 0);
-		MASSERT(head_index < MLOWERFS_BUCKET_NUMBER - 1);
-
-		for (i = head_index; i >= 0; i--) {
-			if (!mlowerfs_bucket2s_used(bucket, i)) {
-				break;
-			}
-		}
-		if (i >= 0) {
-			if (i < head_index) {
-				memmove(&mlowerfs_bucket2slot(bucket, i),
-			 	       &mlowerfs_bucket2slot(bucket, i + 1),
-			 	       sizeof(struct mlowerfs_slot) * (head_index - i));
-			}
-			selected_index = head_index;
-		} else {
-			/* This is the hardest condition to cover for tests */
-			for (i = head_index + 1; i < MLOWERFS_BUCKET_NUMBER; i++) {
-				if (!mlowerfs_bucket2s_used(bucket, i)) {
-					break;
-				}
-			}
-
-			if (i == MLOWERFS_BUCKET_NUMBER) {
-				goto out;
-			}
-			
-			if (i - head_index - 1 != 0) {
-				MASSERT(head_index + 2 < MLOWERFS_BUCKET_NUMBER);
-				memmove(&mlowerfs_bucket2slot(bucket, head_index + 1),
-				        &mlowerfs_bucket2slot(bucket, head_index + 2),
-				        sizeof(struct mlowerfs_slot) * (i - head_index - 1));
-			}
-			selected_index = head_index + 1;
-		}
+	i = _mlowerfs_bucket_lower(bucket, count, position);
+	if (i < count && mlowerfs_bucket2s_start(bucket, i) <= position) {
+		ret = 1;
 	}
 
-	MASSERT(selected_index >= 0);
-	MASSERT(selected_index < MLOWERFS_BUCKET_NUMBER);
-	mlowerfs_bucket2s_used(bucket, selected_index) = 0;
-
-out:
-	MRETURN(selected_index);
+	MRETURN(ret);
 }
 
+/*
+ * Add extent to bucket, merging the extents it overlaps.
+ * If no slot is idle, extents are coalesced at the smallest gap,
+ * so that the least positions are covered without being dirty.
+ */
 int _mlowerfs_bucket_add(struct mlowerfs_bucket *bucket,
                          struct mtfs_interval_node_extent *extent)
 {
+	int capacity = mlowerfs_bucket2capacity(bucket);
+	int count = _mlowerfs_bucket_count(bucket);
+	int start_index = 0;
+	int end_index = 0;
+	int merge_index = -1;
+	int merge_prev = 0;
+	int merge_next = 0;
+	__u64 min_gap = 0;
+	__u64 gap = 0;
 	int ret = 0;
-	__u64 tmp_start = 0;
-	__u64 tmp_end = 0;
-	__u64 start = 0;
-	__u64 end = 0;
-	int start_inited = 0;
-	int end_inited = 0;
-	int start_index = MLOWERFS_BUCKET_NUMBER;
-	int end_index = MLOWERFS_BUCKET_NUMBER;
-	int selected_index = -1;
-	int i = 0;	
-	__u64 min_interval = MTFS_INTERVAL_EOF;
-	__u64 tmp_interval = 0;
-	__u64 head_index = 0;
-	struct mtfs_interval_node_extent last_extent = {0, 0};
-	int last_inited = 0;
 	MENTRY();
 
 	MASSERT(extent->start <= extent->end);
-	/* Collect information */
-	for (i = 0; i < MLOWERFS_BUCKET_NUMBER; i++) {
-		if (!mlowerfs_bucket2s_used(bucket, i)) {
-			continue;
+	/* Extents in [start_index, end_index) overlap */
+	start_index = _mlowerfs_bucket_lower(bucket, count, extent->start);
+	end_index = _mlowerfs_bucket_upper(bucket, count, extent->end);
+	if (start_index < end_index) {
+		if (mlowerfs_bucket2s_start(bucket, start_index) > extent->start) {
+			mlowerfs_bucket2s_start(bucket, start_index) = extent->start;
 		}
-
-		tmp_start = mlowerfs_bucket2s_start(bucket, i);
-		tmp_end = mlowerfs_bucket2s_end(bucket, i);
-		if (start_index == MLOWERFS_BUCKET_NUMBER) {
-			if (extent->start < tmp_start) {
-				start_inited = 1;
-				start = extent->start;
-				start_index = i - 1;
-			} else if (extent->start >= tmp_start &&
-			           extent->start <= tmp_end) {
-				start_inited = 1;
-				start = tmp_start;
-				start_index = i;
-			}
-		}
-		if (start_index != MLOWERFS_BUCKET_NUMBER &&
-		    end_index == MLOWERFS_BUCKET_NUMBER) {
-			if (extent->end < tmp_start) {
-				end_inited = 1;
-				end = extent->end;
-				end_index = i - 1;
-				break;
-			} else if (extent->end >= tmp_start &&
-			           extent->end <= tmp_end) {
-				end_inited = 1;
-				end = tmp_end;
-				end_index = i;
-				break;
-			}
-		}
-	}
-
-	/* Select overlaped intervals */
-	for (i = (0 > start_index ? 0 : start_index);
-	     i < (MLOWERFS_BUCKET_NUMBER < end_index + 1 ? MLOWERFS_BUCKET_NUMBER : end_index + 1);
-	     i++) {
-		if (!mlowerfs_bucket2s_used(bucket, i)) {
-			continue;
+		if (mlowerfs_bucket2s_end(bucket, end_index - 1) > extent->end) {
+			mlowerfs_bucket2s_end(bucket, start_index) =
+				mlowerfs_bucket2s_end(bucket, end_index - 1);
+		} else {
+			mlowerfs_bucket2s_end(bucket, start_index) = extent->end;
 		}
 
-		if (extent_overlapped(extent, &mlowerfs_bucket2s_extent(bucket, i))) {
-		    	/* Overlaped */
-			mlowerfs_bucket2s_used(bucket, i) = 0;
-			if (selected_index == -1) {
-				selected_index = i;
-			}
+		if (end_index - start_index > 1) {
+			memmove(&mlowerfs_bucket2slot(bucket, start_index + 1),
+			        &mlowerfs_bucket2slot(bucket, end_index),
+			        sizeof(struct mlowerfs_slot) * (count - end_index));
+			memset(&mlowerfs_bucket2slot(bucket, count - (end_index - start_index - 1)),
+			       0,
+			       sizeof(struct mlowerfs_slot) * (end_index - start_index - 1));
 		}
-	}
-
-	if (!end_inited) {
-		end_inited = 1;
-		end = extent->end;
-	}
-
-	if (selected_index != -1) {
-		MASSERT(start_inited);
-		goto out_selected;
+		goto out;
 	}
 
 	MASSERT(start_index == end_index);
-	if (!start_inited) {
-		start_inited = 1;
-		start = extent->start;
-	}
-      
-	MASSERT(start_inited);
-	MASSERT(end_inited);
-	MASSERT(start == extent->start);
-	MASSERT(end == extent->end);
-	selected_index = _mlowerfs_bucket_shift_idle(bucket, start_index);
-	if (selected_index != -1) {
-		goto out_selected;
+	if (count < capacity) {
+		goto out_insert;
 	}
 
-	/* All intervals is used */
-	if (start_index == -1) {
-		head_index = -1;
-		min_interval = mlowerfs_bucket2s_start(bucket, 0) - extent->end;
-		end =  mlowerfs_bucket2s_end(bucket, 0);
-	}
-
-	/* Get min interval */
-	for (i = 0; i < MLOWERFS_BUCKET_NUMBER - 1; i++) {
-		if (!mlowerfs_bucket2s_used(bucket, i)) {
-			continue;
+	/* Full, coalesce at the smallest gap to make room */
+	merge_index = _mlowerfs_bucket_min_gap(bucket, count, &min_gap);
+	if (start_index > 0) {
+		gap = extent->start - mlowerfs_bucket2s_end(bucket, start_index - 1) - 1;
+		if (merge_index == -1 || gap <= min_gap) {
+			min_gap = gap;
+			merge_prev = 1;
 		}
+	}
 
-		if (last_inited) {
-			tmp_interval = mlowerfs_bucket2s_start(bucket, i) - last_extent.end;
-			MASSERT(tmp_interval > 0);
-
-			if (min_interval > tmp_interval) {
-				min_interval = tmp_interval;
-				head_index = i;
-			}
-
-			last_extent = mlowerfs_bucket2s_extent(bucket, i);
-			last_inited = 1;
+	if (start_index < count) {
+		gap = mlowerfs_bucket2s_start(bucket, start_index) - extent->end - 1;
+		if ((merge_index == -1 && !merge_prev) || gap < min_gap ||
+		    (gap == min_gap && !merge_prev)) {
+			merge_prev = 0;
+			merge_next = 1;
 		}
 	}
 
-	/* New interval can be merged to a neighbour */
-	if (start_index == -1) {
-		if (head_index == -1) {
-			/* Merge to head */
-			 mlowerfs_bucket2s_start(bucket, 0) = extent->start;
-			goto out;
-		}
-	} else if (start_index == MLOWERFS_BUCKET_NUMBER) {
-		tmp_interval = extent->start -
-		               mlowerfs_bucket2s_end(bucket, MLOWERFS_BUCKET_NUMBER - 1);
-		MASSERT(tmp_interval > 0);
-		if (min_interval > tmp_interval) {
-			/* Merge to tail */
-			 mlowerfs_bucket2s_end(bucket, MLOWERFS_BUCKET_NUMBER - 1) = extent->end;
-		}
-	} else {
-		MASSERT(start_index >= 0);
-		MASSERT(start_index < MLOWERFS_BUCKET_NUMBER - 1);
-		tmp_interval = extent->start - mlowerfs_bucket2s_end(bucket, start_index);
-		MASSERT(tmp_interval > 0);
-		if (min_interval > tmp_interval) {
-			min_interval = tmp_interval;
-				tmp_interval = mlowerfs_bucket2s_start(bucket, start_index + 1) -
-			                       extent->end;
-			MASSERT(tmp_interval > 0);
-			if (min_interval > tmp_interval) {
-				/* Merge to $start_index + 1 */
-				mlowerfs_bucket2s_start(bucket, start_index + 1) = extent->start;
-			} else {
-				/* Merge to $start_index */
-				mlowerfs_bucket2s_end(bucket, start_index) = extent->end;
-			}
-			goto out;
-		}
+	if (merge_prev) {
+		mlowerfs_bucket2s_end(bucket, start_index - 1) = extent->end;
+		goto out;
+	} else if (merge_next) {
+		mlowerfs_bucket2s_start(bucket, start_index) = extent->start;
+		goto out;
 	}
 
-	/* Merge old intervals and then insert new interval */
-	MASSERT(head_index >= 0);
-	MASSERT(head_index < MLOWERFS_BUCKET_NUMBER - 1);
-	mlowerfs_bucket2s_end(bucket, head_index) = mlowerfs_bucket2s_end(bucket, head_index + 1);
-	mlowerfs_bucket2s_used(bucket, head_index + 1) = 0;
-	selected_index = _mlowerfs_bucket_shift_idle(bucket, start_index);
-	MASSERT(selected_index != -1);
-
-out_selected:
-	MASSERT(start_inited);
-	MASSERT(end_inited);
-	MASSERT(!mlowerfs_bucket2s_used(bucket, selected_index));
-
-	mlowerfs_bucket2s_start(bucket, selected_index) = start;
-	mlowerfs_bucket2s_end(bucket, selected_index) = end;
-	mlowerfs_bucket2s_used(bucket, selected_index) = 1;
+	/* Merge old extents and then insert new extent */
+	MASSERT(merge_index >= 0);
+	_mlowerfs_bucket_merge(bucket, count, merge_index);
+	count--;
+	if (start_index > merge_index) {
+		start_index--;
+	}
+out_insert:
+	if (start_index < count) {
+		memmove(&mlowerfs_bucket2slot(bucket, start_index + 1),
+		        &mlowerfs_bucket2slot(bucket, start_index),
+		        sizeof(struct mlowerfs_slot) * (count - start_index));
+	}
+	mlowerfs_bucket2s_start(bucket, start_index) = extent->start;
+	mlowerfs_bucket2s_end(bucket, start_index) = extent->end;
+	mlowerfs_bucket2s_used(bucket, start_index) = 1;
 out:
 	MRETURN(ret);
 }
@@ -791,6 +675,10 @@ int mlowerfs_setflag_nop(struct inode *inode, __u32 mtfs_flag)
 }
 EXPORT_SYMBOL(mlowerfs_setflag_nop);
 
+static int mlowerfs_bucket_slots = MLOWERFS_BUCKET_NUMBER;
+module_param(mlowerfs_bucket_slots, int, 0644);
+MODULE_PARM_DESC(mlowerfs_bucket_slots, "Number of slots used by each bucket, at most 64");
+
 static inline void mlowerfs_bucket_lock_init(struct mlowerfs_bucket *bucket)
 {
 	init_MUTEX(mlowerfs_bucket2lock(bucket));
@@ -817,6 +705,7 @@ int mlowerfs_bucket_init(struct mlowerfs_bucket *bucket,
 	       sizeof(struct mlowerfs_disk_bucket));
 	mlowerfs_bucket_lock_init(bucket);
 	mlowerfs_bucket2type(bucket) = type;
+	bucket->mb_slot_number = mlowerfs_bucket_slots;
 
 	if (mlowerfs_bucket2type(bucket)->mbto_init) {
 		ret = mlowerfs_bucket2type(bucket)->mbto_init(bucket);
@@ -943,6 +832,8 @@ static int mlowerfs_bucket_read_xattr(struct mlowerfs_bucket *bucket)
 			}
 		}
 	} else {
+		/* Written by older versions or with more slots */
+		_mlowerfs_bucket_pack(bucket);
 		ret = 0;
 	}
 
@@ -583,8 +583,24 @@ static int mlog_print_async_rec_cb(struct mlog_handle *mlh,
 				   void *data)
 {
 	struct mlog_async_rec *mas = (struct mlog_async_rec *)rec;
+	struct mlog_async_path_rec *map = (struct mlog_async_path_rec *)rec;
+	struct mlog_async_region_rec *mar = (struct mlog_async_region_rec *)rec;
 	MENTRY();
 
+	if (rec->mrh_type == MLOG_ASYNC_PATH_MAGIC) {
+		printk("seeing record at index %d, fid: %llu, path: %.*s\n",
+		       rec->mrh_index, map->map_fid,
+		       map->map_path_len, map->map_path);
+		MRETURN(0);
+	}
+
+	if (rec->mrh_type == MLOG_ASYNC_REGION_MAGIC) {
+		printk("seeing record at index %d, fid: %llu, region: [%llu, %llu]\n",
+		       rec->mrh_index, mar->mar_fid,
+		       mar->mar_start, mar->mar_end);
+		MRETURN(0);
+	}
+
 	if (rec->mrh_type != MLOG_ASYNC_MAGIC) {
 		MERROR("invalid record in catalog\n");
 		MRETURN(-EINVAL);
@@ -602,8 +618,13 @@ static int super_mlog_init(struct super_block *sb, struct mtfs_device *device)
 	struct mtfs_lowerfs *lowerfs = NULL;
 	struct mlog_ctxt *ctxt = NULL;
 	struct mlog_handle *handle = NULL;
+	struct mtfs_run_ctxt saved;
+	struct mtfs_ucred ucred = { 0 };
 	MENTRY();
 
+	/* the owner of log file should always be root */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+
 	/*
 	 * Do not use mtfs_s2bops,
 	 * since mtfs_s2dev is inited in mtfs_init_super()
@@ -634,6 +655,17 @@ static int super_mlog_init(struct super_block *sb, struct mtfs_device *device)
 			goto out_fini;
 		}
 		mlog_init_handle(handle, MLOG_F_IS_CAT, &mlog_cat_uuid);
+		ctxt->moc_run_ctxt = &mtfs_s2bctxt(sb, bindex);
+
+		mtfs_push_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		ret = mlog_cat_reap(handle);
+		mtfs_pop_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		if (ret) {
+			/* Not fatal, left to the next mount */
+			MERROR("failed to reap logs of branch[%d], ret = %d\n",
+			       bindex, ret);
+			ret = 0;
+		}
 
 		if (0) {
 			ret = mlog_cat_process(handle,
@@ -1063,11 +1095,17 @@ static int __init mtfs_init(void)
 		goto out;
 	}
 
+	ret = mlog_spare_init();
+	if (ret) {
+		MERROR("failed to init mlog spare service, ret = %d\n", ret);
+		goto out_fini_mlock;
+	}
+
 	ret = mtfs_init_kmem_caches();
 	if (ret) {
 		MERROR("failed to allocate one or more kmem_cache objects, "
 		       "ret = %d\n", ret);
-		goto out_fini_mlock;
+		goto out_fini_mlog_spare;
 	}
 
 	ret = mtfs_insert_proc();
@@ -1097,6 +1135,8 @@ out_remove_proc:
 	mtfs_remove_proc();
 out_free_kmem:
 	mtfs_free_kmem_caches();
+out_fini_mlog_spare:
+	mlog_spare_fini();
 out_fini_mlock:
 	mlock_fini();
 out:
@@ -1110,6 +1150,7 @@ static void __exit mtfs_exit(void)
 	unregister_filesystem(&mtfs_fs_type);
 	mtfs_remove_proc();
 	mtfs_free_kmem_caches();
+	mlog_spare_fini();
 	mlock_fini();
 }
 
@@ -6,7 +6,13 @@
 #include <linux/module.h>
 #include <linux/mount.h>
 #include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
 #include <debug.h>
+#include <memory.h>
+#include <thread.h>
+#include <mtfs_list.h>
+#include <mtfs_service.h>
 #include <mtfs_record.h>
 #include "heal_internal.h"
 #include "file_internal.h"
@@ -59,20 +65,256 @@ int mrecord_add(struct mrecord_handle *handle, struct mrecord_head *head)
 	MENTRY();
 
 	MASSERT(handle->mrh_ops);
+	/* Records lost on the way show as holes of sequence */
+	head->mrh_sequence = atomic64_inc_return(&handle->mrh_prev_sequence);
 	if (handle->mrh_ops->mro_add) {
-		head->mrh_sequence = handle->mrh_prev_sequence + 1;
 		ret = handle->mrh_ops->mro_add(handle, head);
 		if (ret) {
 			MERROR("failed to add record, ret = %d\n", ret);
-			goto out;
 		}
 	}
-	handle->mrh_prev_sequence++;
-out:
 	MRETURN(ret);
 }
 EXPORT_SYMBOL(mrecord_add);
 
+/*
+ * Records are added into the per-CPU rings of the handle without any lock,
+ * and written into the file in large batches by the drain thread. When a
+ * ring is full, records are dropped and counted rather than waited for.
+ */
+static int mrecord_ring_size = 256 << 10;
+module_param(mrecord_ring_size, int, 0444);
+MODULE_PARM_DESC(mrecord_ring_size, "bytes of the record ring of each CPU");
+
+static int mrecord_drain_interval = 1;
+module_param(mrecord_drain_interval, int, 0444);
+MODULE_PARM_DESC(mrecord_drain_interval, "max seconds records wait in rings");
+
+#define MRECORD_BATCH_SIZE (1 << 20)
+
+static inline unsigned long mrecord_ring_used(struct mrecord_ring *ring)
+{
+	return ACCESS_ONCE(ring->mrr_head) - ACCESS_ONCE(ring->mrr_tail);
+}
+
+/* Tail moved by the mmap reader, clamped between the last tail and head */
+static inline __u64 mrecord_ring_reader_tail(struct mrecord_ring *ring)
+{
+	__u64 tail = ACCESS_ONCE(ring->mrr_tail);
+	__u64 head = ACCESS_ONCE(ring->mrr_head);
+	__u64 reader_tail = ACCESS_ONCE(ring->mrr_header->mrrh_tail);
+
+	if ((__s64)(reader_tail - tail) < 0) {
+		return tail;
+	} else if (reader_tail - tail > head - tail) {
+		return head;
+	}
+	return reader_tail;
+}
+
+static void mrecord_file_rings_free(struct mrecord_file_info *mrh_file)
+{
+	struct mrecord_ring *ring = NULL;
+	int cpu = 0;
+
+	if (mrh_file->mrfi_rings == NULL) {
+		return;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(mrh_file->mrfi_rings, cpu);
+		if (ring->mrr_header == NULL) {
+			continue;
+		}
+		MTFS_VFREE(ring->mrr_header, ring->mrr_area_size);
+	}
+	free_percpu(mrh_file->mrfi_rings);
+	mrh_file->mrfi_rings = NULL;
+}
+
+/*
+ * Header and data of a ring are in one area, so they are mapped together.
+ * Rings are per-CPU data, so that only possible CPUs take memory.
+ */
+static int mrecord_file_rings_alloc(struct mrecord_file_info *mrh_file)
+{
+	struct mrecord_ring *ring = NULL;
+	int cpu = 0;
+	int ret = 0;
+	MENTRY();
+
+	MASSERT(sizeof(struct mrecord_ring_header) <= PAGE_SIZE);
+	mrh_file->mrfi_ring_size =
+		roundup_pow_of_two(max_t(int, mrecord_ring_size, PAGE_SIZE));
+	/* Zeroed, so that a failure frees the rings allocated */
+	mrh_file->mrfi_rings = alloc_percpu(struct mrecord_ring);
+	if (mrh_file->mrfi_rings == NULL) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(mrh_file->mrfi_rings, cpu);
+		ring->mrr_area_size = PAGE_SIZE + mrh_file->mrfi_ring_size;
+		MTFS_VMALLOC_USER(ring->mrr_header, ring->mrr_area_size);
+		if (ring->mrr_header == NULL) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		ring->mrr_header->mrrh_size = mrh_file->mrfi_ring_size;
+		ring->mrr_header->mrrh_offset = PAGE_SIZE;
+		ring->mrr_header->mrrh_cpu = cpu;
+		ring->mrr_buf = (char *)ring->mrr_header + PAGE_SIZE;
+	}
+	goto out;
+out_free:
+	MERROR("not enough memory\n");
+	mrecord_file_rings_free(mrh_file);
+out:
+	MRETURN(ret);
+}
+
+static int mrecord_file_write(struct mrecord_file_info *mrh_file,
+                              char *buf, size_t count)
+{
+	ssize_t size = 0;
+	int ret = 0;
+	MENTRY();
+
+	down_write(&mrh_file->mrfi_rwsem);
+	size = _do_read_write(WRITE, mrh_file->mrfi_filp,
+	                      buf, count,
+	                      &mrh_file->mrfi_filp->f_pos);
+	up_write(&mrh_file->mrfi_rwsem);
+	if (size != count) {
+		ret = size < 0 ? size : -EIO;
+		MERROR("failed to write %zu bytes of records, ret = %d\n",
+		       count, ret);
+	}
+	MRETURN(ret);
+}
+
+static int mrecord_file_drain_locked(struct mrecord_handle *handle)
+{
+	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
+	unsigned int ring_size = mrh_file->mrfi_ring_size;
+	struct mrecord_ring_header *header = NULL;
+	struct mrecord_ring *ring = NULL;
+	unsigned long dropped = 0;
+	__u64 head = 0;
+	__u64 tail = 0;
+	size_t batched = 0;
+	size_t length = 0;
+	int cpu = 0;
+	int ret = 0;
+	int rc = 0;
+	MENTRY();
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(mrh_file->mrfi_rings, cpu);
+		header = ring->mrr_header;
+		tail = ring->mrr_tail;
+		head = ACCESS_ONCE(ring->mrr_head);
+		/* Read the records after seeing the head */
+		smp_rmb();
+		while (tail != head) {
+			length = min_t(size_t, head - tail,
+			               ring_size - (tail & (ring_size - 1)));
+			length = min_t(size_t, length,
+			               mrh_file->mrfi_batch_size - batched);
+			memcpy(mrh_file->mrfi_batch + batched,
+			       ring->mrr_buf + (tail & (ring_size - 1)),
+			       length);
+			batched += length;
+			tail += length;
+			if (batched == mrh_file->mrfi_batch_size) {
+				rc = mrecord_file_write(mrh_file,
+				                        mrh_file->mrfi_batch,
+				                        batched);
+				if (rc && ret == 0) {
+					ret = rc;
+				}
+				batched = 0;
+			}
+		}
+		/* Finish reading the records before freeing their space */
+		smp_mb();
+		ring->mrr_tail = tail;
+		header->mrrh_tail = tail;
+		dropped += ACCESS_ONCE(ring->mrr_dropped);
+	}
+
+	if (batched > 0) {
+		rc = mrecord_file_write(mrh_file, mrh_file->mrfi_batch, batched);
+		if (rc && ret == 0) {
+			ret = rc;
+		}
+	}
+
+	if (dropped != mrh_file->mrfi_dropped) {
+		MWARN("%lu records of [%s] dropped because rings are full, "
+		      "%lu in total\n", dropped - mrh_file->mrfi_dropped,
+		      mrh_file->mrfi_fname, dropped);
+		mrh_file->mrfi_dropped = dropped;
+	}
+	MRETURN(ret);
+}
+
+/* Rings being exported are left to the mmap reader */
+static int mrecord_file_drain(struct mrecord_handle *handle)
+{
+	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
+	int ret = 0;
+	MENTRY();
+
+	mutex_lock(&mrh_file->mrfi_drain_mutex);
+	if (!mrh_file->mrfi_exported) {
+		ret = mrecord_file_drain_locked(handle);
+	}
+	mutex_unlock(&mrh_file->mrfi_drain_mutex);
+	MRETURN(ret);
+}
+
+static int mrecord_drain_busy(struct mtfs_service *service,
+                              struct mservice_thread *thread)
+{
+	struct mrecord_handle *handle = (struct mrecord_handle *)service->srv_data;
+	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
+	int cpu = 0;
+
+	if (ACCESS_ONCE(mrh_file->mrfi_exported)) {
+		return 0;
+	}
+
+	for_each_possible_cpu(cpu) {
+		if (mrecord_ring_used(per_cpu_ptr(mrh_file->mrfi_rings, cpu)) >=
+		    mrh_file->mrfi_ring_size / 2) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int mrecord_drain_main(struct mtfs_service *service,
+                              struct mservice_thread *thread)
+{
+	struct mrecord_handle *handle = (struct mrecord_handle *)service->srv_data;
+	int ret = 0;
+	MENTRY();
+
+	/* Wakes up when a ring is half full, or after the interval */
+	while (1) {
+		if (mservice_wait_event(service, thread)) {
+			break;
+		}
+
+		mrecord_file_drain(handle);
+	}
+	MRETURN(ret);
+}
+
+#define MRECORD_DRAIN_SERVICE_NAME "mrecord_drain"
+
 static int mrecord_file_init(struct mrecord_handle *handle)
 {
 	int ret = 0;
@@ -110,7 +352,42 @@ static int mrecord_file_init(struct mrecord_handle *handle)
 	}
 
 	init_rwsem(&mrh_file->mrfi_rwsem);
+	mutex_init(&mrh_file->mrfi_drain_mutex);
+	mrh_file->mrfi_exported = 0;
+	mrh_file->mrfi_dropped = 0;
+
+	ret = mrecord_file_rings_alloc(mrh_file);
+	if (ret) {
+		goto out_fput;
+	}
+
+	mrh_file->mrfi_batch_size = MRECORD_BATCH_SIZE;
+	MTFS_VMALLOC(mrh_file->mrfi_batch, mrh_file->mrfi_batch_size);
+	if (mrh_file->mrfi_batch == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_free_rings;
+	}
+
+	mrh_file->mrfi_service = mservice_init(MRECORD_DRAIN_SERVICE_NAME,
+	                                       MRECORD_DRAIN_SERVICE_NAME,
+	                                       1, 1,
+	                                       max(mrecord_drain_interval, 1),
+	                                       0, mrecord_drain_main,
+	                                       mrecord_drain_busy,
+	                                       handle);
+	if (mrh_file->mrfi_service == NULL) {
+		MERROR("failed to init service of draining records\n");
+		ret = -EINVAL;
+		goto out_free_batch;
+	}
 	goto out;
+out_free_batch:
+	MTFS_VFREE(mrh_file->mrfi_batch, mrh_file->mrfi_batch_size);
+out_free_rings:
+	mrecord_file_rings_free(mrh_file);
+out_fput:
+	fput(mrh_file->mrfi_filp);
 out_dput:
 	dput(mrh_file->mrfi_dchild);
 out:
@@ -121,15 +398,55 @@ static int mrecord_file_add(struct mrecord_handle *handle, struct mrecord_head *
 {
 	int ret = 0;
 	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
-	ssize_t size = 0;
+	unsigned int ring_size = mrh_file->mrfi_ring_size;
+	unsigned int length = head->mrh_len;
+	struct mrecord_ring_header *header = NULL;
+	struct mrecord_ring *ring = NULL;
+	unsigned long used = 0;
+	__u64 tail = 0;
+	unsigned int offset = 0;
+	unsigned int first = 0;
 	MENTRY();
 
-	MASSERT(mrh_file->mrfi_filp);
-	down_write(&mrh_file->mrfi_rwsem);
-	size = _do_read_write(WRITE, mrh_file->mrfi_filp,
-	                      (void *)head, head->mrh_len,
-	                      &mrh_file->mrfi_filp->f_pos);
-	up_write(&mrh_file->mrfi_rwsem);
+	if (unlikely(length > ring_size / 2)) {
+		MERROR("record of %u bytes is too large\n", length);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ring = per_cpu_ptr(mrh_file->mrfi_rings, get_cpu());
+	header = ring->mrr_header;
+	if (ACCESS_ONCE(mrh_file->mrfi_exported)) {
+		tail = mrecord_ring_reader_tail(ring);
+	} else {
+		tail = ACCESS_ONCE(ring->mrr_tail);
+	}
+	used = ring->mrr_head - tail;
+	if (used + length > ring_size) {
+		ring->mrr_dropped++;
+		header->mrrh_dropped = ring->mrr_dropped;
+		put_cpu();
+		goto out;
+	}
+	/* See the tail before overwriting the space it freed */
+	smp_mb();
+
+	offset = ring->mrr_head & (ring_size - 1);
+	first = min(length, ring_size - offset);
+	memcpy(ring->mrr_buf + offset, head, first);
+	if (first < length) {
+		memcpy(ring->mrr_buf, (char *)head + first, length - first);
+	}
+	/* Copy the record before publishing the head */
+	smp_wmb();
+	ring->mrr_head += length;
+	header->mrrh_head = ring->mrr_head;
+	put_cpu();
+
+	if (used < ring_size / 2 && used + length >= ring_size / 2) {
+		wake_up(&mrh_file->mrfi_service->srv_waitq);
+	}
+out:
 	MRETURN(ret);
 }
 
@@ -141,6 +458,14 @@ static int mrecord_file_fini(struct mrecord_handle *handle)
 
 	MASSERT(mrh_file->mrfi_filp);
 	MASSERT(mrh_file->mrfi_dchild);
+	mservice_fini(mrh_file->mrfi_service);
+	MASSERT(!mrh_file->mrfi_exported);
+	ret = mrecord_file_drain(handle);
+	if (ret) {
+		MERROR("failed to drain records, ret = %d\n", ret);
+	}
+	MTFS_VFREE(mrh_file->mrfi_batch, mrh_file->mrfi_batch_size);
+	mrecord_file_rings_free(mrh_file);
 	fput(mrh_file->mrfi_filp);
 	dput(mrh_file->mrfi_dchild);
 	MRETURN(ret);
@@ -161,12 +486,192 @@ static int mrecord_file_cleanup(struct mrecord_handle *handle)
 	MASSERT(S_ISREG(inode->i_mode));
 	newattrs.ia_size = 0;
 	newattrs.ia_valid = ATTR_SIZE;
+	down_write(&mrh_file->mrfi_rwsem);
 	mutex_lock(&inode->i_mutex);
 	ret = notify_change(mrh_file->mrfi_dchild, &newattrs);
 	mutex_unlock(&inode->i_mutex);
+	mrh_file->mrfi_filp->f_pos = 0;
+	up_write(&mrh_file->mrfi_rwsem);
 	MRETURN(ret);
 }
 
+/* Records dropped because rings of the handle are full */
+unsigned long mrecord_dropped(struct mrecord_handle *handle)
+{
+	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
+	struct mrecord_ring *ring = NULL;
+	unsigned long dropped = 0;
+	int cpu = 0;
+	MENTRY();
+
+	if (handle->mrh_ops != &mrecord_file_ops) {
+		goto out;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(mrh_file->mrfi_rings, cpu);
+		dropped += ACCESS_ONCE(ring->mrr_dropped);
+	}
+out:
+	MRETURN(dropped);
+}
+EXPORT_SYMBOL(mrecord_dropped);
+
+/*
+ * Hand the rings over to a mmap reader. Records added before are
+ * written into the file first, so that the file and the stream of the
+ * reader join without a gap. Only one reader at a time.
+ */
+int mrecord_export_start(struct mrecord_handle *handle)
+{
+	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
+	int ret = 0;
+	MENTRY();
+
+	if (handle->mrh_ops != &mrecord_file_ops) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	mutex_lock(&mrh_file->mrfi_drain_mutex);
+	if (mrh_file->mrfi_exported) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+
+	ret = mrecord_file_drain_locked(handle);
+	if (ret) {
+		MERROR("failed to drain records, ret = %d\n", ret);
+		goto out_unlock;
+	}
+	mrh_file->mrfi_exported = 1;
+out_unlock:
+	mutex_unlock(&mrh_file->mrfi_drain_mutex);
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mrecord_export_start);
+
+/* Records left by the reader go to the file again */
+void mrecord_export_stop(struct mrecord_handle *handle)
+{
+	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
+	struct mrecord_ring *ring = NULL;
+	__u64 tail = 0;
+	int cpu = 0;
+	MENTRY();
+
+	mutex_lock(&mrh_file->mrfi_drain_mutex);
+	MASSERT(mrh_file->mrfi_exported);
+	/* The reader might have left a broken tail */
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(mrh_file->mrfi_rings, cpu);
+		tail = mrecord_ring_reader_tail(ring);
+		if (tail != ACCESS_ONCE(ring->mrr_header->mrrh_tail)) {
+			MERROR("reset broken tail %llu of ring %d to %llu, "
+			       "head = %llu\n",
+			       (unsigned long long)ring->mrr_header->mrrh_tail,
+			       cpu, (unsigned long long)tail,
+			       (unsigned long long)ACCESS_ONCE(ring->mrr_head));
+		}
+		ring->mrr_tail = tail;
+		ring->mrr_header->mrrh_tail = tail;
+	}
+	mrh_file->mrfi_exported = 0;
+	mutex_unlock(&mrh_file->mrfi_drain_mutex);
+	wake_up(&mrh_file->mrfi_service->srv_waitq);
+	_MRETURN();
+}
+EXPORT_SYMBOL(mrecord_export_stop);
+
+/*
+ * The ring of CPU N is mapped at offset N * (PAGE_SIZE + ring size),
+ * where the ring size is shown in the "trace/stats" proc file. Only
+ * the header page may be mapped writable, for moving the tail.
+ */
+int mrecord_export_mmap(struct mrecord_handle *handle,
+                        struct vm_area_struct *vma)
+{
+	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
+	unsigned long area_pages = (PAGE_SIZE + mrh_file->mrfi_ring_size) >> PAGE_SHIFT;
+	unsigned long cpu = vma->vm_pgoff / area_pages;
+	unsigned long page = vma->vm_pgoff % area_pages;
+	unsigned long pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+	int ret = 0;
+	MENTRY();
+
+	if (page + pages > area_pages ||
+	    cpu >= nr_cpu_ids || !cpu_possible(cpu)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (page + pages > 1) {
+		if (vma->vm_flags & VM_WRITE) {
+			ret = -EPERM;
+			goto out;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	vma->vm_pgoff = 0;
+	ret = remap_vmalloc_range(vma, per_cpu_ptr(mrh_file->mrfi_rings, cpu)->mrr_header, page);
+	if (ret) {
+		MERROR("failed to map ring of CPU %lu, ret = %d\n", cpu, ret);
+	}
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(mrecord_export_mmap);
+
+/* Print the layout and state of the rings, for readers and admins */
+int mrecord_export_stats(struct mrecord_handle *handle, char *buf, int size)
+{
+	struct mrecord_file_info *mrh_file = &handle->u.mrh_file;
+	struct mrecord_ring *ring = NULL;
+	int exported = 0;
+	__u64 head = 0;
+	__u64 tail = 0;
+	int length = 0;
+	int cpu = 0;
+	MENTRY();
+
+	if (handle->mrh_ops != &mrecord_file_ops) {
+		goto out;
+	}
+
+	exported = ACCESS_ONCE(mrh_file->mrfi_exported);
+	length += snprintf(buf + length, size - length,
+	                   "ring_size: %u\n"
+	                   "area_size: %lu\n"
+	                   "exported: %d\n",
+	                   mrh_file->mrfi_ring_size,
+	                   PAGE_SIZE + mrh_file->mrfi_ring_size,
+	                   exported);
+	for_each_possible_cpu(cpu) {
+		if (length >= size) {
+			break;
+		}
+		ring = per_cpu_ptr(mrh_file->mrfi_rings, cpu);
+		head = ACCESS_ONCE(ring->mrr_head);
+		tail = exported ? mrecord_ring_reader_tail(ring) :
+		                  ACCESS_ONCE(ring->mrr_tail);
+		length += snprintf(buf + length, size - length,
+		                   "cpu%d: head %llu tail %llu lag %llu "
+		                   "dropped %llu\n", cpu,
+		                   (unsigned long long)head,
+		                   (unsigned long long)tail,
+		                   (unsigned long long)(head - tail),
+		                   (unsigned long long)ACCESS_ONCE(ring->mrr_dropped));
+	}
+	if (length > size) {
+		length = size;
+	}
+out:
+	MRETURN(length);
+}
+EXPORT_SYMBOL(mrecord_export_stats);
+
 struct mrecord_operations mrecord_file_ops = {
 	mro_init:    mrecord_file_init,
 	mro_add:     mrecord_file_add,
@@ -6,6 +6,10 @@
  * For both kernel and userspace use
  * DO NOT use anything special that opposes this purpose
  */
+#if defined (__linux__) && defined(__KERNEL__)
+#include <linux/module.h>
+#endif /* defined (__linux__) && defined(__KERNEL__) */
+#include <compat.h>
 #include <debug.h>
 #include <mtfs_string.h>
 #include <mtfs_queue.h>
@@ -188,6 +192,7 @@ free_all:
 out:
 	return ret;
 }
+EXPORT_SYMBOL(rule_tree_destruct);
 
 /*
  * Function: rule_tree_t *__rule_tree_construct(rule_t *rule_array, unsigned int rule_number)
@@ -378,6 +383,48 @@ raid_type_t rule_tree_search(rule_tree_t *root, const char *string)
 	return rule;
 }
 
+/*
+ * Function: raid_type_t rule_tree_search_prefix(rule_tree_t *root, const char *string)
+ * Purpose : Search a rule_tree constructed by rule_tree_construct_prefix()
+ * Params  : root - root of a rule_tree
+ *	     string - string to be searched
+ * Returns : rule of the longest prefix matched, RAID_TYPE_NONE if not matched
+ */
+raid_type_t rule_tree_search_prefix(rule_tree_t *root, const char *string)
+{
+	rule_tree_t *tmp_root = NULL;
+	raid_type_t rule = RAID_TYPE_NONE;
+	const char *ptr = NULL;
+	const char *tmp_string = string;
+
+	MASSERT(root != NULL);
+	MASSERT(string != NULL);
+
+	tmp_root = root;
+	while (tmp_root) {
+		if (tmp_root->rule != RAID_TYPE_NONE) {
+			rule = tmp_root->rule;
+		}
+
+		if (*tmp_string == '\0' || tmp_root->list_length == 0) {
+			break;
+		}
+
+		MASSERT(tmp_root->list != NULL);
+		MASSERT(tmp_root->key_list != NULL);
+		ptr = bsearch(tmp_string, tmp_root->key_list, tmp_root->list_length,
+		              sizeof(char), compare_char_pointer);
+		if (ptr == NULL) {
+			break;
+		}
+		tmp_root = tmp_root->list[ptr - tmp_root->key_list];
+		tmp_string++;
+	}
+
+	return rule;
+}
+EXPORT_SYMBOL(rule_tree_search_prefix);
+
 /*
  * Function: const rule_t *have_equal_string(const rule_t *rule_array, unsigned int str_num)
  * Purpose : find equal string in a sorted string array
@@ -403,13 +450,15 @@ static inline int compare_rule_pointer(const void *p1, const void *p2)
 }
 
 /*
- * Function: rule_tree_t *rule_tree_construct(rule_t *rule_array, unsigned int rule_number)
+ * Function: rule_tree_t *_rule_tree_construct(rule_t *rule_array, unsigned int rule_number, int reverse)
  * Purpose : Construct a rule_tree
  * Params  : rule_array - array of rule
  *	     rule_number  - rule number
+ *	     reverse  - whether to match from the end of strings
  * Returns : root of tree constructed
  */
-rule_tree_t *rule_tree_construct(rule_t *rule_array, unsigned int rule_number)
+static rule_tree_t *_rule_tree_construct(rule_t *rule_array, unsigned int rule_number,
+                                         int reverse)
 {
 	int ret = 0;
 	rule_tree_t *root = NULL;
@@ -427,7 +476,9 @@ rule_tree_t *rule_tree_construct(rule_t *rule_array, unsigned int rule_number)
 			ret = -EINVAL;
 			goto out;
 		}
-		reverse_string(rule_array[i].string);
+		if (reverse) {
+			reverse_string(rule_array[i].string);
+		}
 	}
 
 	/* step2: sort */
@@ -458,3 +509,28 @@ out:
 	}
 	return root;
 }
+
+/*
+ * Function: rule_tree_t *rule_tree_construct(rule_t *rule_array, unsigned int rule_number)
+ * Purpose : Construct a rule_tree that matches suffixes
+ * Params  : rule_array - array of rule
+ *	     rule_number  - rule number
+ * Returns : root of tree constructed
+ */
+rule_tree_t *rule_tree_construct(rule_t *rule_array, unsigned int rule_number)
+{
+	return _rule_tree_construct(rule_array, rule_number, 1);
+}
+
+/*
+ * Function: rule_tree_t *rule_tree_construct_prefix(rule_t *rule_array, unsigned int rule_number)
+ * Purpose : Construct a rule_tree that matches prefixes
+ * Params  : rule_array - array of rule
+ *	     rule_number  - rule number
+ * Returns : root of tree constructed
+ */
+rule_tree_t *rule_tree_construct_prefix(rule_t *rule_array, unsigned int rule_number)
+{
+	return _rule_tree_construct(rule_array, rule_number, 0);
+}
+EXPORT_SYMBOL(rule_tree_construct_prefix);
@@ -10,6 +10,9 @@
 #include "async_bucket_internal.h"
 #include "async_info_internal.h"
 #include "async_extent_internal.h"
+#include "async_recover_internal.h"
+#include "async_bloom_internal.h"
+#include "async_cache_internal.h"
 
 static int _masync_shrink(int nr_to_scan, unsigned int gfp_mask);
 int masync_super_init(struct super_block *sb)
@@ -25,6 +28,12 @@ int masync_super_init(struct super_block *sb)
 	}
 
 	mtfs_s2subinfo(sb) = (void *)info;
+
+	/* Recovery rebuilds the filter if not loaded */
+	masync_bloom_init(info, sb);
+
+	/* Files are still accessable even if failed to recover */
+	masync_recover_init(sb, info);
 out:
 	MRETURN(ret);
 }
@@ -36,6 +45,8 @@ int masync_super_fini(struct super_block *sb)
 	MENTRY();
 
 	info = (struct msubject_async_info *)mtfs_s2subinfo(sb);
+	masync_recover_fini(info);
+	masync_bloom_fini(info, sb);
 	masync_info_fini(info, sb, 0);
 
 	MRETURN(ret);
@@ -79,6 +90,30 @@ struct mtfs_subject_operations masync_subject_ops = {
 };
 EXPORT_SYMBOL(masync_subject_ops);
 
+/* Branch 0 caches the recently used files of branch 1 */
+int masync_cache_super_init(struct super_block *sb)
+{
+	int ret = 0;
+	struct msubject_async_info *info = NULL;
+	MENTRY();
+
+	ret = masync_super_init(sb);
+	info = (struct msubject_async_info *)mtfs_s2subinfo(sb);
+	if (info) {
+		masync_cache_enable(info);
+	}
+
+	MRETURN(ret);
+}
+
+struct mtfs_subject_operations masync_cache_subject_ops = {
+	mso_super_init:                 masync_cache_super_init,
+	mso_super_fini:                 masync_super_fini,
+	mso_inode_init:                 masync_inode_init,
+	mso_inode_fini:                 masync_inode_fini,
+};
+EXPORT_SYMBOL(masync_cache_subject_ops);
+
 struct msubject_async the_async;
 
 void masync_service_wakeup(void)
@@ -98,6 +133,9 @@ int masync_service_busy(struct mtfs_service *service, struct mservice_thread *th
 	mtfs_spin_lock(&async->msa_cancel_lock);
 	ret = !mtfs_list_empty(&async->msa_cancel_extents);
 	mtfs_spin_unlock(&async->msa_cancel_lock);
+	if (!ret) {
+		ret = masync_cache_wanted();
+	}
 	MRETURN(ret);
 }
 
@@ -144,6 +182,7 @@ int masync_service_main(struct mtfs_service *service, struct mservice_thread *th
 				}
 				nr_to_scan = _masync_shrink(nr_to_scan, __GFP_FS);
 			}
+			masync_cache_shrink();
 			continue;
 		}
 #endif
@@ -155,13 +194,14 @@ int masync_service_main(struct mtfs_service *service, struct mservice_thread *th
 
 		/* If not in tree, masync_extent_flush() will skip it */
 		retry = masync_extent_flush(async_extent, buf, buf_size);
-		if (retry) {
+		if (retry == MASYNC_FLUSH_RETRY || retry == MASYNC_FLUSH_AGAIN) {
 			mtfs_spin_lock(&async->msa_cancel_lock);
 			mtfs_list_add_tail(&async_extent->mae_cancel_linkage, &async->msa_cancel_extents);
 			mtfs_spin_unlock(&async->msa_cancel_lock);
-		} else {
+		} else if (retry == MASYNC_FLUSH_DONE) {
 			masync_extent_put(async_extent);
 		}
+		/* Parked extent keeps its reference until requeued */
 	}
 
 	MTFS_FREE(buf, buf_size);
@@ -257,6 +297,7 @@ static int __init masync_init(void)
 	MTFS_INIT_LIST_HEAD(&the_async.msa_infos);
 	mtfs_spin_lock_init(&the_async.msa_info_lock);
 	atomic_set(&the_async.msa_info_number, 0);
+	atomic_set(&the_async.msa_cache_wanted, 0);
 	the_async.msa_service = mservice_init(MSLEFHEAL_SERVICE_NAME,
 	                                      MSLEFHEAL_SERVICE_NAME,
 	                                      1, 1, 1,
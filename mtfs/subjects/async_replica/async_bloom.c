@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <linux/module.h>
+#include <linux/mount.h>
+#include <mtfs_inode.h>
+#include <mtfs_super.h>
+#include <mtfs_device.h>
+#include <mtfs_dentry.h>
+#include <mtfs_file.h>
+#include <mtfs_lowerfs.h>
+#include <mtfs_checksum.h>
+#include <mtfs_context.h>
+#include "async_bloom_internal.h"
+
+/*
+ * Bloom filter of fids that may be dirty.
+ *
+ * A fid is added when its file becomes dirty and its intent records are
+ * about to be logged, and deleted when the records are canceled. Files that
+ * fail to be recovered or are evicted with unsynced extents keep their
+ * records, so the fids stay in the filter. The filter is saved next to the
+ * catalog when umounting and loaded when mounting. The saved file is then
+ * invalidated so that a crash before the next umount makes recovery rebuild
+ * the filter from the records. A file not in the filter is definitely clean.
+ */
+
+static int masync_bloom_bits = 16;
+module_param(masync_bloom_bits, int, 0444);
+MODULE_PARM_DESC(masync_bloom_bits, "Log2 of counters in the filter of dirty files");
+
+static int masync_bloom_hashes = 4;
+module_param(masync_bloom_hashes, int, 0444);
+MODULE_PARM_DESC(masync_bloom_hashes, "Number of hashes of each file in the filter of dirty files");
+
+static struct file *masync_bloom_open(struct super_block *sb,
+                                      mtfs_bindex_t bindex)
+{
+	struct dentry *dchild = NULL;
+	struct file *file = NULL;
+	MENTRY();
+
+	dchild = mtfs_dchild_create(mtfs_s2bdlog(sb, bindex),
+	                            MASYNC_BLOOM_NAME,
+	                            strlen(MASYNC_BLOOM_NAME),
+	                            S_IFREG | S_IRWXU, 0, NULL, 0);
+	if (IS_ERR(dchild)) {
+		MERROR("failed to create [%s] of branch[%d], ret = %ld\n",
+		       MASYNC_BLOOM_NAME, bindex, PTR_ERR(dchild));
+		file = (struct file *)dchild;
+		goto out;
+	}
+
+	file = mtfs_dentry_open(dchild,
+	                        mntget(mtfs_s2blogctxt(sb, bindex)->moc_mnt),
+	                        O_RDWR | O_LARGEFILE,
+	                        current_cred());
+	if (IS_ERR(file)) {
+		MERROR("failed to open [%s] of branch[%d], ret = %ld\n",
+		       MASYNC_BLOOM_NAME, bindex, PTR_ERR(file));
+	}
+out:
+	MRETURN(file);
+}
+
+static __u32 masync_bloom_checksum(struct mtfs_bloom *bloom)
+{
+	__u32 checksum = mchecksum_init(MCHECKSUM_CRC32);
+
+	return mchecksum_compute(checksum, bloom->mbl_counters,
+	                         mtfs_bloom_size(bloom), MCHECKSUM_CRC32);
+}
+
+/*
+ * Load the saved filter and invalidate the file.
+ * Return 1 if loaded, 0 if not saved or not valid.
+ */
+static int masync_bloom_load(struct msubject_async_info *info,
+                             struct super_block *sb,
+                             struct file *file)
+{
+	mtfs_bindex_t bindex = info->msai_bloom_bindex;
+	struct mtfs_lowerfs *lowerfs = mtfs_s2blowerfs(sb, bindex);
+	struct mtfs_bloom *bloom = &info->msai_bloom;
+	struct masync_bloom_hdr hdr;
+	loff_t off = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (i_size_read(file->f_dentry->d_inode) <
+	    sizeof(hdr) + mtfs_bloom_size(bloom)) {
+		goto out;
+	}
+
+	ret = mlowerfs_read_record(lowerfs, file, &hdr, sizeof(hdr), &off);
+	if (ret) {
+		MERROR("failed to read header of saved filter, ret = %d\n", ret);
+		goto out;
+	}
+
+	if (hdr.mbh_magic != MASYNC_BLOOM_MAGIC) {
+		/* Not umounted cleanly last time */
+		goto out;
+	}
+
+	if (hdr.mbh_bindex != bindex ||
+	    hdr.mbh_bits != bloom->mbl_bits ||
+	    hdr.mbh_hashes != bloom->mbl_hashes) {
+		MPRINT("saved filter of dirty files does not match, "
+		       "bindex = %u, bits = %u, hashes = %u, rebuilding\n",
+		       hdr.mbh_bindex, hdr.mbh_bits, hdr.mbh_hashes);
+		goto out_invalidate;
+	}
+
+	ret = mlowerfs_read_record(lowerfs, file, bloom->mbl_counters,
+	                           mtfs_bloom_size(bloom), &off);
+	if (ret) {
+		MERROR("failed to read saved filter, ret = %d\n", ret);
+		goto out_clear;
+	}
+
+	if (masync_bloom_checksum(bloom) != hdr.mbh_checksum) {
+		MERROR("saved filter of dirty files is corrupted, rebuilding\n");
+		goto out_clear;
+	}
+	bloom->mbl_keys = hdr.mbh_keys;
+	info->msai_bloom_loaded = 1;
+	goto out_invalidate;
+out_clear:
+	memset(bloom->mbl_counters, 0, mtfs_bloom_size(bloom));
+out_invalidate:
+	memset(&hdr, 0, sizeof(hdr));
+	off = 0;
+	ret = mlowerfs_write_record(lowerfs, file, &hdr, sizeof(hdr), &off, 1);
+	if (ret) {
+		/* A stale filter should never be loaded after crash */
+		MERROR("failed to invalidate saved filter, ret = %d\n", ret);
+		memset(bloom->mbl_counters, 0, mtfs_bloom_size(bloom));
+		bloom->mbl_keys = 0;
+		info->msai_bloom_loaded = 0;
+	}
+out:
+	MRETURN(info->msai_bloom_loaded);
+}
+
+static int masync_bloom_save(struct msubject_async_info *info,
+                             struct super_block *sb,
+                             struct file *file)
+{
+	mtfs_bindex_t bindex = info->msai_bloom_bindex;
+	struct mtfs_lowerfs *lowerfs = mtfs_s2blowerfs(sb, bindex);
+	struct mtfs_bloom *bloom = &info->msai_bloom;
+	struct masync_bloom_hdr hdr;
+	loff_t off = sizeof(hdr);
+	int ret = 0;
+	MENTRY();
+
+	/* Header is still invalid until counters are written */
+	ret = mlowerfs_write_record(lowerfs, file, bloom->mbl_counters,
+	                            mtfs_bloom_size(bloom), &off, 1);
+	if (ret) {
+		MERROR("failed to write filter, ret = %d\n", ret);
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mbh_magic = MASYNC_BLOOM_MAGIC;
+	hdr.mbh_bindex = bindex;
+	hdr.mbh_bits = bloom->mbl_bits;
+	hdr.mbh_hashes = bloom->mbl_hashes;
+	hdr.mbh_keys = bloom->mbl_keys;
+	hdr.mbh_checksum = masync_bloom_checksum(bloom);
+	off = 0;
+	ret = mlowerfs_write_record(lowerfs, file, &hdr, sizeof(hdr), &off, 1);
+	if (ret) {
+		MERROR("failed to write header of filter, ret = %d\n", ret);
+	}
+out:
+	MRETURN(ret);
+}
+
+int masync_bloom_init(struct msubject_async_info *info,
+                      struct super_block *sb)
+{
+	struct mtfs_device *device = mtfs_s2dev(sb);
+	struct mtfs_lowerfs *lowerfs = NULL;
+	struct mtfs_run_ctxt saved;
+	struct mtfs_ucred ucred = { 0 };
+	struct file *file = NULL;
+	mtfs_bindex_t bindex = 0;
+	int ret = 0;
+	MENTRY();
+
+	info->msai_bloom_bindex = -1;
+	info->msai_bloom_loaded = 0;
+
+	/* Same branch as the recovery, records of other branches are ignored */
+	for (bindex = 0; bindex < mtfs_s2bnum(sb); bindex++) {
+		lowerfs = mtfs_dev2blowerfs(device, bindex);
+		if (lowerfs->ml_trans_support) {
+			break;
+		}
+	}
+	if (bindex == mtfs_s2bnum(sb)) {
+		goto out;
+	}
+
+	ret = mtfs_bloom_init(&info->msai_bloom, masync_bloom_bits,
+	                      masync_bloom_hashes);
+	if (ret) {
+		MERROR("failed to init filter of dirty files, ret = %d\n", ret);
+		goto out;
+	}
+	info->msai_bloom_bindex = bindex;
+
+	/* the owner of log file should always be root */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+	mtfs_push_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+	file = masync_bloom_open(sb, bindex);
+	if (!IS_ERR(file)) {
+		masync_bloom_load(info, sb, file);
+		fput(file);
+	}
+	mtfs_pop_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+out:
+	MRETURN(ret);
+}
+
+void masync_bloom_fini(struct msubject_async_info *info,
+                       struct super_block *sb)
+{
+	mtfs_bindex_t bindex = info->msai_bloom_bindex;
+	struct mtfs_run_ctxt saved;
+	struct mtfs_ucred ucred = { 0 };
+	struct file *file = NULL;
+	MENTRY();
+
+	if (bindex < 0) {
+		goto out;
+	}
+
+	/* Nobody is able to change the filter since now */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+	mtfs_push_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+	file = masync_bloom_open(sb, bindex);
+	if (!IS_ERR(file)) {
+		masync_bloom_save(info, sb, file);
+		fput(file);
+	}
+	mtfs_pop_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+
+	info->msai_bloom_bindex = -1;
+	mtfs_bloom_fini(&info->msai_bloom);
+out:
+	_MRETURN();
+}
+
+/* Return fid of inode in the filter, zero if no filter or no branch */
+__u64 masync_bloom_fid(struct msubject_async_info *info, struct inode *inode)
+{
+	struct inode *hidden_inode = NULL;
+
+	if (info->msai_bloom_bindex < 0) {
+		return 0;
+	}
+
+	hidden_inode = mtfs_i2branch(inode, info->msai_bloom_bindex);
+	if (hidden_inode == NULL) {
+		return 0;
+	}
+	return hidden_inode->i_ino;
+}
+
+/* Called holding msai_intent_lock */
+void masync_bloom_add_nonlock(struct msubject_async_info *info, __u64 fid)
+{
+	MASSERT(info->msai_bloom_bindex >= 0);
+	mtfs_bloom_add(&info->msai_bloom, fid);
+}
+
+/* Called holding msai_intent_lock */
+void masync_bloom_del_nonlock(struct msubject_async_info *info, __u64 fid)
+{
+	MASSERT(info->msai_bloom_bindex >= 0);
+	mtfs_bloom_del(&info->msai_bloom, fid);
+}
+
+void masync_bloom_add(struct msubject_async_info *info, __u64 fid)
+{
+	mtfs_spin_lock(&info->msai_intent_lock);
+	masync_bloom_add_nonlock(info, fid);
+	mtfs_spin_unlock(&info->msai_intent_lock);
+}
+
+void masync_bloom_del(struct msubject_async_info *info, __u64 fid)
+{
+	mtfs_spin_lock(&info->msai_intent_lock);
+	masync_bloom_del_nonlock(info, fid);
+	mtfs_spin_unlock(&info->msai_intent_lock);
+}
+
+/*
+ * Return 0 if file of fid is definitely clean.
+ * No lock needed, since counters of a fid not deleted never drop to zero.
+ */
+int masync_bloom_dirty(struct msubject_async_info *info, __u64 fid)
+{
+	if (info->msai_bloom_bindex < 0) {
+		return 1;
+	}
+	return mtfs_bloom_test(&info->msai_bloom, fid);
+}
+
+int masync_bloom_proc_read(struct msubject_async_info *info,
+                           char *page, int count)
+{
+	struct mtfs_bloom *bloom = &info->msai_bloom;
+	unsigned long fill = 0;
+	__u64 keys = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (info->msai_bloom_bindex < 0) {
+		ret = snprintf(page, count, "state: disabled\n");
+		goto out;
+	}
+
+	mtfs_spin_lock(&info->msai_intent_lock);
+	keys = bloom->mbl_keys;
+	mtfs_spin_unlock(&info->msai_intent_lock);
+	/* Too many counters to scan holding the lock */
+	fill = mtfs_bloom_fill(bloom);
+
+	ret = snprintf(page, count,
+	               "state: %s\n"
+	               "branch: %d\n"
+	               "counters: %lu\n"
+	               "hashes: %d\n"
+	               "keys: %llu\n"
+	               "fill: %lu\n",
+	               info->msai_bloom_loaded ? "loaded" : "rebuilt",
+	               info->msai_bloom_bindex,
+	               mtfs_bloom_size(bloom),
+	               bloom->mbl_hashes,
+	               keys, fill);
+out:
+	MRETURN(ret);
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#ifndef __MTFS_ASYNC_BLOOM_INTERNAL_H__
+#define __MTFS_ASYNC_BLOOM_INTERNAL_H__
+#include <mtfs_async.h>
+#include "async_internal.h"
+
+int masync_bloom_init(struct msubject_async_info *info,
+                      struct super_block *sb);
+void masync_bloom_fini(struct msubject_async_info *info,
+                       struct super_block *sb);
+__u64 masync_bloom_fid(struct msubject_async_info *info, struct inode *inode);
+void masync_bloom_add_nonlock(struct msubject_async_info *info, __u64 fid);
+void masync_bloom_del_nonlock(struct msubject_async_info *info, __u64 fid);
+void masync_bloom_add(struct msubject_async_info *info, __u64 fid);
+void masync_bloom_del(struct msubject_async_info *info, __u64 fid);
+int masync_bloom_dirty(struct msubject_async_info *info, __u64 fid);
+int masync_bloom_proc_read(struct msubject_async_info *info,
+                           char *page, int count);
+#endif /* __MTFS_ASYNC_BLOOM_INTERNAL_H__ */
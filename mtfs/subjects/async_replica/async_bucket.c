@@ -3,6 +3,7 @@
  */
 
 #include <linux/sched.h>
+#include <linux/module.h>
 #include <linux/mount.h>
 #include <mtfs_interval_tree.h>
 #include <mtfs_async.h>
@@ -12,80 +13,234 @@
 #include "async_bucket_internal.h"
 #include "async_extent_internal.h"
 #include "async_chunk_internal.h"
+#include "async_intent_internal.h"
+#include "async_cache_internal.h"
 
-/* Called holding mab_lock */
+/*
+ * A branch whose writes took longer than this in a pass leaves the pass,
+ * so that a slow branch does not hold back others.
+ */
+static int masync_branch_lag = 1000;
+module_param(masync_branch_lag, int, 0644);
+MODULE_PARM_DESC(masync_branch_lag, "max milliseconds a branch may hold back others in a flush");
+
+/*
+ * Copy extent from primary branch to every branch set in dirty.
+ * Each read of primary feeds all lagging branches in a single pass.
+ * Holes of primary are not read, and they as well as blocks of zero
+ * are left as holes in the branches, so resync keeps files sparse.
+ * A branch that fails, or is slower than masync_branch_lag while others
+ * are still in the pass, leaves the pass and is kept in dirty. Others
+ * keep going and are cleared from dirty when done.
+ * Return 0 if no branch failed, even if some left the pass for lag.
+ * Called holding mab_lock.
+ */
 int masync_sync_file(struct masync_bucket *bucket,
                      struct mtfs_interval_node_extent *extent,
+                     unsigned long *dirty,
                      char *buf,
                      int buf_size)
 {
 	int ret = 0;
 	struct file *src_file = NULL;
 	struct file *dest_file = NULL;
-	struct inode *inode = mtfs_bucket2inode(bucket);
-	struct super_block *sb = inode->i_sb;
-	struct msubject_async_info *info = NULL;
+	unsigned long active[MASYNC_BRANCH_LONGS];
+	unsigned long spent[MTFS_BRANCH_MAX];
+	unsigned long start = 0;
+	mtfs_bindex_t bindex = 0;
+	mtfs_bindex_t bnum = 0;
 	loff_t pos = 0;
 	loff_t tmp_pos = 0;
+	loff_t end = 0;
+	loff_t data_start = 0;
+	loff_t data_end = 0;
+	loff_t size = 0;
 	size_t len = 0;
-	size_t result = 0;
+	ssize_t result = 0;
+	int nr_active = 0;
+	int hole = 0;
 	MENTRY();
 
-	info = (struct msubject_async_info *)mtfs_s2subinfo(sb);
-
 	MASSERT(bucket->mab_fvalid);
+	bnum = bucket->mab_finfo.bnum;
 	src_file = bucket->mab_finfo.barray[0].bfile;
-	dest_file = bucket->mab_finfo.barray[1].bfile;
 	MASSERT(src_file);
-	MASSERT(dest_file);
+
+	memcpy(active, dirty, sizeof(active));
+	memset(spent, 0, sizeof(spent));
+	for (bindex = 1; bindex < bnum; bindex++) {
+		if (mtfs_test_bit(bindex, active)) {
+			MASSERT(bucket->mab_finfo.barray[bindex].bfile);
+			nr_active++;
+		}
+	}
 
 	pos = extent->start;
-	while (pos <= extent->end) {
-		len = extent->end - pos + 1;
+	end = extent->end + 1;
+	data_start = pos;
+	data_end = pos;
+	while (pos < end && nr_active > 0) {
+		if (pos >= bucket->mab_discard_start) {
+			/* Truncate is waiting to discard it, do not copy */
+			ret = -ECANCELED;
+			goto out;
+		}
+
+		if (pos >= data_end) {
+			mtfs_file_seek_data(src_file, pos, end,
+			                    &data_start, &data_end);
+		}
+
+		hole = (pos < data_start);
+		if (hole) {
+			len = data_start - pos;
+		} else {
+			len = data_end - pos;
+		}
 		if (len > buf_size) {
 			len = buf_size;
 		}
 
-		tmp_pos = pos;
-		result = _do_read_write(READ, src_file, buf, len, &tmp_pos);
-		if (result != len) {
-			/* TODO: MERROR */
-			MERROR("failed to read extent [%lu, %lu] of file, "
-			       "expected %ld, got %ld\n",
-			       extent->start, extent->end,
-			       len, result);
-			if (result == 0) {
-				MBUG();
-				break;
-			}
+		if (hole) {
+			memset(buf, 0, len);
+		} else {
+			tmp_pos = pos;
+			result = _do_read_write(READ, src_file, buf, len, &tmp_pos);
+			if (result != len) {
+				/* TODO: MERROR */
+				MERROR("failed to read extent [%lu, %lu] of file, "
+				       "expected %ld, got %ld\n",
+				       extent->start, extent->end,
+				       len, result);
+				if (result == 0) {
+					MBUG();
+					break;
+				}
 
-			if (result < 0) {
-				ret = result;
-				break;
-			}
+				if (result < 0) {
+					ret = result;
+					goto out;
+				}
 
-			len = result;
+				len = result;
+			}
 		}
 
-		tmp_pos = pos;
-		result = _do_read_write(WRITE, dest_file, buf, len, &tmp_pos);
-		if (result != len) {
-			MERROR("failed to write extent [%lu, %lu] of file, "
-			       "expected %ld, got %ld\n",
-			       extent->start, extent->end,
-			       len, result);
-			if (result >= 0) {
-				ret = -EIO;
-				break;
+		for (bindex = 1; bindex < bnum; bindex++) {
+			if (!mtfs_test_bit(bindex, active)) {
+				continue;
+			}
+
+			dest_file = bucket->mab_finfo.barray[bindex].bfile;
+			start = jiffies;
+			if (hole) {
+				result = mtfs_file_write_zero(dest_file, buf,
+				                              len, pos);
+			} else {
+				result = mtfs_file_write_sparse(dest_file, buf,
+				                                len, pos);
+			}
+			spent[bindex] += jiffies - start;
+			if (result != len) {
+				MERROR("failed to write extent [%lu, %lu] of "
+				       "branch[%d], expected %ld, got %ld\n",
+				       extent->start, extent->end,
+				       bindex, len, result);
+				ret = (result < 0) ? result : -EIO;
+				mtfs_clear_bit(bindex, active);
+				nr_active--;
+			} else if (nr_active > 1 &&
+			           spent[bindex] > msecs_to_jiffies(masync_branch_lag)) {
+				MDEBUG("branch[%d] is lagging, left for next pass\n",
+				       bindex);
+				mtfs_clear_bit(bindex, active);
+				nr_active--;
 			}
 		}
 
 		pos += len;
 	}
 
+	/* Zero skipped at the tail is not written, extend to the size */
+	size = i_size_read(src_file->f_dentry->d_inode);
+	if (pos > size) {
+		pos = size;
+	}
+	for (bindex = 1; bindex < bnum; bindex++) {
+		if (!mtfs_test_bit(bindex, active)) {
+			continue;
+		}
+
+		dest_file = bucket->mab_finfo.barray[bindex].bfile;
+		result = mtfs_file_extend(dest_file, pos);
+		if (result) {
+			MERROR("failed to extend branch[%d] to %llu, ret = %ld\n",
+			       bindex, pos, result);
+			ret = result;
+			mtfs_clear_bit(bindex, active);
+		}
+	}
+
+	/* Branches still active have the whole extent */
+	for (bindex = 1; bindex < bnum; bindex++) {
+		if (mtfs_test_bit(bindex, active)) {
+			mtfs_clear_bit(bindex, dirty);
+		}
+	}
+out:
+	MRETURN(ret);
+}
+
+/*
+ * Try to lock bucket without sleeping.
+ * Return 0 if locked, otherwise park deferred to be notified
+ * by masync_bucket_unlock() and return 1.
+ */
+int masync_bucket_trylock(struct masync_bucket *bucket,
+                          struct mlock_deferred *deferred)
+{
+	int ret = 0;
+	MENTRY();
+
+	if (!down_trylock(&bucket->mab_lock)) {
+		goto out;
+	}
+
+	mtfs_spin_lock(&bucket->mab_deferred_lock);
+	/* Check again, the holder may have unlocked without seeing us */
+	if (down_trylock(&bucket->mab_lock)) {
+		MASSERT(mtfs_list_empty(&deferred->mld_linkage));
+		mtfs_list_add_tail(&deferred->mld_linkage, &bucket->mab_deferred);
+		ret = 1;
+	}
+	mtfs_spin_unlock(&bucket->mab_deferred_lock);
+out:
 	MRETURN(ret);
 }
 
+/* Unlock bucket and notify flushes parked by masync_bucket_trylock() */
+void masync_bucket_unlock(struct masync_bucket *bucket)
+{
+	struct mlock_deferred *deferred = NULL;
+	MTFS_LIST_HEAD(deferred_list);
+	MENTRY();
+
+	up(&bucket->mab_lock);
+
+	mtfs_spin_lock(&bucket->mab_deferred_lock);
+	mtfs_list_splice_init(&bucket->mab_deferred, &deferred_list);
+	mtfs_spin_unlock(&bucket->mab_deferred_lock);
+
+	while (!mtfs_list_empty(&deferred_list)) {
+		deferred = mtfs_list_entry(deferred_list.next,
+		                           struct mlock_deferred,
+		                           mld_linkage);
+		mtfs_list_del_init(&deferred->mld_linkage);
+		deferred->mld_notify(deferred);
+	}
+	_MRETURN();
+}
+
 void masync_bucket_init(struct msubject_async_info *info,
                         struct masync_bucket *bucket)
 {
@@ -94,12 +249,20 @@ void masync_bucket_init(struct msubject_async_info *info,
 	bucket->mab_info = info;
 	bucket->mab_root = NULL;
 	atomic_set(&bucket->mab_number, 0);
+	bucket->mab_dirty_start = MTFS_INTERVAL_EOF;
+	bucket->mab_dirty_end = 0;
+	seqlock_init(&bucket->mab_dirty_seqlock);
+	bucket->mab_discard_start = MTFS_INTERVAL_EOF;
 	bucket->mab_fvalid = 0;
 	init_MUTEX(&bucket->mab_lock);
+	MTFS_INIT_LIST_HEAD(&bucket->mab_deferred);
+	mtfs_spin_lock_init(&bucket->mab_deferred_lock);
 	MTFS_INIT_LIST_HEAD(&bucket->mab_linkage);
 	masync_bucket_add_to_list(bucket);
-	init_MUTEX(&bucket->mab_chunk_lock);
-	MTFS_INIT_LIST_HEAD(&bucket->mab_chunks);
+	bucket->mab_chunk_root = NULL;
+	mtfs_spin_lock_init(&bucket->mab_chunk_lock);
+	masync_intent_init(bucket);
+	masync_cache_bucket_init(bucket);
 	_MRETURN();
 }
 
@@ -117,7 +280,7 @@ enum mtfs_interval_iter masync_overlap_cb(struct mtfs_interval_node *node,
 }
 
 /* Called when holding mab_lock */
-static int masycn_bucket_fget(struct masync_bucket *bucket, struct file *file)
+int masycn_bucket_fget(struct masync_bucket *bucket, struct file *file)
 {
 	int ret = 0;
 	mtfs_bindex_t bindex = 0;
@@ -196,14 +359,6 @@ int masync_bucket_add_start(struct inode *inode,
 		goto out;
 	}
 
-	ret = masync_chunk_add_interval(bucket,
-	                                &extent->mae_chunks,
-	                                0,
-	                                MASYNC_CHUNK_SIZE - 1);
-	if (ret) {
-		extent->mae_bucket = NULL;
-		masync_extent_fini(extent);
-	}
 	*async_extent = extent;
 out:
 	MRETURN(ret);
@@ -224,9 +379,10 @@ void masync_bucket_add_end(struct file *file,
 	struct masync_extent *tmp_async_extent = NULL;
 	__u64 min_start = interval->start;
 	__u64 max_end = interval->end;
+	__u64 mark_start = 0;
+	__u64 mark_end = 0;
 	struct inode *inode = file->f_dentry->d_inode;
 	struct masync_bucket *bucket = mtfs_i2bucket(inode);
-	struct mtfs_interval_node *found = NULL;
 	MENTRY();
 
 	MDEBUG("adding [%lu, %lu]\n", interval->start, interval->end);
@@ -262,20 +418,31 @@ void masync_bucket_add_end(struct file *file,
 			max_end = tmp_extent->mi_node.in_extent.end;
 		}
 
-		atomic_dec(&bucket->mab_number);
-		mtfs_interval_erase(&tmp_extent->mi_node, &bucket->mab_root);
+		masync_bucket_extent_erase(bucket, &tmp_extent->mi_node);
 
 		tmp_async_extent = masync_interval2extent(tmp_extent);
+		/* Merged range is dirty on any branch one of them is */
+		masync_extent_dirty_merge(async_extent, tmp_async_extent);
 
 		/* Export that this extent is not used since now */
-		mtfs_spin_lock(&tmp_async_extent->mae_lock);
+		mutex_lock(&tmp_async_extent->mae_lock);
 		tmp_async_extent->mae_bucket = NULL;
-		mtfs_spin_unlock(&tmp_async_extent->mae_lock);
+		mutex_unlock(&tmp_async_extent->mae_lock);
 	}
-	atomic_inc(&bucket->mab_number);
 	mtfs_interval_set(&node->mi_node, min_start, max_end);
-	found = mtfs_interval_insert(&node->mi_node, &bucket->mab_root);
-	MASSERT(!found);
+	masync_bucket_extent_insert(bucket, &node->mi_node);
+	masync_bucket_dirty_update(bucket);
+
+	/* Only blocks touched by this write may become wholly dirty */
+	mark_start = interval->start & ~(MASYNC_BLOCK_SIZE - 1);
+	if (mark_start < min_start) {
+		mark_start = min_start;
+	}
+	mark_end = interval->end | (MASYNC_BLOCK_SIZE - 1);
+	if (mark_end > max_end) {
+		mark_end = max_end;
+	}
+	masync_chunk_mark(bucket, mark_start, mark_end);
 
 	if (!bucket->mab_fvalid) {
 		masycn_bucket_fget(bucket, file);
@@ -285,7 +452,7 @@ void masync_bucket_add_end(struct file *file,
 	 * since masync_bucket_cleanup() may miss it and cause memory leak.
 	 */
 	masync_extent_add_to_lru(async_extent);
-	up(&bucket->mab_lock);
+	masync_bucket_unlock(bucket);
 
 	/* Can be moved to background */
 	mtfs_list_for_each_entry_safe(tmp_extent, head, &extent_list, mi_linkage) {
@@ -317,11 +484,13 @@ int masync_bucket_cleanup(struct masync_bucket *bucket)
 	int buf_size = MASYNC_BULK_SIZE;
 	char *buf = NULL;
 	struct masync_extent *async_extent = NULL;
+	int synced = 1;
 	MENTRY();
 
 	MTFS_ALLOC(buf, buf_size);
 	if (buf == NULL) {
 		MERROR("not enough memory\n");
+		synced = 0;
 	}
 
 	/* Cleanup extents */
@@ -329,21 +498,23 @@ int masync_bucket_cleanup(struct masync_bucket *bucket)
 	extent_number = atomic_read(&bucket->mab_number);
 	while (bucket->mab_root) {
 		node = mtfs_node2interval(bucket->mab_root);
-		if (buf != NULL) {
-			if (bucket->mab_fvalid) {
-				ret = masync_sync_file(bucket,
-				                       &node->mi_node.in_extent,
-				                       buf, buf_size);
-				if (ret) {
-					MERROR("failed sync file between branches\n");
-					mtfs_inode_size_dump(mtfs_bucket2inode(bucket));
-				}
+		async_extent = masync_interval2extent(node);
+		/* Branches left for lag are synced by the next passes */
+		while (buf != NULL && bucket->mab_fvalid &&
+		       masync_dirty_next(async_extent->mae_dirty,
+		                         bucket->mab_finfo.bnum, 1)) {
+			ret = masync_sync_file(bucket,
+			                       &node->mi_node.in_extent,
+			                       async_extent->mae_dirty,
+			                       buf, buf_size);
+			if (ret) {
+				MERROR("failed sync file between branches\n");
+				mtfs_inode_size_dump(mtfs_bucket2inode(bucket));
+				synced = 0;
+				break;
 			}
 		}
-		atomic_dec(&bucket->mab_number);
-		mtfs_interval_erase(bucket->mab_root, &bucket->mab_root);
-
-		async_extent = masync_interval2extent(node);
+		masync_bucket_extent_erase(bucket, bucket->mab_root);
 
 		/*
 		 * If in LRU list, release it.
@@ -353,27 +524,41 @@ int masync_bucket_cleanup(struct masync_bucket *bucket)
 		masync_extent_remove_from_lru(async_extent);
 
 		/* Export that this extent is not used since now */
-		mtfs_spin_lock(&async_extent->mae_lock);
+		mutex_lock(&async_extent->mae_lock);
 		async_extent->mae_bucket = NULL;
-		mtfs_spin_unlock(&async_extent->mae_lock);
+		mutex_unlock(&async_extent->mae_lock);
 
 		/* Extent tree release reference */
 		masync_extent_put(async_extent);
 	}
+	masync_bucket_dirty_update(bucket);
 	if (bucket->mab_fvalid) {
 		masycn_bucket_fput(bucket);
 	}
-	up(&bucket->mab_lock);
+	masync_bucket_unlock(bucket);
+
+	/* Flushes parked on lock resource will skip the detached extents */
+	mlock_resource_wakeup(mtfs_i2resource(mtfs_bucket2inode(bucket)));
+
+	/*
+	 * Keep the intent records if any extent is not synced,
+	 * so that recovery will sync the file.
+	 */
+	if (synced) {
+		masync_intent_clear(bucket);
+	}
+	masync_intent_fini(bucket);
 
 	/* Cleanup chunks */
 	masync_chunk_cleanup(bucket);
 
+	masync_cache_bucket_fini(bucket);
 	masync_bucket_remove_from_list(bucket);
 
 	MASSERT(bucket->mab_root == NULL);
 	MASSERT(atomic_read(&bucket->mab_number) == 0);
 	MASSERT(!bucket->mab_fvalid);
-	MASSERT(mtfs_list_empty(&bucket->mab_chunks));
+	MASSERT(bucket->mab_chunk_root == NULL);
 
 	if (buf) {
 		MTFS_FREE(buf, buf_size);
@@ -382,40 +567,44 @@ int masync_bucket_cleanup(struct masync_bucket *bucket)
 	MRETURN(extent_number);
 }
 
-/* Called holding bucket->mab_lock */
-static void _masync_bucket_remove(struct masync_bucket *bucket,
-                                  struct masync_extent *async_extent)
+/*
+ * Release extent that is out of tree, pending flush of it will skip.
+ * Called holding bucket->mab_lock.
+ */
+static void _masync_bucket_discard(struct masync_bucket *bucket,
+                                   struct masync_extent *async_extent)
 {
-	struct mtfs_interval *extent = &async_extent->mae_interval;
-
-	atomic_dec(&bucket->mab_number);
-	mtfs_interval_erase(&extent->mi_node, &bucket->mab_root);
-
 	/* Export that this extent is not used since now */
-	mtfs_spin_lock(&async_extent->mae_lock);
+	mutex_lock(&async_extent->mae_lock);
 	async_extent->mae_bucket = NULL;
-	mtfs_spin_unlock(&async_extent->mae_lock);
+	mutex_unlock(&async_extent->mae_lock);
 
 	masync_extent_remove_from_lru(async_extent);
 	/* Extent tree release reference */
 	masync_extent_put(async_extent);
 }
 
+/* Called holding bucket->mab_lock */
+static void _masync_bucket_remove(struct masync_bucket *bucket,
+                                  struct masync_extent *async_extent)
+{
+	struct mtfs_interval *extent = &async_extent->mae_interval;
+
+	masync_bucket_extent_erase(bucket, &extent->mi_node);
+	_masync_bucket_discard(bucket, async_extent);
+}
+
 static void _masync_bucket_add_end(struct masync_bucket *bucket,
                                    struct masync_extent *async_extent,
                                    struct mtfs_interval_node_extent *interval)
 {
-	struct mtfs_interval_node *found = NULL;
 	MENTRY();
 
 	masync_extent_get(async_extent);
-	atomic_inc(&bucket->mab_number);
 	mtfs_interval_set(&async_extent->mae_interval.mi_node,
 	                  interval->start,
 	                  interval->end);
-	found = mtfs_interval_insert(&async_extent->mae_interval.mi_node,
-	                             &bucket->mab_root);
-	MASSERT(!found);
+	masync_bucket_extent_insert(bucket, &async_extent->mae_interval.mi_node);
 	masync_extent_add_to_lru(async_extent);
 
 	_MRETURN();
@@ -443,12 +632,26 @@ static int masync_bucket_extent_truncate(struct masync_bucket *bucket,
 		goto out;
 	}
 	
+	memcpy(add_extent->mae_dirty, extent->mae_dirty,
+	       sizeof(add_extent->mae_dirty));
 	_masync_bucket_remove(bucket, extent);
 	_masync_bucket_add_end(bucket, add_extent, &add_interval);
 out:
 	MRETURN(ret);
 }
 
+static enum mtfs_interval_iter masync_count_cb(struct mtfs_interval_node *node,
+                                               void *args)
+{
+	(*(int *)args)++;
+	return MTFS_INTERVAL_ITER_CONT;
+}
+
+/*
+ * Drop extents beyond size.
+ * Called holding MLOCK_MODE_CLEAN lock of [size, EOF], so no flush of them
+ * is running, and pending ones will skip the dropped extents.
+ */
 int masync_bucket_truncate(struct masync_bucket *bucket, __u64 size)
 {
 	int ret = 0;
@@ -457,35 +660,97 @@ int masync_bucket_truncate(struct masync_bucket *bucket, __u64 size)
 	struct mtfs_interval *list_interval = NULL;
 	struct mtfs_interval *head_interval = NULL;
 	struct masync_extent *extent = NULL;
+	int number = 0;
 	MENTRY();
 
-	search_interval.start = size;
-	search_interval.end = MTFS_INTERVAL_EOF;
 	down(&bucket->mab_lock);
+	if (bucket->mab_root == NULL ||
+	    bucket->mab_root->in_max_high < size) {
+		goto out_clear;
+	}
+
+	/* At most one extent covers size, since extents never overlap */
+	search_interval.start = size;
+	search_interval.end = size;
 	mtfs_interval_search(bucket->mab_root, &search_interval,
 	                     masync_overlap_cb, &extent_list);
-
-	mtfs_list_for_each_entry_safe(list_interval, head_interval,
-	                              &extent_list, mi_linkage) {
-		extent = masync_interval2extent(list_interval);
+	if (!mtfs_list_empty(&extent_list)) {
+		list_interval = mtfs_list_entry(extent_list.next,
+		                                struct mtfs_interval,
+		                                mi_linkage);
+		mtfs_list_del_init(&list_interval->mi_linkage);
+		MASSERT(mtfs_list_empty(&extent_list));
 		if (list_interval->mi_node.in_extent.start < size) {
 			/* Remove old one and insert new one */
 			ret = masync_bucket_extent_truncate(bucket,
-			                                    extent,
+			                                    masync_interval2extent(list_interval),
 			                                    size);
 			if (ret) {
-				break;
+				goto out_update;
 			}
-		} else {
-			/* Covered, remove the extent */
-			_masync_bucket_remove(bucket, extent);
 		}
 	}
-	up(&bucket->mab_lock);
+
+	/* Every extent left in [size, EOF] is covered */
+	search_interval.end = MTFS_INTERVAL_EOF;
+	mtfs_interval_search(bucket->mab_root, &search_interval,
+	                     masync_count_cb, &number);
+	if (number * 2 > atomic_read(&bucket->mab_number)) {
+		/*
+		 * Most extents are dropped, e.g. truncated to zero.
+		 * Empty the tree at once and insert the others back,
+		 * rather than rebalancing for each dropped one.
+		 */
+		mtfs_interval_detach(&bucket->mab_root, masync_overlap_cb,
+		                     &extent_list);
+		mtfs_list_for_each_entry_safe(list_interval, head_interval,
+		                              &extent_list, mi_linkage) {
+			mtfs_list_del_init(&list_interval->mi_linkage);
+			masync_bucket_extent_detached(bucket, &list_interval->mi_node);
+			extent = masync_interval2extent(list_interval);
+			if (list_interval->mi_node.in_extent.start < size) {
+				masync_bucket_extent_insert(bucket,
+				                            &list_interval->mi_node);
+			} else {
+				_masync_bucket_discard(bucket, extent);
+			}
+		}
+	} else {
+		mtfs_interval_search(bucket->mab_root, &search_interval,
+		                     masync_overlap_cb, &extent_list);
+		mtfs_list_for_each_entry_safe(list_interval, head_interval,
+		                              &extent_list, mi_linkage) {
+			mtfs_list_del_init(&list_interval->mi_linkage);
+			_masync_bucket_remove(bucket,
+			                      masync_interval2extent(list_interval));
+		}
+	}
+out_update:
+	masync_bucket_dirty_update(bucket);
+out_clear:
+	/* Writers are serialized with truncate by i_mutex, ignore them */
+	masync_chunk_clear(bucket, size, MTFS_INTERVAL_EOF);
+	masync_bucket_unlock(bucket);
 
 	MRETURN(ret);
 }
 
+/*
+ * Make flushes of extents beyond size give up, since they are going to be
+ * discarded. Called holding i_mutex before locking [size, EOF].
+ */
+void masync_bucket_discard_start(struct masync_bucket *bucket, __u64 size)
+{
+	bucket->mab_discard_start = size;
+	smp_mb();
+}
+
+void masync_bucket_discard_end(struct masync_bucket *bucket)
+{
+	bucket->mab_discard_start = MTFS_INTERVAL_EOF;
+	smp_mb();
+}
+
 static enum mtfs_interval_iter masync_dump_overlap_cb(struct mtfs_interval_node *node,
                                                           void *args)
 {
@@ -4,7 +4,9 @@
 
 #ifndef __MTFS_ASYNC_BUCKET_INTERNAL_H__
 #define __MTFS_ASYNC_BUCKET_INTERNAL_H__
+#include <mtfs_async.h>
 #include "async_internal.h"
+#include "async_info_internal.h"
 
 static inline void masync_bucket_remove_from_list(struct masync_bucket *bucket)
 {
@@ -38,10 +40,86 @@ static inline void masync_bucket_add_to_list(struct masync_bucket *bucket)
 	_MRETURN();
 }
 
-int masync_chunk_add_interval(struct masync_bucket *bucket,
-                              mtfs_list_t *chunks,
-                              __u64 start,
-                              __u64 end);
+/* Called holding mab_lock */
+static inline void masync_bucket_extent_insert(struct masync_bucket *bucket,
+                                               struct mtfs_interval_node *node)
+{
+	struct mtfs_interval_node *found = NULL;
+	struct msubject_async_info *info = bucket->mab_info;
+
+	atomic_inc(&bucket->mab_number);
+	found = mtfs_interval_insert(node, &bucket->mab_root);
+	MASSERT(!found);
+	masync_info_usage_inc(info, &info->msai_dirty_bytes,
+	                      mtfs_interval_high(node) - mtfs_interval_low(node) + 1);
+}
+
+/*
+ * Account an extent that is out of tree,
+ * either erased or emptied by mtfs_interval_detach().
+ * Called holding mab_lock.
+ */
+static inline void masync_bucket_extent_detached(struct masync_bucket *bucket,
+                                                 struct mtfs_interval_node *node)
+{
+	struct msubject_async_info *info = bucket->mab_info;
+
+	atomic_dec(&bucket->mab_number);
+	masync_info_usage_dec(info, &info->msai_dirty_bytes,
+	                      mtfs_interval_high(node) - mtfs_interval_low(node) + 1);
+}
+
+/* Called holding mab_lock */
+static inline void masync_bucket_extent_erase(struct masync_bucket *bucket,
+                                              struct mtfs_interval_node *node)
+{
+	mtfs_interval_erase(node, &bucket->mab_root);
+	masync_bucket_extent_detached(bucket, node);
+}
+
+/*
+ * Refresh the range covering all extents after tree changes.
+ * Extents never overlap, so the root has the highest end.
+ * Called holding mab_lock.
+ */
+static inline void masync_bucket_dirty_update(struct masync_bucket *bucket)
+{
+	struct mtfs_interval_node *first = NULL;
+
+	write_seqlock(&bucket->mab_dirty_seqlock);
+	if (bucket->mab_root == NULL) {
+		bucket->mab_dirty_start = MTFS_INTERVAL_EOF;
+		bucket->mab_dirty_end = 0;
+	} else {
+		first = mtfs_interval_first(bucket->mab_root);
+		bucket->mab_dirty_start = mtfs_interval_low(first);
+		bucket->mab_dirty_end = bucket->mab_root->in_max_high;
+	}
+	write_sequnlock(&bucket->mab_dirty_seqlock);
+}
+
+/*
+ * Get the range covering all extents without mab_lock.
+ * Return 0 if bucket has no extent.
+ */
+static inline int masync_bucket_dirty_range(struct masync_bucket *bucket,
+                                            __u64 *start, __u64 *end)
+{
+	unsigned seq = 0;
+
+	if (atomic_read(&bucket->mab_number) == 0) {
+		return 0;
+	}
+
+	do {
+		seq = read_seqbegin(&bucket->mab_dirty_seqlock);
+		*start = bucket->mab_dirty_start;
+		*end = bucket->mab_dirty_end;
+	} while (read_seqretry(&bucket->mab_dirty_seqlock, seq));
+
+	return (*start <= *end);
+}
+
 int masync_bucket_add_start(struct inode *inode,
                             struct masync_extent **async_extent);
 void masync_bucket_add_end(struct file *file,
@@ -53,12 +131,19 @@ void masync_bucket_add_abort(struct file *file,
 int masync_bucket_cancel(struct masync_bucket *bucket,
                          char *buf, int buf_len,
                          int nr_to_cacel);
+int masync_bucket_trylock(struct masync_bucket *bucket,
+                          struct mlock_deferred *deferred);
+void masync_bucket_unlock(struct masync_bucket *bucket);
+int masycn_bucket_fget(struct masync_bucket *bucket, struct file *file);
 void masync_bucket_init(struct msubject_async_info *info,
                         struct masync_bucket *bucket);
 int masync_bucket_cleanup(struct masync_bucket *bucket);
 int masync_bucket_truncate(struct masync_bucket *bucket, __u64 size);
+void masync_bucket_discard_start(struct masync_bucket *bucket, __u64 size);
+void masync_bucket_discard_end(struct masync_bucket *bucket);
 int masync_sync_file(struct masync_bucket *bucket,
                      struct mtfs_interval_node_extent *extent,
+                     unsigned long *dirty,
                      char *buf,
                      int buf_size);
 enum mtfs_interval_iter masync_overlap_cb(struct mtfs_interval_node *node,
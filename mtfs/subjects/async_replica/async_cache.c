@@ -0,0 +1,604 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <linux/module.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
+#include <mtfs_inode.h>
+#include <mtfs_super.h>
+#include <mtfs_dentry.h>
+#include <mtfs_file.h>
+#include "async_cache_internal.h"
+#include "async_bucket_internal.h"
+#include "async_info_internal.h"
+#include "async_recover_internal.h"
+
+/*
+ * Writeback cache mode.
+ *
+ * Cache branch is a small fast file system in front of the backing branch.
+ * Writes are absorbed by the cache branch and destaged by selfheal service
+ * just like async replica. A file missing in the cache branch is filled from
+ * the backing branch when opened. Clean files that nobody opens are evicted
+ * in LRU order by selfheal service when the cache grows above its capacity.
+ * Eviction keeps the size of the file in the cache branch but frees all its
+ * blocks, so an evicted file can be told after its inode is dropped.
+ */
+
+static int masync_cache_capacity = 0;
+module_param(masync_cache_capacity, int, 0644);
+MODULE_PARM_DESC(masync_cache_capacity, "Capacity of cache branch in MB for cache mode, 0 for no limit");
+
+void masync_cache_info_init(struct msubject_async_info *info)
+{
+	info->msai_cache_enabled = 0;
+	MTFS_INIT_LIST_HEAD(&info->msai_cache_lru);
+	info->msai_cache_number = 0;
+	info->msai_cache_bytes = 0;
+	info->msai_cache_capacity = 0;
+	info->msai_cache_fill_bytes = 0;
+	mtfs_spin_lock_init(&info->msai_cache_lock);
+	atomic_set(&info->msai_cache_hits, 0);
+	atomic_set(&info->msai_cache_misses, 0);
+	atomic_set(&info->msai_cache_evictions, 0);
+}
+
+/* Called when mounting, before any inode is loaded */
+void masync_cache_enable(struct msubject_async_info *info)
+{
+	info->msai_cache_enabled = 1;
+	info->msai_cache_capacity = ((__u64)masync_cache_capacity) << 20;
+}
+
+void masync_cache_bucket_init(struct masync_bucket *bucket)
+{
+	bucket->mab_cache_state = MASYNC_CACHE_UNKNOWN;
+	bucket->mab_cache_opens = 0;
+	bucket->mab_cache_bytes = 0;
+	MTFS_INIT_LIST_HEAD(&bucket->mab_cache_linkage);
+}
+
+void masync_cache_bucket_fini(struct masync_bucket *bucket)
+{
+	struct msubject_async_info *info = bucket->mab_info;
+	MENTRY();
+
+	MASSERT(bucket->mab_cache_opens == 0);
+	mtfs_spin_lock(&info->msai_cache_lock);
+	if (!mtfs_list_empty(&bucket->mab_cache_linkage)) {
+		mtfs_list_del_init(&bucket->mab_cache_linkage);
+		info->msai_cache_number--;
+		MASSERT(info->msai_cache_bytes >= bucket->mab_cache_bytes);
+		info->msai_cache_bytes -= bucket->mab_cache_bytes;
+		bucket->mab_cache_bytes = 0;
+	}
+	mtfs_spin_unlock(&info->msai_cache_lock);
+	_MRETURN();
+}
+
+/* Called holding msai_cache_lock */
+static int masync_cache_over_nonlock(struct msubject_async_info *info)
+{
+	return info->msai_cache_capacity != 0 &&
+	       info->msai_cache_bytes > info->msai_cache_capacity;
+}
+
+/*
+ * Move the file to the tail of LRU and account its current size.
+ * Let selfheal service evict some files if above capacity.
+ */
+static void masync_cache_touch(struct masync_bucket *bucket)
+{
+	struct msubject_async_info *info = bucket->mab_info;
+	struct inode *inode = mtfs_bucket2inode(bucket);
+	struct inode *cache_inode = mtfs_i2branch(inode, MASYNC_CACHE_BINDEX);
+	__u64 bytes = 0;
+	int over = 0;
+	MENTRY();
+
+	if (cache_inode) {
+		bytes = i_size_read(cache_inode);
+	}
+
+	mtfs_spin_lock(&info->msai_cache_lock);
+	if (mtfs_list_empty(&bucket->mab_cache_linkage)) {
+		info->msai_cache_number++;
+	}
+	mtfs_list_move_tail(&bucket->mab_cache_linkage, &info->msai_cache_lru);
+	info->msai_cache_bytes -= bucket->mab_cache_bytes;
+	info->msai_cache_bytes += bytes;
+	bucket->mab_cache_bytes = bytes;
+	over = masync_cache_over_nonlock(info);
+	mtfs_spin_unlock(&info->msai_cache_lock);
+
+	if (over) {
+		atomic_set(&the_async.msa_cache_wanted, 1);
+		masync_service_wakeup();
+	}
+	_MRETURN();
+}
+
+/* Called holding mab_lock */
+static int masync_cache_clean(struct masync_bucket *bucket)
+{
+	struct msubject_async_info *info = bucket->mab_info;
+	int clean = 0;
+
+	if (bucket->mab_root != NULL || bucket->mab_chunk_root != NULL) {
+		return 0;
+	}
+
+	mtfs_spin_lock(&info->msai_intent_lock);
+	clean = (bucket->mab_intent == MASYNC_INTENT_CLEAN &&
+	         bucket->mab_intent_writers == 0);
+	mtfs_spin_unlock(&info->msai_intent_lock);
+	return clean;
+}
+
+/*
+ * Whether the file needs filling from the backing branch.
+ * A file not checked since loaded is taken as evicted if it is clean
+ * and has blocks on the backing branch but none on the cache branch.
+ * Called holding mab_lock.
+ */
+static int masync_cache_absent(struct masync_bucket *bucket)
+{
+	struct inode *inode = mtfs_bucket2inode(bucket);
+	struct inode *cache_inode = mtfs_i2branch(inode, MASYNC_CACHE_BINDEX);
+	struct inode *backing_inode = mtfs_i2branch(inode, MASYNC_BACKING_BINDEX);
+	MENTRY();
+
+	if (bucket->mab_cache_state != MASYNC_CACHE_UNKNOWN) {
+		goto out;
+	}
+
+	if (masync_cache_clean(bucket) &&
+	    !masync_recover_pending(inode) &&
+	    i_size_read(cache_inode) > 0 &&
+	    cache_inode->i_blocks == 0 &&
+	    backing_inode->i_blocks > 0) {
+		bucket->mab_cache_state = MASYNC_CACHE_ABSENT;
+	} else {
+		bucket->mab_cache_state = MASYNC_CACHE_PRESENT;
+	}
+out:
+	MRETURN(bucket->mab_cache_state == MASYNC_CACHE_ABSENT);
+}
+
+/*
+ * Copy the file from backing branch to the cache branch.
+ * Evicted file is all hole in the cache branch, so only data is written.
+ * Called holding mab_lock.
+ */
+static int masync_cache_fill(struct masync_bucket *bucket,
+                             char *buf, int buf_size)
+{
+	struct msubject_async_info *info = bucket->mab_info;
+	struct file *src_file = NULL;
+	struct file *dest_file = NULL;
+	loff_t size = 0;
+	loff_t pos = 0;
+	loff_t tmp_pos = 0;
+	loff_t data_start = 0;
+	loff_t data_end = 0;
+	ssize_t len = 0;
+	ssize_t result = 0;
+	__u64 filled = 0;
+	int ret = 0;
+	MENTRY();
+
+	MASSERT(bucket->mab_fvalid);
+	src_file = bucket->mab_finfo.barray[MASYNC_BACKING_BINDEX].bfile;
+	dest_file = bucket->mab_finfo.barray[MASYNC_CACHE_BINDEX].bfile;
+	size = i_size_read(src_file->f_dentry->d_inode);
+
+	while (pos < size) {
+		if (pos >= data_end) {
+			mtfs_file_seek_data(src_file, pos, size,
+			                    &data_start, &data_end);
+			if (data_start >= size) {
+				break;
+			}
+			pos = data_start;
+		}
+
+		len = data_end - pos;
+		if (len > buf_size) {
+			len = buf_size;
+		}
+
+		tmp_pos = pos;
+		result = _do_read_write(READ, src_file, buf, len, &tmp_pos);
+		if (result <= 0) {
+			MERROR("failed to read backing branch at %llu, ret = %ld\n",
+			       pos, result);
+			ret = result ? result : -EIO;
+			goto out;
+		}
+		len = result;
+
+		if (!mtfs_buffer_is_zero(buf, len)) {
+			tmp_pos = pos;
+			result = _do_read_write(WRITE, dest_file, buf, len, &tmp_pos);
+			if (result != len) {
+				MERROR("failed to write cache branch at %llu, "
+				       "ret = %ld\n", pos, result);
+				ret = result < 0 ? result : -EIO;
+				goto out;
+			}
+			filled += len;
+		}
+		pos += len;
+	}
+
+	ret = mtfs_file_extend(dest_file, size);
+	if (ret) {
+		MERROR("failed to extend cache branch to %llu, ret = %d\n",
+		       size, ret);
+	}
+out:
+	mtfs_spin_lock(&info->msai_cache_lock);
+	info->msai_cache_fill_bytes += filled;
+	mtfs_spin_unlock(&info->msai_cache_lock);
+	MRETURN(ret);
+}
+
+/* Fill the file into cache branch if evicted, and count the open */
+int masync_cache_open(struct inode *inode, struct file *file)
+{
+	struct dentry *dentry = file->f_dentry;
+	struct masync_bucket *bucket = mtfs_i2bucket(inode);
+	struct msubject_async_info *info = bucket->mab_info;
+	int buf_size = MASYNC_BULK_SIZE;
+	char *buf = NULL;
+	int ret = 0;
+	MENTRY();
+
+	ret = mtfs_open(inode, file);
+	if (ret || !S_ISREG(inode->i_mode) || !info->msai_cache_enabled) {
+		goto out;
+	}
+
+	down(&bucket->mab_lock);
+	bucket->mab_cache_opens++;
+	if (mtfs_d2branch(dentry, MASYNC_CACHE_BINDEX) == NULL ||
+	    mtfs_d2branch(dentry, MASYNC_BACKING_BINDEX) == NULL ||
+	    !masync_cache_absent(bucket)) {
+		atomic_inc(&info->msai_cache_hits);
+		goto out_unlock;
+	}
+
+	atomic_inc(&info->msai_cache_misses);
+	MTFS_ALLOC(buf, buf_size);
+	if (buf == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_release;
+	}
+
+	if (!bucket->mab_fvalid) {
+		ret = masycn_bucket_fget(bucket, file);
+		if (ret) {
+			goto out_free;
+		}
+	}
+
+	ret = masync_cache_fill(bucket, buf, buf_size);
+	if (ret) {
+		MERROR("failed to fill [%.*s] from backing branch, ret = %d\n",
+		       dentry->d_name.len, dentry->d_name.name, ret);
+		goto out_free;
+	}
+	bucket->mab_cache_state = MASYNC_CACHE_PRESENT;
+	MTFS_FREE(buf, buf_size);
+out_unlock:
+	masync_bucket_unlock(bucket);
+	masync_cache_touch(bucket);
+	goto out;
+out_free:
+	MTFS_FREE(buf, buf_size);
+out_release:
+	bucket->mab_cache_opens--;
+	masync_bucket_unlock(bucket);
+	mtfs_release(inode, file);
+out:
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(masync_cache_open);
+
+int masync_cache_release(struct inode *inode, struct file *file)
+{
+	struct masync_bucket *bucket = mtfs_i2bucket(inode);
+	struct msubject_async_info *info = bucket->mab_info;
+	int ret = 0;
+	MENTRY();
+
+	if (S_ISREG(inode->i_mode) && info->msai_cache_enabled) {
+		down(&bucket->mab_lock);
+		MASSERT(bucket->mab_cache_opens > 0);
+		bucket->mab_cache_opens--;
+		masync_bucket_unlock(bucket);
+
+		/* Size may have changed */
+		masync_cache_touch(bucket);
+	}
+
+	ret = mtfs_release(inode, file);
+	MRETURN(ret);
+}
+EXPORT_SYMBOL(masync_cache_release);
+
+static int masync_cache_truncate(struct dentry *hidden_dentry, loff_t size)
+{
+	struct inode *hidden_inode = hidden_dentry->d_inode;
+	struct iattr newattrs;
+	int ret = 0;
+	MENTRY();
+
+	newattrs.ia_size = size;
+	newattrs.ia_valid = ATTR_SIZE;
+	mutex_lock(&hidden_inode->i_mutex);
+	ret = notify_change(hidden_dentry, &newattrs);
+	mutex_unlock(&hidden_inode->i_mutex);
+
+	MRETURN(ret);
+}
+
+/*
+ * Free blocks of the file in cache branch and drop it from LRU.
+ * Give up if the file is busy, dirty or opened.
+ * Called with a reference of inode.
+ */
+static int masync_cache_evict_inode(struct inode *inode)
+{
+	struct masync_bucket *bucket = mtfs_i2bucket(inode);
+	struct msubject_async_info *info = bucket->mab_info;
+	struct dentry *dentry = NULL;
+	struct dentry *hidden_dentry = NULL;
+	loff_t size = 0;
+	int ret = 0;
+	MENTRY();
+
+	dentry = d_find_alias(inode);
+	if (dentry == NULL) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	hidden_dentry = mtfs_d2branch(dentry, MASYNC_CACHE_BINDEX);
+	if (hidden_dentry == NULL || hidden_dentry->d_inode == NULL) {
+		ret = -ENOENT;
+		goto out_dput;
+	}
+
+	/* Never wait, writers may hold them while waiting for selfheal */
+	if (!mutex_trylock(&inode->i_mutex)) {
+		ret = -EBUSY;
+		goto out_dput;
+	}
+
+	if (down_trylock(&bucket->mab_lock)) {
+		ret = -EBUSY;
+		goto out_unlock_inode;
+	}
+
+	if (bucket->mab_cache_opens > 0 || !masync_cache_clean(bucket)) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+
+	if (bucket->mab_cache_state != MASYNC_CACHE_ABSENT) {
+		size = i_size_read(hidden_dentry->d_inode);
+		ret = masync_cache_truncate(hidden_dentry, 0);
+		if (ret == 0) {
+			ret = masync_cache_truncate(hidden_dentry, size);
+		}
+		if (ret) {
+			MERROR("failed to evict [%.*s] from cache branch, "
+			       "ret = %d\n",
+			       dentry->d_name.len, dentry->d_name.name, ret);
+			/* Data may be partly gone, fill it next time */
+			bucket->mab_cache_state = MASYNC_CACHE_ABSENT;
+			goto out_unlock;
+		}
+		bucket->mab_cache_state = MASYNC_CACHE_ABSENT;
+		atomic_inc(&info->msai_cache_evictions);
+	}
+
+	/* Before mab_lock is up, so that a new open touches it again */
+	masync_cache_bucket_fini(bucket);
+out_unlock:
+	masync_bucket_unlock(bucket);
+out_unlock_inode:
+	mutex_unlock(&inode->i_mutex);
+out_dput:
+	dput(dentry);
+out:
+	MRETURN(ret);
+}
+
+/* Evict LRU files until below capacity, each file is tried once */
+static void masync_cache_evict(struct msubject_async_info *info)
+{
+	struct masync_bucket *bucket = NULL;
+	struct inode *inode = NULL;
+	int tries = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&info->msai_cache_lock);
+	tries = info->msai_cache_number;
+	mtfs_spin_unlock(&info->msai_cache_lock);
+
+	for (; tries > 0; tries--) {
+		mtfs_spin_lock(&info->msai_cache_lock);
+		if (!masync_cache_over_nonlock(info) ||
+		    mtfs_list_empty(&info->msai_cache_lru)) {
+			mtfs_spin_unlock(&info->msai_cache_lock);
+			break;
+		}
+		bucket = mtfs_list_entry(info->msai_cache_lru.next,
+		                         struct masync_bucket,
+		                         mab_cache_linkage);
+		/* Busy ones are tried again in the next round */
+		mtfs_list_move_tail(&bucket->mab_cache_linkage,
+		                    &info->msai_cache_lru);
+		/* NULL if being freed, which removes it from LRU anyway */
+		inode = igrab(mtfs_bucket2inode(bucket));
+		mtfs_spin_unlock(&info->msai_cache_lock);
+
+		if (inode == NULL) {
+			continue;
+		}
+
+		masync_cache_evict_inode(inode);
+		iput(inode);
+	}
+	_MRETURN();
+}
+
+int masync_cache_wanted(void)
+{
+	return atomic_read(&the_async.msa_cache_wanted);
+}
+
+/* Called by selfheal service */
+void masync_cache_shrink(void)
+{
+	struct msubject_async *subject = &the_async;
+	struct msubject_async_info *info = NULL;
+	int i = 0;
+	MENTRY();
+
+	atomic_set(&subject->msa_cache_wanted, 0);
+
+	/* Not accurate because of race, but that's ok */
+	for (i = atomic_read(&subject->msa_info_number); i > 0; i--) {
+		mtfs_spin_lock(&subject->msa_info_lock);
+		if (mtfs_list_empty(&subject->msa_infos)) {
+			mtfs_spin_unlock(&subject->msa_info_lock);
+			break;
+		}
+		info = mtfs_list_entry(subject->msa_infos.next,
+		                       struct msubject_async_info,
+		                       msai_linkage);
+		masync_info_get(info);
+		masync_info_touch_list_nonlock(info);
+		mtfs_spin_unlock(&subject->msa_info_lock);
+
+		if (info->msai_cache_enabled) {
+			masync_cache_evict(info);
+		}
+		masync_info_put(info);
+	}
+	_MRETURN();
+}
+
+int masync_cache_proc_read(struct msubject_async_info *info,
+                           char *page, int count)
+{
+	__u64 bytes = 0;
+	__u64 capacity = 0;
+	__u64 fill_bytes = 0;
+	int number = 0;
+	int hits = 0;
+	int misses = 0;
+	int ratio = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (!info->msai_cache_enabled) {
+		ret = snprintf(page, count, "mode: replica\n");
+		goto out;
+	}
+
+	mtfs_spin_lock(&info->msai_cache_lock);
+	bytes = info->msai_cache_bytes;
+	capacity = info->msai_cache_capacity;
+	fill_bytes = info->msai_cache_fill_bytes;
+	number = info->msai_cache_number;
+	mtfs_spin_unlock(&info->msai_cache_lock);
+
+	hits = atomic_read(&info->msai_cache_hits);
+	misses = atomic_read(&info->msai_cache_misses);
+	if (hits + misses > 0) {
+		ratio = (int)(((unsigned long)hits * 100) /
+		              (unsigned long)(hits + misses));
+	}
+
+	ret = snprintf(page, count,
+	               "mode: writeback\n"
+	               "files: %d\n"
+	               "bytes: %llu\n"
+	               "capacity: %llu\n"
+	               "hits: %d\n"
+	               "misses: %d\n"
+	               "hit_ratio: %d%%\n"
+	               "fill_bytes: %llu\n"
+	               "evictions: %d\n",
+	               number, bytes, capacity,
+	               hits, misses, ratio, fill_bytes,
+	               atomic_read(&info->msai_cache_evictions));
+out:
+	MRETURN(ret);
+}
+
+int masync_cache_proc_read_capacity(struct msubject_async_info *info,
+                                    char *page, int count)
+{
+	__u64 capacity = 0;
+	int ret = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&info->msai_cache_lock);
+	capacity = info->msai_cache_capacity;
+	mtfs_spin_unlock(&info->msai_cache_lock);
+
+	ret = snprintf(page, count, "%llu\n", capacity);
+	MRETURN(ret);
+}
+
+/* Write capacity in bytes, 0 means no limit */
+int masync_cache_proc_write_capacity(struct msubject_async_info *info,
+                                     const char *buffer,
+                                     unsigned long count)
+{
+	char kern_buf[32];
+	char *end = NULL;
+	__u64 capacity = 0;
+	int over = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (count > (sizeof(kern_buf) - 1)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (copy_from_user(kern_buf, buffer, count)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	kern_buf[count] = '\0';
+
+	capacity = simple_strtoull(kern_buf, &end, 10);
+	if (kern_buf == end) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	mtfs_spin_lock(&info->msai_cache_lock);
+	info->msai_cache_capacity = capacity;
+	over = masync_cache_over_nonlock(info);
+	mtfs_spin_unlock(&info->msai_cache_lock);
+
+	if (over) {
+		atomic_set(&the_async.msa_cache_wanted, 1);
+		masync_service_wakeup();
+	}
+out:
+	if (ret) {
+		MRETURN(ret);
+	}
+	MRETURN(count);
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#ifndef __MTFS_ASYNC_CACHE_INTERNAL_H__
+#define __MTFS_ASYNC_CACHE_INTERNAL_H__
+#include <mtfs_async.h>
+#include "async_internal.h"
+
+void masync_cache_info_init(struct msubject_async_info *info);
+void masync_cache_enable(struct msubject_async_info *info);
+void masync_cache_bucket_init(struct masync_bucket *bucket);
+void masync_cache_bucket_fini(struct masync_bucket *bucket);
+int masync_cache_wanted(void);
+void masync_cache_shrink(void);
+int masync_cache_proc_read(struct msubject_async_info *info,
+                           char *page, int count);
+int masync_cache_proc_read_capacity(struct msubject_async_info *info,
+                                    char *page, int count);
+int masync_cache_proc_write_capacity(struct msubject_async_info *info,
+                                     const char *buffer,
+                                     unsigned long count);
+#endif /* __MTFS_ASYNC_CACHE_INTERNAL_H__ */
@@ -4,30 +4,33 @@
 
 #include <mtfs_async.h>
 #include "async_chunk_internal.h"
+#include "async_bucket_internal.h"
+#include "async_info_internal.h"
 
 struct masync_chunk *masync_chunk_init(struct masync_bucket *bucket,
-                                       __u64 start,
-                                       __u64 end)
+                                       __u64 start)
 {
 	struct masync_chunk *chunk = NULL;
 	MENTRY();
 
-	MASSERT(start + MASYNC_CHUNK_SIZE - 1 == end);
+	MASSERT((start & (MASYNC_CHUNK_SIZE - 1)) == 0);
 
 	MTFS_SLAB_ALLOC_PTR(chunk, mtfs_async_chunk_cache);
 	if (chunk == NULL) {
-		MERROR("failed to create interval, not enough memory\n");
+		MERROR("failed to create chunk, not enough memory\n");
 		goto out;
 	}
 
 	chunk->mac_bucket = bucket;
 	chunk->mac_info = bucket->mab_info;
-	MTFS_INIT_LIST_HEAD(&chunk->mac_linkage);
-	chunk->mac_start = start;
-	chunk->mac_end = end;
-	chunk->mac_size = end - start + 1;
+	masync_info_usage_inc(chunk->mac_info,
+	                      &chunk->mac_info->msai_object_bytes,
+	                      sizeof(*chunk));
+	MTFS_INIT_LIST_HEAD(&chunk->mac_interval.mi_linkage);
+	mtfs_interval_set(&chunk->mac_interval.mi_node,
+	                  start, start + MASYNC_CHUNK_SIZE - 1);
 	atomic_set(&chunk->mac_reference, 1);
-	init_MUTEX(&chunk->mac_lock);
+	atomic_set(&chunk->mac_writers, 0);
 out:
 	MRETURN(chunk);
 }
@@ -36,8 +39,12 @@ void masync_chunk_fini(struct masync_chunk *chunk)
 {
 	MENTRY();
 
-	MASSERT(mtfs_list_empty(&chunk->mac_linkage));
+	MASSERT(!mtfs_interval_is_intree(&chunk->mac_interval.mi_node));
 	MASSERT(atomic_read(&chunk->mac_reference) == 0);
+	MASSERT(atomic_read(&chunk->mac_writers) == 0);
+	masync_info_usage_dec(chunk->mac_info,
+	                      &chunk->mac_info->msai_object_bytes,
+	                      sizeof(*chunk));
 	MTFS_SLAB_FREE_PTR(chunk, mtfs_async_chunk_cache);
 
 	_MRETURN();
@@ -63,137 +70,326 @@ void masync_chunk_put(struct masync_chunk *chunk)
 	_MRETURN();
 }
 
-struct masync_chunk *masync_chunk_find(struct masync_bucket *bucket,
-                                       __u64 start,
-                                       __u64 end)
+/* Called holding mab_chunk_lock */
+static struct masync_chunk *masync_chunk_find(struct masync_bucket *bucket,
+                                              __u64 start)
 {
-	struct masync_chunk *chunk = NULL;
+	struct mtfs_interval_node_extent extent;
+	struct mtfs_interval_node *node = NULL;
 	struct masync_chunk *find = NULL;
 	MENTRY();
 
-	mtfs_list_for_each_entry(chunk,
-	                         &bucket->mab_chunks,
-	                         mac_linkage) {
-		if (chunk->mac_start == start) {
-			MASSERT(chunk->mac_end == end);
-			find = chunk;
-			masync_chunk_get(find);
-			break;
-		}
+	extent.start = start;
+	extent.end = start + MASYNC_CHUNK_SIZE - 1;
+	node = mtfs_interval_find(bucket->mab_chunk_root, &extent);
+	if (node != NULL) {
+		find = masync_interval2chunk(mtfs_node2interval(node));
 	}
 	MRETURN(find);
 }
 
+/* Called holding mab_chunk_lock */
+static void masync_chunk_erase(struct masync_bucket *bucket,
+                               struct masync_chunk *chunk,
+                               mtfs_list_t *free_list)
+{
+	mtfs_interval_erase(&chunk->mac_interval.mi_node,
+	                    &bucket->mab_chunk_root);
+	mtfs_list_add_tail(&chunk->mac_interval.mi_linkage, free_list);
+}
+
+static void masync_chunk_free_list(mtfs_list_t *free_list)
+{
+	struct mtfs_interval *interval = NULL;
+	struct mtfs_interval *n = NULL;
+
+	mtfs_list_for_each_entry_safe(interval, n, free_list, mi_linkage) {
+		mtfs_list_del_init(&interval->mi_linkage);
+		/* Chunk tree release reference */
+		masync_chunk_put(masync_interval2chunk(interval));
+	}
+}
+
 void masync_chunk_cleanup(struct masync_bucket *bucket)
 {
 	struct masync_chunk *chunk = NULL;
-	struct masync_chunk *n = NULL;
+	MTFS_LIST_HEAD(free_list);
 
-	down(&bucket->mab_chunk_lock);
-	mtfs_list_for_each_entry_safe(chunk,
-	                              n,
-	                              &bucket->mab_chunks,
-	                              mac_linkage) {
-		mtfs_list_del_init(&chunk->mac_linkage);
-		masync_chunk_put(chunk);
+	mtfs_spin_lock(&bucket->mab_chunk_lock);
+	while (bucket->mab_chunk_root) {
+		chunk = masync_interval2chunk(mtfs_node2interval(bucket->mab_chunk_root));
+		masync_chunk_erase(bucket, chunk, &free_list);
 	}
-	up(&bucket->mab_chunk_lock);
+	mtfs_spin_unlock(&bucket->mab_chunk_lock);
+
+	masync_chunk_free_list(&free_list);
 }
 
 /*
- * If failed to alloc, chunk will be set to NULL
+ * Get chunk of offset, create it if not exist.
+ * Return NULL if failed to alloc.
+ * Called holding mab_lock, which serializes chunk creation.
  */
-int masync_chunk_add(struct masync_bucket *bucket,
-                     struct masync_chunk **chunk,
-                     __u64 start,
-                     __u64 end)
+struct masync_chunk *masync_chunk_add(struct masync_bucket *bucket,
+                                      __u64 start)
 {
-	struct masync_chunk *tmp_chunk = NULL;
-	int ret = 0;
+	struct masync_chunk *chunk = NULL;
+	struct mtfs_interval_node *found = NULL;
 	MENTRY();
 
-	MASSERT(start + MASYNC_CHUNK_SIZE - 1 == end);
-
-	down(&bucket->mab_chunk_lock);
-	tmp_chunk = masync_chunk_find(bucket,
-	                               start,
-	                               end);
-	if (tmp_chunk == NULL) {
-		tmp_chunk = masync_chunk_init(bucket, start, end);
-		if (tmp_chunk != NULL) {
-			mtfs_list_add_tail(&tmp_chunk->mac_linkage,
-			                   &bucket->mab_chunks);
-			masync_chunk_get(tmp_chunk);
-		}
+	mtfs_spin_lock(&bucket->mab_chunk_lock);
+	chunk = masync_chunk_find(bucket, start);
+	mtfs_spin_unlock(&bucket->mab_chunk_lock);
+	if (chunk != NULL) {
+		goto out;
 	}
-	up(&bucket->mab_chunk_lock);
-	if (tmp_chunk == NULL) {
-		MERROR("failed to init chunk\n");
-		ret = -ENOMEM;
+
+	chunk = masync_chunk_init(bucket, start);
+	if (chunk == NULL) {
 		goto out;
 	}
 
-	*chunk = tmp_chunk;
+	mtfs_spin_lock(&bucket->mab_chunk_lock);
+	found = mtfs_interval_insert(&chunk->mac_interval.mi_node,
+	                             &bucket->mab_chunk_root);
+	MASSERT(!found);
+	mtfs_spin_unlock(&bucket->mab_chunk_lock);
 out:
-	MRETURN(ret);
+	MRETURN(chunk);
 }
 
-int masync_chunk_add_interval(struct masync_bucket *bucket,
-                              mtfs_list_t *chunks,
-                              __u64 start,
-                              __u64 end)
+/*
+ * Set dirty bits of blocks wholly inside [start, end].
+ * Bits are only a hint if failed to alloc chunk,
+ * writers then add extents as usual.
+ * Called holding mab_lock after extents covering the range are inserted,
+ * which must be dirty on every secondary branch.
+ */
+void masync_chunk_mark(struct masync_bucket *bucket,
+                       __u64 start,
+                       __u64 end)
 {
 	struct masync_chunk *chunk = NULL;
-	struct masync_chunk_linkage *linkage = NULL;
-	struct masync_chunk_linkage *head = NULL;
+	__u64 first = 0;
+	__u64 last = 0;
+	__u64 block = 0;
 	__u64 chunk_start = 0;
-	__u64 chunk_end = 0;
-	__u64 num = 0;
-	__u64 tmp_start = 0;
-	__u64 tmp_end = 0;
-	__u64 i = 0;
-	int ret = 0;
 	MENTRY();
 
-	MASSERT(mtfs_list_empty(chunks));
 	MASSERT(start <= end);
+	first = (start + MASYNC_BLOCK_SIZE - 1) >> MASYNC_BLOCK_SHIFT;
+	if (first == 0 && start != 0) {
+		/* Overflowed */
+		goto out;
+	}
 
-	chunk_start = start / MASYNC_CHUNK_SIZE;
-	chunk_end = end / MASYNC_CHUNK_SIZE;
-	num = chunk_end - chunk_start + 1;
+	if (end == MTFS_INTERVAL_EOF) {
+		last = end >> MASYNC_BLOCK_SHIFT;
+	} else if (((end + 1) >> MASYNC_BLOCK_SHIFT) == 0) {
+		goto out;
+	} else {
+		last = ((end + 1) >> MASYNC_BLOCK_SHIFT) - 1;
+	}
 
-	for (i = 0; i < num; i++) {
-		MTFS_ALLOC_PTR(linkage);
-		if (linkage == NULL) {
-			goto out_clean;
+	for (block = first; block <= last && block >= first; block++) {
+		if (chunk == NULL ||
+		    (block << MASYNC_BLOCK_SHIFT) > mtfs_interval_high(&chunk->mac_interval.mi_node)) {
+			chunk_start = (block << MASYNC_BLOCK_SHIFT) &
+			              ~(MASYNC_CHUNK_SIZE - 1);
+			chunk = masync_chunk_add(bucket, chunk_start);
+			if (chunk == NULL) {
+				MERROR("failed to add chunk [%llu, %llu]\n",
+				       chunk_start,
+				       chunk_start + MASYNC_CHUNK_SIZE - 1);
+				/* Skip the chunk */
+				block = ((chunk_start + MASYNC_CHUNK_SIZE) >> MASYNC_BLOCK_SHIFT) - 1;
+				continue;
+			}
 		}
+		mtfs_set_bit(block & (MASYNC_CHUNK_BLOCKS - 1), chunk->mac_dirty);
+	}
+out:
+	_MRETURN();
+}
+
+struct masync_chunk_clear_args {
+	__u64        mcca_start;
+	__u64        mcca_end;
+	/* Chunks with writers relying on bits cleared */
+	int          mcca_busy;
+	/* Chunks totally clean, to be released */
+	mtfs_list_t  mcca_free;
+};
+
+static enum mtfs_interval_iter masync_chunk_clear_cb(struct mtfs_interval_node *node,
+                                                     void *args)
+{
+	struct masync_chunk_clear_args *clear_args = args;
+	struct masync_chunk *chunk = NULL;
+	__u64 start = clear_args->mcca_start;
+	__u64 end = clear_args->mcca_end;
+	int first = 0;
+	int last = MASYNC_CHUNK_BLOCKS - 1;
+	int bit = 0;
+
+	chunk = masync_interval2chunk(mtfs_node2interval(node));
+	if (start > mtfs_interval_low(node)) {
+		first = (start - mtfs_interval_low(node)) >> MASYNC_BLOCK_SHIFT;
+	}
+	if (end < mtfs_interval_high(node)) {
+		last = (end - mtfs_interval_low(node)) >> MASYNC_BLOCK_SHIFT;
+	}
+
+	for (bit = mtfs_find_next_bit(chunk->mac_dirty, MASYNC_CHUNK_BLOCKS, first);
+	     bit <= last && bit < MASYNC_CHUNK_BLOCKS;
+	     bit = mtfs_find_next_bit(chunk->mac_dirty, MASYNC_CHUNK_BLOCKS, bit + 1)) {
+		mtfs_clear_bit(bit, chunk->mac_dirty);
+	}
+
+	if (atomic_read(&chunk->mac_writers)) {
+		clear_args->mcca_busy++;
+	} else if (mtfs_find_first_bit(chunk->mac_dirty, MASYNC_CHUNK_BLOCKS) >=
+	           MASYNC_CHUNK_BLOCKS &&
+	           chunk->mac_region_epoch != chunk->mac_bucket->mab_region_epoch) {
+		/* Logged regions are kept until the file is totally clean */
+		mtfs_list_add_tail(&chunk->mac_interval.mi_linkage,
+		                   &clear_args->mcca_free);
+	}
+	return MTFS_INTERVAL_ITER_CONT;
+}
+
+/*
+ * Clear dirty bits of blocks overlapping [start, end].
+ * Extents never overlap, so a block with dirty bit overlapping
+ * an extent is wholly inside it.
+ * Return number of chunks that writers are relying on,
+ * which means the range is still being written.
+ * Called holding mab_lock.
+ */
+int masync_chunk_clear(struct masync_bucket *bucket,
+                       __u64 start,
+                       __u64 end)
+{
+	struct masync_chunk_clear_args args;
+	struct mtfs_interval_node_extent extent;
+	struct mtfs_interval *interval = NULL;
+	struct mtfs_interval *n = NULL;
+	MTFS_LIST_HEAD(free_list);
+	MENTRY();
+
+	args.mcca_start = start;
+	args.mcca_end = end;
+	args.mcca_busy = 0;
+	MTFS_INIT_LIST_HEAD(&args.mcca_free);
+	extent.start = start;
+	extent.end = end;
+
+	mtfs_spin_lock(&bucket->mab_chunk_lock);
+	mtfs_interval_search(bucket->mab_chunk_root, &extent,
+	                     masync_chunk_clear_cb, &args);
+	mtfs_list_for_each_entry_safe(interval, n, &args.mcca_free, mi_linkage) {
+		mtfs_list_del_init(&interval->mi_linkage);
+		masync_chunk_erase(bucket, masync_interval2chunk(interval),
+		                   &free_list);
+	}
+	mtfs_spin_unlock(&bucket->mab_chunk_lock);
+
+	masync_chunk_free_list(&free_list);
+	MRETURN(args.mcca_busy);
+}
+
+/*
+ * Return number of chunks in [start, end] whose regions are not logged,
+ * or MASYNC_REGION_MAX + 1 if there are too many chunks to count.
+ */
+int masync_chunk_unlogged(struct masync_bucket *bucket,
+                          __u64 start,
+                          __u64 end)
+{
+	struct masync_chunk *chunk = NULL;
+	__u64 chunk_start = start & ~(MASYNC_CHUNK_SIZE - 1);
+	__u64 number = 0;
+	int unlogged = 0;
+	MENTRY();
+
+	MASSERT(start <= end);
+	number = (end >> MASYNC_CHUNK_SHIFT) - (start >> MASYNC_CHUNK_SHIFT) + 1;
+	if (number > MASYNC_REGION_MAX) {
+		unlogged = MASYNC_REGION_MAX + 1;
+		goto out;
+	}
 
-	     	tmp_start = (chunk_start + i) * MASYNC_CHUNK_SIZE;
-		tmp_end = tmp_start + MASYNC_CHUNK_SIZE - 1;
-		ret = masync_chunk_add(bucket,
-		                       &chunk,
-		                       tmp_start,
-		                       tmp_end);
-		if (ret) {
-			MERROR("failed to add chunk [%llu, %llu], ret = %d\n",
-			       tmp_start, tmp_end, ret);
-			MTFS_FREE_PTR(linkage);
-			goto out_clean;
+	mtfs_spin_lock(&bucket->mab_chunk_lock);
+	for (; number > 0; number--, chunk_start += MASYNC_CHUNK_SIZE) {
+		chunk = masync_chunk_find(bucket, chunk_start);
+		if (chunk == NULL ||
+		    chunk->mac_region_epoch != bucket->mab_region_epoch) {
+			unlogged++;
 		}
+	}
+	mtfs_spin_unlock(&bucket->mab_chunk_lock);
+out:
+	MRETURN(unlogged);
+}
 
-		linkage->macl_chunk = chunk;
-		mtfs_list_add_tail(&linkage->macl_linkage,
-		                   chunks);
+/*
+ * Try to write [start, end] without adding an extent.
+ * Succeed only if the range is inside a single chunk and every block
+ * it touches is dirty, i.e. covered by extents not synced to any branch.
+ * The chunk is pinned until masync_chunk_write_end(), so that
+ * a flush clearing its bits will retry rather than miss the write.
+ * Return the chunk if succeeded, NULL otherwise.
+ */
+struct masync_chunk *masync_chunk_write_start(struct masync_bucket *bucket,
+                                              __u64 start,
+                                              __u64 end)
+{
+	struct masync_chunk *chunk = NULL;
+	__u64 chunk_start = start & ~(MASYNC_CHUNK_SIZE - 1);
+	int first = 0;
+	int last = 0;
+	MENTRY();
+
+	MASSERT(start <= end);
+	if ((end & ~(MASYNC_CHUNK_SIZE - 1)) != chunk_start) {
+		goto out;
 	}
 
-	goto out;
-out_clean:
-	mtfs_list_for_each_entry_safe(linkage, head, chunks, macl_linkage) {
-		mtfs_list_del(&linkage->macl_linkage);
-		chunk = linkage->macl_chunk;
-		masync_chunk_put(chunk);
-		MTFS_FREE_PTR(linkage);
+	if (bucket->mab_chunk_root == NULL) {
+		goto out;
+	}
+
+	mtfs_spin_lock(&bucket->mab_chunk_lock);
+	chunk = masync_chunk_find(bucket, chunk_start);
+	if (chunk != NULL) {
+		masync_chunk_get(chunk);
+		atomic_inc(&chunk->mac_writers);
+	}
+	mtfs_spin_unlock(&bucket->mab_chunk_lock);
+	if (chunk == NULL) {
+		goto out;
+	}
+
+	/*
+	 * Bits cleared before mac_writers was seen by masync_chunk_clear()
+	 * are visible here because of mab_chunk_lock.
+	 */
+	first = (start - chunk_start) >> MASYNC_BLOCK_SHIFT;
+	last = (end - chunk_start) >> MASYNC_BLOCK_SHIFT;
+	if (mtfs_find_next_zero_bit(chunk->mac_dirty, last + 1, first) <= last) {
+		masync_chunk_write_end(chunk);
+		chunk = NULL;
 	}
 out:
-	MRETURN(ret);
+	MRETURN(chunk);
+}
+
+void masync_chunk_write_end(struct masync_chunk *chunk)
+{
+	MENTRY();
+
+	atomic_dec(&chunk->mac_writers);
+	masync_chunk_put(chunk);
+
+	_MRETURN();
 }
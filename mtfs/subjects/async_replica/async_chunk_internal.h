@@ -8,10 +8,24 @@
 #include <mtfs_async.h>
 
 struct masync_chunk *masync_chunk_init(struct masync_bucket *bucket,
-                                      __u64 start,
-                                      __u64 end);
+                                       __u64 start);
 void masync_chunk_fini(struct masync_chunk *chunk);
 void masync_chunk_get(struct masync_chunk *chunk);
 void masync_chunk_put(struct masync_chunk *chunk);
 void masync_chunk_cleanup(struct masync_bucket *bucket);
+struct masync_chunk *masync_chunk_add(struct masync_bucket *bucket,
+                                      __u64 start);
+int masync_chunk_unlogged(struct masync_bucket *bucket,
+                          __u64 start,
+                          __u64 end);
+void masync_chunk_mark(struct masync_bucket *bucket,
+                       __u64 start,
+                       __u64 end);
+int masync_chunk_clear(struct masync_bucket *bucket,
+                       __u64 start,
+                       __u64 end);
+struct masync_chunk *masync_chunk_write_start(struct masync_bucket *bucket,
+                                              __u64 start,
+                                              __u64 end);
+void masync_chunk_write_end(struct masync_chunk *chunk);
 #endif /* __MTFS_ASYNC_CHUNK_INTERNAL_H__ */
@@ -8,10 +8,32 @@
 #include "async_extent_internal.h"
 #include "async_bucket_internal.h"
 #include "async_chunk_internal.h"
+#include "async_intent_internal.h"
+
+/*
+ * The conflict of a parked flush went away, put it back to cancel list.
+ * The reference of cancel list is kept while parked.
+ */
+static void masync_extent_deferred_notify(struct mlock_deferred *deferred)
+{
+	struct masync_extent *async_extent = NULL;
+	MENTRY();
+
+	async_extent = container_of(deferred, struct masync_extent, mae_deferred);
+	mtfs_spin_lock(&the_async.msa_cancel_lock);
+	MASSERT(mtfs_list_empty(&async_extent->mae_cancel_linkage));
+	mtfs_list_add_tail(&async_extent->mae_cancel_linkage,
+	                   &the_async.msa_cancel_extents);
+	mtfs_spin_unlock(&the_async.msa_cancel_lock);
+
+	masync_service_wakeup();
+	_MRETURN();
+}
 
 struct masync_extent *masync_extent_init(struct masync_bucket *bucket)
 {
 	struct masync_extent *async_extent = NULL;
+	mtfs_bindex_t bnum = mtfs_i2bnum(mtfs_bucket2inode(bucket));
 	MENTRY();
 
 	MTFS_SLAB_ALLOC_PTR(async_extent, mtfs_async_extent_cache);
@@ -22,11 +44,16 @@ struct masync_extent *masync_extent_init(struct masync_bucket *bucket)
 
 	async_extent->mae_bucket = bucket;
 	async_extent->mae_info = bucket->mab_info;
-	mtfs_spin_lock_init(&async_extent->mae_lock);
+	masync_info_usage_inc(async_extent->mae_info,
+	                      &async_extent->mae_info->msai_object_bytes,
+	                      sizeof(*async_extent));
+	mutex_init(&async_extent->mae_lock);
 	MTFS_INIT_LIST_HEAD(&async_extent->mae_lru_linkage);
 	MTFS_INIT_LIST_HEAD(&async_extent->mae_cancel_linkage);
-	MTFS_INIT_LIST_HEAD(&async_extent->mae_chunks);
+	mlock_deferred_init(&async_extent->mae_deferred,
+	                    masync_extent_deferred_notify);
 	atomic_set(&async_extent->mae_reference, 0);
+	masync_dirty_init(async_extent->mae_dirty, bnum);
 
 out:
 	MRETURN(async_extent);
@@ -35,26 +62,16 @@ out:
 
 void masync_extent_fini(struct masync_extent *async_extent)
 {
-	struct masync_chunk *chunk = NULL;
-	struct masync_chunk_linkage *linkage = NULL;
-	struct masync_chunk_linkage *head = NULL;
 	MENTRY();
 
-	mtfs_list_for_each_entry_safe(linkage,
-	                              head,
-	                              &async_extent->mae_chunks,
-	                              macl_linkage) {
-		mtfs_list_del(&linkage->macl_linkage);
-		chunk = linkage->macl_chunk;
-		masync_chunk_put(chunk);
-		MTFS_FREE_PTR(linkage);
-	}
-
 	MASSERT(async_extent->mae_bucket == NULL);
-	MASSERT(mtfs_list_empty(&async_extent->mae_chunks));
 	MASSERT(mtfs_list_empty(&async_extent->mae_lru_linkage));
 	MASSERT(mtfs_list_empty(&async_extent->mae_cancel_linkage));
+	MASSERT(mtfs_list_empty(&async_extent->mae_deferred.mld_linkage));
 	MASSERT(atomic_read(&async_extent->mae_reference) == 0);
+	masync_info_usage_dec(async_extent->mae_info,
+	                      &async_extent->mae_info->msai_object_bytes,
+	                      sizeof(*async_extent));
 	MTFS_SLAB_FREE_PTR(async_extent, mtfs_async_extent_cache);
 
 	_MRETURN();
@@ -80,10 +97,34 @@ void masync_extent_put(struct masync_extent *async_extent)
 	_MRETURN();
 }
 
+/*
+ * Set dirty bits of chunks back after a flush gave up.
+ * Skipped if some branch has been synced, writers then add extents
+ * that make every branch dirty again.
+ * Called holding mab_lock.
+ */
+static void masync_extent_chunk_remark(struct masync_bucket *bucket,
+                                       struct masync_extent *async_extent,
+                                       mtfs_bindex_t bnum)
+{
+	struct mtfs_interval_node_extent *extent = NULL;
+	MENTRY();
+
+	if (masync_dirty_full(async_extent->mae_dirty, bnum)) {
+		extent = &async_extent->mae_interval.mi_node.in_extent;
+		masync_chunk_mark(bucket, extent->start, extent->end);
+	}
+
+	_MRETURN();
+}
+
 /*
  * Flush extent and release it.
  * Please make sure reference is 1 or 2 while calling.
- * Return 0 if succeeded, return 1 if retry is needed.
+ * Return MASYNC_FLUSH_DONE if succeeded or skipped,
+ * MASYNC_FLUSH_RETRY if retry is needed,
+ * MASYNC_FLUSH_AGAIN if lagging branches left the pass and are still dirty,
+ * MASYNC_FLUSH_PARKED if parked until the conflict goes away.
  */
 int masync_extent_flush(struct masync_extent *async_extent,
                         char *buf,
@@ -95,17 +136,22 @@ int masync_extent_flush(struct masync_extent *async_extent,
 	struct inode             *inode = NULL;
 	struct mlock_resource    *resource = NULL;
 	struct mlock_enqueue_info einfo = {0};
+	struct mlog_cookie        cookies[MTFS_BRANCH_MAX];
+	struct masync_cookies     regions[MTFS_BRANCH_MAX];
+	struct super_block       *sb = NULL;
+	mtfs_bindex_t             bnum = 0;
+	int clean = 0;
 	int ret = 0;
 	MENTRY();
 
 	node = &async_extent->mae_interval;
-	mtfs_spin_lock(&async_extent->mae_lock);
+	mutex_lock(&async_extent->mae_lock);
 	bucket = async_extent->mae_bucket;
 	inode = mtfs_bucket2inode(bucket);
 	resource = mtfs_i2resource(inode);
 	if (bucket == NULL) {
 		/* Already been removed from tree */
-		mtfs_spin_unlock(&async_extent->mae_lock);
+		mutex_unlock(&async_extent->mae_lock);
 		goto out;
 	}
 
@@ -113,49 +159,98 @@ int masync_extent_flush(struct masync_extent *async_extent,
 	einfo.flag = MLOCK_FL_BLOCK_NOWAIT;
 	einfo.data.mlp_extent.start = node->mi_node.in_extent.start;
 	einfo.data.mlp_extent.end = node->mi_node.in_extent.end;
+	einfo.deferred = &async_extent->mae_deferred;
 	mlock = mlock_enqueue(resource, &einfo);
 	if (IS_ERR(mlock)) {
 		MDEBUG("failed to enqueue lock, ret = %d\n", PTR_ERR(mlock));
-		mtfs_spin_unlock(&async_extent->mae_lock);
-		ret = 1;
+		mutex_unlock(&async_extent->mae_lock);
+		if (PTR_ERR(mlock) == -EWOULDBLOCK) {
+			/* Parked on resource, notified by mlock_cancel() */
+			ret = MASYNC_FLUSH_PARKED;
+		} else {
+			ret = MASYNC_FLUSH_RETRY;
+		}
 		goto out;
 	}
 
-	if (down_trylock(&bucket->mab_lock)) {
+	if (masync_bucket_trylock(bucket, &async_extent->mae_deferred)) {
 		MDEBUG("failed to lock bucket\n");
 		mlock_cancel(mlock);
-		mtfs_spin_unlock(&async_extent->mae_lock);
-		ret = 1;
+		mutex_unlock(&async_extent->mae_lock);
+		/* Parked on bucket, notified by masync_bucket_unlock() */
+		ret = MASYNC_FLUSH_PARKED;
 		goto out;
 	}
 
 	MASSERT(async_extent->mae_bucket);
 	MASSERT(atomic_read(&async_extent->mae_reference) == 2);
+	bnum = mtfs_i2bnum(inode);
 
-	if (bucket->mab_fvalid) {
+	/*
+	 * Clear dirty bits before reading primary branch,
+	 * so that no writer will skip adding extent since now.
+	 */
+	if (masync_chunk_clear(bucket,
+	                       node->mi_node.in_extent.start,
+	                       node->mi_node.in_extent.end)) {
+		MDEBUG("extent is being written\n");
+		masync_extent_chunk_remark(bucket, async_extent, bnum);
+		masync_bucket_unlock(bucket);
+		mlock_cancel(mlock);
+		mutex_unlock(&async_extent->mae_lock);
+		ret = MASYNC_FLUSH_RETRY;
+		goto out;
+	}
 
+	if (bucket->mab_fvalid) {
+		/* One read of primary feeds every dirty branch */
 		ret = masync_sync_file(bucket,
 		                       &node->mi_node.in_extent,
+		                       async_extent->mae_dirty,
 		                       buf, buf_size);
 		if (ret) {
-			MERROR("failed to sync file between branches\n");
-			mtfs_inode_size_dump(inode);
-			masync_extets_dump(bucket); 
-			up(&bucket->mab_lock);
+			if (ret == -ECANCELED) {
+				/* Truncate is dropping it, skipped on retry */
+				MDEBUG("extent is being truncated\n");
+			} else {
+				MERROR("failed to sync file between branches\n");
+				mtfs_inode_size_dump(inode);
+				masync_extets_dump(bucket);
+			}
+			masync_extent_chunk_remark(bucket, async_extent, bnum);
+			masync_bucket_unlock(bucket);
+			mlock_cancel(mlock);
+			mutex_unlock(&async_extent->mae_lock);
+			ret = MASYNC_FLUSH_RETRY;
+			goto out;
+		}
+
+		if (masync_dirty_next(async_extent->mae_dirty, bnum, 1)) {
+			/* Lagging branches get their turn after other extents */
+			masync_bucket_unlock(bucket);
 			mlock_cancel(mlock);
-			mtfs_spin_unlock(&async_extent->mae_lock);
-			ret = 1;
+			mutex_unlock(&async_extent->mae_lock);
+			ret = MASYNC_FLUSH_AGAIN;
 			goto out;
 		}
 	}
-	atomic_dec(&bucket->mab_number);
-	mtfs_interval_erase(&node->mi_node, &bucket->mab_root);
+
+	masync_bucket_extent_erase(bucket, &node->mi_node);
+	masync_bucket_dirty_update(bucket);
 
 	/* Export that this extent is not used since now */
 	async_extent->mae_bucket = NULL;
-	up(&bucket->mab_lock);
+
+	/* Bucket is totally clean, detach its intent records */
+	clean = masync_intent_detach(bucket, cookies, regions);
+	sb = inode->i_sb;
+	masync_bucket_unlock(bucket);
 	mlock_cancel(mlock);
-	mtfs_spin_unlock(&async_extent->mae_lock);
+	mutex_unlock(&async_extent->mae_lock);
+
+	if (clean) {
+		masync_intent_cancel_detached(sb, cookies, regions);
+	}
 
 	/* Extent tree release reference */
 	masync_extent_put(async_extent);
@@ -89,6 +89,23 @@ static inline void masync_extent_remove_from_lru(struct masync_extent *extent)
 	_MRETURN();
 }
 
+/* Called holding mab_lock */
+static inline void masync_extent_dirty_merge(struct masync_extent *extent,
+                                             struct masync_extent *from)
+{
+	int i = 0;
+
+	for (i = 0; i < MASYNC_BRANCH_LONGS; i++) {
+		extent->mae_dirty[i] |= from->mae_dirty[i];
+	}
+}
+
+/* Return values of masync_extent_flush() */
+#define MASYNC_FLUSH_DONE   0 /* Flushed or skipped, release the reference */
+#define MASYNC_FLUSH_RETRY  1 /* Failed, put it back to cancel list */
+#define MASYNC_FLUSH_PARKED 2 /* Requeued by notify when conflict goes away */
+#define MASYNC_FLUSH_AGAIN  3 /* Lagging branches left, put it back for them */
+
 int masync_extent_flush(struct masync_extent *async_extent,
 			char *buf,
                         int buf_size);
@@ -2,12 +2,16 @@
  * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
  */
 
+#include <linux/uaccess.h>
 #include <thread.h>
 #include <mtfs_super.h>
 #include <mtfs_inode.h>
 #include <mtfs_device.h>
 #include "async_extent_internal.h"
 #include "async_info_internal.h"
+#include "async_recover_internal.h"
+#include "async_bloom_internal.h"
+#include "async_cache_internal.h"
 #include "async_internal.h"
 
 static int masync_proc_read_dirty(char *page, char **start, off_t off, int count,
@@ -38,8 +42,243 @@ static int masync_proc_read_dirty(char *page, char **start, off_t off, int count
 	MRETURN(ret);
 }
 
+static int masync_proc_read_intent(char *page, char **start, off_t off, int count,
+                                   int *eof, void *data)
+{
+	int ret = 0;
+	struct msubject_async_info *async_info = NULL;
+	MENTRY();
+
+	*eof = 1;
+
+	async_info = (struct msubject_async_info *)data;
+	ret = snprintf(page, count, "batches: %d\nrecords: %d\nregions: %d\n",
+	               atomic_read(&async_info->msai_intent_batches),
+	               atomic_read(&async_info->msai_intent_records),
+	               atomic_read(&async_info->msai_region_records));
+
+	MRETURN(ret);
+}
+
+static int masync_proc_read_recovery(char *page, char **start, off_t off, int count,
+                                     int *eof, void *data)
+{
+	int ret = 0;
+	struct msubject_async_info *async_info = NULL;
+	MENTRY();
+
+	*eof = 1;
+
+	async_info = (struct msubject_async_info *)data;
+	ret = masync_recover_proc_read(async_info, page, count);
+
+	MRETURN(ret);
+}
+
+static int masync_proc_read_bloom(char *page, char **start, off_t off, int count,
+                                  int *eof, void *data)
+{
+	int ret = 0;
+	struct msubject_async_info *async_info = NULL;
+	MENTRY();
+
+	*eof = 1;
+
+	async_info = (struct msubject_async_info *)data;
+	ret = masync_bloom_proc_read(async_info, page, count);
+
+	MRETURN(ret);
+}
+
+static int masync_proc_read_cache(char *page, char **start, off_t off, int count,
+                                  int *eof, void *data)
+{
+	int ret = 0;
+	struct msubject_async_info *async_info = NULL;
+	MENTRY();
+
+	*eof = 1;
+
+	async_info = (struct msubject_async_info *)data;
+	ret = masync_cache_proc_read(async_info, page, count);
+
+	MRETURN(ret);
+}
+
+static int masync_proc_read_cache_capacity(char *page, char **start, off_t off,
+                                           int count, int *eof, void *data)
+{
+	struct msubject_async_info *async_info = (struct msubject_async_info *)data;
+
+	*eof = 1;
+	return masync_cache_proc_read_capacity(async_info, page, count);
+}
+
+static int masync_proc_write_cache_capacity(struct file *file, const char *buffer,
+                                            unsigned long count, void *data)
+{
+	struct msubject_async_info *async_info = (struct msubject_async_info *)data;
+
+	return masync_cache_proc_write_capacity(async_info, buffer, count);
+}
+
+static int masync_proc_read_throttle(char *page, char **start, off_t off, int count,
+                                     int *eof, void *data)
+{
+	int ret = 0;
+	struct msubject_async_info *async_info = NULL;
+	__u64 dirty_bytes = 0;
+	__u64 object_bytes = 0;
+	MENTRY();
+
+	*eof = 1;
+
+	async_info = (struct msubject_async_info *)data;
+	mtfs_spin_lock(&async_info->msai_throttle_lock);
+	dirty_bytes = async_info->msai_dirty_bytes;
+	object_bytes = async_info->msai_object_bytes;
+	mtfs_spin_unlock(&async_info->msai_throttle_lock);
+
+	ret = snprintf(page, count,
+	               "dirty_bytes: %llu\n"
+	               "object_bytes: %llu\n"
+	               "throttled: %d\n"
+	               "blocked: %d\n",
+	               dirty_bytes, object_bytes,
+	               atomic_read(&async_info->msai_throttled),
+	               atomic_read(&async_info->msai_blocked));
+
+	MRETURN(ret);
+}
+
+static int masync_proc_limit_read(struct msubject_async_info *async_info,
+                                  char *page, int count,
+                                  __u64 *soft, __u64 *hard)
+{
+	int ret = 0;
+	__u64 soft_limit = 0;
+	__u64 hard_limit = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&async_info->msai_throttle_lock);
+	soft_limit = *soft;
+	hard_limit = *hard;
+	mtfs_spin_unlock(&async_info->msai_throttle_lock);
+
+	ret = snprintf(page, count, "%llu %llu\n", soft_limit, hard_limit);
+
+	MRETURN(ret);
+}
+
+/* Write "soft hard" in bytes, hard limit 0 means no limit */
+static int masync_proc_limit_write(struct msubject_async_info *async_info,
+                                   const char *buffer, unsigned long count,
+                                   __u64 *soft, __u64 *hard)
+{
+	int ret = 0;
+	char kern_buf[64];
+	char *end = NULL;
+	char *pbuf = NULL;
+	__u64 soft_limit = 0;
+	__u64 hard_limit = 0;
+	MENTRY();
+
+	if (count > (sizeof(kern_buf) - 1)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (copy_from_user(kern_buf, buffer, count)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	kern_buf[count] = '\0';
+
+	pbuf = kern_buf;
+	soft_limit = simple_strtoull(pbuf, &end, 10);
+	if (pbuf == end) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	pbuf = end;
+	hard_limit = simple_strtoull(pbuf, &end, 10);
+	if (pbuf == end) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (hard_limit != 0 && soft_limit > hard_limit) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	mtfs_spin_lock(&async_info->msai_throttle_lock);
+	*soft = soft_limit;
+	*hard = hard_limit;
+	mtfs_spin_unlock(&async_info->msai_throttle_lock);
+
+	/* Limits may be raised */
+	wake_up(&async_info->msai_throttle_waitq);
+out:
+	if (ret) {
+		MRETURN(ret);
+	}
+	MRETURN(count);
+}
+
+static int masync_proc_read_dirty_limit(char *page, char **start, off_t off, int count,
+                                        int *eof, void *data)
+{
+	struct msubject_async_info *async_info = (struct msubject_async_info *)data;
+
+	*eof = 1;
+	return masync_proc_limit_read(async_info, page, count,
+	                              &async_info->msai_dirty_soft,
+	                              &async_info->msai_dirty_hard);
+}
+
+static int masync_proc_write_dirty_limit(struct file *file, const char *buffer,
+                                         unsigned long count, void *data)
+{
+	struct msubject_async_info *async_info = (struct msubject_async_info *)data;
+
+	return masync_proc_limit_write(async_info, buffer, count,
+	                               &async_info->msai_dirty_soft,
+	                               &async_info->msai_dirty_hard);
+}
+
+static int masync_proc_read_object_limit(char *page, char **start, off_t off, int count,
+                                         int *eof, void *data)
+{
+	struct msubject_async_info *async_info = (struct msubject_async_info *)data;
+
+	*eof = 1;
+	return masync_proc_limit_read(async_info, page, count,
+	                              &async_info->msai_object_soft,
+	                              &async_info->msai_object_hard);
+}
+
+static int masync_proc_write_object_limit(struct file *file, const char *buffer,
+                                          unsigned long count, void *data)
+{
+	struct msubject_async_info *async_info = (struct msubject_async_info *)data;
+
+	return masync_proc_limit_write(async_info, buffer, count,
+	                               &async_info->msai_object_soft,
+	                               &async_info->msai_object_hard);
+}
+
 static struct mtfs_proc_vars masync_proc_vars[] = {
 	{ "dirty", masync_proc_read_dirty, NULL, NULL },
+	{ "intent", masync_proc_read_intent, NULL, NULL },
+	{ "recovery", masync_proc_read_recovery, NULL, NULL },
+	{ "bloom", masync_proc_read_bloom, NULL, NULL },
+	{ "throttle", masync_proc_read_throttle, NULL, NULL },
+	{ "dirty_limit", masync_proc_read_dirty_limit, masync_proc_write_dirty_limit, NULL },
+	{ "object_limit", masync_proc_read_object_limit, masync_proc_write_object_limit, NULL },
+	{ "cache", masync_proc_read_cache, NULL, NULL },
+	{ "cache_capacity", masync_proc_read_cache_capacity, masync_proc_write_cache_capacity, NULL },
 	{ 0 }
 };
 
@@ -95,6 +334,29 @@ struct msubject_async_info *masync_info_init(struct super_block *sb)
 	MTFS_INIT_LIST_HEAD(&info->msai_linkage);
 	atomic_set(&info->msai_reference, 0);
 	init_waitqueue_head(&info->msai_waitq);
+	MTFS_INIT_LIST_HEAD(&info->msai_intent_pending);
+	info->msai_intent_committing = 0;
+	mtfs_spin_lock_init(&info->msai_intent_lock);
+	init_waitqueue_head(&info->msai_intent_waitq);
+	atomic_set(&info->msai_intent_batches, 0);
+	atomic_set(&info->msai_intent_records, 0);
+	atomic_set(&info->msai_region_records, 0);
+	info->msai_recover = NULL;
+	mtfs_spin_lock_init(&info->msai_recover_lock);
+	info->msai_dirty_bytes = 0;
+	info->msai_object_bytes = 0;
+	info->msai_dirty_soft = MASYNC_DIRTY_SOFT_DEFAULT;
+	info->msai_dirty_hard = MASYNC_DIRTY_HARD_DEFAULT;
+	info->msai_object_soft = MASYNC_OBJECT_SOFT_DEFAULT;
+	info->msai_object_hard = MASYNC_OBJECT_HARD_DEFAULT;
+	mtfs_spin_lock_init(&info->msai_throttle_lock);
+	init_waitqueue_head(&info->msai_throttle_waitq);
+	atomic_set(&info->msai_throttled, 0);
+	atomic_set(&info->msai_blocked, 0);
+	/* Enabled by masync_bloom_init() */
+	info->msai_bloom_bindex = -1;
+	/* Enabled by masync_cache_enable() */
+	masync_cache_info_init(info);
 	masync_info_add_to_list(info);
 
 	ret = masync_info_proc_init(info, sb);
@@ -115,6 +377,7 @@ void masync_info_fini(struct msubject_async_info *info,
                       int force)
 {
 	int ret = 0;
+	struct mtfs_wait_info object_mwi = { 0 };
 	MENTRY();
 
 	/* TODO: masync_info_cleanup */
@@ -140,12 +403,24 @@ force_wait:
 		
 	}
 
+	/*
+	 * Extents left on cancel list account their memory to this info,
+	 * wait for selfheal service to release them.
+	 */
+	mtfs_wait_event(info->msai_throttle_waitq,
+	                masync_info_object_empty(info), &object_mwi);
+
 	/* TODO: masync_info_cleanup */
 	MASSERT(info);
 	MASSERT(mtfs_list_empty(&info->msai_lru_extents));
 	MASSERT(mtfs_list_empty(&info->msai_buckets));
+	MASSERT(mtfs_list_empty(&info->msai_intent_pending));
+	MASSERT(info->msai_recover == NULL);
+	MASSERT(info->msai_bloom_bindex < 0);
 	MASSERT(atomic_read(&info->msai_lru_number) == 0);
 	MASSERT(atomic_read(&info->msai_reference) == 0);
+	MASSERT(info->msai_dirty_bytes == 0);
+	MASSERT(mtfs_list_empty(&info->msai_cache_lru));
 	masync_info_proc_fini(info, sb);
 
 	MTFS_FREE_PTR(info);
@@ -226,3 +501,84 @@ int masync_info_shrink(struct msubject_async_info *info,
 }
 
 
+
+/* Pause in jiffies, growing from 1 at soft limit to the max at hard limit */
+static long masync_throttle_pause(__u64 usage, __u64 soft, __u64 hard)
+{
+	unsigned long over = 0;
+	unsigned long step = 0;
+
+	if (hard == 0 || usage <= soft) {
+		return 0;
+	}
+
+	if (usage >= hard) {
+		return MASYNC_THROTTLE_PAUSE_MAX;
+	}
+
+	/* In KB, so that no 64 bit division is needed */
+	over = (unsigned long)((usage - soft) >> 10);
+	step = (unsigned long)((hard - soft) >> 10) / MASYNC_THROTTLE_PAUSE_MAX + 1;
+	return over / step + 1;
+}
+
+/*
+ * Slow down writers when extents use too much memory or cover too much
+ * dirty data, and let selfheal service drain some extents.
+ * Above soft limits, writers pause in proportion to the usage.
+ * Above hard limits, writers block until usage drops below them.
+ * Called before taking any lock of the file.
+ */
+void masync_info_throttle(struct msubject_async_info *info)
+{
+	long pause = 0;
+	long object_pause = 0;
+	int over_hard = 0;
+	int ret = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&info->msai_throttle_lock);
+	pause = masync_throttle_pause(info->msai_dirty_bytes,
+	                              info->msai_dirty_soft,
+	                              info->msai_dirty_hard);
+	object_pause = masync_throttle_pause(info->msai_object_bytes,
+	                                     info->msai_object_soft,
+	                                     info->msai_object_hard);
+	over_hard = masync_info_over_hard_nonlock(info);
+	mtfs_spin_unlock(&info->msai_throttle_lock);
+
+	if (object_pause > pause) {
+		pause = object_pause;
+	}
+
+	if (pause == 0) {
+		goto out;
+	}
+
+	masync_info_shrink(info, MASYNC_THROTTLE_BATCH);
+	if (!over_hard) {
+		atomic_inc(&info->msai_throttled);
+		schedule_timeout_uninterruptible(pause);
+		goto out;
+	}
+
+	atomic_inc(&info->msai_blocked);
+	while (1) {
+		struct mtfs_wait_info mwi = MWI_TIMEOUT_INTR_ALL(MASYNC_THROTTLE_PAUSE_MAX,
+		                                                 NULL,
+		                                                 MWI_ON_SIGNAL_NOOP,
+		                                                 NULL);
+
+		ret = mtfs_wait_event(info->msai_throttle_waitq,
+		                      !masync_info_over_hard(info), &mwi);
+		if (ret != -ETIMEDOUT) {
+			/* Below hard limits, or killed */
+			break;
+		}
+
+		/* Selfheal service is slow, give it more */
+		masync_info_shrink(info, MASYNC_THROTTLE_BATCH);
+	}
+out:
+	_MRETURN();
+}
@@ -64,6 +64,62 @@ static inline void masync_info_put(struct msubject_async_info *info)
 	}
 }
 
+/* Called holding msai_throttle_lock */
+static inline int masync_info_over_hard_nonlock(struct msubject_async_info *info)
+{
+	return (info->msai_dirty_hard != 0 &&
+	        info->msai_dirty_bytes >= info->msai_dirty_hard) ||
+	       (info->msai_object_hard != 0 &&
+	        info->msai_object_bytes >= info->msai_object_hard);
+}
+
+static inline int masync_info_over_hard(struct msubject_async_info *info)
+{
+	int ret = 0;
+
+	mtfs_spin_lock(&info->msai_throttle_lock);
+	ret = masync_info_over_hard_nonlock(info);
+	mtfs_spin_unlock(&info->msai_throttle_lock);
+	return ret;
+}
+
+static inline int masync_info_object_empty(struct msubject_async_info *info)
+{
+	int ret = 0;
+
+	mtfs_spin_lock(&info->msai_throttle_lock);
+	ret = (info->msai_object_bytes == 0);
+	mtfs_spin_unlock(&info->msai_throttle_lock);
+	return ret;
+}
+
+/* Account usage, either msai_dirty_bytes or msai_object_bytes */
+static inline void masync_info_usage_inc(struct msubject_async_info *info,
+                                         __u64 *usage, __u64 bytes)
+{
+	mtfs_spin_lock(&info->msai_throttle_lock);
+	*usage += bytes;
+	mtfs_spin_unlock(&info->msai_throttle_lock);
+}
+
+/* Release usage and wake writers blocked at hard limits */
+static inline void masync_info_usage_dec(struct msubject_async_info *info,
+                                         __u64 *usage, __u64 bytes)
+{
+	int wake = 0;
+
+	mtfs_spin_lock(&info->msai_throttle_lock);
+	MASSERT(*usage >= bytes);
+	*usage -= bytes;
+	wake = !masync_info_over_hard_nonlock(info) || info->msai_object_bytes == 0;
+	mtfs_spin_unlock(&info->msai_throttle_lock);
+
+	if (wake && waitqueue_active(&info->msai_throttle_waitq)) {
+		wake_up(&info->msai_throttle_waitq);
+	}
+}
+
+void masync_info_throttle(struct msubject_async_info *info);
 int masync_calculate_all(struct msubject_async_info *info);
 struct msubject_async_info *masync_info_init(struct super_block *sb);
 void masync_info_fini(struct msubject_async_info *info,
@@ -0,0 +1,816 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <linux/module.h>
+#include <thread.h>
+#include <mtfs_inode.h>
+#include <mtfs_dentry.h>
+#include <mtfs_super.h>
+#include <mtfs_device.h>
+#include <mtfs_lowerfs.h>
+#include <mtfs_log.h>
+#include <mtfs_context.h>
+#include "async_intent_internal.h"
+#include "async_bucket_internal.h"
+#include "async_chunk_internal.h"
+#include "async_recover_internal.h"
+#include "async_bloom_internal.h"
+
+/*
+ * Intent records tell the recovery which files may differ between branches.
+ * A record is only needed when a file changes from clean to dirty, so every
+ * bucket remembers whether its records are already in the logs. Buckets
+ * that become dirty at the same time are queued in the pending batch of the
+ * info. The first writer that finds no commit running becomes the leader and
+ * logs the records of the whole batch, the others just wait for it.
+ *
+ * Region records tell the recovery which chunks of a file may differ,
+ * so that it copies them rather than the whole file. Both kinds of records
+ * are canceled together when the file becomes totally clean.
+ * Fids of files with intent records are also kept in the filter of
+ * dirty files, see async_bloom.c.
+ */
+
+void masync_intent_init(struct masync_bucket *bucket)
+{
+	MENTRY();
+
+	bucket->mab_intent = MASYNC_INTENT_CLEAN;
+	bucket->mab_intent_writers = 0;
+	bucket->mab_intent_error = 0;
+	memset(bucket->mab_cookies, 0, sizeof(bucket->mab_cookies));
+	MTFS_INIT_LIST_HEAD(&bucket->mab_intent_linkage);
+	bucket->mab_intent_path = NULL;
+	bucket->mab_intent_path_len = 0;
+	init_MUTEX(&bucket->mab_region_lock);
+	memset(bucket->mab_regions, 0, sizeof(bucket->mab_regions));
+	bucket->mab_region_number = 0;
+	bucket->mab_region_whole = 0;
+	/* Zero is never the epoch, so that new chunks are not logged */
+	bucket->mab_region_epoch = 1;
+	bucket->mab_bloom_fid = 0;
+
+	_MRETURN();
+}
+
+/* Free cookies left by bucket, records are kept for recovery */
+void masync_intent_fini(struct masync_bucket *bucket)
+{
+	mtfs_bindex_t bindex = 0;
+	MENTRY();
+
+	for (bindex = 0; bindex < MTFS_BRANCH_MAX; bindex++) {
+		masync_cookies_free(&bucket->mab_regions[bindex]);
+	}
+
+	_MRETURN();
+}
+
+/*
+ * Cancel intent records in cookies.
+ * A cookie with zero index has never been logged.
+ */
+int masync_intent_cancel(struct super_block *sb,
+                         struct mlog_cookie *cookies)
+{
+	mtfs_bindex_t bindex = 0;
+	mtfs_bindex_t bnum = mtfs_s2bnum(sb);
+	struct mtfs_device *device = mtfs_s2dev(sb);
+	struct mtfs_lowerfs *lowerfs = NULL;
+	struct mtfs_run_ctxt saved;
+	struct mtfs_ucred ucred = { 0 };
+	int ret = 0;
+	int rc = 0;
+	MENTRY();
+
+	/* the owner of log file should always be root */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+
+	for (bindex = 0; bindex < bnum; bindex++) {
+		lowerfs = mtfs_dev2blowerfs(device, bindex);
+		if (!lowerfs->ml_trans_support) {
+			continue;
+		}
+		if (cookies[bindex].mgc_index == 0) {
+			continue;
+		}
+		MASSERT(mtfs_s2bcathandle(sb, bindex));
+		mtfs_push_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		rc = mlog_cat_cancel_records(mtfs_s2bcathandle(sb, bindex),
+		                             1,
+		                             &cookies[bindex]);
+		mtfs_pop_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		if (rc) {
+			MERROR("cancel mlog record[%d] failed: %d\n", bindex, rc);
+			ret = rc;
+		}
+	}
+
+	MRETURN(ret);
+}
+
+/*
+ * Cancel intent and region records detached from bucket and free the
+ * cookies. The intent record joins the region records of its branch, so
+ * that each branch cancels them all in one catalog batch.
+ */
+void masync_intent_cancel_detached(struct super_block *sb,
+                                   struct mlog_cookie *cookies,
+                                   struct masync_cookies *regions)
+{
+	struct masync_cookies single;
+	mtfs_bindex_t bindex = 0;
+	MENTRY();
+
+	for (bindex = 0; bindex < mtfs_s2bnum(sb); bindex++) {
+		if (cookies[bindex].mgc_index != 0 &&
+		    masync_cookies_add(&regions[bindex], &cookies[bindex])) {
+			/* Not enough memory to batch, cancel it alone */
+			memset(&single, 0, sizeof(single));
+			single.mc_array = &cookies[bindex];
+			single.mc_count = 1;
+			masync_cookies_cancel(sb, bindex, &single);
+		}
+		masync_cookies_cancel(sb, bindex, &regions[bindex]);
+		masync_cookies_free(&regions[bindex]);
+	}
+
+	_MRETURN();
+}
+
+int masync_cookies_add(struct masync_cookies *cookies,
+                       struct mlog_cookie *cookie)
+{
+	struct mlog_cookie *array = NULL;
+	int size = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (cookies->mc_count == cookies->mc_size) {
+		size = cookies->mc_size ? cookies->mc_size * 2 : 8;
+		MTFS_ALLOC(array, sizeof(*array) * size);
+		if (array == NULL) {
+			MERROR("not enough memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		if (cookies->mc_array) {
+			memcpy(array, cookies->mc_array,
+			       sizeof(*array) * cookies->mc_count);
+			MTFS_FREE(cookies->mc_array,
+			          sizeof(*array) * cookies->mc_size);
+		}
+		cookies->mc_array = array;
+		cookies->mc_size = size;
+	}
+	cookies->mc_array[cookies->mc_count++] = *cookie;
+out:
+	MRETURN(ret);
+}
+
+void masync_cookies_free(struct masync_cookies *cookies)
+{
+	if (cookies->mc_array) {
+		MTFS_FREE(cookies->mc_array,
+		          sizeof(*cookies->mc_array) * cookies->mc_size);
+	}
+	cookies->mc_array = NULL;
+	cookies->mc_count = 0;
+	cookies->mc_size = 0;
+}
+
+int masync_cookies_cancel(struct super_block *sb,
+                          mtfs_bindex_t bindex,
+                          struct masync_cookies *cookies)
+{
+	struct mtfs_run_ctxt saved;
+	struct mtfs_ucred ucred = { 0 };
+	int ret = 0;
+	MENTRY();
+
+	if (cookies->mc_count == 0) {
+		goto out;
+	}
+
+	/* the owner of log file should always be root */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+	mtfs_push_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+	ret = mlog_cat_cancel_records(mtfs_s2bcathandle(sb, bindex),
+	                              cookies->mc_count,
+	                              cookies->mc_array);
+	mtfs_pop_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+	if (ret) {
+		MERROR("failed to cancel %d records of branch[%d], ret = %d\n",
+		       cookies->mc_count, bindex, ret);
+	}
+out:
+	MRETURN(ret);
+}
+
+static void masync_intent_path_free(struct masync_bucket *bucket)
+{
+	if (bucket->mab_intent_path) {
+		MTFS_FREE(bucket->mab_intent_path, MASYNC_PATH_MAX);
+		bucket->mab_intent_path = NULL;
+		bucket->mab_intent_path_len = 0;
+	}
+}
+
+/* Called holding msai_intent_lock */
+static void masync_intent_bloom_del_nonlock(struct masync_bucket *bucket)
+{
+	if (bucket->mab_bloom_fid != 0) {
+		masync_bloom_del_nonlock(bucket->mab_info, bucket->mab_bloom_fid);
+		bucket->mab_bloom_fid = 0;
+	}
+}
+
+/* Length of the intent record of bucket */
+static inline int masync_intent_rec_len(struct masync_bucket *bucket)
+{
+	if (bucket->mab_intent_path) {
+		return MLOG_ASYNC_PATH_REC_LEN(bucket->mab_intent_path_len);
+	}
+	return sizeof(struct mlog_async_rec);
+}
+
+/*
+ * Log intent records of all buckets in the batch.
+ * Records of each branch are appended with one mlog_cat_add_recs(),
+ * so that the whole batch takes one log append and one header write.
+ * Called by the leader without holding any lock.
+ */
+static void masync_intent_commit(struct msubject_async_info *info,
+                                 struct super_block *sb,
+                                 mtfs_list_t *batch)
+{
+	mtfs_bindex_t bindex = 0;
+	mtfs_bindex_t bnum = mtfs_s2bnum(sb);
+	struct mtfs_device *device = mtfs_s2dev(sb);
+	struct mtfs_lowerfs *lowerfs = NULL;
+	struct masync_bucket *bucket = NULL;
+	struct inode *inode = NULL;
+	struct mlog_async_path_rec *rec = NULL;
+	struct mlog_rec_hdr **recs = NULL;
+	struct mlog_cookie *cookies = NULL;
+	struct masync_bucket **buckets = NULL;
+	char *buf = NULL;
+	int buf_size = 0;
+	int offset = 0;
+	int number = 0;
+	int count = 0;
+	struct mtfs_run_ctxt *saved = NULL;
+	struct mtfs_ucred ucred = { 0 };
+	int records = 0;
+	int ret = 0;
+	int i = 0;
+	MENTRY();
+
+	mtfs_list_for_each_entry(bucket, batch, mab_intent_linkage) {
+		buf_size += masync_intent_rec_len(bucket);
+		number++;
+	}
+
+	MTFS_ALLOC(buf, buf_size);
+	if (buf == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_error;
+	}
+
+	MTFS_ALLOC(recs, sizeof(*recs) * number);
+	if (recs == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_free_buf;
+	}
+
+	MTFS_ALLOC(cookies, sizeof(*cookies) * number);
+	if (cookies == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_free_recs;
+	}
+
+	MTFS_ALLOC(buckets, sizeof(*buckets) * number);
+	if (buckets == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_free_cookies;
+	}
+
+	MTFS_ALLOC_PTR(saved);
+	if (saved == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out_free_buckets;
+	}
+
+	/* the owner of log file should always be root */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+
+	/*
+	 * Do not use mtfs_s2bops,
+	 * since mtfs_s2dev is inited in mtfs_init_super()
+	 */
+	for (bindex = 0; bindex < bnum; bindex++) {
+		lowerfs = mtfs_dev2blowerfs(device, bindex);
+		if (!lowerfs->ml_trans_support) {
+			continue;
+		}
+		MASSERT(mtfs_s2blogctxt(sb, bindex));
+		MASSERT(mtfs_s2bcathandle(sb, bindex));
+
+		count = 0;
+		offset = 0;
+		memset(buf, 0, buf_size);
+		memset(cookies, 0, sizeof(*cookies) * number);
+		mtfs_list_for_each_entry(bucket, batch, mab_intent_linkage) {
+			if (bucket->mab_intent_error) {
+				continue;
+			}
+
+			inode = mtfs_bucket2inode(bucket);
+			if (!mtfs_i2branch(inode, bindex)) {
+				continue;
+			}
+
+			rec = (struct mlog_async_path_rec *)(buf + offset);
+			rec->map_hdr.mrh_len = masync_intent_rec_len(bucket);
+			if (bucket->mab_intent_path) {
+				/* Recovery finds the file on every branch by path */
+				rec->map_hdr.mrh_type = MLOG_ASYNC_PATH_MAGIC;
+				rec->map_path_len = bucket->mab_intent_path_len;
+				memcpy(rec->map_path, bucket->mab_intent_path,
+				       bucket->mab_intent_path_len);
+			} else {
+				rec->map_hdr.mrh_type = MLOG_ASYNC_MAGIC;
+			}
+			rec->map_fid = mtfs_i2branch(inode, bindex)->i_ino;
+			offset += rec->map_hdr.mrh_len;
+			recs[count] = &rec->map_hdr;
+			buckets[count] = bucket;
+			count++;
+		}
+
+		if (count == 0) {
+			continue;
+		}
+
+		mtfs_push_ctxt(saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		ret = mlog_cat_add_recs(mtfs_s2bcathandle(sb, bindex),
+		                        recs, count, cookies);
+		mtfs_pop_ctxt(saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		for (i = 0; i < count; i++) {
+			/* Logged records are canceled on error by their cookies */
+			buckets[i]->mab_cookies[bindex] = cookies[i];
+			if (ret) {
+				buckets[i]->mab_intent_error = ret;
+			}
+		}
+		if (ret) {
+			MERROR("failed to write %d mlog records: %d\n",
+			       count, ret);
+			continue;
+		}
+		records += count;
+	}
+
+	/* Do not leave half logged intent behind */
+	mtfs_list_for_each_entry(bucket, batch, mab_intent_linkage) {
+		masync_intent_path_free(bucket);
+		if (bucket->mab_intent_error) {
+			masync_intent_cancel(sb, bucket->mab_cookies);
+			memset(bucket->mab_cookies, 0, sizeof(bucket->mab_cookies));
+		}
+	}
+
+	atomic_inc(&info->msai_intent_batches);
+	atomic_add(records, &info->msai_intent_records);
+
+	MTFS_FREE_PTR(saved);
+	MTFS_FREE(buckets, sizeof(*buckets) * number);
+	MTFS_FREE(cookies, sizeof(*cookies) * number);
+	MTFS_FREE(recs, sizeof(*recs) * number);
+	MTFS_FREE(buf, buf_size);
+	goto out;
+out_free_buckets:
+	MTFS_FREE(buckets, sizeof(*buckets) * number);
+out_free_cookies:
+	MTFS_FREE(cookies, sizeof(*cookies) * number);
+out_free_recs:
+	MTFS_FREE(recs, sizeof(*recs) * number);
+out_free_buf:
+	MTFS_FREE(buf, buf_size);
+out_error:
+	mtfs_list_for_each_entry(bucket, batch, mab_intent_linkage) {
+		masync_intent_path_free(bucket);
+		bucket->mab_intent_error = ret;
+	}
+out:
+	_MRETURN();
+}
+
+static int masync_intent_done(struct msubject_async_info *info,
+                              struct masync_bucket *bucket)
+{
+	int ret = 0;
+
+	mtfs_spin_lock(&info->msai_intent_lock);
+	ret = (bucket->mab_intent == MASYNC_INTENT_DURABLE ||
+	       bucket->mab_intent == MASYNC_INTENT_CLEAN ||
+	       !info->msai_intent_committing);
+	mtfs_spin_unlock(&info->msai_intent_lock);
+
+	return ret;
+}
+
+/*
+ * Make sure intent records of the file are in the logs before writing.
+ * Should be paired with masync_intent_put() if succeeded.
+ */
+int masync_intent_get(struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+	struct masync_bucket *bucket = mtfs_i2bucket(inode);
+	struct msubject_async_info *info = bucket->mab_info;
+	struct masync_bucket *tmp_bucket = NULL;
+	struct masync_bucket *head = NULL;
+	MTFS_LIST_HEAD(batch);
+	char *buf = NULL;
+	char *path = NULL;
+	int path_len = 0;
+	__u64 fid = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (bucket->mab_intent != MASYNC_INTENT_DURABLE) {
+		/* Racy check, path is only needed by the first writer */
+		MTFS_ALLOC(buf, MASYNC_PATH_MAX);
+		if (buf != NULL) {
+			path = mtfs_dentry_path(dentry, buf, MASYNC_PATH_MAX);
+			if (IS_ERR(path)) {
+				MERROR("failed to get path of [%.*s], ret = %ld\n",
+				       dentry->d_name.len, dentry->d_name.name,
+				       PTR_ERR(path));
+				MTFS_FREE(buf, MASYNC_PATH_MAX);
+				buf = NULL;
+			} else {
+				path_len = strlen(path);
+				memmove(buf, path, path_len);
+			}
+		}
+	}
+
+	mtfs_spin_lock(&info->msai_intent_lock);
+	bucket->mab_intent_writers++;
+	if (likely(bucket->mab_intent == MASYNC_INTENT_DURABLE)) {
+		mtfs_spin_unlock(&info->msai_intent_lock);
+		goto out;
+	}
+
+	if (bucket->mab_intent == MASYNC_INTENT_CLEAN) {
+		bucket->mab_intent = MASYNC_INTENT_PENDING;
+		bucket->mab_intent_error = 0;
+		/* Added before any record is logged */
+		MASSERT(bucket->mab_bloom_fid == 0);
+		fid = masync_bloom_fid(info, inode);
+		if (fid != 0) {
+			masync_bloom_add_nonlock(info, fid);
+			bucket->mab_bloom_fid = fid;
+		}
+		MASSERT(bucket->mab_intent_path == NULL);
+		if (buf != NULL) {
+			bucket->mab_intent_path = buf;
+			bucket->mab_intent_path_len = path_len;
+			buf = NULL;
+		}
+		mtfs_list_add_tail(&bucket->mab_intent_linkage,
+		                   &info->msai_intent_pending);
+	}
+
+	while (1) {
+		if (bucket->mab_intent == MASYNC_INTENT_DURABLE) {
+			break;
+		}
+
+		if (bucket->mab_intent == MASYNC_INTENT_CLEAN) {
+			ret = bucket->mab_intent_error;
+			MASSERT(ret);
+			bucket->mab_intent_writers--;
+			break;
+		}
+
+		if (info->msai_intent_committing) {
+			mtfs_spin_unlock(&info->msai_intent_lock);
+			mtfs_wait_condition(info->msai_intent_waitq,
+			                    masync_intent_done(info, bucket));
+			mtfs_spin_lock(&info->msai_intent_lock);
+			continue;
+		}
+
+		/* Become the leader, take all pending buckets */
+		info->msai_intent_committing = 1;
+		mtfs_list_splice_init(&info->msai_intent_pending, &batch);
+		mtfs_list_for_each_entry(tmp_bucket, &batch, mab_intent_linkage) {
+			MASSERT(tmp_bucket->mab_intent == MASYNC_INTENT_PENDING);
+			tmp_bucket->mab_intent = MASYNC_INTENT_LOGGING;
+		}
+		mtfs_spin_unlock(&info->msai_intent_lock);
+
+		masync_intent_commit(info, inode->i_sb, &batch);
+
+		mtfs_spin_lock(&info->msai_intent_lock);
+		mtfs_list_for_each_entry_safe(tmp_bucket, head, &batch,
+		                              mab_intent_linkage) {
+			mtfs_list_del_init(&tmp_bucket->mab_intent_linkage);
+			if (tmp_bucket->mab_intent_error) {
+				tmp_bucket->mab_intent = MASYNC_INTENT_CLEAN;
+				masync_intent_bloom_del_nonlock(tmp_bucket);
+			} else {
+				tmp_bucket->mab_intent = MASYNC_INTENT_DURABLE;
+			}
+		}
+		info->msai_intent_committing = 0;
+		mtfs_spin_unlock(&info->msai_intent_lock);
+		wake_up_all(&info->msai_intent_waitq);
+		mtfs_spin_lock(&info->msai_intent_lock);
+	}
+	mtfs_spin_unlock(&info->msai_intent_lock);
+out:
+	if (buf != NULL) {
+		MTFS_FREE(buf, MASYNC_PATH_MAX);
+	}
+	MRETURN(ret);
+}
+
+/*
+ * Detach intent records from bucket if it is totally clean.
+ * Return 1 if cookies are detached and need to be canceled.
+ */
+int masync_intent_detach(struct masync_bucket *bucket,
+                         struct mlog_cookie *cookies,
+                         struct masync_cookies *regions)
+{
+	struct msubject_async_info *info = bucket->mab_info;
+	int ret = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&info->msai_intent_lock);
+	if (bucket->mab_intent == MASYNC_INTENT_DURABLE &&
+	    bucket->mab_intent_writers == 0 &&
+	    atomic_read(&bucket->mab_number) == 0) {
+		memcpy(cookies, bucket->mab_cookies, sizeof(bucket->mab_cookies));
+		memset(bucket->mab_cookies, 0, sizeof(bucket->mab_cookies));
+		/* No writer is left, so nobody is logging regions */
+		memcpy(regions, bucket->mab_regions, sizeof(bucket->mab_regions));
+		memset(bucket->mab_regions, 0, sizeof(bucket->mab_regions));
+		bucket->mab_region_number = 0;
+		bucket->mab_region_whole = 0;
+		bucket->mab_region_epoch++;
+		bucket->mab_intent = MASYNC_INTENT_CLEAN;
+		/* Records will be canceled soon, a crash before that is safe */
+		masync_intent_bloom_del_nonlock(bucket);
+		ret = 1;
+	}
+	mtfs_spin_unlock(&info->msai_intent_lock);
+
+	MRETURN(ret);
+}
+
+/*
+ * Cancel intent records if bucket is totally clean.
+ */
+void masync_intent_clear(struct masync_bucket *bucket)
+{
+	struct mlog_cookie cookies[MTFS_BRANCH_MAX];
+	struct masync_cookies regions[MTFS_BRANCH_MAX];
+	struct super_block *sb = mtfs_bucket2inode(bucket)->i_sb;
+	MENTRY();
+
+	if (masync_intent_detach(bucket, cookies, regions)) {
+		masync_intent_cancel_detached(sb, cookies, regions);
+	}
+
+	_MRETURN();
+}
+
+void masync_intent_put(struct inode *inode)
+{
+	struct masync_bucket *bucket = mtfs_i2bucket(inode);
+	struct msubject_async_info *info = bucket->mab_info;
+	int writers = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&info->msai_intent_lock);
+	MASSERT(bucket->mab_intent_writers > 0);
+	writers = --bucket->mab_intent_writers;
+	mtfs_spin_unlock(&info->msai_intent_lock);
+
+	/* Nothing added to the tree, e.g. write failed */
+	if (writers == 0 && atomic_read(&bucket->mab_number) == 0) {
+		masync_intent_clear(bucket);
+	}
+
+	_MRETURN();
+}
+
+/*
+ * Log region record of [start, end] to every branch.
+ * Called holding mab_region_lock but not mab_lock.
+ */
+static int masync_intent_region_log(struct masync_bucket *bucket,
+                                    __u64 start, __u64 end)
+{
+	struct inode *inode = mtfs_bucket2inode(bucket);
+	struct super_block *sb = inode->i_sb;
+	mtfs_bindex_t bindex = 0;
+	mtfs_bindex_t bnum = mtfs_s2bnum(sb);
+	struct mtfs_device *device = mtfs_s2dev(sb);
+	struct mtfs_lowerfs *lowerfs = NULL;
+	struct mlog_async_region_rec rec;
+	struct mlog_cookie cookie;
+	struct mtfs_run_ctxt saved;
+	struct mtfs_ucred ucred = { 0 };
+	int ret = 0;
+	MENTRY();
+
+	/* the owner of log file should always be root */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+
+	for (bindex = 0; bindex < bnum; bindex++) {
+		lowerfs = mtfs_dev2blowerfs(device, bindex);
+		if (!lowerfs->ml_trans_support) {
+			continue;
+		}
+
+		if (!mtfs_i2branch(inode, bindex)) {
+			continue;
+		}
+		MASSERT(mtfs_s2bcathandle(sb, bindex));
+
+		memset(&rec, 0, sizeof(rec));
+		rec.mar_hdr.mrh_len = sizeof(rec);
+		rec.mar_hdr.mrh_type = MLOG_ASYNC_REGION_MAGIC;
+		rec.mar_fid = mtfs_i2branch(inode, bindex)->i_ino;
+		rec.mar_start = start;
+		rec.mar_end = end;
+		mtfs_push_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		ret = mlog_cat_add_rec(mtfs_s2bcathandle(sb, bindex),
+		                       &rec.mar_hdr, &cookie, NULL);
+		mtfs_pop_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		if (ret != 1) {
+			MERROR("failed to write region record: %d\n", ret);
+			ret = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+
+		ret = masync_cookies_add(&bucket->mab_regions[bindex], &cookie);
+		if (ret) {
+			/* Not able to cancel it, left to recovery */
+			MERROR("failed to add cookie, ret = %d\n", ret);
+			goto out;
+		}
+		atomic_inc(&bucket->mab_info->msai_region_records);
+	}
+out:
+	MRETURN(ret);
+}
+
+/*
+ * Cancel the first logged[bindex] region records of each branch,
+ * which are covered by the whole file region logged after them.
+ * Called holding mab_region_lock but not mab_lock.
+ */
+static void masync_intent_region_compact(struct masync_bucket *bucket,
+                                         int *logged)
+{
+	struct super_block *sb = mtfs_bucket2inode(bucket)->i_sb;
+	struct masync_cookies *regions = NULL;
+	struct masync_cookies canceled;
+	mtfs_bindex_t bindex = 0;
+	MENTRY();
+
+	for (bindex = 0; bindex < mtfs_s2bnum(sb); bindex++) {
+		regions = &bucket->mab_regions[bindex];
+		if (logged[bindex] == 0) {
+			continue;
+		}
+
+		canceled.mc_array = regions->mc_array;
+		canceled.mc_count = logged[bindex];
+		canceled.mc_size = logged[bindex];
+		if (masync_cookies_cancel(sb, bindex, &canceled)) {
+			/* Leave them to be canceled when file is clean */
+			continue;
+		}
+
+		regions->mc_count -= logged[bindex];
+		memmove(regions->mc_array, regions->mc_array + logged[bindex],
+		        sizeof(*regions->mc_array) * regions->mc_count);
+	}
+	bucket->mab_region_number = 0;
+
+	_MRETURN();
+}
+
+/*
+ * Make sure regions of [start, end] are in the logs before writing,
+ * so that recovery only needs to copy them rather than the whole file.
+ * A region is a chunk of the bucket, and is logged at most once until
+ * the file is totally clean. Once a file has too many regions, the whole
+ * file is logged instead and its region records are canceled.
+ * Called between masync_intent_get() and masync_intent_put().
+ */
+int masync_intent_region(struct inode *inode, __u64 start, __u64 end)
+{
+	struct masync_bucket *bucket = mtfs_i2bucket(inode);
+	int logged[MTFS_BRANCH_MAX];
+	mtfs_bindex_t bindex = 0;
+	struct masync_chunk *chunk = NULL;
+	__u64 chunk_start = 0;
+	int unlogged = 0;
+	int ret = 0;
+	MENTRY();
+
+	MASSERT(start <= end);
+	if (bucket->mab_region_whole) {
+		goto out;
+	}
+
+	unlogged = masync_chunk_unlogged(bucket, start, end);
+	if (unlogged == 0) {
+		goto out;
+	}
+
+	/*
+	 * Records are appended without mab_lock, which is taken by
+	 * writers, checksum readers and flushes.
+	 */
+	down(&bucket->mab_region_lock);
+	if (bucket->mab_region_whole) {
+		goto out_up;
+	}
+
+	unlogged = masync_chunk_unlogged(bucket, start, end);
+	if (unlogged == 0) {
+		goto out_up;
+	}
+
+	/*
+	 * Regions logged before recovery of the file finishes
+	 * would hide the data that recovery is supposed to copy.
+	 */
+	if (unlogged > MASYNC_REGION_MAX - bucket->mab_region_number ||
+	    masync_recover_pending(inode)) {
+		for (bindex = 0; bindex < MTFS_BRANCH_MAX; bindex++) {
+			logged[bindex] = bucket->mab_regions[bindex].mc_count;
+		}
+
+		ret = masync_intent_region_log(bucket, 0, MTFS_INTERVAL_EOF);
+		if (ret == 0) {
+			bucket->mab_region_whole = 1;
+			masync_intent_region_compact(bucket, logged);
+		}
+		goto out_up;
+	}
+
+	for (chunk_start = start & ~(MASYNC_CHUNK_SIZE - 1);
+	     chunk_start <= end;
+	     chunk_start += MASYNC_CHUNK_SIZE) {
+		if (masync_chunk_unlogged(bucket, chunk_start, chunk_start) == 0) {
+			goto next;
+		}
+
+		ret = masync_intent_region_log(bucket, chunk_start,
+		                               chunk_start + MASYNC_CHUNK_SIZE - 1);
+		if (ret) {
+			break;
+		}
+		bucket->mab_region_number++;
+
+		/* Chunk might be released by flush while logging, add it again */
+		down(&bucket->mab_lock);
+		chunk = masync_chunk_add(bucket, chunk_start);
+		if (chunk != NULL) {
+			chunk->mac_region_epoch = bucket->mab_region_epoch;
+		}
+		masync_bucket_unlock(bucket);
+		if (chunk == NULL) {
+			/* Record is canceled when file is clean */
+			ret = -ENOMEM;
+			break;
+		}
+next:
+		if (chunk_start + MASYNC_CHUNK_SIZE == 0) {
+			/* Overflowed */
+			break;
+		}
+	}
+out_up:
+	up(&bucket->mab_region_lock);
+out:
+	MRETURN(ret);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#ifndef __MTFS_ASYNC_INTENT_INTERNAL_H__
+#define __MTFS_ASYNC_INTENT_INTERNAL_H__
+#include <mtfs_async.h>
+#include "async_internal.h"
+
+void masync_intent_init(struct masync_bucket *bucket);
+void masync_intent_fini(struct masync_bucket *bucket);
+int masync_intent_get(struct dentry *dentry);
+void masync_intent_put(struct inode *inode);
+int masync_intent_region(struct inode *inode, __u64 start, __u64 end);
+int masync_intent_detach(struct masync_bucket *bucket,
+                         struct mlog_cookie *cookies,
+                         struct masync_cookies *regions);
+int masync_intent_cancel(struct super_block *sb,
+                         struct mlog_cookie *cookies);
+void masync_intent_cancel_detached(struct super_block *sb,
+                                   struct mlog_cookie *cookies,
+                                   struct masync_cookies *regions);
+void masync_intent_clear(struct masync_bucket *bucket);
+int masync_cookies_add(struct masync_cookies *cookies,
+                       struct mlog_cookie *cookie);
+void masync_cookies_free(struct masync_cookies *cookies);
+int masync_cookies_cancel(struct super_block *sb,
+                          mtfs_bindex_t bindex,
+                          struct masync_cookies *cookies);
+#endif /* __MTFS_ASYNC_INTENT_INTERNAL_H__ */
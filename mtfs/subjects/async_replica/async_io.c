@@ -13,6 +13,9 @@
 #include <mtfs_context.h>
 #include "async_internal.h"
 #include "async_bucket_internal.h"
+#include "async_chunk_internal.h"
+#include "async_intent_internal.h"
+#include "async_recover_internal.h"
 
 static int masync_bucket_fvalid(struct file *file)
 {
@@ -34,35 +37,45 @@ static int masync_bucket_fvalid(struct file *file)
 	MRETURN(ret);
 }
 
-static enum mtfs_interval_iter masync_checksum_overlap_cb(struct mtfs_interval_node *node,
-                                                          void *args)
+static enum mtfs_interval_iter masync_dirty_copy_cb(struct mtfs_interval_node *node,
+                                                    void *args)
 {
-	return MTFS_INTERVAL_ITER_STOP;
+	mtfs_list_t *extent_list = (mtfs_list_t *)args;
+	struct mtfs_interval *copy = NULL;
+
+	MTFS_ALLOC_PTR(copy);
+	if (copy == NULL) {
+		return MTFS_INTERVAL_ITER_STOP;
+	}
+
+	copy->mi_node.in_extent = node->in_extent;
+	/* Called in order, so the list is sorted */
+	mtfs_list_add_tail(&copy->mi_linkage, extent_list);
+	return MTFS_INTERVAL_ITER_CONT;
 }
 
-static int masync_extent_cmp(void *priv, mtfs_list_t *a, mtfs_list_t *b)
+static void masync_dirty_extets_free(struct mtfs_io_checksum *checksum)
 {
-	int ret = 0;
-	struct mtfs_interval *extent_a = NULL;
-	struct mtfs_interval *extent_b = NULL;
-	MENTRY();
-
-	extent_a = mtfs_list_entry(a, struct mtfs_interval, mi_linkage);
-	extent_b = mtfs_list_entry(b, struct mtfs_interval, mi_linkage);
+	struct mtfs_interval *tmp_extent = NULL;
+	struct mtfs_interval *head = NULL;
 
-	if (extent_a->mi_node.in_extent.start >  extent_b->mi_node.in_extent.start) {
-		MASSERT(extent_a->mi_node.in_extent.start > extent_b->mi_node.in_extent.end);
-		ret = 1;
-	} else {
-		MASSERT(extent_a->mi_node.in_extent.end < extent_b->mi_node.in_extent.start);
-		ret = -1;
+	mtfs_list_for_each_entry_safe(tmp_extent, head,
+	                              &checksum->dirty_extents,
+	                              mi_linkage) {
+		mtfs_list_del(&tmp_extent->mi_linkage);
+		MTFS_FREE_PTR(tmp_extent);
 	}
-
-	MRETURN(ret);
 }
 
-/* Called holding bucket->mab_lock */
-static void masync_dirty_extets_build(struct mtfs_io *io)
+/*
+ * Copy dirty extents overlapping the read range,
+ * so that readers only hold mab_lock for a short time.
+ * The copy keeps valid while reading, since MLOCK_MODE_CHECK lock
+ * excludes writing and flushing of the range. A read that may come up
+ * short holds the lock to EOF, so that tail_dirty keeps valid as well.
+ * Reads outside the range covering all extents skip the tree.
+ */
+static int masync_dirty_extets_build(struct mtfs_io *io)
 {
 	struct mtfs_io_rw *io_rw = &io->u.mi_rw;
 	struct mtfs_io_checksum *checksum = &io->subject.mi_checksum;
@@ -71,7 +84,11 @@ static void masync_dirty_extets_build(struct mtfs_io *io)
 	struct inode *inode = dentry->d_inode;
 	struct masync_bucket *bucket = mtfs_i2bucket(inode);
 	struct mtfs_interval_node_extent tmp_interval;
+	enum mtfs_interval_iter iter = MTFS_INTERVAL_ITER_CONT;
 	loff_t pos = *(io_rw->ppos);
+	__u64 dirty_start = 0;
+	__u64 dirty_end = 0;
+	int ret = 0;
 	MENTRY();
 
 	MTFS_INIT_LIST_HEAD(&checksum->dirty_extents);
@@ -80,13 +97,44 @@ static void masync_dirty_extets_build(struct mtfs_io *io)
 	 */
 	tmp_interval.start = pos;
 	tmp_interval.end = pos + io_rw->rw_size - 1;
-	mtfs_interval_search(bucket->mab_root,
-	                     &tmp_interval,
-	                     masync_overlap_cb,
-	                     &checksum->dirty_extents);
+	if (!masync_bucket_dirty_range(bucket, &dirty_start, &dirty_end)) {
+		checksum->tail_dirty = 0;
+		goto out;
+	}
 
-	mtfs_list_sort(NULL, &checksum->dirty_extents, masync_extent_cmp);
-	_MRETURN();
+	if (dirty_start > tmp_interval.end || dirty_end < tmp_interval.start) {
+		/* Dirty extents between [pos + rw_size, EOF] */
+		checksum->tail_dirty = (dirty_end > tmp_interval.end);
+		goto out;
+	}
+
+	down(&bucket->mab_lock);
+	iter = mtfs_interval_search_inorder(bucket->mab_root,
+	                                    &tmp_interval,
+	                                    masync_dirty_copy_cb,
+	                                    &checksum->dirty_extents);
+	if (iter == MTFS_INTERVAL_ITER_STOP) {
+		masync_bucket_unlock(bucket);
+		MERROR("not enough memory\n");
+		masync_dirty_extets_free(checksum);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Dirty extents between [pos + rw_size, EOF] */
+	checksum->tail_dirty = (bucket->mab_root != NULL &&
+	                        bucket->mab_root->in_max_high > tmp_interval.end);
+	masync_bucket_unlock(bucket);
+out:
+	MRETURN(ret);
+}
+
+/* Debug dump of the whole tree */
+static void masync_extets_dump_lock(struct masync_bucket *bucket)
+{
+	down(&bucket->mab_lock);
+	masync_extets_dump(bucket);
+	masync_bucket_unlock(bucket);
 }
 
 static void masync_dirty_extets_dump(mtfs_list_t *list)
@@ -204,8 +252,6 @@ static __u32 masync_checksum_fill(__u32 checksum,
 	size_t tmp_offset = offset;
 	size_t tmp_len = 0;
 	size_t tmp_total = 0;
-	char data[1] = {0};
-	size_t i  = 0;
 	MENTRY();
 
 	MASSERT(len > 0);
@@ -217,12 +263,9 @@ static __u32 masync_checksum_fill(__u32 checksum,
 			tmp_len = tmp_extent->mi_node.in_extent.start -
 			          tmp_offset;
 
-			for (i = 0; i < tmp_len; i++) {
-				checksum_value = mchecksum_compute(checksum_value,
-				                                   data,
-				                                   1,
-				                                   type);
-			}
+			checksum_value = mchecksum_compute_zero(checksum_value,
+			                                        tmp_len,
+			                                        type);
 			tmp_total += tmp_len;
 			tmp_offset += tmp_len;
 		}
@@ -411,7 +454,7 @@ static int masync_checksum_need_append(struct mtfs_io_checksum *checksum,
 	MRETURN(ret);
 }
 
-/* Called holding bucket->mab_lock */
+/* Called holding MLOCK_MODE_CHECK lock */
 static void masync_checksum_branch_primary(struct mtfs_io *io)
 {
 	struct mtfs_io_rw *io_rw = &io->u.mi_rw;
@@ -420,9 +463,7 @@ static void masync_checksum_branch_primary(struct mtfs_io *io)
 	struct dentry *dentry = file->f_dentry;
 	struct inode *inode = dentry->d_inode;
 	struct masync_bucket *bucket = mtfs_i2bucket(inode);
-	struct mtfs_interval_node_extent tmp_interval;
 	loff_t pos = *(io_rw->ppos);
-	enum mtfs_interval_iter iter = MTFS_INTERVAL_ITER_CONT;
 	__u32 checksum_value = 0;
 	struct mtfs_interval *tmp_extent = NULL;
 	size_t total = 0;
@@ -436,13 +477,7 @@ static void masync_checksum_branch_primary(struct mtfs_io *io)
 	MASSERT(io->mi_result.ssize >= 0);
 	MASSERT(io->mi_result.ssize <= io_rw->rw_size);
 	if (io->mi_result.ssize < io_rw->rw_size) {
-		tmp_interval.start = pos + io->mi_result.ssize;
-		tmp_interval.end = MTFS_INTERVAL_EOF;
-		iter = mtfs_interval_search(bucket->mab_root,
-		                            &tmp_interval,
-		                            masync_checksum_overlap_cb,
-		                            &tmp_interval);
-		if (iter == MTFS_INTERVAL_ITER_STOP) {
+		if (checksum->tail_dirty) {
 			MERROR("unexpected short read\n");
 			MERROR("tried [%lu, %lu], "
 			       "read [%lu, %lu]\n",
@@ -471,7 +506,7 @@ static void masync_checksum_branch_primary(struct mtfs_io *io)
 				       tmp_extent->mi_node.in_extent.start,
 				       tmp_extent->mi_node.in_extent.end);
 				masync_dirty_extets_dump(&checksum->dirty_extents);
-				masync_extets_dump(bucket);
+				masync_extets_dump_lock(bucket);
 				MBUG();
 			}
 		}
@@ -495,30 +530,22 @@ static void masync_checksum_branch_primary(struct mtfs_io *io)
 		       pos, pos + io_rw->rw_size - 1,
 		       pos, pos + io->mi_result.ssize - 1);
 		masync_dirty_extets_dump(&checksum->dirty_extents);
-		masync_extets_dump(bucket);
+		masync_extets_dump_lock(bucket);
 		mtfs_inode_size_dump(inode);
 		MBUG();
 	}
 	_MRETURN();
 }
 
-/* Called holding bucket->mab_lock */
+/* Called holding MLOCK_MODE_CHECK lock */
 static void masync_checksum_branch_secondary(struct mtfs_io *io)
 {
 	struct mtfs_io_rw *io_rw = &io->u.mi_rw;
-	struct file *file = io_rw->file;
-	struct dentry *dentry = file->f_dentry;
-	struct inode *inode = dentry->d_inode;
-	struct masync_bucket *bucket = mtfs_i2bucket(inode);
 	struct mtfs_io_checksum *checksum = &io->subject.mi_checksum;
 	loff_t pos = *(io_rw->ppos);
 	__u32 checksum_value = 0;
-	size_t i = 0;
 	size_t total = 0;
 	size_t tmp_len = 0;
-	struct mtfs_interval_node_extent tmp_interval;
-	enum mtfs_interval_iter iter = MTFS_INTERVAL_ITER_CONT;
-	char data[1] = {0};
 	int ret = 0;
 	MENTRY();
 
@@ -547,20 +574,11 @@ static void masync_checksum_branch_secondary(struct mtfs_io *io)
 		 */
 	    	MASSERT(masync_checksum_need_append(checksum, pos + total));
 		/* Sometimes need to add zero to tail */
-		tmp_interval.start = pos + io_rw->rw_size;
-		tmp_interval.end = MTFS_INTERVAL_EOF;
-		iter = mtfs_interval_search(bucket->mab_root,
-		                            &tmp_interval,
-		                            masync_checksum_overlap_cb,
-		                            &tmp_interval);
-		if (iter == MTFS_INTERVAL_ITER_STOP) {
+		if (checksum->tail_dirty) {
 			tmp_len = io_rw->rw_size - total;
-			for (i = 0; i < tmp_len; i++) {
-				checksum_value = mchecksum_compute(checksum_value,
-				                                   data,
-				                                   1,
-				                                   checksum->type);
-			}
+			checksum_value = mchecksum_compute_zero(checksum_value,
+			                                        tmp_len,
+			                                        checksum->type);
 			total += tmp_len;
 		}
 	}
@@ -589,7 +607,8 @@ static void masync_iter_check_readv(struct mtfs_io *io)
 	MENTRY();
 
 	if ((io->mi_flags & MTFS_OPERATION_SUCCESS) &&
-	    mtfs_dev2checksum(mtfs_i2dev(inode))) {
+	    mtfs_dev2checksum(mtfs_i2dev(inode)) &&
+	    !io->subject.mi_checksum.primary_only) {
 		if (io->mi_bindex == io->mi_bnum - 1) {
 			masync_checksum_branch_primary(io);
 		} else {
@@ -600,163 +619,6 @@ static void masync_iter_check_readv(struct mtfs_io *io)
 	_MRETURN();
 }
 
-static int test_fid(struct mtfs_lowerfs *lowerfs,
-		     struct super_block *sb,
-		     __u64 fid)
-{
-	struct inode *inode = NULL;
-	struct dentry *dentry = NULL;
-	int ret = 0;
-	MENTRY();
-
-	inode = mlowerfs_iget(lowerfs, sb, fid);
-	if (IS_ERR(inode)) {
-		MERROR("failed to get inode from fid %llu\n", fid);
-		ret = PTR_ERR(inode);
-		goto out;
-	}
-
-	dentry = d_obtain_alias(inode);
-	if (IS_ERR(dentry)) {
-		MERROR("failed to get dentry from inode %llu\n", fid);
-		ret = PTR_ERR(dentry);
-		goto out;
-	}
-
-	MERROR("get dentry of %llu: [%.*s]\n",
-	       fid,
-	       dentry->d_name.len,
-	       dentry->d_name.name);
-
-	dput(dentry);
-out:
-	MRETURN(ret);
-}
-
-static int masync_set_async(struct inode *inode, struct mlog_cookie *cookies)
-{
-	struct super_block *sb = inode->i_sb;
-	mtfs_bindex_t bindex = 0;
-	mtfs_bindex_t bnum = mtfs_s2bnum(sb);
-	struct mtfs_device *device = mtfs_s2dev(sb);
-	int ret = 0;
-	struct mtfs_lowerfs *lowerfs = NULL;
-	struct mlog_async_rec *rec;
-	struct mtfs_run_ctxt *saved;
-	struct mtfs_ucred ucred = { 0 };
-	MENTRY();
-
-	MTFS_ALLOC_PTR(rec);
-	if (rec == NULL) {
-		MERROR("not enough memory\n");
-		goto out;
-	}
-
-	MTFS_ALLOC_PTR(saved);
-	if (saved == NULL) {
-		MERROR("not enough memory\n");
-		goto out_free_rec;
-	}
-
-	rec->mas_hdr.mrh_len = sizeof(struct mlog_async_rec);
-	rec->mas_hdr.mrh_type =  MLOG_ASYNC_MAGIC;
-
-        /* the owner of log file should always be root */
-        cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
-
-	/*
-	 * Do not use mtfs_s2bops,
-	 * since mtfs_s2dev is inited in mtfs_init_super()
-	 */
-	for (bindex = 0; bindex < bnum; bindex++) {
-		lowerfs = mtfs_dev2blowerfs(device, bindex);
-		if (!lowerfs->ml_trans_support) {
-			continue;
-		}
-		if (!mtfs_i2branch(inode, bindex)) {
-			continue;
-		}
-		MASSERT(mtfs_s2blogctxt(sb, bindex));
-		MASSERT(mtfs_s2bcathandle(sb, bindex));
-		rec->mas_fid = mtfs_i2branch(inode, bindex)->i_ino;
-		if (0)
-			test_fid(mtfs_s2blowerfs(sb, bindex),
-				 mtfs_s2branch(sb, bindex),
-				 rec->mas_fid);
-		MERROR("set async %llu\n", rec->mas_fid);
-		mtfs_push_ctxt(saved, &mtfs_s2bctxt(sb, bindex), &ucred);
-		ret = mlog_cat_add_rec(mtfs_s2bcathandle(sb, bindex),
-				       &rec->mas_hdr,
-				       &cookies[bindex],
-				       NULL);
-		mtfs_pop_ctxt(saved, &mtfs_s2bctxt(sb, bindex), &ucred);
-		if (ret != 1) {
-			MERROR("failed to write mlog record: %d\n", ret);
-			goto out_clear;
-		}
-		ret = 0;
-	}
-	goto out_free_saved;
-out_clear:
-	for (; bindex >= 0; bindex--) {
-		lowerfs = mtfs_dev2blowerfs(device, bindex);
-		if (!lowerfs->ml_trans_support) {
-			continue;
-		}
-		if (!mtfs_i2branch(inode, bindex)) {
-			continue;
-		}
-	        ret = mlog_cat_cancel_records(mtfs_s2bcathandle(sb, bindex),
-	        			      1,
-	        			      &cookies[bindex]);
-		if (ret) {
-			MERROR("cancel mlog record[%d] failed: %d\n", bindex, ret);
-		}
-	}
-out_free_saved:
-	MTFS_FREE_PTR(saved);
-out_free_rec:
-	MTFS_FREE_PTR(rec);
-out:
-	MRETURN(ret);
-}
-
-static int masync_clear_async(struct inode *inode,
-			      struct mlog_cookie *cookies)
-{
-	struct super_block *sb = inode->i_sb;
-	mtfs_bindex_t bindex = 0;
-	mtfs_bindex_t bnum = mtfs_s2bnum(sb);
-	struct mtfs_device *device = mtfs_s2dev(sb);
-	int ret = 0;
-	struct mtfs_lowerfs *lowerfs = NULL;
-	MENTRY();
-
-	/*
-	 * Do not use mtfs_s2bops,
-	 * since mtfs_s2dev is inited in mtfs_init_super()
-	 */
-	for (bindex = 0; bindex < bnum; bindex++) {
-		lowerfs = mtfs_dev2blowerfs(device, bindex);
-		if (!lowerfs->ml_trans_support) {
-			continue;
-		}
-		if (!mtfs_i2branch(inode, bindex)) {
-			continue;
-		}
-		MASSERT(mtfs_s2blogctxt(sb, bindex));
-		MASSERT(mtfs_s2bcathandle(sb, bindex));
-		ret = mlog_cat_cancel_records(mtfs_s2bcathandle(sb, bindex),
-	        			      1,
-	        			      &cookies[bindex]);
-		if (ret) {
-			MERROR("cancel mlog record[%d] failed: %d\n", bindex, ret);
-		}
-	}
-
-	MRETURN(ret);
-}
-
 static void masync_io_iter_start_writev(struct mtfs_io *io)
 {
 	struct mtfs_io_rw *io_rw = &io->u.mi_rw;
@@ -764,37 +626,66 @@ static void masync_io_iter_start_writev(struct mtfs_io *io)
 	struct file *file = io_rw->file;
 	struct dentry *dentry = file->f_dentry;
 	struct masync_extent *async_extent = NULL;
+	struct masync_chunk *chunk = NULL;
 	int ret = 0;
-	struct mlog_cookie *cookies = NULL;
 	MENTRY();
 
 	MASSERT(io->mi_type == MIOT_WRITEV);
 	MASSERT(io->mi_bindex == 0);
 
-	MTFS_ALLOC(cookies, sizeof(struct mlog_cookie) * mtfs_f2bnum(file));
-	if (cookies == NULL) {
-		MERROR("not enough memory\n");
-		goto out;
-	}
 	/*
-	 * TODO: sign the file async,
-	 * since the server may crash immediately after branch write completes. 
+	 * Sign the file async before writing any branch,
+	 * since the server may crash immediately after branch write completes.
+	 * Only the first write after the file is clean really logs.
 	 */
-	ret = masync_set_async(file->f_dentry->d_inode, cookies);
+	ret = masync_intent_get(dentry);
 	if (ret) {
 		MERROR("failed to set async of file [%.*s], ret = %d\n",
 		       dentry->d_name.len, dentry->d_name.name,
 		       ret);
-		goto out_free_cookies;
+		goto out;
+	}
+
+	if (io_rw->rw_size > 0) {
+		if (file->f_flags & O_APPEND) {
+			/* Position is unknown until written */
+			ret = masync_intent_region(dentry->d_inode,
+			                           0, MTFS_INTERVAL_EOF);
+		} else {
+			ret = masync_intent_region(dentry->d_inode,
+			                           io_rw->pos_tmp,
+			                           io_rw->pos_tmp + io_rw->rw_size - 1);
+		}
+		if (ret) {
+			MERROR("failed to log region of file [%.*s], ret = %d\n",
+			       dentry->d_name.len, dentry->d_name.name,
+			       ret);
+			goto out_intent_put;
+		}
+	}
+
+	/*
+	 * Overwriting blocks that are already dirty,
+	 * a few bit operations instead of a new extent.
+	 */
+	if (!(file->f_flags & O_APPEND) && io_rw->rw_size > 0) {
+		chunk = masync_chunk_write_start(mtfs_i2bucket(dentry->d_inode),
+		                                 io_rw->pos_tmp,
+		                                 io_rw->pos_tmp + io_rw->rw_size - 1);
+		if (chunk != NULL) {
+			mio_iter_start_rw(io);
+			masync_chunk_write_end(chunk);
+			goto out_intent_put;
+		}
 	}
 
-	ret = masync_bucket_add_start(file->f_dentry->d_inode,
+	ret = masync_bucket_add_start(dentry->d_inode,
 	                              &async_extent);
 	if (ret) {
 		MERROR("failed to add extent to bucket of [%.*s], ret = %d\n",
 		       dentry->d_name.len, dentry->d_name.name,
 		       ret);
-		goto out_clear_aync;
+		goto out_intent_put;
 	}
 	mio_iter_start_rw(io);
 
@@ -820,18 +711,12 @@ static void masync_io_iter_start_writev(struct mtfs_io *io)
 
 	masync_bucket_add_end(file, &extent, async_extent);
 
-	goto out_free_cookies;
+	goto out_intent_put;
 out_bucket_abort:
 	masync_bucket_add_abort(file, &extent, async_extent);
-out_clear_aync:
-	ret = masync_clear_async(file->f_dentry->d_inode, cookies);
-	if (ret) {
-		MERROR("failed to clear async of file [%.*s], ret = %d\n",
-		       dentry->d_name.len, dentry->d_name.name,
-		       ret);
-	}
-out_free_cookies:
-	MTFS_FREE(cookies, sizeof(struct mlog_cookie) * mtfs_f2bnum(file));
+out_intent_put:
+	/* Records are canceled when the bucket is totally clean */
+	masync_intent_put(dentry->d_inode);
 out:
 	_MRETURN();
 }
@@ -850,6 +735,24 @@ static void masync_io_iter_fini_read_ops(struct mtfs_io *io, int init_ret)
 	_MRETURN();
 }
 
+static void masync_io_iter_fini_readv(struct mtfs_io *io, int init_ret)
+{
+	MENTRY();
+
+	if (io->subject.mi_checksum.primary_only) {
+		MASSERT(io->mi_bindex == 0);
+		if (unlikely(init_ret)) {
+			MBUG();
+		}
+		io->mi_break = 1;
+		goto out;
+	}
+
+	mio_iter_fini_read_ops(io, init_ret);
+out:
+	_MRETURN();
+}
+
 static void masync_io_iter_fini_writev(struct mtfs_io *io, int init_ret)
 {
 	MENTRY();
@@ -923,7 +826,11 @@ static int masync_io_init_readv(struct mtfs_io *io)
 	}
 	MASSERT(inode);
 
-	if (mtfs_dev2checksum(mtfs_i2dev(inode))) {
+	if (masync_recover_pending(inode)) {
+		/* Not recovered since crash, secondary branches may be stale */
+		io->subject.mi_checksum.primary_only = 1;
+		ret = mio_init_oplist(io, &mtfs_oplist_equal);
+	} else if (mtfs_dev2checksum(mtfs_i2dev(inode))) {
 		ret = mio_init_oplist(io, &mtfs_oplist_reverse);
 		io->subject.mi_checksum.type = mchecksum_type_select();	
 	} else {
@@ -949,13 +856,25 @@ static int masync_io_lock_setattr(struct mtfs_io *io)
 	struct mtfs_io_setattr *io_setattr = &io->u.mi_setattr;
 	struct iattr *attr = io_setattr->ia;
 	int ia_valid = attr->ia_valid;
+	struct masync_bucket *bucket = mtfs_i2bucket(io_setattr->dentry->d_inode);
 	MENTRY();
 
 	/* We only need to get read lock no matter readv, writev or truncate */
 	if ((ia_valid & ATTR_SIZE) && 
 	    mtfs_dev2checksum(mtfs_d2dev(io_setattr->dentry))) {
+		/*
+		 * Only the discarded range, so that writes and flushes below
+		 * new size go on. Flushes beyond it give up rather than making
+		 * truncate wait for data that is going to be dropped.
+		 */
+		MASSERT(io->mi_einfo.data.mlp_extent.start == attr->ia_size);
+		MASSERT(io->mi_einfo.data.mlp_extent.end == MTFS_INTERVAL_EOF);
+		masync_bucket_discard_start(bucket, attr->ia_size);
 		io->mi_einfo.mode = MLOCK_MODE_CLEAN;
 		ret = mio_lock_mlock(io);
+		if (ret) {
+			masync_bucket_discard_end(bucket);
+		}
 	}
 
 	MRETURN(ret);
@@ -970,6 +889,8 @@ static void masync_io_unlock_setattr(struct mtfs_io *io)
 
 	if ((ia_valid & ATTR_SIZE) &&
 	    mtfs_dev2checksum(mtfs_d2dev(io_setattr->dentry))) {
+		/* Extents beyond size are dropped, or kept if truncate failed */
+		masync_bucket_discard_end(mtfs_i2bucket(io_setattr->dentry->d_inode));
 		mio_unlock_mlock(io);
 	}
 
@@ -1004,25 +925,63 @@ static void masync_iter_start_setattr(struct mtfs_io *io)
 		}
 	}
 
+	if ((ia_valid & ATTR_SIZE) &&
+	    io->mi_bindex == io->mi_bnum - 1 &&
+	    io->mi_flags & MTFS_OPERATION_SUCCESS) {
+		/* All branches truncated, intent records may be useless now */
+		masync_intent_clear(bucket);
+	}
+
 	_MRETURN();
 }
 
+/*
+ * Whether the read may come up short, so its check depends on the
+ * dirty extents after the range.
+ */
+static int masync_io_read_may_short(struct mtfs_io *io)
+{
+	struct mtfs_io_rw *io_rw = &io->u.mi_rw;
+	struct inode *inode = io_rw->file->f_dentry->d_inode;
+	struct masync_bucket *bucket = mtfs_i2bucket(inode);
+	loff_t size = 0;
+
+	down(&bucket->mab_lock);
+	size = i_size_read(inode);
+	masync_bucket_unlock(bucket);
+
+	return *(io_rw->ppos) + io_rw->rw_size > size;
+}
+
 static int masync_io_rw_lock(struct mtfs_io *io)
 {
 	int ret = 0;
 	struct mtfs_io_rw *io_rw = &io->u.mi_rw;
 	struct file *file = io_rw->file;
-	struct dentry *dentry = file->f_dentry;
-	struct inode *inode = dentry->d_inode;
-	struct masync_bucket *bucket = mtfs_i2bucket(inode);
+	struct masync_bucket *bucket = mtfs_i2bucket(file->f_dentry->d_inode);
 	MENTRY();
 
+	if (io->mi_type == MIOT_WRITEV) {
+		/*
+		 * Throttle before locking, since selfheal service
+		 * needs to lock the dirty extents to drain them.
+		 */
+		masync_info_throttle(bucket->mab_info);
+	}
+
 	if (mtfs_dev2checksum(mtfs_f2dev(file))) {
 		if (io->mi_type == MIOT_WRITEV) {
 			io->mi_einfo.mode = MLOCK_MODE_DIRTY;
 		} else {
 			/* Need to check file, so get write lock */
 			io->mi_einfo.mode = MLOCK_MODE_CHECK;
+			/*
+			 * Short reads are checked against dirty extents
+			 * after the range, so keep them stable as well.
+			 */
+			if (masync_io_read_may_short(io)) {
+				io->mi_einfo.data.mlp_extent.end = MTFS_INTERVAL_EOF;
+			}
 		}
 		ret = mio_lock_mlock(io);
 		if (ret) {
@@ -1030,10 +989,28 @@ static int masync_io_rw_lock(struct mtfs_io *io)
 			goto out;
 		}
 
+		/*
+		 * Truncate of the range is excluded since now, but might
+		 * have shrunk the file before the lock.
+		 */
+		if (io->mi_type == MIOT_READV &&
+		    io->mi_einfo.data.mlp_extent.end != MTFS_INTERVAL_EOF &&
+		    masync_io_read_may_short(io)) {
+			mio_unlock_mlock(io);
+			io->mi_einfo.data.mlp_extent.end = MTFS_INTERVAL_EOF;
+			ret = mio_lock_mlock(io);
+			if (ret) {
+				MERROR("failed to lock extent\n");
+				goto out;
+			}
+		}
+
 		if (io->mi_type == MIOT_READV) {
-			/* Lock to prevent race of file sync */
-			down(&bucket->mab_lock);
-			masync_dirty_extets_build(io);
+			ret = masync_dirty_extets_build(io);
+			if (ret) {
+				mio_unlock_mlock(io);
+				goto out;
+			}
 		}
 	}
 
@@ -1045,14 +1022,11 @@ static void masync_io_rw_unlock(struct mtfs_io *io)
 {
 	struct mtfs_io_rw *io_rw = &io->u.mi_rw;
 	struct file *file = io_rw->file;
-	struct dentry *dentry = file->f_dentry;
-	struct inode *inode = dentry->d_inode;
-	struct masync_bucket *bucket = mtfs_i2bucket(inode);
 	MENTRY();
 
 	if (mtfs_dev2checksum(mtfs_f2dev(file))) {
 		if (io->mi_type == MIOT_READV) {	
-			up(&bucket->mab_lock);
+			masync_dirty_extets_free(&io->subject.mi_checksum);
 		}
 
 		mio_unlock_mlock(io);
@@ -1176,7 +1150,7 @@ const struct mtfs_io_operations masync_io_ops[] = {
 		.mio_iter_init  = mio_iter_init_rw,
 		.mio_iter_start = mio_iter_start_rw,
 		.mio_iter_end   = masync_iter_end_readv,
-		.mio_iter_fini  = mio_iter_fini_read_ops,
+		.mio_iter_fini  = masync_io_iter_fini_readv,
 	},
 	[MIOT_WRITEV] = {
 		.mio_init       = masync_io_init_create_ops,
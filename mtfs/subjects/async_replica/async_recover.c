@@ -0,0 +1,1064 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <linux/module.h>
+#include <linux/mount.h>
+#include <linux/namei.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <thread.h>
+#include <mtfs_inode.h>
+#include <mtfs_super.h>
+#include <mtfs_device.h>
+#include <mtfs_dentry.h>
+#include <mtfs_file.h>
+#include <mtfs_lowerfs.h>
+#include <mtfs_log.h>
+#include <mtfs_context.h>
+#include <mtfs_service.h>
+#include "async_recover_internal.h"
+#include "async_intent_internal.h"
+#include "async_bloom_internal.h"
+
+/*
+ * Crash recovery of async files.
+ *
+ * Intent records left in the catalogs when mounting name files that may
+ * differ between branches. Records of the first branch that supports
+ * transactions are merged by fid into a hash of files to recover. Records
+ * of other branches are sorted by their own fids, and canceled at the end
+ * for the files recovered, or all of them if no file failed. Plain logs of
+ * a catalog are scanned in parallel, since the merge ignores order. A pool
+ * of workers copies every file from the primary branch to the others in the
+ * background, while reads of files still in the hash are served only by the
+ * primary branch. If region records of a file are found, only the regions
+ * are copied rather than the whole file. Files are added to the filter of
+ * dirty files unless it is loaded, and deleted from it when recovered.
+ */
+
+static int masync_recover_threads = 4;
+module_param(masync_recover_threads, int, 0644);
+MODULE_PARM_DESC(masync_recover_threads, "Number of threads to recover async files");
+
+static inline int masync_recover_hash(__u64 fid)
+{
+	return hash_long((unsigned long)fid, MASYNC_RECOVER_HASH_BITS);
+}
+
+/* Called holding msr_lock */
+static struct masync_recover_file *
+masync_recover_find_nonlock(struct masync_recover *recover, __u64 fid)
+{
+	struct masync_recover_file *rfile = NULL;
+	mtfs_hlist_node_t *pos = NULL;
+
+	mtfs_hlist_for_each_entry(rfile, pos,
+	                          &recover->msr_hash[masync_recover_hash(fid)],
+	                          mrf_hash) {
+		if (rfile->mrf_fid == fid) {
+			return rfile;
+		}
+	}
+	return NULL;
+}
+
+static void masync_recover_file_free(struct masync_recover_file *rfile)
+{
+	if (rfile->mrf_path) {
+		MTFS_FREE(rfile->mrf_path, rfile->mrf_path_len + 1);
+	}
+	masync_cookies_free(&rfile->mrf_cookies);
+	if (rfile->mrf_regions) {
+		MTFS_FREE(rfile->mrf_regions,
+		          sizeof(*rfile->mrf_regions) * rfile->mrf_region_size);
+	}
+	MTFS_FREE_PTR(rfile);
+}
+
+static int masync_recover_other_add(struct masync_recover_others *others,
+                                    __u64 fid, struct mlog_cookie *cookie)
+{
+	struct masync_recover_other *array = NULL;
+	int size = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (others->mro_count == others->mro_size) {
+		size = others->mro_size ? others->mro_size * 2 : 8;
+		MTFS_ALLOC(array, sizeof(*array) * size);
+		if (array == NULL) {
+			MERROR("not enough memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		if (others->mro_array) {
+			memcpy(array, others->mro_array,
+			       sizeof(*array) * others->mro_count);
+			MTFS_FREE(others->mro_array,
+			          sizeof(*array) * others->mro_size);
+		}
+		others->mro_array = array;
+		others->mro_size = size;
+	}
+	array = &others->mro_array[others->mro_count++];
+	array->mro_fid = fid;
+	array->mro_cookie = *cookie;
+	array->mro_done = 0;
+out:
+	MRETURN(ret);
+}
+
+static void masync_recover_others_free(struct masync_recover_others *others)
+{
+	if (others->mro_array) {
+		MTFS_FREE(others->mro_array,
+		          sizeof(*others->mro_array) * others->mro_size);
+	}
+	others->mro_array = NULL;
+	others->mro_count = 0;
+	others->mro_size = 0;
+}
+
+static int masync_recover_other_cmp(const void *a, const void *b)
+{
+	const struct masync_recover_other *other_a = a;
+	const struct masync_recover_other *other_b = b;
+
+	if (other_a->mro_fid < other_b->mro_fid) {
+		return -1;
+	} else if (other_a->mro_fid > other_b->mro_fid) {
+		return 1;
+	}
+	return 0;
+}
+
+/* Mark the records of fid as recovered, called holding msr_lock */
+static void masync_recover_other_done(struct masync_recover_others *others,
+                                      __u64 fid)
+{
+	int start = 0;
+	int end = others->mro_count;
+	int mid = 0;
+
+	/* Find the first record of fid */
+	while (start < end) {
+		mid = (start + end) / 2;
+		if (others->mro_array[mid].mro_fid < fid) {
+			start = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+
+	for (; start < others->mro_count &&
+	     others->mro_array[start].mro_fid == fid; start++) {
+		others->mro_array[start].mro_done = 1;
+	}
+}
+
+/* Regions are aligned to chunks, so duplicated ones are equal */
+static int masync_recover_region_add(struct masync_recover_file *rfile,
+                                     __u64 start, __u64 end)
+{
+	struct mtfs_interval_node_extent *array = NULL;
+	int size = 0;
+	int i = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (start == 0 && end == MTFS_INTERVAL_EOF) {
+		rfile->mrf_whole = 1;
+		goto out;
+	}
+
+	for (i = 0; i < rfile->mrf_region_count; i++) {
+		if (rfile->mrf_regions[i].start == start &&
+		    rfile->mrf_regions[i].end == end) {
+			goto out;
+		}
+	}
+
+	if (rfile->mrf_region_count == rfile->mrf_region_size) {
+		size = rfile->mrf_region_size ? rfile->mrf_region_size * 2 : 8;
+		MTFS_ALLOC(array, sizeof(*array) * size);
+		if (array == NULL) {
+			MERROR("not enough memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		if (rfile->mrf_regions) {
+			memcpy(array, rfile->mrf_regions,
+			       sizeof(*array) * rfile->mrf_region_count);
+			MTFS_FREE(rfile->mrf_regions,
+			          sizeof(*array) * rfile->mrf_region_size);
+		}
+		rfile->mrf_regions = array;
+		rfile->mrf_region_size = size;
+	}
+	rfile->mrf_regions[rfile->mrf_region_count].start = start;
+	rfile->mrf_regions[rfile->mrf_region_count].end = end;
+	rfile->mrf_region_count++;
+out:
+	MRETURN(ret);
+}
+
+struct masync_recover_scan {
+	struct masync_recover      *mrs_recover;
+	struct msubject_async_info *mrs_info;
+	mtfs_bindex_t               mrs_bindex;
+	/* Plain logs are scanned in parallel, serialize the records */
+	struct mutex                mrs_mutex;
+};
+
+/* Called holding mrs_mutex */
+static int masync_recover_scan_rec(struct mlog_handle *mlh,
+                                   struct mlog_rec_hdr *rec,
+                                   void *data)
+{
+	struct masync_recover_scan *scan = (struct masync_recover_scan *)data;
+	struct masync_recover *recover = scan->mrs_recover;
+	struct mlog_async_path_rec *map = (struct mlog_async_path_rec *)rec;
+	struct mlog_async_region_rec *mar = (struct mlog_async_region_rec *)rec;
+	struct masync_recover_file *rfile = NULL;
+	__u64 fid = 0;
+	struct mlog_cookie cookie;
+	char *path = NULL;
+	int path_len = 0;
+	int ret = 0;
+	MENTRY();
+
+	memset(&cookie, 0, sizeof(cookie));
+	cookie.mgc_mgl = mlh->mgh_id;
+	cookie.mgc_index = rec->mrh_index;
+
+	if (rec->mrh_type != MLOG_ASYNC_MAGIC &&
+	    rec->mrh_type != MLOG_ASYNC_PATH_MAGIC &&
+	    rec->mrh_type != MLOG_ASYNC_REGION_MAGIC) {
+		MERROR("invalid record in catalog of branch[%d]\n",
+		       scan->mrs_bindex);
+		goto out;
+	}
+	recover->msr_records++;
+
+	if (rec->mrh_type == MLOG_ASYNC_REGION_MAGIC) {
+		if (rec->mrh_len < sizeof(*mar) ||
+		    mar->mar_start > mar->mar_end) {
+			MERROR("invalid region record in catalog of branch[%d]\n",
+			       scan->mrs_bindex);
+			goto out;
+		}
+		fid = mar->mar_fid;
+	} else {
+		fid = map->map_fid;
+	}
+
+	if (scan->mrs_bindex != recover->msr_bindex) {
+		/* Same files as the recovery branch, canceled when recovered */
+		ret = masync_recover_other_add(&recover->msr_others[scan->mrs_bindex],
+		                               fid, &cookie);
+		goto out;
+	}
+
+	/* Record layout of MLOG_ASYNC_MAGIC is a prefix of the path one */
+	if (rec->mrh_type == MLOG_ASYNC_PATH_MAGIC &&
+	    map->map_path_len > 0 &&
+	    MLOG_ASYNC_PATH_REC_LEN(map->map_path_len) <= rec->mrh_len) {
+		path = map->map_path;
+		path_len = map->map_path_len;
+	}
+
+	/* Workers are not started yet, msr_lock is not needed */
+	rfile = masync_recover_find_nonlock(recover, fid);
+	if (rfile == NULL) {
+		MTFS_ALLOC_PTR(rfile);
+		if (rfile == NULL) {
+			MERROR("not enough memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+		rfile->mrf_fid = fid;
+		MTFS_INIT_LIST_HEAD(&rfile->mrf_linkage);
+		mtfs_hlist_add_head(&rfile->mrf_hash,
+		                    &recover->msr_hash[masync_recover_hash(rfile->mrf_fid)]);
+		mtfs_list_add_tail(&rfile->mrf_linkage, &recover->msr_files);
+		atomic_inc(&recover->msr_untrusted);
+		recover->msr_total++;
+		if (scan->mrs_info->msai_bloom_bindex >= 0 &&
+		    !scan->mrs_info->msai_bloom_loaded) {
+			/* The saved filter already has it if loaded */
+			masync_bloom_add(scan->mrs_info, fid);
+		}
+	}
+
+	if (rfile->mrf_path == NULL && path != NULL) {
+		MTFS_ALLOC(rfile->mrf_path, path_len + 1);
+		if (rfile->mrf_path == NULL) {
+			MERROR("not enough memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+		memcpy(rfile->mrf_path, path, path_len);
+		rfile->mrf_path_len = path_len;
+	}
+
+	if (rec->mrh_type == MLOG_ASYNC_REGION_MAGIC) {
+		ret = masync_recover_region_add(rfile, mar->mar_start,
+		                                mar->mar_end);
+		if (ret) {
+			goto out;
+		}
+	}
+
+	ret = masync_cookies_add(&rfile->mrf_cookies, &cookie);
+out:
+	MRETURN(ret);
+}
+
+/* Records are merged by fid, so their order does not matter */
+static int masync_recover_scan_cb(struct mlog_handle *mlh,
+                                  struct mlog_rec_hdr *rec,
+                                  void *data)
+{
+	struct masync_recover_scan *scan = (struct masync_recover_scan *)data;
+	int ret = 0;
+
+	mutex_lock(&scan->mrs_mutex);
+	ret = masync_recover_scan_rec(mlh, rec, data);
+	mutex_unlock(&scan->mrs_mutex);
+	return ret;
+}
+
+/*
+ * Lookup path component by component under d_root.
+ * Needed to dput the returned dentry.
+ */
+static struct dentry *masync_recover_lookup(struct dentry *d_root,
+                                            const char *path,
+                                            int len)
+{
+	struct dentry *dparent = dget(d_root);
+	struct dentry *dchild = NULL;
+	const char *name = path;
+	const char *end = path + len;
+	const char *next = NULL;
+	MENTRY();
+
+	while (name < end) {
+		while (name < end && *name == '/') {
+			name++;
+		}
+
+		if (name == end) {
+			break;
+		}
+
+		for (next = name; next < end && *next != '/'; next++);
+
+		mutex_lock(&dparent->d_inode->i_mutex);
+		dchild = lookup_one_len(name, dparent, next - name);
+		mutex_unlock(&dparent->d_inode->i_mutex);
+		dput(dparent);
+		if (IS_ERR(dchild)) {
+			goto out;
+		}
+
+		if (dchild->d_inode == NULL) {
+			dput(dchild);
+			dchild = ERR_PTR(-ENOENT);
+			goto out;
+		}
+
+		dparent = dchild;
+		name = next;
+	}
+	dchild = dparent;
+out:
+	MRETURN(dchild);
+}
+
+static struct file *masync_recover_open(struct super_block *sb,
+                                        mtfs_bindex_t bindex,
+                                        struct dentry *hidden_dentry,
+                                        int flags)
+{
+	struct vfsmount *hidden_mnt = mtfs_s2mntbranch(sb, bindex);
+	struct file *hidden_file = NULL;
+	MENTRY();
+
+	dget(hidden_dentry);
+	mntget(hidden_mnt);
+	hidden_file = mtfs_dentry_open(hidden_dentry,
+	                               hidden_mnt,
+	                               flags | O_LARGEFILE,
+	                               current_cred());
+	if (IS_ERR(hidden_file)) {
+		MERROR("open branch[%d] of file [%.*s], flags = 0x%x, ret = %ld\n",
+		       bindex, hidden_dentry->d_name.len, hidden_dentry->d_name.name,
+		       flags, PTR_ERR(hidden_file));
+	}
+
+	MRETURN(hidden_file);
+}
+
+static int masync_recover_truncate(struct dentry *hidden_dentry, loff_t size)
+{
+	struct inode *inode = hidden_dentry->d_inode;
+	struct iattr newattrs;
+	int ret = 0;
+	MENTRY();
+
+	if (i_size_read(inode) == size) {
+		goto out;
+	}
+
+	newattrs.ia_size = size;
+	newattrs.ia_valid = ATTR_SIZE;
+	mutex_lock(&inode->i_mutex);
+	ret = notify_change(hidden_dentry, &newattrs);
+	mutex_unlock(&inode->i_mutex);
+out:
+	MRETURN(ret);
+}
+
+/*
+ * Copy [start, end) from primary branch to the others.
+ * Blocks of zero, including holes of primary, are left as holes.
+ * SEEK_DATA is not used since llseek of lower fs may take i_mutex.
+ * Called holding i_mutex of primary branch.
+ */
+static int masync_recover_copy(struct masync_recover *recover,
+                               struct masync_recover_file *rfile,
+                               struct file **hidden_file,
+                               loff_t start,
+                               loff_t end,
+                               char *buf,
+                               int buf_size)
+{
+	mtfs_bindex_t bnum = mtfs_s2bnum(recover->msr_sb);
+	mtfs_bindex_t bindex = 0;
+	loff_t pos = 0;
+	loff_t tmp_pos = 0;
+	ssize_t len = 0;
+	ssize_t result = 0;
+	__u64 copied = 0;
+	__u64 sparse = 0;
+	int zero = 0;
+	int ret = 0;
+	MENTRY();
+
+	for (pos = start; pos < end; pos += len) {
+		len = end - pos;
+		if (len > buf_size) {
+			len = buf_size;
+		}
+
+		tmp_pos = pos;
+		result = _do_read_write(READ, hidden_file[0], buf, len, &tmp_pos);
+		if (result <= 0) {
+			MERROR("failed to read [%.*s] at %llu, ret = %ld\n",
+			       rfile->mrf_path_len, rfile->mrf_path,
+			       pos, result);
+			ret = result ? result : -EIO;
+			break;
+		}
+		len = result;
+		zero = mtfs_buffer_is_zero(buf, len);
+
+		for (bindex = 1; bindex < bnum; bindex++) {
+			if (hidden_file[bindex] == NULL) {
+				continue;
+			}
+
+			if (zero) {
+				result = mtfs_file_write_zero(hidden_file[bindex],
+				                              buf, len, pos);
+			} else {
+				tmp_pos = pos;
+				result = _do_read_write(WRITE, hidden_file[bindex],
+				                        buf, len, &tmp_pos);
+			}
+			if (result != len) {
+				MERROR("failed to write [%.*s] of branch[%d] "
+				       "at %llu, ret = %ld\n",
+				       rfile->mrf_path_len, rfile->mrf_path,
+				       bindex, pos, result);
+				ret = result < 0 ? result : -EIO;
+				break;
+			}
+		}
+		if (ret) {
+			break;
+		}
+		if (zero) {
+			sparse += len;
+		} else {
+			copied += len;
+		}
+	}
+
+	mtfs_spin_lock(&recover->msr_lock);
+	recover->msr_copied += copied;
+	recover->msr_sparse += sparse;
+	mtfs_spin_unlock(&recover->msr_lock);
+	MRETURN(ret);
+}
+
+/*
+ * Copy the file from primary branch to the others,
+ * only the regions in the records if any.
+ * Return 0 if recovered or the file does not exist any more.
+ */
+static int masync_recover_sync(struct masync_recover *recover,
+                               struct masync_recover_file *rfile,
+                               char *buf,
+                               int buf_size)
+{
+	struct super_block *sb = recover->msr_sb;
+	mtfs_bindex_t bnum = mtfs_s2bnum(sb);
+	mtfs_bindex_t bindex = 0;
+	struct dentry *hidden_dentry[MTFS_BRANCH_MAX];
+	struct file *hidden_file[MTFS_BRANCH_MAX];
+	struct inode *primary_inode = NULL;
+	struct dentry *hidden_root = NULL;
+	struct mtfs_interval_node_extent *region = NULL;
+	loff_t size = 0;
+	loff_t end = 0;
+	int i = 0;
+	int ret = 0;
+	MENTRY();
+
+	memset(hidden_dentry, 0, sizeof(hidden_dentry));
+	memset(hidden_file, 0, sizeof(hidden_file));
+
+	if (rfile->mrf_path == NULL) {
+		MERROR("no path of fid %llu in records, unable to recover\n",
+		       rfile->mrf_fid);
+		ret = -ENOENT;
+		goto out;
+	}
+
+	for (bindex = 0; bindex < bnum; bindex++) {
+		hidden_root = recover->msr_roots[bindex];
+		if (hidden_root == NULL) {
+			continue;
+		}
+
+		hidden_dentry[bindex] = masync_recover_lookup(hidden_root,
+		                                              rfile->mrf_path,
+		                                              rfile->mrf_path_len);
+		if (IS_ERR(hidden_dentry[bindex])) {
+			ret = PTR_ERR(hidden_dentry[bindex]);
+			hidden_dentry[bindex] = NULL;
+			if (bindex == 0 && ret == -ENOENT) {
+				/* Removed after being written, nothing to do */
+				ret = 0;
+				goto out_put;
+			}
+			MERROR("failed to lookup [%.*s] on branch[%d], ret = %d\n",
+			       rfile->mrf_path_len, rfile->mrf_path,
+			       bindex, ret);
+			goto out_put;
+		}
+
+		if (!S_ISREG(hidden_dentry[bindex]->d_inode->i_mode)) {
+			MERROR("[%.*s] on branch[%d] is not a regular file\n",
+			       rfile->mrf_path_len, rfile->mrf_path, bindex);
+			ret = -EINVAL;
+			goto out_put;
+		}
+	}
+
+	if (hidden_dentry[0] == NULL) {
+		ret = -ENOENT;
+		goto out_put;
+	}
+
+	if (hidden_dentry[recover->msr_bindex] == NULL ||
+	    hidden_dentry[recover->msr_bindex]->d_inode->i_ino != rfile->mrf_fid) {
+		/* Renamed or replaced since logged, the path is not trustable */
+		MERROR("[%.*s] is not fid %llu any more\n",
+		       rfile->mrf_path_len, rfile->mrf_path, rfile->mrf_fid);
+		ret = -ESTALE;
+		goto out_put;
+	}
+
+	for (bindex = 0; bindex < bnum; bindex++) {
+		if (hidden_dentry[bindex] != NULL) {
+			rfile->mrf_bfids[bindex] = hidden_dentry[bindex]->d_inode->i_ino;
+		}
+	}
+
+	for (bindex = 0; bindex < bnum; bindex++) {
+		if (hidden_dentry[bindex] == NULL) {
+			continue;
+		}
+
+		hidden_file[bindex] = masync_recover_open(sb, bindex,
+		                                          hidden_dentry[bindex],
+		                                          bindex == 0 ? O_RDONLY : O_WRONLY);
+		if (IS_ERR(hidden_file[bindex])) {
+			ret = PTR_ERR(hidden_file[bindex]);
+			hidden_file[bindex] = NULL;
+			goto out_fput;
+		}
+	}
+
+	/* Block writers of the primary branch while copying */
+	primary_inode = hidden_dentry[0]->d_inode;
+	mutex_lock(&primary_inode->i_mutex);
+	size = i_size_read(primary_inode);
+	if (rfile->mrf_region_count == 0 || rfile->mrf_whole) {
+		ret = masync_recover_copy(recover, rfile, hidden_file,
+		                          0, size, buf, buf_size);
+	} else {
+		for (i = 0; ret == 0 && i < rfile->mrf_region_count; i++) {
+			region = &rfile->mrf_regions[i];
+			if (region->start >= size) {
+				continue;
+			}
+
+			if (region->end >= size) {
+				end = size;
+			} else {
+				end = region->end + 1;
+			}
+			ret = masync_recover_copy(recover, rfile, hidden_file,
+			                          region->start, end,
+			                          buf, buf_size);
+		}
+	}
+
+	for (bindex = 1; ret == 0 && bindex < bnum; bindex++) {
+		if (hidden_dentry[bindex] == NULL) {
+			continue;
+		}
+
+		ret = masync_recover_truncate(hidden_dentry[bindex], size);
+		if (ret) {
+			MERROR("failed to truncate [%.*s] of branch[%d], "
+			       "ret = %d\n",
+			       rfile->mrf_path_len, rfile->mrf_path,
+			       bindex, ret);
+		}
+	}
+	mutex_unlock(&primary_inode->i_mutex);
+out_fput:
+	for (bindex = 0; bindex < bnum; bindex++) {
+		if (hidden_file[bindex]) {
+			fput(hidden_file[bindex]);
+		}
+	}
+out_put:
+	for (bindex = 0; bindex < bnum; bindex++) {
+		if (hidden_dentry[bindex]) {
+			dput(hidden_dentry[bindex]);
+		}
+	}
+out:
+	MRETURN(ret);
+}
+
+/* Called when no file is left to recover */
+static void masync_recover_finish(struct masync_recover *recover)
+{
+	struct super_block *sb = recover->msr_sb;
+	struct masync_recover_others *others = NULL;
+	struct masync_cookies cookies;
+	int failed = atomic_read(&recover->msr_failed);
+	mtfs_bindex_t bindex = 0;
+	int i = 0;
+	MENTRY();
+
+	/*
+	 * Records of failed files are kept for next mount. So are the
+	 * records left by a failure to batch them, which is harmless.
+	 */
+	for (bindex = 0; bindex < mtfs_s2bnum(sb); bindex++) {
+		others = &recover->msr_others[bindex];
+		memset(&cookies, 0, sizeof(cookies));
+		for (i = 0; i < others->mro_count; i++) {
+			if (failed && !others->mro_array[i].mro_done) {
+				continue;
+			}
+			if (masync_cookies_add(&cookies,
+			                       &others->mro_array[i].mro_cookie)) {
+				break;
+			}
+		}
+		masync_cookies_cancel(sb, bindex, &cookies);
+		masync_cookies_free(&cookies);
+		masync_recover_others_free(others);
+	}
+
+	MPRINT("recovered %d of %d async files with %d records, %d failed\n",
+	       atomic_read(&recover->msr_recovered), recover->msr_total,
+	       recover->msr_records, atomic_read(&recover->msr_failed));
+	_MRETURN();
+}
+
+static void masync_recover_file_done(struct masync_recover *recover,
+                                     struct masync_recover_file *rfile,
+                                     int result)
+{
+	struct msubject_async_info *info = NULL;
+	mtfs_bindex_t bindex = 0;
+	int finished = 0;
+	MENTRY();
+
+	info = (struct msubject_async_info *)mtfs_s2subinfo(recover->msr_sb);
+	if (result == 0) {
+		masync_cookies_cancel(recover->msr_sb, recover->msr_bindex,
+		                      &rfile->mrf_cookies);
+		if (info->msai_bloom_bindex >= 0) {
+			masync_bloom_del(info, rfile->mrf_fid);
+		}
+	}
+
+	mtfs_spin_lock(&recover->msr_lock);
+	if (result == 0) {
+		for (bindex = 0; bindex < mtfs_s2bnum(recover->msr_sb); bindex++) {
+			if (bindex == recover->msr_bindex ||
+			    rfile->mrf_bfids[bindex] == 0) {
+				continue;
+			}
+			masync_recover_other_done(&recover->msr_others[bindex],
+			                          rfile->mrf_bfids[bindex]);
+		}
+		mtfs_hlist_del_init(&rfile->mrf_hash);
+		atomic_dec(&recover->msr_untrusted);
+		atomic_inc(&recover->msr_recovered);
+	} else {
+		/* Keep it untrusted, records are left for next mount */
+		atomic_inc(&recover->msr_failed);
+	}
+	recover->msr_running--;
+	if (mtfs_list_empty(&recover->msr_files) &&
+	    recover->msr_running == 0 &&
+	    !recover->msr_finished) {
+		recover->msr_finished = 1;
+		finished = 1;
+	}
+	mtfs_spin_unlock(&recover->msr_lock);
+
+	if (result == 0) {
+		masync_recover_file_free(rfile);
+	}
+
+	if (finished) {
+		masync_recover_finish(recover);
+	}
+	_MRETURN();
+}
+
+static int masync_recover_busy(struct mtfs_service *service,
+                               struct mservice_thread *thread)
+{
+	struct masync_recover *recover = (struct masync_recover *)service->srv_data;
+	int ret = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&recover->msr_lock);
+	ret = !mtfs_list_empty(&recover->msr_files);
+	mtfs_spin_unlock(&recover->msr_lock);
+	MRETURN(ret);
+}
+
+static int masync_recover_main(struct mtfs_service *service,
+                               struct mservice_thread *thread)
+{
+	struct masync_recover *recover = (struct masync_recover *)service->srv_data;
+	struct masync_recover_file *rfile = NULL;
+	int buf_size = MASYNC_RECOVER_BULK_SIZE;
+	char *buf = NULL;
+	int ret = 0;
+	MENTRY();
+
+	MTFS_ALLOC(buf, buf_size);
+	if (buf == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (1) {
+		if (mservice_wait_event(service, thread)) {
+			break;
+		}
+
+		mtfs_spin_lock(&recover->msr_lock);
+		if (mtfs_list_empty(&recover->msr_files)) {
+			mtfs_spin_unlock(&recover->msr_lock);
+			continue;
+		}
+		rfile = mtfs_list_entry(recover->msr_files.next,
+		                        struct masync_recover_file,
+		                        mrf_linkage);
+		mtfs_list_del_init(&rfile->mrf_linkage);
+		recover->msr_running++;
+		mtfs_spin_unlock(&recover->msr_lock);
+
+		ret = masync_recover_sync(recover, rfile, buf, buf_size);
+		masync_recover_file_done(recover, rfile, ret);
+	}
+
+	MTFS_FREE(buf, buf_size);
+out:
+	MRETURN(ret);
+}
+
+/*
+ * Return 1 if the file is not recovered yet,
+ * and only the primary branch is trustable.
+ */
+int masync_recover_pending(struct inode *inode)
+{
+	struct msubject_async_info *info = NULL;
+	struct masync_recover *recover = NULL;
+	struct inode *hidden_inode = NULL;
+	int ret = 0;
+	MENTRY();
+
+	info = (struct msubject_async_info *)mtfs_s2subinfo(inode->i_sb);
+	recover = info->msai_recover;
+	if (likely(recover == NULL ||
+	           atomic_read(&recover->msr_untrusted) == 0)) {
+		goto out;
+	}
+
+	hidden_inode = mtfs_i2branch(inode, recover->msr_bindex);
+	if (hidden_inode == NULL) {
+		goto out;
+	}
+
+	/* Most files are clean, skip the hash lookup under lock */
+	MASSERT(info->msai_bloom_bindex < 0 ||
+	        info->msai_bloom_bindex == recover->msr_bindex);
+	if (!masync_bloom_dirty(info, hidden_inode->i_ino)) {
+		goto out;
+	}
+
+	mtfs_spin_lock(&recover->msr_lock);
+	ret = (masync_recover_find_nonlock(recover, hidden_inode->i_ino) != NULL);
+	mtfs_spin_unlock(&recover->msr_lock);
+out:
+	MRETURN(ret);
+}
+
+#define MASYNC_RECOVER_SERVICE_NAME "mtfs_recover"
+int masync_recover_init(struct super_block *sb,
+                        struct msubject_async_info *info)
+{
+	struct mtfs_device *device = mtfs_s2dev(sb);
+	struct masync_recover *recover = NULL;
+	struct masync_recover_scan scan;
+	struct mtfs_lowerfs *lowerfs = NULL;
+	struct mtfs_run_ctxt saved;
+	struct mtfs_ucred ucred = { 0 };
+	mtfs_bindex_t bindex = 0;
+	int threads = masync_recover_threads;
+	int i = 0;
+	int ret = 0;
+	MENTRY();
+
+	MTFS_ALLOC_PTR(recover);
+	if (recover == NULL) {
+		MERROR("not enough memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * sb->s_root is set before subject init,
+	 * but it is cleared when umounting before subject fini.
+	 */
+	MASSERT(sb->s_root);
+	recover->msr_sb = sb;
+	recover->msr_bindex = -1;
+	for (bindex = 0; bindex < mtfs_s2bnum(sb); bindex++) {
+		if (mtfs_d2branch(sb->s_root, bindex)) {
+			recover->msr_roots[bindex] = dget(mtfs_d2branch(sb->s_root, bindex));
+		}
+	}
+	for (i = 0; i < MASYNC_RECOVER_HASH_SIZE; i++) {
+		MTFS_INIT_HLIST_HEAD(&recover->msr_hash[i]);
+	}
+	MTFS_INIT_LIST_HEAD(&recover->msr_files);
+	mtfs_spin_lock_init(&recover->msr_lock);
+	atomic_set(&recover->msr_untrusted, 0);
+	atomic_set(&recover->msr_recovered, 0);
+	atomic_set(&recover->msr_failed, 0);
+
+	/* the owner of log file should always be root */
+	cap_raise(ucred.luc_cap, CAP_SYS_RESOURCE);
+	scan.mrs_recover = recover;
+	scan.mrs_info = info;
+	mutex_init(&scan.mrs_mutex);
+	for (bindex = 0; bindex < mtfs_s2bnum(sb); bindex++) {
+		lowerfs = mtfs_dev2blowerfs(device, bindex);
+		if (!lowerfs->ml_trans_support) {
+			continue;
+		}
+
+		if (recover->msr_bindex == -1) {
+			recover->msr_bindex = bindex;
+		}
+
+		scan.mrs_bindex = bindex;
+		MASSERT(mtfs_s2bcathandle(sb, bindex));
+		mtfs_push_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		ret = mlog_cat_process_flags(mtfs_s2bcathandle(sb, bindex),
+		                             masync_recover_scan_cb,
+		                             &scan, MLOG_PROCESS_UNORDERED);
+		mtfs_pop_ctxt(&saved, &mtfs_s2bctxt(sb, bindex), &ucred);
+		if (ret) {
+			MERROR("failed to scan records of branch[%d], ret = %d\n",
+			       bindex, ret);
+			goto out_free;
+		}
+	}
+
+	if (recover->msr_records == 0) {
+		/* Clean shutdown */
+		goto out_free;
+	}
+
+	for (bindex = 0; bindex < mtfs_s2bnum(sb); bindex++) {
+		sort(recover->msr_others[bindex].mro_array,
+		     recover->msr_others[bindex].mro_count,
+		     sizeof(*recover->msr_others[bindex].mro_array),
+		     masync_recover_other_cmp, NULL);
+	}
+
+	MPRINT("recovering %d async files with %d records\n",
+	       recover->msr_total, recover->msr_records);
+	if (recover->msr_total == 0) {
+		recover->msr_finished = 1;
+		masync_recover_finish(recover);
+		goto out_free;
+	}
+
+	if (threads > recover->msr_total) {
+		threads = recover->msr_total;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	mtfs_spin_lock(&info->msai_recover_lock);
+	info->msai_recover = recover;
+	mtfs_spin_unlock(&info->msai_recover_lock);
+	recover->msr_service = mservice_init(MASYNC_RECOVER_SERVICE_NAME,
+	                                     MASYNC_RECOVER_SERVICE_NAME,
+	                                     threads, threads, 1, 0,
+	                                     masync_recover_main,
+	                                     masync_recover_busy,
+	                                     recover);
+	if (recover->msr_service == NULL) {
+		MERROR("failed to start service\n");
+		mtfs_spin_lock(&info->msai_recover_lock);
+		info->msai_recover = NULL;
+		mtfs_spin_unlock(&info->msai_recover_lock);
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	goto out;
+out_free:
+	masync_recover_free(recover);
+out:
+	MRETURN(ret);
+}
+
+void masync_recover_free(struct masync_recover *recover)
+{
+	struct masync_recover_file *rfile = NULL;
+	mtfs_hlist_node_t *pos = NULL;
+	mtfs_hlist_node_t *n = NULL;
+	mtfs_bindex_t bindex = 0;
+	int i = 0;
+	MENTRY();
+
+	for (i = 0; i < MASYNC_RECOVER_HASH_SIZE; i++) {
+		mtfs_hlist_for_each_entry_safe(rfile, pos, n,
+		                               &recover->msr_hash[i],
+		                               mrf_hash) {
+			mtfs_hlist_del_init(&rfile->mrf_hash);
+			masync_recover_file_free(rfile);
+		}
+	}
+
+	for (bindex = 0; bindex < MTFS_BRANCH_MAX; bindex++) {
+		masync_recover_others_free(&recover->msr_others[bindex]);
+		if (recover->msr_roots[bindex]) {
+			dput(recover->msr_roots[bindex]);
+		}
+	}
+	MTFS_FREE_PTR(recover);
+	_MRETURN();
+}
+
+void masync_recover_fini(struct msubject_async_info *info)
+{
+	struct masync_recover *recover = NULL;
+	MENTRY();
+
+	/* Hide it from proc readers before freeing */
+	mtfs_spin_lock(&info->msai_recover_lock);
+	recover = info->msai_recover;
+	info->msai_recover = NULL;
+	mtfs_spin_unlock(&info->msai_recover_lock);
+	if (recover == NULL) {
+		goto out;
+	}
+
+	/* Unfinished files keep their records for next mount */
+	mservice_fini(recover->msr_service);
+	masync_recover_free(recover);
+out:
+	_MRETURN();
+}
+
+int masync_recover_proc_read(struct msubject_async_info *info,
+                             char *page, int count)
+{
+	struct masync_recover *recover = NULL;
+	__u64 copied = 0;
+	__u64 sparse = 0;
+	int ret = 0;
+	MENTRY();
+
+	mtfs_spin_lock(&info->msai_recover_lock);
+	recover = info->msai_recover;
+	if (recover == NULL) {
+		ret = snprintf(page, count, "state: clean\n");
+		goto out_unlock;
+	}
+
+	mtfs_spin_lock(&recover->msr_lock);
+	copied = recover->msr_copied;
+	sparse = recover->msr_sparse;
+	mtfs_spin_unlock(&recover->msr_lock);
+
+	ret = snprintf(page, count,
+	               "state: %s\n"
+	               "files: %d\n"
+	               "records: %d\n"
+	               "recovered: %d\n"
+	               "untrusted: %d\n"
+	               "failed: %d\n"
+	               "copied: %llu\n"
+	               "sparse: %llu\n",
+	               recover->msr_finished ? "finished" : "recovering",
+	               recover->msr_total,
+	               recover->msr_records,
+	               atomic_read(&recover->msr_recovered),
+	               atomic_read(&recover->msr_untrusted),
+	               atomic_read(&recover->msr_failed),
+	               copied,
+	               sparse);
+out_unlock:
+	mtfs_spin_unlock(&info->msai_recover_lock);
+	MRETURN(ret);
+}
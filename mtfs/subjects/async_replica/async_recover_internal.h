@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#ifndef __MTFS_ASYNC_RECOVER_INTERNAL_H__
+#define __MTFS_ASYNC_RECOVER_INTERNAL_H__
+#include <mtfs_async.h>
+#include "async_internal.h"
+
+int masync_recover_init(struct super_block *sb,
+                        struct msubject_async_info *info);
+void masync_recover_fini(struct msubject_async_info *info);
+void masync_recover_free(struct masync_recover *recover);
+int masync_recover_pending(struct inode *inode);
+int masync_recover_proc_read(struct msubject_async_info *info,
+                             char *page, int count);
+#endif /* __MTFS_ASYNC_RECOVER_INTERNAL_H__ */
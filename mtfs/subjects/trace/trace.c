@@ -11,11 +11,9 @@
 #include <mtfs_proc.h>
 #include <mtfs_subject.h>
 #include <mtfs_super.h>
+#include <mtfs_device.h>
 #include <mtfs_mmap.h>
-
-#define TOPS_READ         0x00000001
-#define TOPS_WRITE        0x00000002
-#define TOPS_DEFAULT      (TOPS_READ | TOPS_WRITE)
+#include "trace_filter_internal.h"
 
 unsigned int mtrace_operations = TOPS_DEFAULT;
 module_param(mtrace_operations, int, 0644);
@@ -174,8 +172,10 @@ static void mtrace_io_iter_start_rw(struct mtfs_io *io)
 		}
 	} else {
 		/* Trace branch */
-		if ((io->mi_type == MIOT_WRITEV && mtrace_trace_type(TOPS_WRITE)) || 
-		    (io->mi_type == MIOT_READV && mtrace_trace_type(TOPS_READ))) {
+		if (((io->mi_type == MIOT_WRITEV && mtrace_trace_type(TOPS_WRITE)) || 
+		     (io->mi_type == MIOT_READV && mtrace_trace_type(TOPS_READ))) &&
+		    mtrace_filter_match(info, io, io->mi_type == MIOT_WRITEV ?
+		                                  TOPS_WRITE : TOPS_READ)) {
 			head->mrh_len = sizeof(*io_trace);
 			io_trace->type = io->mi_type;
 			io_trace->result = io->mi_result;
@@ -477,6 +477,11 @@ static int mtrace_io_init_rw(struct mtfs_io *io, int is_write,
 	io_rw->iov_length = sizeof(*iov) * nr_segs;
 	io_rw->rw_size = rw_size;
 
+	/* Taken before *ppos is moved by the data branches */
+	io->subject.mi_trace.ino = file->f_dentry->d_inode->i_ino;
+	io->subject.mi_trace.offset = *ppos;
+	io->subject.mi_trace.size = rw_size;
+
 	MRETURN(ret);
 }
 
@@ -590,6 +595,106 @@ EXPORT_SYMBOL(mtrace_file_aio_write);
 
 #endif /* !HAVE_FILE_READV */
 
+/*
+ * Reader of "trace/ring" takes the records from the rings instead of the
+ * record file, until it closes the file and unmaps the rings. The super
+ * block is held meanwhile, so umount is delayed until then.
+ */
+static int mtrace_ring_open(struct inode *inode, struct file *file)
+{
+	struct super_block *sb = (struct super_block *)PDE(inode)->data;
+	struct msubject_trace_info *info = NULL;
+	int ret = 0;
+	MENTRY();
+
+	if (sb == NULL || !atomic_inc_not_zero(&sb->s_active)) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	info = (struct msubject_trace_info *)mtfs_s2subinfo(sb);
+	ret = mrecord_export_start(&info->msti_handle);
+	if (ret) {
+		MERROR("failed to export rings, ret = %d\n", ret);
+		goto out_deactivate;
+	}
+	file->private_data = sb;
+	goto out;
+out_deactivate:
+	deactivate_super(sb);
+out:
+	MRETURN(ret);
+}
+
+static int mtrace_ring_release(struct inode *inode, struct file *file)
+{
+	struct super_block *sb = (struct super_block *)file->private_data;
+	struct msubject_trace_info *info = NULL;
+	int ret = 0;
+	MENTRY();
+
+	info = (struct msubject_trace_info *)mtfs_s2subinfo(sb);
+	mrecord_export_stop(&info->msti_handle);
+	deactivate_super(sb);
+	MRETURN(ret);
+}
+
+static int mtrace_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct super_block *sb = (struct super_block *)file->private_data;
+	struct msubject_trace_info *info = NULL;
+	int ret = 0;
+	MENTRY();
+
+	info = (struct msubject_trace_info *)mtfs_s2subinfo(sb);
+	ret = mrecord_export_mmap(&info->msti_handle, vma);
+	MRETURN(ret);
+}
+
+static struct file_operations mtrace_ring_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mtrace_ring_open,
+	.release = mtrace_ring_release,
+	.mmap    = mtrace_ring_mmap,
+};
+
+static int mtrace_proc_read_stats(char *page, char **start, off_t off,
+                                  int count, int *eof, void *data)
+{
+	struct super_block *sb = (struct super_block *)data;
+	struct msubject_trace_info *info = NULL;
+
+	*eof = 1;
+	info = (struct msubject_trace_info *)mtfs_s2subinfo(sb);
+	return mrecord_export_stats(&info->msti_handle, page, count);
+}
+
+static int mtrace_proc_read_filter(char *page, char **start, off_t off,
+                                   int count, int *eof, void *data)
+{
+	struct super_block *sb = (struct super_block *)data;
+
+	*eof = 1;
+	return mtrace_filter_proc_read(mtfs_s2subinfo(sb), page, count);
+}
+
+static int mtrace_proc_write_filter(struct file *file, const char *buffer,
+                                    unsigned long count, void *data)
+{
+	struct super_block *sb = (struct super_block *)data;
+
+	return mtrace_filter_proc_write(mtfs_s2subinfo(sb), buffer, count);
+}
+
+static struct mtfs_proc_vars mtrace_proc_vars[] = {
+	{ "ring", NULL, NULL, NULL, &mtrace_ring_fops, 0600 },
+	{ "stats", mtrace_proc_read_stats, NULL, NULL },
+	{ "filter", mtrace_proc_read_filter, mtrace_proc_write_filter, NULL },
+	{ 0 }
+};
+
+#define MTRACE_PROC_NAME "trace"
+
 int mtrace_super_init(struct super_block *sb)
 {
 	int ret = 0;
@@ -607,6 +712,7 @@ int mtrace_super_init(struct super_block *sb)
 	}
 	handle = &info->msti_handle;
 	handle->mrh_ops = &mrecord_file_ops;
+	mutex_init(&info->msti_filter_mutex);
 
 	mrh_file = &handle->u.mrh_file;
 	mrh_file->mrfi_mnt = mtfs_s2mntbranch(sb, bindex);
@@ -624,20 +730,38 @@ int mtrace_super_init(struct super_block *sb)
 		goto out_fini_handle;
 	}
 
+	/* Proc handlers find info through sb once registered */
+	mtfs_s2subinfo(sb) = (void *)info;
+	info->msti_proc_entry = mtfs_proc_register(MTRACE_PROC_NAME,
+	                                           mtfs_dev2proc(mtfs_s2dev(sb)),
+	                                           mtrace_proc_vars, sb);
+	if (unlikely(info->msti_proc_entry == NULL)) {
+		MERROR("failed to register proc for trace\n");
+		ret = -ENOMEM;
+		goto out_fini_handle;
+	}
+
 #ifdef CONFIG_SYSCTL
 #ifdef HAVE_REGISTER_SYSCTL_2ARGS
 	info->msti_ctl_table = register_sysctl_table(mtrace_top_table, 0);
 #else /* !HAVE_REGISTER_SYSCTL_2ARGS */
 	info->msti_ctl_table = register_sysctl_table(mtrace_top_table);
 #endif /* !HAVE_REGISTER_SYSCTL_2ARGS */
+	if (unlikely(info->msti_ctl_table == NULL)) {
+		MERROR("failed to register sysctl for trace\n");
+		ret = -ENOMEM;
+		goto out_fini_handle;
+	}
 #endif /* CONFIG_SYSCTL */
-
-	mtfs_s2subinfo(sb) = (void *)info;
 	goto out;
 out_fini_handle:
+	mtfs_proc_remove(&info->msti_proc_entry);
+	mtfs_s2subinfo(sb) = NULL;
+	/* Filters might have been written through proc meanwhile */
+	mtrace_filter_fini(info);
 	mrecord_fini(handle);
 out_free_handle:
-	MTFS_FREE_PTR(handle);
+	MTFS_FREE_PTR(info);
 out:
 	MRETURN(ret);
 }
@@ -650,7 +774,9 @@ int mtrace_super_fini(struct super_block *sb)
 
 	info = (struct msubject_trace_info *)mtfs_s2subinfo(sb);
 	unregister_sysctl_table(info->msti_ctl_table);
+	mtfs_proc_remove(&info->msti_proc_entry);
 	mrecord_fini(&info->msti_handle);
+	mtrace_filter_fini(info);
 	MTFS_FREE_PTR(info);
 	MRETURN(ret);
 }
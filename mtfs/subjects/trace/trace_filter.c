@@ -0,0 +1,528 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <linux/module.h>
+#include <linux/uaccess.h>
+#include <linux/percpu.h>
+#include <linux/jiffies.h>
+#include <linux/cred.h>
+#include <debug.h>
+#include <memory.h>
+#include <mtfs_io.h>
+#include <mtfs_dentry.h>
+#include "trace_filter_internal.h"
+
+/*
+ * Per mount filter of traced operations, written into "trace/filter"
+ * as one rule per line, for example:
+ *
+ *   ops=write uid=500 size=1M-16M path=/data,/home result=ok every=10
+ *   ops=read,write result=error rate=100
+ *
+ * An operation is traced if the first rule it matches lets it through
+ * 1-in-N and rate sampling. Without any rule, all operations are traced.
+ * Writing an empty line removes all rules.
+ */
+
+/* Marks a path that could not be built, so that it is built only once */
+static char mtrace_filter_nopath[] = "";
+
+static inline int mtrace_filter_sample(struct mtrace_filter *rule,
+                                       struct mtrace_filter_stats *stats,
+                                       int index)
+{
+	unsigned long now = 0;
+
+	stats->mfs_matched[index]++;
+	if (rule->mtf_every > 1 &&
+	    stats->mfs_matched[index] % rule->mtf_every != 0) {
+		return 0;
+	}
+
+	if (rule->mtf_rate) {
+		now = jiffies;
+		if (time_after_eq(now, rule->mtf_rate_start + HZ)) {
+			/* Racy, a few more might get through */
+			rule->mtf_rate_start = now;
+			atomic_set(&rule->mtf_rate_count, 0);
+		}
+		if (atomic_inc_return(&rule->mtf_rate_count) > rule->mtf_rate) {
+			return 0;
+		}
+	}
+
+	stats->mfs_hits[index]++;
+	return 1;
+}
+
+/*
+ * Whether to trace this operation. Path is only built when a rule that
+ * has passed other conditions needs it, since that is the slow part.
+ */
+int mtrace_filter_match(struct msubject_trace_info *info,
+                        struct mtfs_io *io, unsigned int ops)
+{
+	struct mtfs_io_rw *io_rw = &io->u.mi_rw;
+	struct mtrace_filter_stats *stats = NULL;
+	struct mtrace_filters *filters = NULL;
+	struct mtrace_filter *rule = NULL;
+	char *path = NULL;
+	char *buf = NULL;
+	int need_path = 0;
+	int traced = 0;
+	int i = 0;
+	MENTRY();
+
+again:
+	rcu_read_lock();
+	filters = rcu_dereference(info->msti_filters);
+	if (filters == NULL) {
+		rcu_read_unlock();
+		traced = 1;
+		goto out;
+	}
+
+	for (i = 0; i < filters->mtfs_number; i++) {
+		rule = &filters->mtfs_rules[i];
+		if (!(rule->mtf_ops & ops)) {
+			continue;
+		}
+
+		if ((rule->mtf_valid & MTF_UID) &&
+		    rule->mtf_uid != current_fsuid()) {
+			continue;
+		}
+
+		if ((rule->mtf_valid & MTF_GID) &&
+		    rule->mtf_gid != current_fsgid()) {
+			continue;
+		}
+
+		if ((rule->mtf_valid & MTF_SIZE) &&
+		    (io_rw->rw_size < rule->mtf_size_min ||
+		     io_rw->rw_size > rule->mtf_size_max)) {
+			continue;
+		}
+
+		if ((rule->mtf_valid & MTF_RESULT) &&
+		    rule->mtf_error != (io->mi_result.ssize < 0)) {
+			continue;
+		}
+
+		if (rule->mtf_valid & MTF_PATH) {
+			if (path == NULL) {
+				need_path = 1;
+				break;
+			}
+
+			if (rule_tree_search_prefix(rule->mtf_paths, path) ==
+			    RAID_TYPE_NONE) {
+				continue;
+			}
+		}
+		break;
+	}
+
+	if (!need_path) {
+		stats = per_cpu_ptr(filters->mtfs_stats, get_cpu());
+		if (i < filters->mtfs_number) {
+			traced = mtrace_filter_sample(rule, stats, i);
+		} else {
+			stats->mfs_misses++;
+		}
+		put_cpu();
+	}
+	rcu_read_unlock();
+
+	if (need_path) {
+		/* Rules might be replaced meanwhile, so start over */
+		need_path = 0;
+		path = mtrace_filter_nopath;
+		MTFS_ALLOC(buf, PATH_MAX);
+		if (buf != NULL) {
+			path = mtfs_dentry_path(io_rw->file->f_dentry,
+			                        buf, PATH_MAX);
+			if (IS_ERR(path)) {
+				path = mtrace_filter_nopath;
+			}
+		}
+		goto again;
+	}
+
+out:
+	/* Rules might have been removed while building path */
+	if (buf != NULL) {
+		MTFS_FREE(buf, PATH_MAX);
+	}
+	MRETURN(traced);
+}
+
+static void mtrace_filters_free(struct mtrace_filters *filters)
+{
+	int i = 0;
+
+	for (i = 0; i < filters->mtfs_number; i++) {
+		if (filters->mtfs_rules[i].mtf_paths != NULL) {
+			rule_tree_destruct(filters->mtfs_rules[i].mtf_paths);
+		}
+	}
+	if (filters->mtfs_stats != NULL) {
+		free_percpu(filters->mtfs_stats);
+	}
+	MTFS_FREE_PTR(filters);
+}
+
+static int mtrace_filter_parse_ops(struct mtrace_filter *rule, char *value)
+{
+	char *op = NULL;
+	int ret = 0;
+
+	while ((op = strsep(&value, ",")) != NULL) {
+		if (strcmp(op, "read") == 0) {
+			rule->mtf_ops |= TOPS_READ;
+		} else if (strcmp(op, "write") == 0) {
+			rule->mtf_ops |= TOPS_WRITE;
+		} else {
+			MERROR("unknown operation [%s]\n", op);
+			ret = -EINVAL;
+			break;
+		}
+	}
+	return ret;
+}
+
+static int mtrace_filter_parse_size(struct mtrace_filter *rule, char *value)
+{
+	char *end = NULL;
+	int ret = 0;
+
+	rule->mtf_size_min = memparse(value, &end);
+	if (*end != '-') {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	value = end + 1;
+	if (*value == '\0') {
+		rule->mtf_size_max = (size_t)-1;
+	} else {
+		rule->mtf_size_max = memparse(value, &end);
+		if (*end != '\0' || rule->mtf_size_max < rule->mtf_size_min) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+	rule->mtf_valid |= MTF_SIZE;
+out:
+	if (ret) {
+		MERROR("bad size range, expect [min-max] or [min-]\n");
+	}
+	return ret;
+}
+
+/* Prefixes share one rule_tree, every of them is a rule of RAID0 */
+static int mtrace_filter_parse_path(struct mtrace_filter *rule, char *value)
+{
+	rule_t rules[MAX_RULE_NUM];
+	rule_tree_t *tree = NULL;
+	char *prefix = NULL;
+	int number = 0;
+	int ret = 0;
+	int i = 0;
+	MENTRY();
+
+	while ((prefix = strsep(&value, ",")) != NULL) {
+		if (*prefix == '\0') {
+			continue;
+		}
+
+		if (number >= MAX_RULE_NUM - 1) {
+			MERROR("too many path prefixes, at most %d\n",
+			       MAX_RULE_NUM - 1);
+			ret = -EINVAL;
+			goto out_free;
+		}
+
+		if (strlen(prefix) > MAX_RULE_LEN) {
+			MERROR("path prefix [%s] is too long, at most %d\n",
+			       prefix, MAX_RULE_LEN);
+			ret = -EINVAL;
+			goto out_free;
+		}
+
+		MTFS_ALLOC(rules[number].string, strlen(prefix) + 1);
+		if (rules[number].string == NULL) {
+			MERROR("not enough memory\n");
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		strcpy(rules[number].string, prefix);
+		rules[number].raid_type = RAID_TYPE_RAID0;
+		number++;
+	}
+
+	if (number == 0) {
+		MERROR("no path prefix given\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	tree = rule_tree_construct_prefix(rules, number);
+	if (IS_ERR(tree)) {
+		ret = PTR_ERR(tree);
+		MERROR("failed to construct tree of path prefixes, ret = %d\n",
+		       ret);
+		goto out_free;
+	}
+	rule->mtf_paths = tree;
+	rule->mtf_valid |= MTF_PATH;
+out_free:
+	for (i = 0; i < number; i++) {
+		MTFS_FREE(rules[i].string, strlen(rules[i].string) + 1);
+	}
+out:
+	MRETURN(ret);
+}
+
+static int mtrace_filter_parse(struct mtrace_filter *rule, char *line)
+{
+	char *option = NULL;
+	char *value = NULL;
+	char *end = NULL;
+	int ret = 0;
+	MENTRY();
+
+	strncpy(rule->mtf_string, line, MTRACE_FILTER_LEN - 1);
+	while ((option = strsep(&line, " \t")) != NULL) {
+		if (*option == '\0') {
+			continue;
+		}
+
+		value = strchr(option, '=');
+		if (value == NULL || value[1] == '\0') {
+			MERROR("bad option [%s], expect [name=value]\n", option);
+			ret = -EINVAL;
+			goto out;
+		}
+		*value++ = '\0';
+
+		if (strcmp(option, "ops") == 0) {
+			ret = mtrace_filter_parse_ops(rule, value);
+		} else if (strcmp(option, "uid") == 0) {
+			rule->mtf_uid = simple_strtoul(value, &end, 10);
+			rule->mtf_valid |= MTF_UID;
+		} else if (strcmp(option, "gid") == 0) {
+			rule->mtf_gid = simple_strtoul(value, &end, 10);
+			rule->mtf_valid |= MTF_GID;
+		} else if (strcmp(option, "size") == 0) {
+			ret = mtrace_filter_parse_size(rule, value);
+		} else if (strcmp(option, "result") == 0) {
+			if (strcmp(value, "ok") == 0) {
+				rule->mtf_error = 0;
+			} else if (strcmp(value, "error") == 0) {
+				rule->mtf_error = 1;
+			} else {
+				MERROR("bad result [%s], expect ok or error\n",
+				       value);
+				ret = -EINVAL;
+			}
+			rule->mtf_valid |= MTF_RESULT;
+		} else if (strcmp(option, "path") == 0) {
+			if (rule->mtf_valid & MTF_PATH) {
+				MERROR("path is given twice\n");
+				ret = -EINVAL;
+			} else {
+				ret = mtrace_filter_parse_path(rule, value);
+			}
+		} else if (strcmp(option, "every") == 0) {
+			rule->mtf_every = simple_strtoul(value, &end, 10);
+		} else if (strcmp(option, "rate") == 0) {
+			rule->mtf_rate = simple_strtoul(value, &end, 10);
+		} else {
+			MERROR("unknown option [%s]\n", option);
+			ret = -EINVAL;
+		}
+
+		if (ret == 0 && end != NULL && *end != '\0') {
+			MERROR("bad number [%s] of option [%s]\n", value, option);
+			ret = -EINVAL;
+		}
+		end = NULL;
+
+		if (ret) {
+			goto out;
+		}
+	}
+
+	if (rule->mtf_ops == 0) {
+		rule->mtf_ops = TOPS_DEFAULT;
+	}
+	rule->mtf_rate_start = jiffies;
+	atomic_set(&rule->mtf_rate_count, 0);
+out:
+	MRETURN(ret);
+}
+
+static void mtrace_filters_free_rcu(struct rcu_head *head)
+{
+	struct mtrace_filters *filters = NULL;
+
+	filters = container_of(head, struct mtrace_filters, mtfs_rcu);
+	mtrace_filters_free(filters);
+}
+
+static void mtrace_filters_replace(struct msubject_trace_info *info,
+                                   struct mtrace_filters *filters)
+{
+	struct mtrace_filters *old = NULL;
+
+	mutex_lock(&info->msti_filter_mutex);
+	old = info->msti_filters;
+	rcu_assign_pointer(info->msti_filters, filters);
+	mutex_unlock(&info->msti_filter_mutex);
+
+	if (old != NULL) {
+		call_rcu(&old->mtfs_rcu, mtrace_filters_free_rcu);
+	}
+}
+
+void mtrace_filter_fini(struct msubject_trace_info *info)
+{
+	mtrace_filters_replace(info, NULL);
+	/* Wait for the old rules to be freed */
+	rcu_barrier();
+}
+
+int mtrace_filter_proc_read(struct msubject_trace_info *info,
+                            char *page, int count)
+{
+	struct mtrace_filter_stats *stats = NULL;
+	struct mtrace_filters *filters = NULL;
+	unsigned long matched = 0;
+	unsigned long misses = 0;
+	unsigned long hits = 0;
+	int length = 0;
+	int cpu = 0;
+	int i = 0;
+	MENTRY();
+
+	mutex_lock(&info->msti_filter_mutex);
+	filters = info->msti_filters;
+	if (filters == NULL) {
+		length = snprintf(page, count, "no rule, all traced\n");
+		goto out_unlock;
+	}
+
+	for (i = 0; i < filters->mtfs_number && length < count; i++) {
+		matched = 0;
+		hits = 0;
+		for_each_possible_cpu(cpu) {
+			stats = per_cpu_ptr(filters->mtfs_stats, cpu);
+			matched += stats->mfs_matched[i];
+			hits += stats->mfs_hits[i];
+		}
+		length += snprintf(page + length, count - length,
+		                   "rule%d: %s\n"
+		                   "rule%d_matched: %lu\n"
+		                   "rule%d_hits: %lu\n",
+		                   i, filters->mtfs_rules[i].mtf_string,
+		                   i, matched, i, hits);
+	}
+
+	for_each_possible_cpu(cpu) {
+		misses += per_cpu_ptr(filters->mtfs_stats, cpu)->mfs_misses;
+	}
+	if (length < count) {
+		length += snprintf(page + length, count - length,
+		                   "misses: %lu\n", misses);
+	}
+	if (length > count) {
+		length = count;
+	}
+out_unlock:
+	mutex_unlock(&info->msti_filter_mutex);
+	MRETURN(length);
+}
+
+/* Replace all rules, counters start over */
+int mtrace_filter_proc_write(struct msubject_trace_info *info,
+                             const char *buffer, unsigned long count)
+{
+	struct mtrace_filters *filters = NULL;
+	char *kern_buf = NULL;
+	char *line = NULL;
+	char *next = NULL;
+	int ret = 0;
+	MENTRY();
+
+	if (count >= PAGE_SIZE) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	MTFS_ALLOC(kern_buf, count + 1);
+	if (kern_buf == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(kern_buf, buffer, count)) {
+		ret = -EFAULT;
+		goto out_free_buf;
+	}
+	kern_buf[count] = '\0';
+
+	MTFS_ALLOC_PTR(filters);
+	if (filters == NULL) {
+		ret = -ENOMEM;
+		goto out_free_buf;
+	}
+
+	next = kern_buf;
+	while ((line = strsep(&next, "\n")) != NULL) {
+		line = strstrip(line);
+		if (*line == '\0') {
+			continue;
+		}
+
+		if (filters->mtfs_number >= MTRACE_FILTER_MAX) {
+			MERROR("too many rules, at most %d\n",
+			       MTRACE_FILTER_MAX);
+			ret = -EINVAL;
+			goto out_free_filters;
+		}
+
+		ret = mtrace_filter_parse(&filters->mtfs_rules[filters->mtfs_number],
+		                          line);
+		/* Count it for freeing even if broken */
+		filters->mtfs_number++;
+		if (ret) {
+			goto out_free_filters;
+		}
+	}
+
+	if (filters->mtfs_number == 0) {
+		MTFS_FREE_PTR(filters);
+		filters = NULL;
+		goto out_replace;
+	}
+
+	filters->mtfs_stats = alloc_percpu(struct mtrace_filter_stats);
+	if (filters->mtfs_stats == NULL) {
+		ret = -ENOMEM;
+		goto out_free_filters;
+	}
+out_replace:
+	mtrace_filters_replace(info, filters);
+	goto out_free_buf;
+out_free_filters:
+	mtrace_filters_free(filters);
+out_free_buf:
+	MTFS_FREE(kern_buf, count + 1);
+out:
+	if (ret) {
+		MRETURN(ret);
+	}
+	MRETURN(count);
+}
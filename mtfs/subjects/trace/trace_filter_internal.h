@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#ifndef __MTFS_TRACE_FILTER_INTERNAL_H__
+#define __MTFS_TRACE_FILTER_INTERNAL_H__
+#include <linux/rcupdate.h>
+#include <rule_tree.h>
+#include <mtfs_trace.h>
+
+#define TOPS_READ         0x00000001
+#define TOPS_WRITE        0x00000002
+#define TOPS_DEFAULT      (TOPS_READ | TOPS_WRITE)
+
+#define MTRACE_FILTER_MAX 8
+#define MTRACE_FILTER_LEN 256
+
+/* Conditions set in a rule */
+#define MTF_UID           0x00000001
+#define MTF_GID           0x00000002
+#define MTF_SIZE          0x00000004
+#define MTF_RESULT        0x00000008
+#define MTF_PATH          0x00000010
+
+struct mtrace_filter {
+	unsigned int   mtf_valid;      /* MTF_* */
+	unsigned int   mtf_ops;        /* TOPS_* */
+	uid_t          mtf_uid;
+	gid_t          mtf_gid;
+	size_t         mtf_size_min;
+	size_t         mtf_size_max;
+	int            mtf_error;      /* Match failed operations, or successful ones */
+	rule_tree_t   *mtf_paths;      /* Path prefixes under mtfs root */
+	unsigned int   mtf_every;      /* Trace one in every N matched */
+	unsigned int   mtf_rate;       /* Traced per second at most, zero for no limit */
+	unsigned long  mtf_rate_start; /* Jiffies when the current second started */
+	atomic_t       mtf_rate_count; /* Traced in the current second */
+	char           mtf_string[MTRACE_FILTER_LEN]; /* Rule as written */
+};
+
+/* Counters of a CPU, so that operations filtered out do not share lines */
+struct mtrace_filter_stats {
+	unsigned long  mfs_misses;                       /* Matched by no rule */
+	unsigned long  mfs_matched[MTRACE_FILTER_MAX];
+	unsigned long  mfs_hits[MTRACE_FILTER_MAX];      /* Matched and traced */
+};
+
+/*
+ * Rules are evaluated in order and the first matched one decides. The
+ * whole set is replaced when written, and freed after a grace period.
+ */
+struct mtrace_filters {
+	int                         mtfs_number;
+	struct mtrace_filter_stats *mtfs_stats;
+	struct rcu_head             mtfs_rcu;
+	struct mtrace_filter        mtfs_rules[MTRACE_FILTER_MAX];
+};
+
+int mtrace_filter_match(struct msubject_trace_info *info,
+                        struct mtfs_io *io, unsigned int ops);
+void mtrace_filter_fini(struct msubject_trace_info *info);
+int mtrace_filter_proc_read(struct msubject_trace_info *info,
+                            char *page, int count);
+int mtrace_filter_proc_write(struct msubject_trace_info *info,
+                             const char *buffer, unsigned long count);
+#endif /* __MTFS_TRACE_FILTER_INTERNAL_H__ */
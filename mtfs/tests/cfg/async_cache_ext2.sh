@@ -28,6 +28,8 @@ SUBJECT_NAME_UPPER=${SUBJECT_NAME_UPPER:-`echo ${SUBJECT_NAME} | awk '{printf("%
 SUBJECT_DIR=${SUBJECT_DIR:-`pwd`/../subjects/${SUBJECT_NAME}}
 SUBJECT_MODULE=${SUBJECT_MODULE:-mtfs_subject_${SUBJECT_NAME}}
 SUBJECT_MODULE_PATH=${SUBJECT_MODULE_PATH:-${SUBJECT_DIR}/${SUBJECT_MODULE}.ko}
+# Small cache in /dev/shm, so that files are evicted and filled again
+SUBJECT_MODULE_OPTION=${SUBJECT_MODULE_OPTION:-"masync_cache_capacity=64"}
 
 JUNCTION_COMMON_PATH=${JUNCTION_COMMON_PATH:-`pwd`/../junctions}
 JUNCTION_MODULE=${JUNCTION_MODULE:-mtfs_junction_async_cache_ext}
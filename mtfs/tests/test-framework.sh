@@ -224,10 +224,11 @@ insert_module()
 {
 	local MODULE=$1
 	local MODULE_PATH=$2
+	local MODULE_OPTION=$3
 	
 	debug_print "inserting module $MODULE..."
 	if ! module_is_inserted $MODULE; then
-		/sbin/insmod $MODULE_PATH
+		/sbin/insmod $MODULE_PATH $MODULE_OPTION
 	
 		if ! $(module_is_inserted $MODULE); then		
 			debug_print "failed\n"
@@ -448,7 +449,7 @@ setup_all()
 	fi
 
 	insert_module $MTFS_MODULE $MTFS_MODULE_PATH
-	insert_module $SUBJECT_MODULE $SUBJECT_MODULE_PATH
+	insert_module $SUBJECT_MODULE $SUBJECT_MODULE_PATH "$SUBJECT_MODULE_OPTION"
 	lowerfs_insert_module
 	insert_module $JUNCTION_MODULE $JUNCTION_MODULE_PATH
 
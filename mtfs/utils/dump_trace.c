@@ -4,10 +4,13 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 #include <mntent.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <debug.h>
@@ -15,6 +18,7 @@
 #include <parse_option.h>
 #include <mtfs_common.h>
 #include <mtfs_trace.h>
+#include <mtfs_record.h>
 #include <mtfs_io.h>
 #include "dump_trace.h"
 
@@ -50,9 +54,327 @@ void mtrace_dump(struct mtfs_io_trace *trace)
 	MPRINT("end = %lu.%06lu\n",
 	       trace->end.tv_sec,
 	       trace->end.tv_usec);
+	MPRINT("ino = %llu\n", (unsigned long long)trace->ino);
+	MPRINT("offset = %llu\n", (unsigned long long)trace->offset);
+	MPRINT("size = %llu\n", (unsigned long long)trace->size);
 }
 
-int dump_trace(char *source)
+#define MTRACE_PROC_DEVICES "/proc/fs/mtfs/devices"
+#define MTRACE_IDLE_USEC    10000
+#define MTRACE_CPU_MAX      1024
+
+/* Ring of a CPU mapped from the kernel, see struct mrecord_ring_header */
+struct mtrace_ring {
+	int                                  mr_cpu;
+	volatile struct mrecord_ring_header *mr_header;
+	size_t                               mr_header_size;
+	char                                *mr_buf;
+	size_t                               mr_buf_size;
+	__u64                                mr_dropped; /* Drops reported */
+};
+
+static volatile sig_atomic_t mtrace_follow_stop = 0;
+
+static void mtrace_follow_handler(int signal)
+{
+	mtrace_follow_stop = 1;
+}
+
+/*
+ * Find the proc dir of the device, which is named by the hash of the
+ * device name. Device name is the branches joined by ':'.
+ */
+static int mtrace_proc_dir(struct mount_option *mount_option,
+                           char *proc_dir, int size)
+{
+	char device_name[PATH_MAX] = {'\0'};
+	char line[PATH_MAX];
+	char path[PATH_MAX];
+	struct dirent *dirent = NULL;
+	DIR *dir = NULL;
+	FILE *fp = NULL;
+	int bindex = 0;
+	int ret = -ENOENT;
+	MENTRY();
+
+	for (bindex = 0; bindex < mount_option->bnum; bindex++) {
+		if (strlen(device_name) + strlen(mount_option->branch[bindex].path) + 2 >
+		    sizeof(device_name)) {
+			MERROR("device name is too long\n");
+			ret = -ENAMETOOLONG;
+			goto out;
+		}
+		append_dir(device_name, mount_option->branch[bindex].path);
+	}
+
+	dir = opendir(MTRACE_PROC_DEVICES);
+	if (dir == NULL) {
+		ret = -errno;
+		MERROR("failed to open %s: %s\n", MTRACE_PROC_DEVICES,
+		       strerror(errno));
+		goto out;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		if (dirent->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s/device_name",
+		         MTRACE_PROC_DEVICES, dirent->d_name);
+		fp = fopen(path, "r");
+		if (fp == NULL) {
+			continue;
+		}
+		if (fgets(line, sizeof(line), fp) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			if (strcmp(line, device_name) == 0) {
+				snprintf(proc_dir, size, "%s/%s/trace",
+				         MTRACE_PROC_DEVICES, dirent->d_name);
+				ret = 0;
+			}
+		}
+		fclose(fp);
+		if (ret == 0) {
+			break;
+		}
+	}
+	closedir(dir);
+
+	if (ret) {
+		MERROR("no proc dir of device [%s]\n", device_name);
+	}
+out:
+	MRETURN(ret);
+}
+
+/*
+ * Map the ring of every CPU listed in trace/stats. Only the header is
+ * mapped writable, since the kernel refuses writable data pages.
+ */
+static int mtrace_rings_map(const char *proc_dir, int fd,
+                            struct mtrace_ring *rings, int *nr,
+                            size_t *area_size)
+{
+	char path[PATH_MAX];
+	char line[256];
+	FILE *fp = NULL;
+	void *area = NULL;
+	void *data = NULL;
+	size_t header_size = sysconf(_SC_PAGESIZE);
+	unsigned long value = 0;
+	int cpu = 0;
+	int ret = 0;
+	MENTRY();
+
+	if (snprintf(path, sizeof(path), "%s/stats", proc_dir) >= sizeof(path)) {
+		MERROR("path of stats under %s is too long\n", proc_dir);
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		ret = -errno;
+		MERROR("failed to open %s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	*nr = 0;
+	*area_size = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "area_size: %lu", &value) == 1) {
+			*area_size = value;
+			continue;
+		}
+
+		if (sscanf(line, "cpu%d:", &cpu) != 1) {
+			continue;
+		}
+
+		if (*area_size == 0 || *nr >= MTRACE_CPU_MAX) {
+			MERROR("unexpected line [%s] of %s\n", line, path);
+			ret = -EINVAL;
+			goto out_close;
+		}
+
+		area = mmap(NULL, header_size, PROT_READ | PROT_WRITE,
+		            MAP_SHARED, fd, (off_t)*area_size * cpu);
+		if (area == MAP_FAILED) {
+			ret = -errno;
+			MERROR("failed to map header of ring of CPU %d: %s\n",
+			       cpu, strerror(errno));
+			goto out_close;
+		}
+		rings[*nr].mr_cpu = cpu;
+		rings[*nr].mr_header = area;
+		rings[*nr].mr_header_size = header_size;
+		rings[*nr].mr_buf_size = rings[*nr].mr_header->mrrh_size;
+		data = mmap(NULL, rings[*nr].mr_buf_size, PROT_READ, MAP_SHARED,
+		            fd, (off_t)*area_size * cpu +
+		                rings[*nr].mr_header->mrrh_offset);
+		if (data == MAP_FAILED) {
+			ret = -errno;
+			MERROR("failed to map data of ring of CPU %d: %s\n",
+			       cpu, strerror(errno));
+			munmap(area, header_size);
+			goto out_close;
+		}
+		rings[*nr].mr_buf = data;
+		rings[*nr].mr_dropped = rings[*nr].mr_header->mrrh_dropped;
+		(*nr)++;
+	}
+out_close:
+	fclose(fp);
+out:
+	MRETURN(ret);
+}
+
+/* Copy out of the ring, maybe across its end */
+static void mtrace_ring_copy(struct mtrace_ring *ring, __u64 from,
+                             void *buf, unsigned int length)
+{
+	unsigned int size = ring->mr_header->mrrh_size;
+	unsigned int offset = from & (size - 1);
+	unsigned int first = length < size - offset ? length : size - offset;
+
+	memcpy(buf, ring->mr_buf + offset, first);
+	if (first < length) {
+		memcpy((char *)buf + first, ring->mr_buf, length - first);
+	}
+}
+
+/* Consume all records in the ring. Returns the number of records */
+static int mtrace_ring_consume(struct mtrace_ring *ring,
+                               struct mtfs_param *param)
+{
+	volatile struct mrecord_ring_header *header = ring->mr_header;
+	struct mtfs_io_trace trace;
+	struct mrecord_head head;
+	__u64 dropped = header->mrrh_dropped;
+	__u64 tail = header->mrrh_tail;
+	__u64 end = header->mrrh_head;
+	int records = 0;
+
+	/* Read the records after seeing the head */
+	__sync_synchronize();
+	while (end - tail >= sizeof(head)) {
+		mtrace_ring_copy(ring, tail, &head, sizeof(head));
+		if (head.mrh_len < sizeof(head) || head.mrh_len > end - tail) {
+			MERROR("broken record of %u bytes in ring of CPU %d\n",
+			       head.mrh_len, ring->mr_cpu);
+			tail = end;
+			break;
+		}
+
+		if (!param->quiet) {
+			memset(&trace, 0, sizeof(trace));
+			mtrace_ring_copy(ring, tail, &trace,
+			                 head.mrh_len < sizeof(trace) ?
+			                 head.mrh_len : sizeof(trace));
+			mtrace_dump(&trace);
+		}
+		tail += head.mrh_len;
+		records++;
+	}
+	/* Finish reading the records before freeing their space */
+	__sync_synchronize();
+	header->mrrh_tail = tail;
+
+	if (dropped != ring->mr_dropped) {
+		MPRINT("CPU %d: %llu records dropped, %llu in total\n",
+		       ring->mr_cpu,
+		       (unsigned long long)(dropped - ring->mr_dropped),
+		       (unsigned long long)dropped);
+		ring->mr_dropped = dropped;
+	}
+	return records;
+}
+
+/*
+ * Stream records from the rings mapped from the kernel until interrupted.
+ * Records are printed per CPU, so sort them by sequence if global order
+ * matters. With --quiet, only the rate, lag and drops are printed.
+ */
+static int dump_trace_follow(struct mount_option *mount_option,
+                             struct mtfs_param *param)
+{
+	struct mtrace_ring rings[MTRACE_CPU_MAX];
+	char proc_dir[PATH_MAX];
+	char path[PATH_MAX];
+	unsigned long long records = 0;
+	unsigned long long lag = 0;
+	size_t area_size = 0;
+	time_t last = time(NULL);
+	time_t now = 0;
+	int consumed = 0;
+	int nr = 0;
+	int fd = 0;
+	int ret = 0;
+	int i = 0;
+	MENTRY();
+
+	ret = mtrace_proc_dir(mount_option, proc_dir, sizeof(proc_dir));
+	if (ret) {
+		goto out;
+	}
+
+	if (snprintf(path, sizeof(path), "%s/ring", proc_dir) >= sizeof(path)) {
+		MERROR("path of ring under %s is too long\n", proc_dir);
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		ret = -errno;
+		MERROR("failed to open %s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	ret = mtrace_rings_map(proc_dir, fd, rings, &nr, &area_size);
+	if (ret) {
+		goto out_unmap;
+	}
+
+	signal(SIGINT, mtrace_follow_handler);
+	signal(SIGTERM, mtrace_follow_handler);
+	while (!mtrace_follow_stop) {
+		consumed = 0;
+		for (i = 0; i < nr; i++) {
+			consumed += mtrace_ring_consume(&rings[i], param);
+		}
+		records += consumed;
+
+		now = time(NULL);
+		if (param->quiet && now != last) {
+			lag = 0;
+			for (i = 0; i < nr; i++) {
+				lag += rings[i].mr_header->mrrh_head -
+				       rings[i].mr_header->mrrh_tail;
+			}
+			MPRINT("%llu records/s, lag %llu bytes\n",
+			       records / (now - last), lag);
+			records = 0;
+			last = now;
+		}
+
+		if (consumed == 0) {
+			usleep(MTRACE_IDLE_USEC);
+		}
+	}
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+out_unmap:
+	for (i = 0; i < nr; i++) {
+		munmap(rings[i].mr_buf, rings[i].mr_buf_size);
+		munmap((void *)rings[i].mr_header, rings[i].mr_header_size);
+	}
+	close(fd);
+out:
+	MRETURN(ret);
+}
+
+int dump_trace(char *source, struct mtfs_param *param)
 {
 	struct mount_option *mount_option = NULL;
 	int ret = 0;
@@ -76,6 +398,11 @@ int dump_trace(char *source)
 		goto out_free_option;
 	}
 
+	if (param->follow) {
+		ret = dump_trace_follow(mount_option, param);
+		goto out_fini_option;
+	}
+
 	trace_mnt_path = mount_option->branch[mount_option->bnum - 1].path;
 
 	trace_file_path = full_path(trace_mnt_path, MTFS_RESERVE_ROOT"/"MTFS_RESERVE_RECORD);
@@ -153,8 +480,7 @@ int mtfs_api_dumptrace(const char *path, struct mtfs_param *param)
 			if (len > out_len &&
 			    !strncmp(rpath, mnt->mnt_dir, len)) {
 				out_len = len;
-				memset(device, 0, PATH_MAX);
-				strncpy(device, mnt->mnt_fsname, PATH_MAX);
+				snprintf(device, PATH_MAX, "%s", mnt->mnt_fsname);
 			}
 		}
 		mnt = getmntent(fp);
@@ -166,7 +492,7 @@ int mtfs_api_dumptrace(const char *path, struct mtfs_param *param)
 		goto free_device;
 	}
 
-	ret = dump_trace(device);
+	ret = dump_trace(device, param);
 free_device:
 	MTFS_FREE(device, PATH_MAX);	
 end_mnt:
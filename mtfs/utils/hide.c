@@ -89,8 +89,7 @@ int mtfs_api_hide(const char *path, int unhide, struct mtfs_param *param)
 			if (len > out_len &&
 			    !strncmp(rpath, mnt->mnt_dir, len)) {
 				out_len = len;
-				memset(device, 0, PATH_MAX);
-				strncpy(device, mnt->mnt_fsname, PATH_MAX);
+				snprintf(device, PATH_MAX, "%s", mnt->mnt_fsname);
 			}
 		}
 		mnt = getmntent(fp);
@@ -307,7 +307,7 @@ int mtfs_api_rmbranch(const char *path, mtfs_bindex_t bindex, struct mtfs_param
 	}
 
 	entry_name = get_entry_name(buff);
-	strncpy(remove_info->name, entry_name, strlen(entry_name));
+	snprintf(remove_info->name, sizeof(remove_info->name), "%s", entry_name);
 	remove_info->bindex = bindex;
 
 	ret = ioctl(dirfd(dir), MTFS_IOCTL_REMOVE_BRANCH,
@@ -27,6 +27,9 @@ struct mtfs_param {
 	int verbose;
 	int quiet;
 	int recursive;
+	int follow;
+	int fast;
+	int threads;
 };
 
 int mtfs_api_getstate(char *path, struct mtfs_param *param);
@@ -17,6 +17,7 @@
 #include "hide.h"
 #include "grouplock.h"
 #include "dump_trace.h"
+#include "replay_trace.h"
 
 int mtfs_get_version(int argc, char **argv)
 {
@@ -49,6 +50,7 @@ static int mtfs_hide(int argc, char **argv);
 static int mtfs_grouplock(int argc, char **argv);
 static int mtfs_rmbranch(int argc, char **argv);
 static int mtfs_dumptrace(int argc, char **argv);
+static int mtfs_replaytrace(int argc, char **argv);
 
 command_t mtfs_cmdlist[] = {
 	/* Metacommands */
@@ -96,8 +98,17 @@ command_t mtfs_cmdlist[] = {
 
 	{"dumptrace", mtfs_dumptrace, 0,
 	"To dump the trace info for trace file system.\n"
-	"usage: dumptrace [--quiet | -q] [--verbose | -v]\n"
+	"With --follow, stream records from the kernel until interrupted,\n"
+	"and with --quiet also, only print the rate, lag and drops.\n"
+	"usage: dumptrace [--quiet | -q] [--verbose | -v] [--follow | -f]\n"
 	"                <dir> ...\n"},
+	{"replaytrace", mtfs_replaytrace, 0,
+	"To replay the reads and writes of a trace file on a directory,\n"
+	"with the traced timing, or as fast as possible with --fast.\n"
+	"Each traced inode is replayed on a file named replay.<ino>, and\n"
+	"operations on a file are issued in order by the same thread.\n"
+	"usage: replaytrace [--quiet | -q] [--verbose | -v] [--fast | -f]\n"
+	"                [--threads | -t number] <trace_file> <dir>\n"},
 
 	/* repair commands */
 
@@ -551,9 +562,10 @@ static int mtfs_dumptrace(int argc, char **argv)
 		{"quiet", no_argument, 0, 'q'},
 		{"verbose", no_argument, 0, 'v'},
 		{"unhide", no_argument, 0, 'u'},
+		{"follow", no_argument, 0, 'f'},
 		{0, 0, 0, 0}
 	};
-	char short_opts[] = "qvu";
+	char short_opts[] = "qvuf";
 	int c = 0;
 	int rc = 0;
 	struct mtfs_param param = { 0 };
@@ -569,6 +581,9 @@ static int mtfs_dumptrace(int argc, char **argv)
 			param.verbose++;
 			param.quiet = 0;
 			break;
+		case 'f':
+			param.follow = 1;
+			break;
 		case '?':
 			rc = CMD_HELP;
 			goto out;
@@ -597,6 +612,70 @@ out:
 	return rc;
 }
 
+static int mtfs_replaytrace(int argc, char **argv)
+{
+	struct option long_opts[] = {
+		{"quiet", no_argument, 0, 'q'},
+		{"verbose", no_argument, 0, 'v'},
+		{"fast", no_argument, 0, 'f'},
+		{"threads", required_argument, 0, 't'},
+		{0, 0, 0, 0}
+	};
+	char short_opts[] = "qvft:";
+	char *end = NULL;
+	int c = 0;
+	int rc = 0;
+	struct mtfs_param param = { 0 };
+
+	param.threads = 1;
+	optind = 0;
+	while ((c = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'q':
+ 			param.quiet++;
+			param.verbose = 0;
+			break;
+		case 'v':
+			param.verbose++;
+			param.quiet = 0;
+			break;
+		case 'f':
+			param.fast = 1;
+			break;
+		case 't':
+			param.threads = strtol(optarg, &end, 0);
+			if (*end != '\0' || param.threads <= 0) {
+				fprintf(stderr, "error: %s: bad thread number '%s'\n",
+				        argv[0], optarg);
+				rc = CMD_HELP;
+				goto out;
+			}
+			break;
+		case '?':
+			rc = CMD_HELP;
+			goto out;
+		default:
+			fprintf(stderr, "error: %s: option '%s' unrecognized\n",
+			        argv[0], argv[optind - 1]);
+			rc = CMD_HELP;
+			goto out;
+		}
+	}
+
+	if (optind + 2 != argc) {
+		rc = CMD_HELP;
+		goto out;
+	}
+
+	rc = mtfs_api_replaytrace(argv[optind], argv[optind + 1], &param);
+	if (rc) {
+		fprintf(stderr, "error: %s failed for %s, rc = %d.\n",
+		        argv[0], argv[optind], rc);
+	}
+out:
+	return rc;
+}
+
 #define DEFAULT_GROUP_ID 777
 int stop = 0;
 void handler(int signal)
@@ -0,0 +1,648 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <debug.h>
+#include <memory.h>
+#include <mtfs_record.h>
+#include <mtfs_io.h>
+#include "replay_trace.h"
+
+#define MREPLAY_THREADS_MAX 256
+#define MREPLAY_BUF_SIZE    (1024 * 1024) /* Larger operations are split */
+#define MREPLAY_BUCKETS     32            /* Log2 of latency in usec */
+
+enum {
+	MREPLAY_READ = 0,
+	MREPLAY_WRITE,
+	MREPLAY_TYPES,
+};
+
+static const char *mreplay_type_names[MREPLAY_TYPES] = {
+	[MREPLAY_READ]  = "read",
+	[MREPLAY_WRITE] = "write",
+};
+
+/* Operation loaded from a trace record */
+struct mreplay_op {
+	__u64 mo_sequence;
+	__u64 mo_start;      /* Usec when traced */
+	__u64 mo_offset;
+	__u64 mo_size;
+	__u64 mo_ino;
+	int   mo_type;       /* MREPLAY_* */
+	int   mo_file;       /* Index in mreplay->mr_files */
+};
+
+/* Stand-in of a traced file under the replay directory */
+struct mreplay_file {
+	__u64 mf_ino;
+	__u64 mf_extent;     /* Largest end of the operations on it */
+	int   mf_fd;
+};
+
+struct mreplay_hist {
+	__u64 mh_count;
+	__u64 mh_bytes;
+	__u64 mh_usec;       /* Sum of latencies */
+	__u64 mh_min;
+	__u64 mh_max;
+	__u64 mh_buckets[MREPLAY_BUCKETS];
+};
+
+struct mreplay;
+
+struct mreplay_thread {
+	pthread_t            mt_thread;
+	int                  mt_index;
+	struct mreplay      *mt_replay;
+	struct mreplay_hist  mt_hists[MREPLAY_TYPES];
+	int                  mt_ret;
+};
+
+struct mreplay {
+	struct mreplay_op     *mr_ops;
+	int                    mr_op_number;
+	int                    mr_op_max;    /* Size of mr_ops */
+	struct mreplay_file   *mr_files;
+	int                    mr_file_number;
+	int                    mr_thread_number;
+	int                    mr_fast;
+	struct timespec        mr_t0;        /* When the replay started */
+};
+
+static __u64 mreplay_timespec_usec(const struct timespec *ts)
+{
+	return (__u64)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static __u64 mreplay_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return mreplay_timespec_usec(&ts);
+}
+
+static int mreplay_op_compare(const void *a, const void *b)
+{
+	const struct mreplay_op *op_a = (const struct mreplay_op *)a;
+	const struct mreplay_op *op_b = (const struct mreplay_op *)b;
+
+	if (op_a->mo_sequence < op_b->mo_sequence) {
+		return -1;
+	} else if (op_a->mo_sequence > op_b->mo_sequence) {
+		return 1;
+	}
+	return 0;
+}
+
+static int mreplay_file_compare(const void *a, const void *b)
+{
+	const struct mreplay_file *file_a = (const struct mreplay_file *)a;
+	const struct mreplay_file *file_b = (const struct mreplay_file *)b;
+
+	if (file_a->mf_ino < file_b->mf_ino) {
+		return -1;
+	} else if (file_a->mf_ino > file_b->mf_ino) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Load the read and write records of a trace file, in sequence order.
+ * Records are appended in per-CPU batches, so they are not in order in
+ * the file.
+ */
+static int mreplay_load(struct mreplay *replay, const char *trace_file,
+                        struct mtfs_param *param)
+{
+	struct mtfs_io_trace trace;
+	struct mreplay_op *op = NULL;
+	struct stat st;
+	char *buf = NULL;
+	size_t file_size = 0;
+	size_t buf_size = 0;
+	size_t offset = 0;
+	ssize_t nbytes = 0;
+	int skipped = 0;
+	int fd = 0;
+	int ret = 0;
+	MENTRY();
+
+	fd = open(trace_file, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		MERROR("failed to open file %s\n", trace_file);
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		MERROR("failed to stat file %s\n", trace_file);
+		goto out_close;
+	}
+
+	file_size = st.st_size;
+	if (file_size < sizeof(struct mrecord_head)) {
+		ret = -EINVAL;
+		MERROR("no record in file %s\n", trace_file);
+		goto out_close;
+	}
+
+	MTFS_ALLOC(buf, file_size);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		MERROR("not enough memory\n");
+		goto out_close;
+	}
+
+	while (offset < file_size) {
+		nbytes = read(fd, buf + offset, file_size - offset);
+		if (nbytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = -errno;
+			MERROR("failed to read file %s\n", trace_file);
+			goto out_free_buf;
+		} else if (nbytes == 0) {
+			break;
+		}
+		offset += nbytes;
+	}
+	buf_size = offset;
+	if (buf_size < sizeof(struct mrecord_head)) {
+		ret = -EINVAL;
+		MERROR("file %s is truncated while reading\n", trace_file);
+		goto out_free_buf;
+	}
+
+	/* Every record has the space of an operation at most */
+	replay->mr_op_max = buf_size / sizeof(struct mrecord_head);
+	MTFS_ALLOC(replay->mr_ops, sizeof(*replay->mr_ops) * replay->mr_op_max);
+	if (replay->mr_ops == NULL) {
+		ret = -ENOMEM;
+		MERROR("not enough memory\n");
+		goto out_free_buf;
+	}
+
+	for (offset = 0; offset + sizeof(struct mrecord_head) <= buf_size;
+	     offset += trace.head.mrh_len) {
+		memcpy(&trace.head, buf + offset, sizeof(trace.head));
+		if (trace.head.mrh_len < sizeof(trace.head) ||
+		    trace.head.mrh_len > buf_size - offset) {
+			MERROR("broken record of %u bytes at offset %zu\n",
+			       trace.head.mrh_len, offset);
+			ret = -EINVAL;
+			goto out_free_ops;
+		}
+
+		/* Records of older formats do not tell the file */
+		if (trace.head.mrh_len < sizeof(trace)) {
+			skipped++;
+			continue;
+		}
+		memcpy(&trace, buf + offset, sizeof(trace));
+
+		if (trace.type != MIOT_READV && trace.type != MIOT_WRITEV) {
+			skipped++;
+			continue;
+		}
+
+		op = &replay->mr_ops[replay->mr_op_number++];
+		op->mo_sequence = trace.head.mrh_sequence;
+		op->mo_start = (__u64)trace.start.tv_sec * 1000000 +
+		               trace.start.tv_usec;
+		op->mo_offset = trace.offset;
+		op->mo_size = trace.size;
+		op->mo_ino = trace.ino;
+		op->mo_type = trace.type == MIOT_WRITEV ?
+		              MREPLAY_WRITE : MREPLAY_READ;
+	}
+
+	if (replay->mr_op_number == 0) {
+		ret = -EINVAL;
+		MERROR("no read or write record in file %s\n", trace_file);
+		goto out_free_ops;
+	}
+
+	if (skipped && param->verbose) {
+		MPRINT("%d records skipped\n", skipped);
+	}
+
+	qsort(replay->mr_ops, replay->mr_op_number, sizeof(*replay->mr_ops),
+	      mreplay_op_compare);
+	goto out_free_buf;
+out_free_ops:
+	MTFS_FREE(replay->mr_ops, sizeof(*replay->mr_ops) * replay->mr_op_max);
+	replay->mr_ops = NULL;
+	replay->mr_op_number = 0;
+out_free_buf:
+	MTFS_FREE(buf, file_size);
+out_close:
+	close(fd);
+out:
+	MRETURN(ret);
+}
+
+static void mreplay_files_close(struct mreplay *replay)
+{
+	int i = 0;
+
+	for (i = 0; i < replay->mr_file_number; i++) {
+		if (replay->mr_files[i].mf_fd >= 0) {
+			close(replay->mr_files[i].mf_fd);
+		}
+	}
+}
+
+/*
+ * Records carry no path, so every traced inode is replayed on a file of
+ * its own under the directory, extended to cover all operations on it.
+ */
+static int mreplay_files_open(struct mreplay *replay, const char *dir)
+{
+	struct mreplay_file *file = NULL;
+	struct mreplay_file key;
+	struct mreplay_op *op = NULL;
+	char path[PATH_MAX];
+	struct stat st;
+	int number = 0;
+	int ret = 0;
+	int i = 0;
+	MENTRY();
+
+	MTFS_ALLOC(replay->mr_files,
+	           sizeof(*replay->mr_files) * replay->mr_op_number);
+	if (replay->mr_files == NULL) {
+		ret = -ENOMEM;
+		MERROR("not enough memory\n");
+		goto out;
+	}
+
+	for (i = 0; i < replay->mr_op_number; i++) {
+		replay->mr_files[i].mf_ino = replay->mr_ops[i].mo_ino;
+	}
+	qsort(replay->mr_files, replay->mr_op_number,
+	      sizeof(*replay->mr_files), mreplay_file_compare);
+	for (i = 0; i < replay->mr_op_number; i++) {
+		if (number == 0 ||
+		    replay->mr_files[number - 1].mf_ino !=
+		    replay->mr_files[i].mf_ino) {
+			replay->mr_files[number].mf_ino =
+				replay->mr_files[i].mf_ino;
+			replay->mr_files[number].mf_extent = 0;
+			replay->mr_files[number].mf_fd = -1;
+			number++;
+		}
+	}
+	replay->mr_file_number = number;
+
+	for (i = 0; i < replay->mr_op_number; i++) {
+		op = &replay->mr_ops[i];
+		key.mf_ino = op->mo_ino;
+		file = bsearch(&key, replay->mr_files, replay->mr_file_number,
+		               sizeof(*replay->mr_files), mreplay_file_compare);
+		MASSERT(file);
+		op->mo_file = file - replay->mr_files;
+		if (file->mf_extent < op->mo_offset + op->mo_size) {
+			file->mf_extent = op->mo_offset + op->mo_size;
+		}
+	}
+
+	for (i = 0; i < replay->mr_file_number; i++) {
+		file = &replay->mr_files[i];
+		ret = snprintf(path, sizeof(path), "%s/replay.%llu", dir,
+		               (unsigned long long)file->mf_ino);
+		if (ret >= sizeof(path)) {
+			ret = -ENAMETOOLONG;
+			MERROR("path of [%s] is too long\n", dir);
+			goto out_close;
+		}
+
+		file->mf_fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (file->mf_fd < 0) {
+			ret = -errno;
+			MERROR("failed to open file %s, ret = %d\n", path, ret);
+			goto out_close;
+		}
+
+		if (fstat(file->mf_fd, &st) < 0) {
+			ret = -errno;
+			MERROR("failed to stat file %s, ret = %d\n", path, ret);
+			goto out_close;
+		}
+
+		/* So that reads of the trace do not stop at EOF */
+		if (st.st_size < file->mf_extent &&
+		    ftruncate(file->mf_fd, file->mf_extent) < 0) {
+			ret = -errno;
+			MERROR("failed to truncate file %s, ret = %d\n",
+			       path, ret);
+			goto out_close;
+		}
+	}
+	ret = 0;
+	goto out;
+out_close:
+	mreplay_files_close(replay);
+	MTFS_FREE(replay->mr_files,
+	          sizeof(*replay->mr_files) * replay->mr_op_number);
+	replay->mr_files = NULL;
+	replay->mr_file_number = 0;
+out:
+	MRETURN(ret);
+}
+
+static void mreplay_hist_add(struct mreplay_hist *hist, __u64 usec,
+                             __u64 bytes)
+{
+	int bucket = 0;
+
+	while (bucket < MREPLAY_BUCKETS - 1 && (usec >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+	hist->mh_buckets[bucket]++;
+	if (hist->mh_count == 0 || usec < hist->mh_min) {
+		hist->mh_min = usec;
+	}
+	if (usec > hist->mh_max) {
+		hist->mh_max = usec;
+	}
+	hist->mh_count++;
+	hist->mh_bytes += bytes;
+	hist->mh_usec += usec;
+}
+
+static void mreplay_hist_merge(struct mreplay_hist *hist,
+                               const struct mreplay_hist *other)
+{
+	int i = 0;
+
+	if (other->mh_count == 0) {
+		return;
+	}
+	if (hist->mh_count == 0 || other->mh_min < hist->mh_min) {
+		hist->mh_min = other->mh_min;
+	}
+	if (other->mh_max > hist->mh_max) {
+		hist->mh_max = other->mh_max;
+	}
+	hist->mh_count += other->mh_count;
+	hist->mh_bytes += other->mh_bytes;
+	hist->mh_usec += other->mh_usec;
+	for (i = 0; i < MREPLAY_BUCKETS; i++) {
+		hist->mh_buckets[i] += other->mh_buckets[i];
+	}
+}
+
+/* Upper bound of the bucket holding the percentile */
+static __u64 mreplay_hist_percentile(const struct mreplay_hist *hist,
+                                     int percent)
+{
+	__u64 wanted = (hist->mh_count * percent + 99) / 100;
+	__u64 count = 0;
+	int i = 0;
+
+	for (i = 0; i < MREPLAY_BUCKETS; i++) {
+		count += hist->mh_buckets[i];
+		if (count >= wanted) {
+			break;
+		}
+	}
+	return 2ULL << i;
+}
+
+/* Issue the whole operation, split into pieces of the buffer size */
+static int mreplay_op_issue(struct mreplay *replay, struct mreplay_op *op,
+                            char *buf)
+{
+	int fd = replay->mr_files[op->mo_file].mf_fd;
+	__u64 offset = op->mo_offset;
+	__u64 left = op->mo_size;
+	size_t count = 0;
+	ssize_t nbytes = 0;
+
+	while (left > 0) {
+		count = left < MREPLAY_BUF_SIZE ? left : MREPLAY_BUF_SIZE;
+		if (op->mo_type == MREPLAY_WRITE) {
+			nbytes = pwrite(fd, buf, count, offset);
+		} else {
+			nbytes = pread(fd, buf, count, offset);
+		}
+		if (nbytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		} else if (nbytes == 0) {
+			/* Truncated by someone else */
+			break;
+		}
+		offset += nbytes;
+		left -= nbytes;
+	}
+	return 0;
+}
+
+/*
+ * A thread replays all operations on the files it owns in sequence order,
+ * so operations on the same file are never reordered.
+ */
+static void *mreplay_thread_main(void *arg)
+{
+	struct mreplay_thread *thread = (struct mreplay_thread *)arg;
+	struct mreplay *replay = thread->mt_replay;
+	struct mreplay_op *op = NULL;
+	struct timespec when;
+	__u64 first = replay->mr_ops[0].mo_start;
+	__u64 target = 0;
+	__u64 start = 0;
+	char *buf = NULL;
+	int i = 0;
+
+	MTFS_ALLOC(buf, MREPLAY_BUF_SIZE);
+	if (buf == NULL) {
+		MERROR("not enough memory\n");
+		thread->mt_ret = -ENOMEM;
+		goto out;
+	}
+	memset(buf, 0x5a, MREPLAY_BUF_SIZE);
+
+	for (i = 0; i < replay->mr_op_number; i++) {
+		op = &replay->mr_ops[i];
+		if (op->mo_file % replay->mr_thread_number != thread->mt_index) {
+			continue;
+		}
+
+		/* Late operations are issued at once to catch up */
+		if (!replay->mr_fast && op->mo_start > first) {
+			target = mreplay_timespec_usec(&replay->mr_t0) +
+			         (op->mo_start - first);
+			when.tv_sec = target / 1000000;
+			when.tv_nsec = (target % 1000000) * 1000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			                       &when, NULL) == EINTR);
+		}
+
+		start = mreplay_now_usec();
+		thread->mt_ret = mreplay_op_issue(replay, op, buf);
+		if (thread->mt_ret) {
+			MERROR("failed to %s %llu bytes at %llu of inode %llu, "
+			       "ret = %d\n", mreplay_type_names[op->mo_type],
+			       (unsigned long long)op->mo_size,
+			       (unsigned long long)op->mo_offset,
+			       (unsigned long long)op->mo_ino,
+			       thread->mt_ret);
+			break;
+		}
+		mreplay_hist_add(&thread->mt_hists[op->mo_type],
+		                 mreplay_now_usec() - start, op->mo_size);
+	}
+	MTFS_FREE(buf, MREPLAY_BUF_SIZE);
+out:
+	return NULL;
+}
+
+static void mreplay_report(struct mreplay_hist *hists, double seconds,
+                           struct mtfs_param *param)
+{
+	struct mreplay_hist *hist = NULL;
+	int type = 0;
+	int i = 0;
+
+	MPRINT("replayed in %.3f seconds\n", seconds);
+	for (type = 0; type < MREPLAY_TYPES; type++) {
+		hist = &hists[type];
+		if (hist->mh_count == 0) {
+			continue;
+		}
+		MPRINT("%s: %llu ops, %llu bytes, %.1f ops/s, %.2f MiB/s\n",
+		       mreplay_type_names[type],
+		       (unsigned long long)hist->mh_count,
+		       (unsigned long long)hist->mh_bytes,
+		       hist->mh_count / seconds,
+		       hist->mh_bytes / 1048576.0 / seconds);
+		MPRINT("  latency usec: avg %.1f, min %llu, max %llu, "
+		       "p50 < %llu, p99 < %llu\n",
+		       (double)hist->mh_usec / hist->mh_count,
+		       (unsigned long long)hist->mh_min,
+		       (unsigned long long)hist->mh_max,
+		       (unsigned long long)mreplay_hist_percentile(hist, 50),
+		       (unsigned long long)mreplay_hist_percentile(hist, 99));
+		if (param->quiet) {
+			continue;
+		}
+		for (i = 0; i < MREPLAY_BUCKETS; i++) {
+			if (hist->mh_buckets[i] == 0) {
+				continue;
+			}
+			MPRINT("  [%10llu, %10llu) %llu\n",
+			       i == 0 ? 0ULL : 1ULL << i, 2ULL << i,
+			       (unsigned long long)hist->mh_buckets[i]);
+		}
+	}
+}
+
+/*
+ * Replay the reads and writes of a trace file on the directory, with the
+ * traced timing unless param->fast is set. Operations are spread over
+ * param->threads threads by file.
+ */
+int mtfs_api_replaytrace(const char *trace_file, const char *dir,
+                         struct mtfs_param *param)
+{
+	struct mreplay replay;
+	struct mreplay_thread *threads = NULL;
+	struct mreplay_hist hists[MREPLAY_TYPES];
+	int started = 0;
+	int ret = 0;
+	int i = 0;
+	int type = 0;
+	MENTRY();
+
+	memset(&replay, 0, sizeof(replay));
+	memset(hists, 0, sizeof(hists));
+	replay.mr_fast = param->fast;
+	replay.mr_thread_number = param->threads > 0 ? param->threads : 1;
+	if (replay.mr_thread_number > MREPLAY_THREADS_MAX) {
+		MERROR("too many threads %d, max %d\n",
+		       replay.mr_thread_number, MREPLAY_THREADS_MAX);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = mreplay_load(&replay, trace_file, param);
+	if (ret) {
+		goto out;
+	}
+
+	ret = mreplay_files_open(&replay, dir);
+	if (ret) {
+		goto out_free_ops;
+	}
+
+	if (!param->quiet) {
+		MPRINT("replaying %d ops on %d files with %d threads\n",
+		       replay.mr_op_number, replay.mr_file_number,
+		       replay.mr_thread_number);
+	}
+
+	MTFS_ALLOC(threads, sizeof(*threads) * replay.mr_thread_number);
+	if (threads == NULL) {
+		ret = -ENOMEM;
+		MERROR("not enough memory\n");
+		goto out_close;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &replay.mr_t0);
+	for (started = 0; started < replay.mr_thread_number; started++) {
+		threads[started].mt_index = started;
+		threads[started].mt_replay = &replay;
+		ret = pthread_create(&threads[started].mt_thread, NULL,
+		                     mreplay_thread_main, &threads[started]);
+		if (ret) {
+			MERROR("failed to create thread, ret = %d\n", ret);
+			ret = -ret;
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i].mt_thread, NULL);
+		if (threads[i].mt_ret && ret == 0) {
+			ret = threads[i].mt_ret;
+		}
+		for (type = 0; type < MREPLAY_TYPES; type++) {
+			mreplay_hist_merge(&hists[type],
+			                   &threads[i].mt_hists[type]);
+		}
+	}
+
+	if (ret == 0) {
+		mreplay_report(hists, (mreplay_now_usec() -
+		               mreplay_timespec_usec(&replay.mr_t0)) / 1000000.0,
+		               param);
+	}
+
+	MTFS_FREE(threads, sizeof(*threads) * replay.mr_thread_number);
+out_close:
+	mreplay_files_close(&replay);
+	MTFS_FREE(replay.mr_files,
+	          sizeof(*replay.mr_files) * replay.mr_op_number);
+out_free_ops:
+	MTFS_FREE(replay.mr_ops, sizeof(*replay.mr_ops) * replay.mr_op_max);
+out:
+	MRETURN(ret);
+}
@@ -0,0 +1,11 @@
+/*
+ * Copyright (C) 2011 Li Xi <pkuelelixi@gmail.com>
+ */
+
+#ifndef _MTFS_REPLAY_TRACE_H_
+#define _MTFS_REPLAY_TRACE_H_
+#include "libmtfsapi.h"
+
+int mtfs_api_replaytrace(const char *trace_file, const char *dir,
+                         struct mtfs_param *param);
+#endif /* _MTFS_REPLAY_TRACE_H_ */